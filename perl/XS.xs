@@ -708,7 +708,8 @@ createRenderer(context, parent)
             lpCreateNil,
             lpCreateClone,
             lpFreeVariable,
-            lpCompare
+            lpCompare,
+            NULL
         };
         LiquidRenderer renderer = liquidCreateRenderer(*(LiquidContext*)&context);
         liquidRegisterVariableResolver(renderer, resolver);
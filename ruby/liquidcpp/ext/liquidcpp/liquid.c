@@ -288,7 +288,8 @@ VALUE liquidCRenderer_m_initialize(VALUE self, VALUE contextValue) {
         liquidCcreateNil,
         liquidCcreateClone,
         liquidCfreeVariable,
-        liquidCcompare
+        liquidCcompare,
+        NULL
     };
     TypedData_Get_Struct(self, LiquidRenderer, &liquidCRenderer_type, renderer);
     TypedData_Get_Struct(contextValue, LiquidCRubyContext, &liquidC_type, context);
@@ -0,0 +1,274 @@
+#include "analyzer.h"
+#include "renderer.h"
+#include <cmath>
+#include <algorithm>
+
+namespace Liquid {
+
+    Cost Cost::logarithm() const {
+        if (isConstant())
+            return Cost(std::log2(std::max(getConstant(), 1.0)));
+        if (terms.size() == 1 && terms.begin()->first.size() == 1 && terms.begin()->second == 1)
+            return Cost::size("log(" + terms.begin()->first[0] + ")");
+        return Cost::size("log()");
+    }
+
+    Cost Cost::operator+(const Cost& cost) const {
+        Cost result = *this;
+        for (auto& term : cost.terms) {
+            auto it = result.terms.emplace(term.first, 0).first;
+            it->second += term.second;
+            if (it->second == 0)
+                result.terms.erase(it);
+        }
+        return result;
+    }
+
+    Cost Cost::operator-(const Cost& cost) const {
+        return *this + cost * Cost(-1);
+    }
+
+    Cost Cost::operator*(const Cost& cost) const {
+        Cost result;
+        for (auto& left : terms) {
+            for (auto& right : cost.terms) {
+                std::vector<std::string> factors = left.first;
+                factors.insert(factors.end(), right.first.begin(), right.first.end());
+                // Logarithms after sizes, so they read as "n*log(n)".
+                std::sort(factors.begin(), factors.end(), [](const std::string& a, const std::string& b) {
+                    bool logA = a.compare(0, 4, "log(") == 0, logB = b.compare(0, 4, "log(") == 0;
+                    return logA != logB ? logB : a < b;
+                });
+                auto it = result.terms.emplace(std::move(factors), 0).first;
+                it->second += left.second * right.second;
+                if (it->second == 0)
+                    result.terms.erase(it);
+            }
+        }
+        return result;
+    }
+
+    double Cost::evaluate(const std::function<double(const std::string& name)>& size) const {
+        double total = 0;
+        for (auto& term : terms) {
+            double product = term.second;
+            for (auto& factor : term.first) {
+                if (factor.size() >= 5 && factor.compare(0, 4, "log(") == 0 && factor.back() == ')')
+                    product *= std::log2(std::max(size(factor.substr(4, factor.size() - 5)), 1.0));
+                else
+                    product *= size(factor);
+            }
+            total += product;
+        }
+        return total;
+    }
+
+    std::string Cost::describe() const {
+        if (terms.empty())
+            return "0";
+        std::string result;
+        // Constant first, then by degree.
+        std::vector<const std::pair<const std::vector<std::string>, double>*> ordered;
+        for (auto& term : terms)
+            ordered.push_back(&term);
+        std::stable_sort(ordered.begin(), ordered.end(), [](auto a, auto b) { return a->first.size() < b->first.size(); });
+        for (auto term : ordered) {
+            double coefficient = term->second;
+            if (!result.empty()) {
+                result.append(coefficient < 0 ? " - " : " + ");
+                coefficient = std::abs(coefficient);
+            }
+            std::string factors;
+            for (auto& factor : term->first) {
+                if (!factors.empty())
+                    factors.append("*");
+                factors.append(factor.empty() ? "?" : (factor == "log()" ? "log(?)" : factor));
+            }
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%g", coefficient);
+            if (factors.empty())
+                result.append(buffer);
+            else if (coefficient == 1)
+                result.append(factors);
+            else if (coefficient == -1)
+                result.append("-" + factors);
+            else
+                result.append(std::string(buffer) + "*" + factors);
+        }
+        return result;
+    }
+
+
+    Cost NodeType::cost(CostAnalyzer& analyzer, const Node& node) const {
+        return analyzer.analyzeChildren(node);
+    }
+
+    Cost CostAnalyzer::analyzeNode(const Node& node) {
+        if (!node.type)
+            return Cost();
+        return node.type->cost(*this, node);
+    }
+
+    Cost CostAnalyzer::analyzeChildren(const Node& node) {
+        Cost cost = Cost(1);
+        for (auto& child : node.children) {
+            if (child)
+                cost += analyzeNode(*child.get());
+        }
+        return cost;
+    }
+
+    Cost CostAnalyzer::analyzeRepeated(const Node& body, const Cost& times) {
+        Cost outer = scale;
+        scale = scale * times;
+        Cost cost = analyzeNode(body);
+        scale = outer;
+        return times * (Cost(1) + cost);
+    }
+
+    Cost CostAnalyzer::getSize(const Node& node) {
+        if (!node.type)
+            return node.variant.type == Variant::Type::ARRAY ? Cost(node.variant.a.size()) : Cost::size("");
+        switch (node.type->type) {
+            case NodeType::Type::VARIABLE: {
+                std::string name;
+                for (auto& child : node.children) {
+                    if (!child || child->type || child->variant.type != Variant::Type::STRING)
+                        return Cost::size("");
+                    if (!name.empty())
+                        name.append(".");
+                    name.append(child->variant.s);
+                }
+                return Cost::size(name);
+            }
+            case NodeType::Type::GROUP:
+                return node.children.size() == 1 ? getSize(*node.children[0].get()) : Cost::size("");
+            case NodeType::Type::ARRAY_LITERAL:
+                return Cost(node.children.size());
+            case NodeType::Type::FILTER:
+                return node.children.size() >= 1 ? getSize(*node.children[0].get()) : Cost::size("");
+            case NodeType::Type::OPERATOR:
+                if (node.type->symbol == ".." && node.children.size() == 2) {
+                    const Node& start = *node.children[0].get();
+                    const Node& end = *node.children[1].get();
+                    if (start.type || !start.variant.isNumeric())
+                        return Cost::size("");
+                    if (!end.type && end.variant.isNumeric())
+                        return Cost((double)std::max(end.variant.getInt() - start.variant.getInt() + 1, 0LL));
+                    // The value of the end, less what's skipped at the start.
+                    return getSize(end) + Cost((double)(1 - start.variant.getInt()));
+                }
+            break;
+            default:
+            break;
+        }
+        return Cost::size("");
+    }
+
+    Cost CostAnalyzer::getPartialCost(const std::string& name) const {
+        auto it = partials.find(name);
+        return it != partials.end() ? it->second : Cost(defaultPartialCost);
+    }
+
+    int CostAnalyzer::enter(const Node& node) {
+        hotspots.push_back({ &node, currentHotspot, Cost(), Cost() });
+        currentHotspot = hotspots.size() - 1;
+        return currentHotspot;
+    }
+
+    Cost CostAnalyzer::leave(int hotspot, const Cost& cost) {
+        Hotspot& current = hotspots[hotspot];
+        current.inclusive = scale * cost;
+        currentHotspot = current.parent;
+        if (current.parent != -1)
+            hotspots[current.parent].nested += current.inclusive;
+        return cost;
+    }
+
+    CostAnalyzer::Estimate CostAnalyzer::analyze(const Node& ast, const std::function<double(const std::string& name)>& size) {
+        hotspots.clear();
+        currentHotspot = -1;
+        scale = Cost(1);
+        Estimate estimate;
+        estimate.cost = analyzeNode(ast);
+        estimate.total = estimate.cost.evaluate(size);
+        for (auto& hotspot : hotspots) {
+            double exclusive = (hotspot.inclusive - hotspot.nested).evaluate(size);
+            if (!estimate.worst || exclusive > estimate.worstCost) {
+                estimate.worst = hotspot.node;
+                estimate.worstCost = exclusive;
+            }
+        }
+        return estimate;
+    }
+
+    CostAnalyzer::Estimate CostAnalyzer::analyze(const Node& ast) {
+        return analyze(ast, [this](const std::string& name) { return defaultSize; });
+    }
+
+    CostAnalyzer::Estimate CostAnalyzer::analyze(const Node& ast, Renderer& renderer, Variable store) {
+        return analyze(ast, [this, &renderer, store](const std::string& name) -> double {
+            if (name.empty())
+                return defaultSize;
+            Variable variable = store;
+            size_t offset = 0;
+            while (offset <= name.size()) {
+                size_t dot = std::min(name.find('.', offset), name.size());
+                if (!renderer.variableResolver.getDictionaryVariable(renderer, variable, name.substr(offset, dot - offset).data(), variable))
+                    return defaultSize;
+                offset = dot + 1;
+            }
+            long long size = renderer.variableResolver.getArraySize(renderer, variable);
+            if (size >= 0)
+                return (double)size;
+            long long integer;
+            if (renderer.variableResolver.getInteger(renderer, variable, &integer))
+                return (double)integer;
+            return defaultSize;
+        });
+    }
+
+
+    std::string NodeType::access(AccessAnalyzer& analyzer, const Node& node) const {
+        if (type == Type::GROUP && node.children.size() == 1)
+            return analyzer.analyzeNode(*node.children[0].get());
+        analyzer.analyzeChildren(node);
+        return std::string();
+    }
+
+    std::string AccessAnalyzer::analyzeNode(const Node& node) {
+        if (!node.type)
+            return std::string();
+        return node.type->access(*this, node);
+    }
+
+    void AccessAnalyzer::analyzeChildren(const Node& node) {
+        for (auto& child : node.children) {
+            if (child)
+                read(analyzeNode(*child.get()));
+        }
+    }
+
+    void AccessAnalyzer::partial(const std::string& name) {
+        auto it = partials.find(name);
+        if (it == partials.end()) {
+            unresolvedPartials.insert(name);
+            return;
+        }
+        // Recursive partials read nothing the outer inclusion doesn't.
+        if (std::find(partialStack.begin(), partialStack.end(), name) != partialStack.end())
+            return;
+        partialStack.push_back(name);
+        read(analyzeNode(*it->second));
+        partialStack.pop_back();
+    }
+
+    const std::map<std::string, AccessAnalyzer::Access>& AccessAnalyzer::analyze(const Node& ast) {
+        paths.clear();
+        unresolvedPartials.clear();
+        aliases.clear();
+        partialStack.clear();
+        read(analyzeNode(ast));
+        return paths;
+    }
+}
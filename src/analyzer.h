@@ -0,0 +1,139 @@
+#ifndef LIQUIDANALYZER_H
+#define LIQUIDANALYZER_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+
+#include "common.h"
+
+namespace Liquid {
+
+    struct Renderer;
+
+    // A symbolic cost, in nodes rendered: a sum of terms, each a coefficient times a product of sizes. Sizes are named by the variable path
+    // they're read from ("product.variants"), and are the length of a collection, or the value of an integer; "log(x)" stands for the
+    // logarithm of x, and "" for a size nothing is known about.
+    struct Cost {
+        std::map<std::vector<std::string>, double> terms;
+
+        Cost() { }
+        Cost(double constant) { if (constant != 0) terms[{}] = constant; }
+
+        static Cost size(const std::string& name) { Cost cost; cost.terms[{ name }] = 1; return cost; }
+
+        bool isConstant() const { return terms.empty() || (terms.size() == 1 && terms.begin()->first.empty()); }
+        double getConstant() const { return terms.empty() || !terms.begin()->first.empty() ? 0 : terms.begin()->second; }
+        // Only meaningful for constants, and single sizes; anything else is treated as a size nothing is known about.
+        Cost logarithm() const;
+
+        Cost operator+(const Cost& cost) const;
+        Cost operator-(const Cost& cost) const;
+        Cost operator*(const Cost& cost) const;
+        Cost& operator+=(const Cost& cost) { return *this = *this + cost; }
+
+        double evaluate(const std::function<double(const std::string& name)>& size) const;
+        // As "3 + 2*products + products*log(products)".
+        std::string describe() const;
+    };
+
+    // Derives the cost of rendering a template from its tree, without rendering it; loops multiply the cost of their bodies by the size of
+    // what they iterate over, and node types with a cost other than their children's implement NodeType::cost.
+    struct CostAnalyzer {
+        struct Estimate {
+            Cost cost;
+            // The cost, evaluated against the sizes available.
+            double total = 0;
+            // The loop, array filter or partial that contributes the most to the total, not counting what's nested in it; and that contribution.
+            // Has the line and column it was parsed at.
+            const Node* worst = nullptr;
+            double worstCost = 0;
+        };
+
+        // What sizes that can't be looked up are taken to be.
+        double defaultSize = 100;
+        // The costs of partials, by name, as analyzed beforehand; partials not here cost defaultPartialCost.
+        std::unordered_map<std::string, Cost> partials;
+        double defaultPartialCost = 100;
+
+        // Sizes are all defaultSize.
+        Estimate analyze(const Node& ast);
+        // Sizes are read from the store, through the renderer's variable resolver.
+        Estimate analyze(const Node& ast, Renderer& renderer, Variable store);
+        Estimate analyze(const Node& ast, const std::function<double(const std::string& name)>& size);
+
+        // For node types. Literals are free; everything else costs one, and its children.
+        Cost analyzeNode(const Node& node);
+        Cost analyzeChildren(const Node& node);
+        // Each time costs one, plus the body.
+        Cost analyzeRepeated(const Node& body, const Cost& times);
+        // The size of what the node evaluates to, if it's iterated over.
+        Cost getSize(const Node& node);
+        Cost getPartialCost(const std::string& name) const;
+        // Nodes whose cost can dominate a template bracket their analysis with these, to be considered for Estimate::worst; leave returns cost.
+        int enter(const Node& node);
+        Cost leave(int hotspot, const Cost& cost);
+
+    protected:
+        struct Hotspot {
+            const Node* node;
+            int parent;
+            Cost inclusive;
+            Cost nested;
+        };
+        std::vector<Hotspot> hotspots;
+        int currentHotspot = -1;
+        // The product of the sizes of the loops we're in.
+        Cost scale = Cost(1);
+    };
+
+    // Determines which variables in the store a template can read, without rendering it, so that hosts can load only those beforehand.
+    // Paths are keys joined by '.', with "[]" standing for every element of an array; loop variables are followed back to what they
+    // iterate over, so "{% for p in collection.products %}{{ p.title }}{% endfor %}" reads "collection.products[].title".
+    struct AccessAnalyzer {
+        struct Access {
+            // The value is used as a whole; output, compared, or passed to a filter.
+            bool read = false;
+            // The array is looped over, or passed to an array filter; what's read from its elements is listed under "path[]".
+            bool iterated = false;
+            // A key under the path is only known at render time; anything under it can be read.
+            bool dynamic = false;
+        };
+
+        std::map<std::string, Access> paths;
+        // The trees of partials, by name, for host tags that include them to analyze with partial().
+        std::unordered_map<std::string, const Node*> partials;
+        // Partials asked for that weren't in partials.
+        std::set<std::string> unresolvedPartials;
+
+        const std::map<std::string, Access>& analyze(const Node& ast);
+
+        // For node types. Returns the path of the value in the store the node evaluates to, if it evaluates to one, or an empty string.
+        std::string analyzeNode(const Node& node);
+        // Analyzes every child of the node, reading each value they evaluate to.
+        void analyzeChildren(const Node& node);
+        void partial(const std::string& name);
+
+        // Empty paths are ignored.
+        void read(const std::string& path) { if (!path.empty()) paths[path].read = true; }
+        void iterate(const std::string& path) { if (!path.empty()) paths[path].iterated = true; }
+        void dynamic(const std::string& path) { if (!path.empty()) paths[path].dynamic = true; }
+
+        // Makes a top-level variable refer to a path in the store, until popped; an empty path makes it local to the template.
+        void pushAlias(const std::string& name, const std::string& path) { aliases[name].push_back(path); }
+        void popAlias(const std::string& name) { aliases[name].pop_back(); }
+        // The path a top-level variable refers to.
+        std::string getPath(const std::string& name) const {
+            auto it = aliases.find(name);
+            return it != aliases.end() && !it->second.empty() ? it->second.back() : name;
+        }
+
+    protected:
+        std::unordered_map<std::string, std::vector<std::string>> aliases;
+        std::vector<std::string> partialStack;
+    };
+}
+
+#endif
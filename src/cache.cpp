@@ -0,0 +1,307 @@
+#include "cache.h"
+#include "context.h"
+#include "compiler.h"
+
+namespace Liquid {
+
+    LiquidFragmentCache FragmentCache::getInterface() {
+        LiquidFragmentCache cache;
+        cache.get = +[](void* data, const char* key, size_t keyLength, void (*found)(const char* output, size_t outputLength, unsigned long long renderTime, void* target), void* target) {
+            std::string output;
+            unsigned long long renderTime = 0;
+            if (!static_cast<FragmentCache*>(data)->get(std::string(key, keyLength), output, renderTime))
+                return false;
+            found(output.data(), output.size(), renderTime, target);
+            return true;
+        };
+        cache.set = +[](void* data, const char* key, size_t keyLength, const char* output, size_t outputLength, unsigned long long renderTime, unsigned int ttl) {
+            static_cast<FragmentCache*>(data)->set(std::string(key, keyLength), std::string(output, outputLength), renderTime, ttl);
+        };
+        cache.data = this;
+        return cache;
+    }
+
+
+    LRUFragmentCache::LRUFragmentCache(size_t maximumSize, size_t shards) : shardSize(maximumSize / std::max(shards, (size_t)1)), shardCount(std::max(shards, (size_t)1)), shards(new Shard[shardCount]) { }
+
+    void LRUFragmentCache::erase(Shard& shard, std::list<Entry>::iterator it) {
+        shard.size -= it->key.size() + it->output.size();
+        shard.index.erase(it->key);
+        shard.entries.erase(it);
+    }
+
+    bool LRUFragmentCache::get(const std::string& key, std::string& output, unsigned long long& renderTime) {
+        Shard& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end())
+            return false;
+        auto entry = it->second;
+        if (entry->expiry != std::chrono::steady_clock::time_point() && entry->expiry <= std::chrono::steady_clock::now()) {
+            erase(shard, entry);
+            return false;
+        }
+        shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+        output = entry->output;
+        renderTime = entry->renderTime;
+        return true;
+    }
+
+    void LRUFragmentCache::set(const std::string& key, const std::string& output, unsigned long long renderTime, unsigned int ttl) {
+        size_t size = key.size() + output.size();
+        Shard& shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end())
+            erase(shard, it->second);
+        if (size > shardSize)
+            return;
+        shard.entries.push_front({ key, output, renderTime, ttl ? std::chrono::steady_clock::now() + std::chrono::seconds(ttl) : std::chrono::steady_clock::time_point() });
+        shard.index.emplace(key, shard.entries.begin());
+        shard.size += size;
+        while (shard.size > shardSize)
+            erase(shard, std::prev(shard.entries.end()));
+    }
+
+    void LRUFragmentCache::clear() {
+        for (size_t i = 0; i < shardCount; ++i) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            shards[i].entries.clear();
+            shards[i].index.clear();
+            shards[i].size = 0;
+        }
+    }
+
+    size_t LRUFragmentCache::size() const {
+        size_t total = 0;
+        for (size_t i = 0; i < shardCount; ++i) {
+            std::lock_guard<std::mutex> lock(shards[i].mutex);
+            total += shards[i].size;
+        }
+        return total;
+    }
+
+
+    struct CacheNode : EnclosedNodeType {
+        struct TTLQualifierNode : TagNodeType::QualifierNodeType {
+            TTLQualifierNode() : TagNodeType::QualifierNodeType("ttl", TagNodeType::QualifierNodeType::Arity::UNARY) { }
+        };
+
+        // What the interpreter calls back into this node for; see compile.
+        enum Operation {
+            LOOKUP,
+            CLOCK,
+            STORE
+        };
+
+        // Separates the rendered arguments in the key.
+        static constexpr char separator = '\x1f';
+
+        const NodeType* ttlQualifier;
+        mutable LRUFragmentCache defaultCache;
+        LiquidFragmentCache defaultInterface;
+
+        CacheNode() : EnclosedNodeType("cache", 1, -1, LIQUID_OPTIMIZATION_SCHEME_NONE) {
+            ttlQualifier = registerType<TTLQualifierNode>();
+            defaultInterface = defaultCache.getInterface();
+        }
+
+        const LiquidFragmentCache& getCache(const Renderer& renderer) const {
+            if (renderer.fragmentCache.get)
+                return renderer.fragmentCache;
+            if (renderer.context.fragmentCache.get)
+                return renderer.context.fragmentCache;
+            return defaultInterface;
+        }
+
+        static unsigned long long now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+
+        // FNV-1a, over the shape and literals of the body; partials it includes aren't followed, so their changes are only picked up as
+        // entries expire.
+        static void hashBytes(unsigned long long& hash, const void* data, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                hash ^= static_cast<const unsigned char*>(data)[i];
+                hash *= 0x100000001b3ULL;
+            }
+        }
+
+        static void hashNode(unsigned long long& hash, const Node& node) {
+            if (node.type) {
+                hashBytes(hash, &node.type->type, sizeof(node.type->type));
+                hashBytes(hash, node.type->symbol.data(), node.type->symbol.size() + 1);
+                size_t children = node.children.size();
+                hashBytes(hash, &children, sizeof(children));
+                for (auto& child : node.children) {
+                    if (child)
+                        hashNode(hash, *child.get());
+                    else
+                        hashBytes(hash, "", 1);
+                }
+                return;
+            }
+            hashBytes(hash, &node.variant.type, sizeof(node.variant.type));
+            switch (node.variant.type) {
+                case Variant::Type::STRING:
+                    hashBytes(hash, node.variant.s.data(), node.variant.s.size() + 1);
+                break;
+                case Variant::Type::INT:
+                    hashBytes(hash, &node.variant.i, sizeof(node.variant.i));
+                break;
+                case Variant::Type::FLOAT:
+                    hashBytes(hash, &node.variant.f, sizeof(node.variant.f));
+                break;
+                case Variant::Type::BOOL:
+                    hashBytes(hash, &node.variant.b, sizeof(node.variant.b));
+                break;
+                case Variant::Type::ARRAY:
+                    for (auto& element : node.variant.a)
+                        hashNode(hash, Node(element));
+                break;
+                default:
+                break;
+            }
+        }
+
+        static string getIdentity(const Node& node) {
+            unsigned long long hash = 0xcbf29ce484222325ULL;
+            hashNode(hash, *node.children[1].get());
+            char buffer[17];
+            snprintf(buffer, sizeof(buffer), "%016llx", hash);
+            return string(buffer, 16);
+        }
+
+        bool lookup(Renderer& renderer, const string& key, string& output) const {
+            const LiquidFragmentCache& cache = getCache(renderer);
+            struct Found { string& output; unsigned long long renderTime; } found = { output, 0 };
+            bool hit = cache.get(cache.data, key.data(), key.size(), +[](const char* output, size_t outputLength, unsigned long long renderTime, void* target) {
+                static_cast<Found*>(target)->output.assign(output, outputLength);
+                static_cast<Found*>(target)->renderTime = renderTime;
+            }, &found);
+            if (hit) {
+                ++renderer.fragmentCacheMetrics.hits;
+                renderer.fragmentCacheMetrics.savedTime += found.renderTime;
+            } else
+                ++renderer.fragmentCacheMetrics.misses;
+            return hit;
+        }
+
+        // Output from a render that went wrong isn't kept.
+        void save(Renderer& renderer, const string& key, const string& output, unsigned long long start, const Node& ttl) const {
+            if (renderer.error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                return;
+            long long seconds = !ttl.type && ttl.variant.isNumeric() ? ttl.variant.getInt() : 0;
+            const LiquidFragmentCache& cache = getCache(renderer);
+            cache.set(cache.data, key.data(), key.size(), output.data(), output.size(), now() - start, (unsigned int)std::max(seconds, 0LL));
+        }
+
+        Node call(Interpreter& interpreter) const {
+            switch (interpreter.getStack(-1).variant.i) {
+                case LOOKUP: {
+                    string output;
+                    if (lookup(interpreter, interpreter.getStack(-2).getString(), output))
+                        return Variant(move(output));
+                    return Node();
+                }
+                case CLOCK:
+                    return Variant((long long)now());
+                case STORE:
+                    save(interpreter, interpreter.getStack(-4).getString(), interpreter.getStack(-2).getString(), interpreter.getStack(-3).variant.i, interpreter.getStack(-5));
+                break;
+            }
+            return Node();
+        }
+
+        Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            if (renderer.mode == Renderer::ExecutionMode::INTERPRETER)
+                return call(static_cast<Interpreter&>(renderer));
+            auto& arguments = node.children.front();
+            string key = getIdentity(node);
+            Node ttl;
+            for (auto& child : arguments->children) {
+                if (child->type && child->type->type == NodeType::Type::QUALIFIER) {
+                    if (child->type == ttlQualifier)
+                        ttl = renderer.retrieveRenderedNode(*child->children[0].get(), store);
+                } else {
+                    key.push_back(separator);
+                    key.append(renderer.getString(renderer.retrieveRenderedNode(*child.get(), store)));
+                }
+            }
+            string output;
+            if (lookup(renderer, key, output))
+                return Variant(move(output));
+            unsigned long long start = now();
+            output = getChild(renderer, node, store, 1).getString();
+            save(renderer, key, output, start, ttl);
+            return Variant(move(output));
+        }
+
+        // Calls back into render with the operation on top of the stack.
+        void addCall(Compiler& compiler, Operation operation) const {
+            compiler.add(OP_MOVINT, 0x0, operation);
+            compiler.addPush(0x0);
+            compiler.add(OP_MOVINT, 0x1, 1);
+            compiler.add(OP_CALL, 0x1, (long long)this);
+            --compiler.stackSize;
+        }
+
+        // Keeps the ttl and key on the stack throughout; on a miss, the start time and output go above them for the store.
+        void compile(Compiler& compiler, const Node& node) const override {
+            auto& arguments = node.children.front();
+            const Node* ttl = nullptr;
+            for (auto& child : arguments->children) {
+                if (child->type == ttlQualifier)
+                    ttl = child->children[0].get();
+            }
+            compiler.freeRegister = 0;
+            if (ttl)
+                compiler.compileBranch(*ttl);
+            else
+                compiler.add(OP_MOVNIL, 0x0);
+            compiler.addPush(0x0);
+
+            string identity = getIdentity(node);
+            compiler.add(OP_PUSHBUFFER, 0x0);
+            compiler.add(OP_OUTPUTMEM, 0x0, compiler.add(identity.data(), identity.size()));
+            for (auto& child : arguments->children) {
+                if (child->type && child->type->type == NodeType::Type::QUALIFIER)
+                    continue;
+                compiler.add(OP_OUTPUTMEM, 0x0, compiler.add(&separator, 1));
+                compiler.freeRegister = 0;
+                compiler.compileBranch(*child.get());
+                compiler.add(OP_OUTPUT, 0x0);
+            }
+            compiler.add(OP_POPBUFFER, 0x0);
+            compiler.addPush(0x0);
+
+            addCall(compiler, LOOKUP);
+            compiler.add(OP_MOV, 0x0, 0x2);
+            compiler.add(OP_MOVNIL, 0x1);
+            compiler.add(OP_EQL, 0x1);
+            int miss = compiler.add(OP_JMPTRUE, 0x0, 0x0);
+            compiler.add(OP_OUTPUT, 0x2);
+            int hit = compiler.add(OP_JMP, 0x0, 0x0);
+
+            compiler.modify(miss, OP_JMPTRUE, 0x0, compiler.currentOffset());
+            addCall(compiler, CLOCK);
+            compiler.addPush(0x0);
+            compiler.add(OP_PUSHBUFFER, 0x0);
+            compiler.freeRegister = 0;
+            compiler.compileBranch(*node.children[1].get());
+            compiler.add(OP_POPBUFFER, 0x0);
+            compiler.add(OP_OUTPUT, 0x0);
+            compiler.addPush(0x0);
+            addCall(compiler, STORE);
+            compiler.addPop(2);
+
+            compiler.modify(hit, OP_JMP, 0x0, compiler.currentOffset());
+            compiler.addPop(2);
+            compiler.freeRegister = 0;
+        }
+    };
+
+    void CacheDialect::implement(Context& context) {
+        context.registerType<CacheNode>();
+    }
+}
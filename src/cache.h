@@ -0,0 +1,69 @@
+#ifndef LIQUIDCACHE_H
+#define LIQUIDCACHE_H
+
+#include <list>
+#include <mutex>
+#include <chrono>
+#include <memory>
+
+#include "dialect.h"
+
+namespace Liquid {
+    struct Context;
+
+    // Adds {% cache key, ttl: seconds %}...{% endcache %}, which stores the output of its body under its rendered arguments, combined with a
+    // digest of the body, so that changing the template doesn't serve stale output. The cache used is the renderer's if it has one, then the
+    // context's; otherwise each context keeps an in-process LRUFragmentCache.
+    struct CacheDialect : Dialect {
+        static void implement(Context& context);
+    };
+
+    // Implementations must be safe to share between renderers on different threads.
+    struct FragmentCache {
+        virtual ~FragmentCache() { }
+
+        // renderTime is how long, in nanoseconds, the output took to render when it was stored.
+        virtual bool get(const std::string& key, std::string& output, unsigned long long& renderTime) = 0;
+        // A ttl of 0 never expires.
+        virtual void set(const std::string& key, const std::string& output, unsigned long long renderTime, unsigned int ttl) = 0;
+
+        // The cache must outlive anything it's set on.
+        LiquidFragmentCache getInterface();
+    };
+
+    // Keys are spread over shards, each with their own lock, and share of the size; a shard evicts its least recently used entries once
+    // it's over its share. Entries larger than a shard are never stored.
+    struct LRUFragmentCache : FragmentCache {
+        LRUFragmentCache(size_t maximumSize = 64*1024*1024, size_t shards = 16);
+
+        bool get(const std::string& key, std::string& output, unsigned long long& renderTime) override;
+        void set(const std::string& key, const std::string& output, unsigned long long renderTime, unsigned int ttl) override;
+        void clear();
+        // In bytes, of keys and output.
+        size_t size() const;
+
+    protected:
+        struct Entry {
+            std::string key;
+            std::string output;
+            unsigned long long renderTime;
+            // Never, if it's the epoch.
+            std::chrono::steady_clock::time_point expiry;
+        };
+        struct Shard {
+            mutable std::mutex mutex;
+            std::list<Entry> entries;
+            std::unordered_map<std::string, std::list<Entry>::iterator> index;
+            size_t size = 0;
+        };
+
+        size_t shardSize;
+        size_t shardCount;
+        std::unique_ptr<Shard[]> shards;
+
+        Shard& getShard(const std::string& key) { return shards[std::hash<std::string>()(key) % shardCount]; }
+        void erase(Shard& shard, std::list<Entry>::iterator it);
+    };
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "closure.h"
+#include "context.h"
+#include "renderer.h"
+
+namespace Liquid {
+
+    bool Closure::isConstant() const {
+        return function == &Closure::renderConstant;
+    }
+
+    Closure Closure::bind(const Context& context, const Node& node) {
+        Closure closure;
+        closure.node = &node;
+        if (!node.type) {
+            closure.function = &Closure::renderConstant;
+            // Node's copy assignment doesn't carry variants over; copy, then move.
+            closure.constant = Node(node);
+            return closure;
+        }
+        closure.children.reserve(node.children.size());
+        for (auto& child : node.children)
+            closure.children.push_back(bind(context, *child.get()));
+
+        if (node.type == context.getConcatenationNodeType())
+            closure.function = &Closure::renderConcatenation;
+        else if (node.type == context.getOutputNodeType())
+            closure.function = &Closure::renderOutput;
+        else if (node.type == context.getGroupNodeType() || node.type == context.getGroupDereferenceNodeType())
+            closure.function = &Closure::renderPassthru;
+        else if (node.type == context.getContextBoundaryNodeType())
+            closure.function = &Closure::renderContextBoundary;
+        else {
+            closure.function = &Closure::renderNode;
+            // Variables with a path that's all literals can be resolved directly, without rendering each link.
+            if (node.type == context.getVariableNodeType() && closure.children.size() > 0 && closure.children[0].isConstant() && closure.children[0].constant.variant.type == Variant::Type::STRING) {
+                closure.function = &Closure::renderVariable;
+                for (auto& child : closure.children) {
+                    if (!child.isConstant() || (child.constant.variant.type != Variant::Type::STRING && child.constant.variant.type != Variant::Type::INT))
+                        closure.function = &Closure::renderNode;
+                }
+            }
+        }
+        return closure;
+    }
+
+    Node Closure::renderConstant(Renderer& renderer, const Closure& closure, Variable store) {
+        return closure.constant;
+    }
+
+    Node Closure::renderConcatenation(Renderer& renderer, const Closure& closure, Variable store) {
+        // As Context::ConcatenationNode::render.
+        if (++renderer.currentRenderingDepth > renderer.maximumRenderingDepth) {
+            --renderer.currentRenderingDepth;
+            renderer.error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH;
+            return Node();
+        }
+        if (closure.children.size() == 1) {
+            --renderer.currentRenderingDepth;
+            return closure.children.front().evaluate(renderer, store);
+        }
+        string s;
+        for (auto& child : closure.children) {
+            s.append(child.evaluate(renderer, store).getString());
+            if (renderer.error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                return Node();
+            if (renderer.control != Renderer::Control::NONE) {
+                --renderer.currentRenderingDepth;
+                return Node(move(s));
+            }
+        }
+        --renderer.currentRenderingDepth;
+        return Node(move(s));
+    }
+
+    Node Closure::renderOutput(Renderer& renderer, const Closure& closure, Variable store) {
+        return Variant(renderer.getString(closure.children.front().children[0].evaluate(renderer, store)));
+    }
+
+    Node Closure::renderVariable(Renderer& renderer, const Closure& closure, Variable store) {
+        // As Context::VariableNode::render, with the keys already rendered.
+        if (!renderer.internalDrops.empty()) {
+            pair<void*, Renderer::DropFunction> drop = renderer.getInternalDrop(closure.children[0].constant.variant.s);
+            if (drop.second) {
+                Node result = drop.second(renderer, *closure.node, store, drop.first);
+                if (result.type || result.variant.type != Variant::Type::VARIABLE)
+                    return result;
+                return Node(renderer.parseVariant(result.variant.v));
+            }
+        }
+        Variable storePointer = store;
+        for (auto& child : closure.children) {
+            const Variant& key = child.constant.variant;
+            bool valid = key.type == Variant::Type::INT ?
+                renderer.variableResolver.getArrayVariable(renderer, storePointer, key.i, storePointer) :
+                renderer.variableResolver.getDictionaryVariable(renderer, storePointer, key.s.data(), storePointer);
+            if (!valid) {
+                if (renderer.logUnknownVariables)
+                    renderer.pushUnknownVariableWarning(*closure.node, 0, store);
+                return Node();
+            }
+        }
+        return Node(renderer.parseVariant(storePointer));
+    }
+
+    Node Closure::renderPassthru(Renderer& renderer, const Closure& closure, Variable store) {
+        return closure.children.front().evaluate(renderer, store);
+    }
+
+    Node Closure::renderContextBoundary(Renderer& renderer, const Closure& closure, Variable store) {
+        renderer.nodeContext = static_cast<const ContextBoundaryNode*>(closure.node->type);
+        return closure.children[1].evaluate(renderer, store);
+    }
+
+    Node Closure::renderNode(Renderer& renderer, const Closure& closure, Variable store) {
+        // Anything the node asks for through getOperand, getArgument or getChild comes from our children; anything it walks itself is
+        // rendered as a tree.
+        const Closure* parent = renderer.closure;
+        renderer.closure = &closure;
+        Node result = closure.node->type->render(renderer, *closure.node, store);
+        renderer.closure = parent;
+        return result;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef LIQUIDCLOSURE_H
+#define LIQUIDCLOSURE_H
+
+#include <vector>
+
+#include "common.h"
+
+namespace Liquid {
+
+    struct Context;
+    struct Renderer;
+
+    // A tree of pre-bound functions over an AST, for Renderer::ExecutionMode::CLOSURE. The common node kinds (literals, concatenations,
+    // output, variables with literal paths, groups) get a specialized function with their constants bound in; everything else calls its
+    // NodeType::render, which reaches its children's closures through getOperand, getArgument and getChild.
+    // Meant to be bound once, from an optimized tree, which must outlive it.
+    struct Closure {
+        typedef Node (*Function)(Renderer& renderer, const Closure& closure, Variable store);
+
+        Function function = nullptr;
+        const Node* node = nullptr;
+        // The literal, for constants.
+        Node constant;
+        std::vector<Closure> children;
+
+        Node evaluate(Renderer& renderer, Variable store) const { return function(renderer, *this, store); }
+        bool isConstant() const;
+
+        static Closure bind(const Context& context, const Node& node);
+
+        static Node renderConstant(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderConcatenation(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderOutput(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderVariable(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderPassthru(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderContextBoundary(Renderer& renderer, const Closure& closure, Variable store);
+        static Node renderNode(Renderer& renderer, const Closure& closure, Variable store);
+    };
+}
+
+#endif
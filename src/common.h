@@ -500,6 +500,10 @@ namespace Liquid {
     struct Optimizer;
     struct Compiler;
     struct Program;
+    struct Transpiler;
+    struct CostAnalyzer;
+    struct AccessAnalyzer;
+    struct Cost;
 
     struct NodeType {
         enum Type {
@@ -524,16 +528,33 @@ namespace Liquid {
         void* userData = nullptr;
         LiquidRenderFunction userRenderFunction = nullptr;
         LiquidCompileFunction userCompileFunction = nullptr;
+        // A combination of LiquidEffect flags.
+        int effects;
 
-        NodeType(Type type, string symbol = "", int maxChildren = -1, LiquidOptimizationScheme optimization = LIQUID_OPTIMIZATION_SCHEME_FULL) : type(type), symbol(symbol), maxChildren(maxChildren), optimization(optimization) { }
+        // Whether a node of this type always renders the same, given the same children and store, and changes nothing; if so, it can be
+        // folded, moved, or have its result reused.
+        bool isRepeatable() const { return (effects & ~LIQUID_EFFECT_READS_STORE) == 0; }
+
+        NodeType(Type type, string symbol = "", int maxChildren = -1, LiquidOptimizationScheme optimization = LIQUID_OPTIMIZATION_SCHEME_FULL) : type(type), symbol(symbol), maxChildren(maxChildren), optimization(optimization),
+            effects(optimization >= LIQUID_OPTIMIZATION_SCHEME_PARTIAL ? LIQUID_EFFECT_PURE : LIQUID_EFFECT_UNKNOWN) { }
         NodeType(const NodeType&) = default;
         NodeType(NodeType&&) = default;
         virtual ~NodeType() { }
 
         virtual Node render(Renderer& renderer, const Node& node, Variable store) const;
         virtual void compile(Compiler& compiler, const Node& node) const;
+        // Emits C++ for this node, for liquid-aot. Returns false if the node should be handed to render() at runtime instead.
+        virtual bool transpile(Transpiler& transpiler, const Node& node) const;
         virtual bool validate(Parser& parser, const Node& node) const { return true; }
         virtual bool optimize(Optimizer& optimizer, Node& node, Variable store) const;
+        // The symbolic cost of rendering this node; by default, one, plus that of its children.
+        virtual Cost cost(CostAnalyzer& analyzer, const Node& node) const;
+        // Records the variables this node reads with the analyzer. Returns the path in the store of the value the node evaluates to, if it's
+        // one; by default, reads what each child evaluates to, and returns nothing.
+        virtual string access(AccessAnalyzer& analyzer, const Node& node) const;
+        // Replaces the node with one that renders the same, but does less work, for Optimizer::rewrite; returns whether it did. Called
+        // after the node's children have been rewritten.
+        virtual bool rewrite(Optimizer& optimizer, Node& node) const { return false; }
 
         Node getArgument(Renderer& renderer, const Node& node, Variable store, int idx) const;
         Node getChild(Renderer& renderer, const Node& node, Variable store, int idx) const;
@@ -1,5 +1,11 @@
 #include <cstring>
 #include <cstdlib>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
 
 #include "compiler.h"
 #include "context.h"
@@ -15,10 +21,9 @@ namespace Liquid {
     // This should probably be changed out, but am super lazy at present.
     size_t hash(const char* s, int len) {
         size_t h = 5381;
-        int c;
-        const char* end = s + len;
-        while (((c = *s++) && s <= end))
-            h = ((h << 5) + h) + c;
+        // All of it; switch tables hold NULs.
+        for (const char* end = s + len; s < end; ++s)
+            h = ((h << 5) + h) + (unsigned char)*s;
         return h;
     }
 
@@ -94,6 +99,74 @@ namespace Liquid {
                 return "OP_POPBUFFER";
             case OP_EXIT:
                 return "OP_EXIT";
+            case OP_PLUS:
+                return "OP_PLUS";
+            case OP_MINUS:
+                return "OP_MINUS";
+            case OP_MULTIPLY:
+                return "OP_MULTIPLY";
+            case OP_DIVIDE:
+                return "OP_DIVIDE";
+            case OP_MODULO:
+                return "OP_MODULO";
+            case OP_EQUAL:
+                return "OP_EQUAL";
+            case OP_NOTEQUAL:
+                return "OP_NOTEQUAL";
+            case OP_LESS:
+                return "OP_LESS";
+            case OP_LESSEQUAL:
+                return "OP_LESSEQUAL";
+            case OP_GREATER:
+                return "OP_GREATER";
+            case OP_GREATEREQUAL:
+                return "OP_GREATEREQUAL";
+            case OP_AND:
+                return "OP_AND";
+            case OP_OR:
+                return "OP_OR";
+            case OP_APPEND:
+                return "OP_APPEND";
+            case OP_PREPEND:
+                return "OP_PREPEND";
+            case OP_DEFAULT:
+                return "OP_DEFAULT";
+            case OP_SIZE:
+                return "OP_SIZE";
+            case OP_DOWNCASE:
+                return "OP_DOWNCASE";
+            case OP_UPCASE:
+                return "OP_UPCASE";
+            case OP_JMPFALSEBOOL:
+                return "OP_JMPFALSEBOOL";
+            case OP_JMPTRUEBOOL:
+                return "OP_JMPTRUEBOOL";
+            case OP_PARTIAL:
+                return "OP_PARTIAL";
+            case OP_INVOKE:
+                return "OP_INVOKE";
+            case OP_SWITCH:
+                return "OP_SWITCH";
+            case OP_PLUSINT:
+                return "OP_PLUSINT";
+            case OP_MINUSINT:
+                return "OP_MINUSINT";
+            case OP_EQUALINT:
+                return "OP_EQUALINT";
+            case OP_NOTEQUALINT:
+                return "OP_NOTEQUALINT";
+            case OP_LESSINT:
+                return "OP_LESSINT";
+            case OP_LESSEQUALINT:
+                return "OP_LESSEQUALINT";
+            case OP_GREATERINT:
+                return "OP_GREATERINT";
+            case OP_GREATEREQUALINT:
+                return "OP_GREATEREQUALINT";
+            case OP_EQUALSTR:
+                return "OP_EQUALSTR";
+            case OP_NOTEQUALSTR:
+                return "OP_NOTEQUALSTR";
         }
         assert(false);
         return nullptr;
@@ -101,25 +174,27 @@ namespace Liquid {
 
     int Compiler::add(const char* str, int len) {
         size_t hashValue = hash(str, len);
-        auto it = existingStrings.emplace(hashValue, data.size());
-        if (it.second) {
-            int offset = data.size();
-            int size = sizeof(len) + len + 1;
-            // Align on a 4 byte boundary.
-            data.resize(offset + size + ((offset + size) % 4));
-            *((int*)&data[offset]) = len;
-            memcpy(&data[offset+sizeof(int)], str, len);
-            data[offset+len+sizeof(int)] = 0;
-            return offset;
-        } else {
-            return it.first->second;
+        // Shared only with data that's the same, byte for byte; the hash alone would merge anything that collides.
+        auto range = existingStrings.equal_range(hashValue);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (*((int*)&data[it->second]) == len && memcmp(&data[it->second+sizeof(int)], str, len) == 0)
+                return it->second;
         }
+        int offset = data.size();
+        existingStrings.emplace(hashValue, offset);
+        int size = sizeof(len) + len + 1;
+        // Align on a 4 byte boundary.
+        data.resize((offset + size + 3) & ~3);
+        *((int*)&data[offset]) = len;
+        memcpy(&data[offset+sizeof(int)], str, len);
+        data[offset+len+sizeof(int)] = 0;
+        return offset;
     }
 
     int Compiler::add(OPCode opcode, int target) {
         int offset = code.size();
         code.resize(offset + sizeof(int));
-        *((int*)&code[offset]) = (opcode & 0xFF) | ((target << 8) & 0xFFFF00);
+        *((int*)&code[offset]) = (opcode & 0xFF) | ((unsigned int)target << 8);
         assert(!operandSize(opcode));
         return offset;
     }
@@ -136,17 +211,123 @@ namespace Liquid {
         return offset;
     }
 
+    static void identify(Program& program) {
+        static std::atomic<unsigned long long> programs(0);
+        program.id = ++programs;
+        program.lifetime = std::make_shared<char>();
+    }
+
+    int Compiler::allocateRegisters(int amount) {
+        if (allocatedRegisters + amount > TOTAL_REGISTERS - SCRATCH_REGISTERS)
+            return -1;
+        int first = SCRATCH_REGISTERS + allocatedRegisters;
+        allocatedRegisters += amount;
+        return first;
+    }
+
+    void Compiler::releaseRegisters(int amount) {
+        assert(allocatedRegisters >= amount);
+        allocatedRegisters -= amount;
+    }
+
+    int Compiler::addPartial(const std::string& name) {
+        return add(OP_PARTIAL, allocatedRegisters, add(name.data(), name.size()));
+    }
+
+    // The table is a string in the data segment; the amount of keys, the mask of the slots, then the slots, each the index of a key, or -1
+    // if empty, then each key's offset from the start of the table and length, then the keys themselves.
+    int Compiler::addSwitch(int target, const std::vector<std::string>& keys) {
+        unsigned int mask = 1;
+        while (mask + 1 < keys.size() * 2)
+            mask = (mask << 1) | 1;
+        std::vector<unsigned int> table = { (unsigned int)keys.size(), mask };
+        table.resize(2 + mask + 1, (unsigned int)-1);
+        size_t position = (table.size() + keys.size() * 2) * sizeof(unsigned int);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            unsigned int slot = hashSwitchKey(keys[i].data(), keys[i].size()) & mask;
+            while (table[2 + slot] != (unsigned int)-1)
+                slot = (slot + 1) & mask;
+            table[2 + slot] = i;
+        }
+        for (auto& key : keys) {
+            table.push_back(position);
+            table.push_back(key.size());
+            position += key.size();
+        }
+        std::string blob((const char*)table.data(), table.size() * sizeof(unsigned int));
+        for (auto& key : keys)
+            blob.append(key);
+        return add(OP_SWITCH, target, add(blob.data(), blob.size()));
+    }
+
+    int Compiler::addResolve(int target, long long operand, bool cacheable) {
+        unsigned int slot = 0;
+        if (cacheable && resolveSites < 0xFFFF)
+            slot = ++resolveSites;
+        return add(OP_RESOLVE, target | (slot << 8), operand);
+    }
+
+    // Native operations always leave their result in 0x0. Binary operations take their second operand from 0x1 if either side is a literal,
+    // otherwise from an allocated register; only when we're out of registers do we go through the stack.
+    int Compiler::addNative(OPCode opcode, const NodeType* fallback, const Node& operand) {
+        freeRegister = 0;
+        compileBranch(operand);
+        if (freeRegister > 1)
+            add(OP_MOV, freeRegister - 1, 0x0);
+        freeRegister = 1;
+        return add(opcode, 0x0, (long long)fallback);
+    }
+
+    int Compiler::addNative(OPCode opcode, const NodeType* fallback, const Node& operand, const Node& argument) {
+        freeRegister = 0;
+        if (!argument.type) {
+            compileBranch(operand);
+            if (freeRegister > 1)
+                add(OP_MOV, freeRegister - 1, 0x0);
+            freeRegister = 1;
+            compileBranch(argument);
+        } else if (!operand.type) {
+            compileBranch(argument);
+            add(OP_MOV, freeRegister - 1, 0x1);
+            freeRegister = 0;
+            compileBranch(operand);
+        } else {
+            int reg = allocateRegisters(1);
+            if (reg != -1) {
+                compileBranch(argument);
+                add(OP_MOV, freeRegister - 1, reg);
+                freeRegister = 0;
+                compileBranch(operand);
+                if (freeRegister > 1)
+                    add(OP_MOV, freeRegister - 1, 0x0);
+                releaseRegisters(1);
+                freeRegister = 1;
+                return add(opcode, 0x0 | (reg << 8), (long long)fallback);
+            }
+            compileBranch(argument);
+            addPush(freeRegister - 1);
+            freeRegister = 0;
+            compileBranch(operand);
+            if (freeRegister > 1)
+                add(OP_MOV, freeRegister - 1, 0x0);
+            add(OP_STACK, 0x1, -1);
+            addPop(1);
+        }
+        freeRegister = 1;
+        return add(opcode, 0x0 | (0x1 << 8), (long long)fallback);
+    }
+
     int Compiler::add(OPCode opcode, int target, long long operand) {
         int offset = code.size();
         code.resize(offset + sizeof(int) + sizeof(long long));
-        *((int*)&code[offset]) = (opcode & 0xFF) | ((target << 8) & 0xFFFF00);
+        *((int*)&code[offset]) = (opcode & 0xFF) | ((unsigned int)target << 8);
         *((long long*)&code[offset+sizeof(int)]) = operand;
         assert(operandSize(opcode));
         return offset;
     }
 
     void Compiler::modify(int offset, OPCode opcode, int target, long long operand) {
-        *((int*)&code[offset]) = (opcode & 0xFF) | ((target << 8) & 0xFFFF00);
+        *((int*)&code[offset]) = (opcode & 0xFF) | ((unsigned int)target << 8);
         *((long long*)&code[offset+sizeof(int)]) = operand;
         assert(operandSize(opcode));
     }
@@ -177,6 +358,10 @@ namespace Liquid {
                     add(OP_MOVNIL, freeRegister);
                     ++freeRegister;
                 } break;
+                case Variant::Type::BOOL: {
+                    add(OP_MOVBOOL, freeRegister, branch.variant.b ? 1 : 0);
+                    ++freeRegister;
+                } break;
                 case Variant::Type::FLOAT: {
                     // Intentionally i.
                     add(OP_MOVFLOAT, freeRegister, branch.variant.i);
@@ -196,6 +381,8 @@ namespace Liquid {
         Program program;
         freeRegister = 0;
         stackSize = 0;
+        allocatedRegisters = 0;
+        resolveSites = 0;
         data.clear();
         code.clear();
         existingStrings.clear();
@@ -206,6 +393,8 @@ namespace Liquid {
         program.code.resize(code.size() + data.size());
         memcpy(&program.code[0], data.data(), data.size());
         program.codeOffset = data.size();
+        identify(program);
+        program.resolveSites = resolveSites;
         memcpy(&program.code[program.codeOffset], code.data(), code.size());
         // Go and adjust the JMPs to JMP to the appropriate offsets now that we've shoved the data above.
         unsigned int i = program.codeOffset;
@@ -240,12 +429,16 @@ namespace Liquid {
             result.append((const char*)&program.code[i+sizeof(int)], length);
             result.append("\"");
             result.append("\n");
-            i += length + sizeof(int) + 1;
-            i += i % 4;
+            i = (i + length + sizeof(int) + 1 + 3) & ~3;
         }
         while (i < program.code.size()) {
             unsigned int instruction = *(unsigned int*)&program.code[i];
-            sprintf(buffer, "0x%08x %-14s REG%02d", (int)i, getSymbolicOpcode((OPCode)(program.code[i] & 0xFF)), instruction >> 8);
+            if ((instruction & 0xFF) >= OP_PLUS)
+                sprintf(buffer, "0x%08x %-14s REG%02d, REG%02d", (int)i, getSymbolicOpcode((OPCode)(program.code[i] & 0xFF)), (instruction >> 8) & 0xFF, (instruction >> 16) & 0xFF);
+            else if ((instruction & 0xFF) == OP_RESOLVE)
+                sprintf(buffer, "0x%08x %-14s REG%02d [IC%u]", (int)i, getSymbolicOpcode((OPCode)(program.code[i] & 0xFF)), (instruction >> 8) & 0xFF, instruction >> 16);
+            else
+                sprintf(buffer, "0x%08x %-14s REG%02d", (int)i, getSymbolicOpcode((OPCode)(program.code[i] & 0xFF)), instruction >> 8);
             result.append(buffer);
             i += sizeof(int);
             if (operandSize((OPCode)(instruction & 0xFF))) {
@@ -259,11 +452,370 @@ namespace Liquid {
         return result;
     }
 
+    static void addNodeTypeSymbols(vector<pair<string, const NodeType*>>& symbols, const string& prefix, const unordered_map<string, unique_ptr<NodeType>>& types) {
+        for (auto& it : types) {
+            string name = prefix + it.first;
+            symbols.emplace_back(name, it.second.get());
+            if (const ContextualNodeType* contextual = dynamic_cast<const ContextualNodeType*>(it.second.get())) {
+                addNodeTypeSymbols(symbols, name + "/operator:", contextual->operators);
+                addNodeTypeSymbols(symbols, name + "/filter:", contextual->filters);
+                if (const TagNodeType* tag = dynamic_cast<const TagNodeType*>(contextual)) {
+                    addNodeTypeSymbols(symbols, name + "/tag:", tag->intermediates);
+                    addNodeTypeSymbols(symbols, name + "/qualifier:", tag->qualifiers);
+                }
+            }
+        }
+    }
+
+    // Every node type of the context, by a name that's stable across processes.
+    static vector<pair<string, const NodeType*>> getNodeTypeSymbols(const Context& context) {
+        vector<pair<string, const NodeType*>> symbols = {
+            { "builtin:concatenation", context.getConcatenationNodeType() },
+            { "builtin:output", context.getOutputNodeType() },
+            { "builtin:variable", context.getVariableNodeType() },
+            { "builtin:group", context.getGroupNodeType() },
+            { "builtin:groupDereference", context.getGroupDereferenceNodeType() },
+            { "builtin:arguments", context.getArgumentsNodeType() },
+            { "builtin:unknownFilter", context.getUnknownFilterNodeType() },
+            { "builtin:arrayLiteral", context.getArrayLiteralNodeType() },
+            { "builtin:contextBoundary", context.getContextBoundaryNodeType() },
+            { "builtin:filterWildcardQualifier", context.getFilterWildcardQualifierNodeType() }
+        };
+        addNodeTypeSymbols(symbols, "tag:", context.tagTypes);
+        addNodeTypeSymbols(symbols, "unary:", context.unaryOperatorTypes);
+        addNodeTypeSymbols(symbols, "binary:", context.binaryOperatorTypes);
+        addNodeTypeSymbols(symbols, "filter:", context.filterTypes);
+        addNodeTypeSymbols(symbols, "dot:", context.dotFilterTypes);
+        return symbols;
+    }
+
+    // Whether the operand of the instruction is a NodeType*.
+    static bool hasNodeTypeOperand(OPCode opcode) {
+        return opcode == OP_CALL || opcode >= OP_PLUS;
+    }
+
+    static const unsigned int PROGRAM_MAGIC = 0x4342514C;
+
+    std::vector<unsigned char> Program::serialize(const Context& context) const {
+        unordered_map<const NodeType*, string> names;
+        for (auto& symbol : getNodeTypeSymbols(context))
+            names.emplace(symbol.second, symbol.first);
+
+        std::vector<unsigned char> relocated = code;
+        vector<string> symbols;
+        unordered_map<const NodeType*, unsigned int> symbolIndices;
+        vector<pair<unsigned int, unsigned int>> relocations;
+        unsigned int i = codeOffset;
+        while (i < relocated.size()) {
+            OPCode opcode = (OPCode)(*(unsigned int*)&relocated[i] & 0xFF);
+            i += sizeof(unsigned int);
+            if (!operandSize(opcode))
+                continue;
+            const NodeType* type = hasNodeTypeOperand(opcode) ? *(const NodeType**)&relocated[i] : nullptr;
+            if (type) {
+                auto it = symbolIndices.find(type);
+                if (it == symbolIndices.end()) {
+                    auto name = names.find(type);
+                    if (name == names.end())
+                        throw Exception("Can't serialize program; node type '%s' isn't part of the context.", type->symbol.c_str());
+                    it = symbolIndices.emplace(type, symbols.size()).first;
+                    symbols.push_back(name->second);
+                }
+                relocations.emplace_back(i, it->second);
+                *(long long*)&relocated[i] = 0;
+            }
+            i += sizeof(long long);
+        }
+
+        std::vector<unsigned char> result;
+        auto write = [&result](const void* data, size_t size) {
+            result.insert(result.end(), (const unsigned char*)data, (const unsigned char*)data + size);
+        };
+        auto writeInt = [&write](unsigned int value) { write(&value, sizeof(value)); };
+        writeInt(PROGRAM_MAGIC);
+        writeInt(FORMAT_VERSION);
+        writeInt(sizeof(void*));
+        writeInt(codeOffset);
+        writeInt(resolveSites);
+        writeInt(symbols.size());
+        writeInt(relocations.size());
+        writeInt(relocated.size());
+        for (auto& symbol : symbols) {
+            writeInt(symbol.size());
+            write(symbol.data(), symbol.size());
+        }
+        for (auto& relocation : relocations) {
+            writeInt(relocation.first);
+            writeInt(relocation.second);
+        }
+        write(relocated.data(), relocated.size());
+        return result;
+    }
+
+    Program Program::load(const Context& context, const unsigned char* data, size_t size) {
+        size_t offset = 0;
+        auto read = [data, size, &offset](size_t length) {
+            if (offset + length > size)
+                throw Exception("Can't load program; unexpected end of data.");
+            const unsigned char* start = &data[offset];
+            offset += length;
+            return start;
+        };
+        auto readInt = [&read]() { unsigned int value; memcpy(&value, read(sizeof(value)), sizeof(value)); return value; };
+        if (readInt() != PROGRAM_MAGIC)
+            throw Exception("Can't load program; not a program, or of a different endianness.");
+        unsigned int version = readInt();
+        if (version != FORMAT_VERSION)
+            throw Exception("Can't load program; format version %u, expected %u.", version, FORMAT_VERSION);
+        if (readInt() != sizeof(void*))
+            throw Exception("Can't load program; compiled for a different pointer size.");
+
+        Program program;
+        program.codeOffset = readInt();
+        program.resolveSites = readInt();
+        unsigned int symbolCount = readInt();
+        unsigned int relocationCount = readInt();
+        unsigned int codeSize = readInt();
+
+        unordered_map<string, const NodeType*> types;
+        for (auto& symbol : getNodeTypeSymbols(context))
+            types.emplace(symbol.first, symbol.second);
+        vector<const NodeType*> symbols;
+        for (unsigned int i = 0; i < symbolCount; ++i) {
+            unsigned int length = readInt();
+            string name((const char*)read(length), length);
+            auto it = types.find(name);
+            if (it == types.end())
+                throw Exception("Can't load program; context has no node type '%s'.", name.c_str());
+            symbols.push_back(it->second);
+        }
+        vector<pair<unsigned int, unsigned int>> relocations;
+        for (unsigned int i = 0; i < relocationCount; ++i) {
+            unsigned int position = readInt();
+            unsigned int symbol = readInt();
+            if (symbol >= symbolCount || position < program.codeOffset + sizeof(unsigned int) || (unsigned long long)position + sizeof(long long) > codeSize)
+                throw Exception("Can't load program; invalid relocation.");
+            relocations.emplace_back(position, symbol);
+        }
+        if (program.codeOffset > codeSize)
+            throw Exception("Can't load program; invalid code offset.");
+        const unsigned char* code = read(codeSize);
+        program.code.assign(code, code + codeSize);
+        for (auto& relocation : relocations) {
+            if (!hasNodeTypeOperand((OPCode)(*(unsigned int*)&program.code[relocation.first - sizeof(unsigned int)] & 0xFF)))
+                throw Exception("Can't load program; invalid relocation.");
+            *(const NodeType**)&program.code[relocation.first] = symbols[relocation.second];
+        }
+        identify(program);
+        return program;
+    }
+
+    // Calls the function with every register the instruction refers to, allowing it to change them.
+    template <class Function>
+    static void forEachRegister(unsigned int& word, long long& operand, Function function) {
+        OPCode opcode = (OPCode)(word & 0xFF);
+        if (opcode == OP_PARTIAL || opcode == OP_INVOKE || opcode == OP_EXIT)
+            return;
+        // Resolves and native operations only have a register in the low byte of the target; native operations have another in the next byte.
+        bool wide = opcode != OP_RESOLVE && opcode < OP_PLUS;
+        unsigned int reg = wide ? (word >> 8) : ((word >> 8) & 0xFF);
+        function(reg);
+        word = wide ? ((word & 0xFF) | (reg << 8)) : ((word & ~0xFF00u) | ((reg & 0xFF) << 8));
+        if (opcode >= OP_PLUS) {
+            unsigned int source = (word >> 16) & 0xFF;
+            function(source);
+            word = (word & ~0xFF0000u) | ((source & 0xFF) << 16);
+        }
+        if (opcode == OP_MOV || opcode == OP_ASSIGN || (opcode == OP_RESOLVE && operand != -1)) {
+            unsigned int reg = (unsigned int)operand;
+            function(reg);
+            operand = reg;
+        }
+    }
+
+    struct ProgramImage {
+        const ProgramLinker& linker;
+        std::vector<unsigned char> data;
+        std::vector<unsigned char> code;
+        // Where each program's data segment starts in the image.
+        std::unordered_map<const Program*, unsigned int> dataOffsets;
+        // Where the code of each program that's called rather than inlined starts, relative to the code.
+        std::unordered_map<const Program*, unsigned int> functions;
+        std::vector<const Program*> pendingFunctions;
+        std::vector<pair<unsigned int, const Program*>> invokes;
+        // Operands that are offsets into the code, and so need to be moved past the data.
+        std::vector<unsigned int> codeRelocations;
+        std::vector<const Program*> inlined;
+        unsigned int resolveSites = 0;
+
+        ProgramImage(const ProgramLinker& linker) : linker(linker) { }
+
+        const Program& getPartial(const Program& program, long long nameOffset) {
+            unsigned int length = *(unsigned int*)&program.code[nameOffset];
+            string name((const char*)&program.code[nameOffset+sizeof(unsigned int)], length);
+            auto it = linker.programs.find(name);
+            if (it == linker.programs.end())
+                throw Exception("Can't link program; unknown partial '%s'.", name.c_str());
+            return *it->second;
+        }
+
+        template <class Function>
+        static void forEachInstruction(const Program& program, Function function) {
+            unsigned int i = program.codeOffset;
+            while (i < program.code.size()) {
+                unsigned int offset = i;
+                unsigned int word = *(unsigned int*)&program.code[i];
+                i += sizeof(unsigned int);
+                long long operand = 0;
+                if (operandSize((OPCode)(word & 0xFF))) {
+                    operand = *(long long*)&program.code[i];
+                    i += sizeof(long long);
+                }
+                function(offset, word, operand);
+            }
+        }
+
+        void addData(const Program& program) {
+            if (dataOffsets.find(&program) != dataOffsets.end())
+                return;
+            dataOffsets[&program] = data.size();
+            data.insert(data.end(), program.code.begin(), program.code.begin() + program.codeOffset);
+            forEachInstruction(program, [this, &program](unsigned int offset, unsigned int word, long long operand) {
+                if ((word & 0xFF) == OP_PARTIAL)
+                    addData(getPartial(program, operand));
+            });
+        }
+
+        bool isInlineable(const Program& program, unsigned int shift) {
+            if (program.code.size() - program.codeOffset > linker.inlineThreshold || std::find(inlined.begin(), inlined.end(), &program) != inlined.end())
+                return false;
+            unsigned int maximum = 0;
+            forEachInstruction(program, [&maximum](unsigned int offset, unsigned int word, long long operand) {
+                forEachRegister(word, operand, [&maximum](unsigned int& reg) { maximum = std::max(maximum, reg); });
+            });
+            return maximum < Compiler::SCRATCH_REGISTERS || maximum + shift < Compiler::TOTAL_REGISTERS;
+        }
+
+        // Shift is the amount of registers that are already allocated when this code runs. Inlined code doesn't keep its OP_EXIT.
+        void emit(const Program& program, unsigned int shift, bool isInline) {
+            unsigned int slotBase = resolveSites;
+            if (resolveSites + program.resolveSites <= 0xFFFF)
+                resolveSites += program.resolveSites;
+            else
+                slotBase = 0xFFFF;
+            unsigned int dataOffset = dataOffsets[&program];
+            std::unordered_map<unsigned int, unsigned int> offsets;
+            std::vector<pair<unsigned int, unsigned int>> jumps;
+            forEachInstruction(program, [&](unsigned int offset, unsigned int word, long long operand) {
+                offsets[offset] = code.size();
+                OPCode opcode = (OPCode)(word & 0xFF);
+                switch (opcode) {
+                    case OP_EXIT:
+                        if (isInline)
+                            return;
+                    break;
+                    case OP_MOVSTR:
+                    case OP_OUTPUTMEM:
+                    case OP_SWITCH:
+                        operand += dataOffset;
+                    break;
+                    case OP_JMP:
+                    case OP_JMPFALSE:
+                    case OP_JMPTRUE:
+                    case OP_ITERATE:
+                        jumps.emplace_back(code.size() + sizeof(unsigned int), operand);
+                    break;
+                    case OP_RESOLVE: {
+                        unsigned int slot = word >> 16;
+                        if (slot)
+                            slot = slotBase == 0xFFFF ? 0 : slot + slotBase;
+                        word = (word & 0xFFFF) | (slot << 16);
+                    } break;
+                    case OP_PARTIAL: {
+                        const Program& partial = getPartial(program, operand);
+                        unsigned int live = shift + (word >> 8);
+                        if (isInlineable(partial, live)) {
+                            inlined.push_back(&partial);
+                            emit(partial, live, true);
+                            inlined.pop_back();
+                            return;
+                        }
+                        word = OP_INVOKE | (live << 8);
+                        invokes.emplace_back(code.size() + sizeof(unsigned int), &partial);
+                        if (functions.find(&partial) == functions.end() && std::find(pendingFunctions.begin(), pendingFunctions.end(), &partial) == pendingFunctions.end())
+                            pendingFunctions.push_back(&partial);
+                    } break;
+                    default:
+                    break;
+                }
+                if (shift > 0) {
+                    forEachRegister(word, operand, [shift](unsigned int& reg) {
+                        if (reg >= Compiler::SCRATCH_REGISTERS)
+                            reg += shift;
+                    });
+                }
+                size_t position = code.size();
+                code.resize(position + sizeof(unsigned int));
+                *(unsigned int*)&code[position] = word;
+                if (operandSize(opcode)) {
+                    code.resize(position + sizeof(unsigned int) + sizeof(long long));
+                    *(long long*)&code[position + sizeof(unsigned int)] = operand;
+                }
+            });
+            for (auto& jump : jumps) {
+                *(long long*)&code[jump.first] = offsets.at(jump.second);
+                codeRelocations.push_back(jump.first);
+            }
+        }
+
+        Program link(const Program& program) {
+            addData(program);
+            emit(program, 0, false);
+            for (size_t i = 0; i < pendingFunctions.size(); ++i) {
+                functions[pendingFunctions[i]] = code.size();
+                emit(*pendingFunctions[i], 0, false);
+            }
+            for (auto& invoke : invokes) {
+                *(long long*)&code[invoke.first] = functions[invoke.second];
+                codeRelocations.push_back(invoke.first);
+            }
+            Program result;
+            result.codeOffset = data.size();
+            result.code = std::move(data);
+            result.code.insert(result.code.end(), code.begin(), code.end());
+            for (unsigned int position : codeRelocations)
+                *(long long*)&result.code[result.codeOffset + position] += result.codeOffset;
+            result.resolveSites = resolveSites;
+            identify(result);
+            return result;
+        }
+    };
+
+    Program ProgramLinker::link(const std::string& name) const {
+        auto it = programs.find(name);
+        if (it == programs.end())
+            throw Exception("Can't link program; unknown program '%s'.", name.c_str());
+        Program image = ProgramImage(*this).link(*it->second);
+        image.name = name;
+        return image;
+    }
+
+    std::unordered_map<std::string, Program> ProgramLinker::linkAll() const {
+        std::unordered_map<std::string, Program> images;
+        for (auto& it : programs) {
+            images[it.first] = ProgramImage(*this).link(*it.second);
+            images[it.first].name = it.first;
+        }
+        return images;
+    }
+
     Interpreter::Interpreter(const Context& context) : Renderer(context) {
-        stackPointer = stackBlock;
+        stackBlock.resize(INITIAL_STACK_SIZE);
+        stackPointer = stackHighWater = stackBlock.data();
     }
     Interpreter::Interpreter(const Context& context, LiquidVariableResolver resolver) : Renderer(context, resolver) {
-        stackPointer = stackBlock;
+        stackBlock.resize(INITIAL_STACK_SIZE);
+        stackPointer = stackHighWater = stackBlock.data();
     }
     Interpreter::~Interpreter() {
 
@@ -295,7 +847,7 @@ namespace Liquid {
                 case Register::Type::NIL: {
                     localPointer -= sizeof(unsigned int);
                     if (idx == i)
-                        return Node(nullptr);
+                        return Node(Variant());
                 } break;
                 case Register::Type::SHORT_STRING:
                 case Register::Type::LONG_STRING: {
@@ -307,10 +859,12 @@ namespace Liquid {
                 case Register::Type::VARIABLE: {
                     localPointer -= sizeof(unsigned int) + sizeof(void*);
                     if (idx == i)
-                        return Node(Variable(localPointer));
+                        return Node(Variable(*(void**)localPointer));
                 } break;
                 case Register::Type::EXTRA_LONG_STRING:
-                    assert(false);
+                    localPointer -= sizeof(unsigned int) + sizeof(void*);
+                    if (idx == i)
+                        return Node(**(string**)localPointer);
                 break;
             }
         }
@@ -362,11 +916,14 @@ namespace Liquid {
                     localPointer -= sizeof(unsigned int) + len + (len % 4);
                     if (idx == i) {
                         reg.type = regType;
-                        strncpy(reg.buffer, localPointer, SHORT_STRING_SIZE);
+                        reg.length = len;
+                        memcpy(reg.buffer, localPointer, len);
+                        reg.buffer[len] = 0;
                         return;
                     }
                 } break;
                 case Register::Type::VARIABLE:
+                case Register::Type::EXTRA_LONG_STRING:
                     localPointer -= sizeof(unsigned int) + sizeof(void*);
                     if (idx == i) {
                         reg.type = regType;
@@ -375,7 +932,6 @@ namespace Liquid {
                     }
                 break;
                 case Register::Type::LONG_STRING:
-                case Register::Type::EXTRA_LONG_STRING:
                     assert(false);
                 break;
             }
@@ -383,7 +939,21 @@ namespace Liquid {
         assert(false);
     }
 
+    // Doubles the stack. Past the maximum, we still grow, so the stack stays consistent; the error is picked up at the next jump or iteration,
+    // which bounds how much more can be pushed.
+    void Interpreter::growStack() {
+        size_t offset = stackPointer - stackBlock.data();
+        size_t highWater = stackHighWater - stackBlock.data();
+        stackBlock.resize(stackBlock.size() * 2);
+        stackPointer = stackBlock.data() + offset;
+        stackHighWater = stackBlock.data() + highWater;
+        if (stackBlock.size() > maximumStackSize)
+            error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_MEMORY;
+    }
+
     void Interpreter::pushStack(Register& reg) {
+        if (stackPointer + MAX_STACK_ENTRY_SIZE > stackBlock.data() + stackBlock.size())
+            growStack();
         switch (reg.type) {
             case Register::Type::INT:
                 *((long long*)stackPointer) = reg.i;
@@ -412,20 +982,22 @@ namespace Liquid {
                 stackPointer += sizeof(unsigned int);
             break;
             case Register::Type::VARIABLE:
+            case Register::Type::EXTRA_LONG_STRING:
                 *((void**)stackPointer) = reg.pointer;
                 stackPointer += sizeof(void*);
-                *((unsigned int*)stackPointer) = (unsigned int)Register::Type::VARIABLE;
+                *((unsigned int*)stackPointer) = (unsigned int)reg.type;
                 stackPointer += sizeof(unsigned int);
             break;
             case Register::Type::LONG_STRING:
-            case Register::Type::EXTRA_LONG_STRING:
                 assert(false);
             break;
         }
+        if (stackPointer > stackHighWater)
+            stackHighWater = stackPointer;
     }
 
     void Interpreter::popStack(int popCount) {
-        assert(stackPointer > stackBlock);
+        assert(stackPointer > stackBlock.data());
         for (int i = 0; i < popCount; ++i) {
             unsigned int type = *(unsigned int*)(stackPointer - sizeof(unsigned int));
             switch ((Register::Type)(type & 0xFF)) {
@@ -445,10 +1017,8 @@ namespace Liquid {
                     stackPointer -= sizeof(unsigned int) + len + (len % 4);
                 } break;
                 case Register::Type::VARIABLE:
-                    stackPointer -= sizeof(unsigned int) + sizeof(void*);
-                break;
                 case Register::Type::EXTRA_LONG_STRING:
-                    assert(false);
+                    stackPointer -= sizeof(unsigned int) + sizeof(void*);
                 break;
             }
         }
@@ -472,34 +1042,287 @@ namespace Liquid {
                 pushRegister(reg, node.variant.s);
             break;
             case Variant::Type::STRING_VIEW:
-                assert(false);
+                pushRegister(reg, node.variant.view, node.variant.len);
             break;
             case Variant::Type::BOOL:
                 reg.type = Register::Type::BOOL;
                 reg.b = node.variant.b;
             break;
+            case Variant::Type::VARIABLE:
+                reg.type = node.variant.v.pointer ? Register::Type::VARIABLE : Register::Type::NIL;
+                reg.pointer = node.variant.v.pointer;
+            break;
             case Variant::Type::ARRAY:
             case Variant::Type::POINTER:
-            case Variant::Type::VARIABLE:
                 assert(false);
             break;
         }
     }
 
+    void Interpreter::pushRegister(Register& reg, const char* str, size_t length) {
+        if (length < SHORT_STRING_SIZE) {
+            reg.type = Register::Type::SHORT_STRING;
+            memcpy(reg.buffer, str, length);
+            reg.buffer[length] = 0;
+            reg.length = length;
+        } else {
+            longStrings.emplace_back(str, length);
+            reg.type = Register::Type::EXTRA_LONG_STRING;
+            reg.pointer = &longStrings.back();
+        }
+    }
+
     void Interpreter::pushRegister(Register& reg, const string& str) {
-        reg.type = Register::Type::SHORT_STRING;
-        assert(str.size() < SHORT_STRING_SIZE);
-        memcpy(reg.buffer, str.data(), str.size());
-        reg.buffer[str.size()] = 0;
-        reg.length = str.size();
+        pushRegister(reg, str.data(), str.size());
     }
 
     void Interpreter::pushRegister(Register& reg, string&& str) {
-        reg.type = Register::Type::SHORT_STRING;
-        assert(str.size() < SHORT_STRING_SIZE);
-        memcpy(reg.buffer, str.data(), str.size());
-        reg.buffer[str.size()] = 0;
-        reg.length = str.size();
+        if (str.size() < SHORT_STRING_SIZE) {
+            pushRegister(reg, str.data(), str.size());
+        } else {
+            longStrings.emplace_back(std::move(str));
+            reg.type = Register::Type::EXTRA_LONG_STRING;
+            reg.pointer = &longStrings.back();
+        }
+    }
+
+    // Scalars are pulled into the register directly; anything else is kept as a reference to the 3rd party variable.
+    void Interpreter::pushRegister(Register& reg, Variable var) {
+        switch (variableResolver.getType(LiquidRenderer { this }, var)) {
+            case LIQUID_VARIABLE_TYPE_INT:
+                reg.type = Register::Type::INT;
+                variableResolver.getInteger(LiquidRenderer { this }, var, &reg.i);
+            break;
+            case LIQUID_VARIABLE_TYPE_BOOL:
+                reg.type = Register::Type::BOOL;
+                variableResolver.getBool(LiquidRenderer { this }, var, &reg.b);
+            break;
+            case LIQUID_VARIABLE_TYPE_FLOAT:
+                reg.type = Register::Type::FLOAT;
+                variableResolver.getFloat(LiquidRenderer { this }, var, &reg.f);
+            break;
+            case LIQUID_VARIABLE_TYPE_NIL:
+                reg.type = Register::Type::NIL;
+                reg.pointer = nullptr;
+            break;
+            case LIQUID_VARIABLE_TYPE_STRING: {
+                long long length = variableResolver.getStringLength(LiquidRenderer { this }, var);
+                if (length < SHORT_STRING_SIZE) {
+                    reg.type = Register::Type::SHORT_STRING;
+                    reg.length = (unsigned char)length;
+                    variableResolver.getString(LiquidRenderer { this }, var, reg.buffer);
+                    reg.buffer[length] = 0;
+                } else {
+                    longStrings.emplace_back(length, '\0');
+                    variableResolver.getString(LiquidRenderer { this }, var, &longStrings.back()[0]);
+                    reg.type = Register::Type::EXTRA_LONG_STRING;
+                    reg.pointer = &longStrings.back();
+                }
+            } break;
+            default:
+                reg.type = Register::Type::VARIABLE;
+                reg.pointer = var;
+        }
+    }
+
+    bool Interpreter::isTruthy(const Register& reg) const {
+        switch (reg.type) {
+            case Register::Type::BOOL:
+                return reg.b;
+            case Register::Type::INT:
+                return !((context.falsiness & FALSY_0) && !reg.i);
+            case Register::Type::FLOAT:
+                return !((context.falsiness & FALSY_0) && !reg.f);
+            case Register::Type::NIL:
+                return !(context.falsiness & FALSY_NIL);
+            case Register::Type::SHORT_STRING:
+            case Register::Type::EXTRA_LONG_STRING:
+                return !((context.falsiness & FALSY_EMPTY_STRING) && getStringLength(reg) == 0);
+            case Register::Type::VARIABLE:
+                return reg.pointer || !(context.falsiness & FALSY_NIL);
+            case Register::Type::LONG_STRING:
+                assert(false);
+            break;
+        }
+        return true;
+    }
+
+    unsigned int Interpreter::getSwitchIndex(const Register& reg, const unsigned char* table) const {
+        const unsigned int* words = (const unsigned int*)table;
+        unsigned int count = words[0], mask = words[1];
+        if (!isString(reg))
+            return count + 1;
+        const char* str = getStringBuffer(reg);
+        size_t length = getStringLength(reg);
+        const unsigned int* slots = &words[2];
+        const unsigned int* keys = &slots[mask + 1];
+        // There are at least twice as many slots as keys, so there's always an empty one to stop at.
+        for (unsigned int slot = hashSwitchKey(str, length) & mask; slots[slot] != (unsigned int)-1; slot = (slot + 1) & mask) {
+            const unsigned int* key = &keys[slots[slot] * 2];
+            if (key[1] == length && memcmp(&table[key[0]], str, length) == 0)
+                return slots[slot];
+        }
+        return count;
+    }
+
+    template <class Function>
+    static bool nativeNumeric(Interpreter::Register& target, const Interpreter::Register& source) {
+        typedef Interpreter::Register::Type Type;
+        if ((target.type != Type::INT && target.type != Type::FLOAT) || (source.type != Type::INT && source.type != Type::FLOAT))
+            return false;
+        if (target.type == Type::INT && source.type == Type::INT) {
+            target.i = Function()(target.i, source.i);
+        } else {
+            target.f = Function()(target.type == Type::INT ? (double)target.i : target.f, source.type == Type::INT ? (double)source.i : source.f);
+            target.type = Type::FLOAT;
+        }
+        return true;
+    }
+
+    template <class Function>
+    static bool nativeComparison(Interpreter::Register& target, const Interpreter::Register& source) {
+        typedef Interpreter::Register::Type Type;
+        if ((target.type != Type::INT && target.type != Type::FLOAT) || (source.type != Type::INT && source.type != Type::FLOAT))
+            return false;
+        if (target.type == Type::INT && source.type == Type::INT)
+            target.b = Function()(target.i, source.i);
+        else
+            target.b = Function()(target.type == Type::INT ? (double)target.i : target.f, source.type == Type::INT ? (double)source.i : source.f);
+        target.type = Type::BOOL;
+        return true;
+    }
+
+    void Interpreter::native(OPCode opCode, const NodeType* type, Register& target, Register& source, Variable store) {
+        switch (opCode) {
+            case OP_PLUS:
+                if (nativeNumeric<std::plus<>>(target, source))
+                    return;
+            break;
+            case OP_MINUS:
+                if (nativeNumeric<std::minus<>>(target, source))
+                    return;
+            break;
+            case OP_MULTIPLY:
+                if (nativeNumeric<std::multiplies<>>(target, source))
+                    return;
+            break;
+            case OP_DIVIDE:
+                // Integer division by zero goes through the node type, so that it behaves identically to the tree renderer.
+                if ((source.type != Register::Type::INT || source.i != 0) && nativeNumeric<std::divides<>>(target, source))
+                    return;
+            break;
+            case OP_MODULO:
+                if (target.type == Register::Type::INT && source.type == Register::Type::INT && source.i != 0) {
+                    target.i %= source.i;
+                    return;
+                }
+            break;
+            case OP_LESS:
+                if (nativeComparison<std::less<>>(target, source))
+                    return;
+            break;
+            case OP_LESSEQUAL:
+                if (nativeComparison<std::less_equal<>>(target, source))
+                    return;
+            break;
+            case OP_GREATER:
+                if (nativeComparison<std::greater<>>(target, source))
+                    return;
+            break;
+            case OP_GREATEREQUAL:
+                if (nativeComparison<std::greater_equal<>>(target, source))
+                    return;
+            break;
+            case OP_EQUAL:
+            case OP_NOTEQUAL: {
+                bool isEqual;
+                if (source.type == Register::Type::NIL)
+                    isEqual = target.type == Register::Type::NIL;
+                else if (isString(target) && isString(source))
+                    isEqual = getStringLength(target) == getStringLength(source) && memcmp(getStringBuffer(target), getStringBuffer(source), getStringLength(target)) == 0;
+                else if (target.type == Register::Type::BOOL && source.type == Register::Type::BOOL)
+                    isEqual = target.b == source.b;
+                else if (nativeComparison<std::equal_to<>>(target, source))
+                    isEqual = target.b;
+                else
+                    break;
+                target.type = Register::Type::BOOL;
+                target.b = opCode == OP_EQUAL ? isEqual : !isEqual;
+            } return;
+            case OP_AND:
+            case OP_OR: {
+                bool result = opCode == OP_AND ? isTruthy(target) && isTruthy(source) : isTruthy(target) || isTruthy(source);
+                target.type = Register::Type::BOOL;
+                target.b = result;
+            } return;
+            case OP_APPEND:
+            case OP_PREPEND:
+                if (isString(target) && isString(source)) {
+                    const Register& first = opCode == OP_APPEND ? target : source;
+                    const Register& second = opCode == OP_APPEND ? source : target;
+                    size_t firstLength = getStringLength(first), secondLength = getStringLength(second);
+                    if (firstLength + secondLength < SHORT_STRING_SIZE) {
+                        char buffer[SHORT_STRING_SIZE];
+                        memcpy(buffer, getStringBuffer(first), firstLength);
+                        memcpy(&buffer[firstLength], getStringBuffer(second), secondLength);
+                        pushRegister(target, buffer, firstLength + secondLength);
+                    } else {
+                        string result;
+                        result.reserve(firstLength + secondLength);
+                        result.append(getStringBuffer(first), firstLength);
+                        result.append(getStringBuffer(second), secondLength);
+                        pushRegister(target, std::move(result));
+                    }
+                    return;
+                }
+            break;
+            case OP_DEFAULT:
+                if (!isTruthy(target))
+                    target = source;
+            return;
+            case OP_SIZE:
+                if (isString(target)) {
+                    target.i = getStringLength(target);
+                    target.type = Register::Type::INT;
+                } else if (target.type == Register::Type::VARIABLE) {
+                    long long size = variableResolver.getArraySize(LiquidRenderer { this }, target.pointer);
+                    target.type = size != -1 ? Register::Type::INT : Register::Type::NIL;
+                    target.i = size;
+                } else
+                    target.type = Register::Type::NIL;
+            return;
+            case OP_DOWNCASE:
+            case OP_UPCASE:
+                if (isString(target)) {
+                    if (target.type == Register::Type::EXTRA_LONG_STRING) {
+                        longStrings.emplace_back(*(string*)target.pointer);
+                        target.pointer = &longStrings.back();
+                    }
+                    char* buffer = target.type == Register::Type::SHORT_STRING ? target.buffer : &(*(string*)target.pointer)[0];
+                    size_t length = getStringLength(target);
+                    for (size_t i = 0; i < length; ++i)
+                        buffer[i] = opCode == OP_UPCASE ? toupper((unsigned char)buffer[i]) : tolower((unsigned char)buffer[i]);
+                    return;
+                }
+            break;
+            default:
+                assert(false);
+            break;
+        }
+        // No native path for these types; put the operands on the stack where getOperand and getArgument expect them, and call through.
+        if (!type) {
+            target.type = Register::Type::NIL;
+            return;
+        }
+        int operands = 1;
+        if (&source != &target) {
+            pushStack(source);
+            ++operands;
+        }
+        pushStack(target);
+        Node result = type->render(*this, Node(), store);
+        popStack(operands);
+        pushRegister(target, result);
     }
 
     string Interpreter::renderTemplate(const Program& prog, Variable store) {
@@ -510,6 +1333,77 @@ namespace Liquid {
         return result;
     }
 
+    // The disassembly of the program, split into lines, keyed by their offset.
+    static std::vector<std::pair<size_t, string>> disassembleLines(const Context& context, const Program& program) {
+        std::vector<std::pair<size_t, string>> lines;
+        string disassembly = Compiler(context).disassemble(program);
+        size_t start = 0;
+        while (start < disassembly.size()) {
+            size_t end = disassembly.find('\n', start);
+            if (end == string::npos)
+                end = disassembly.size();
+            lines.emplace_back(strtoull(&disassembly[start], nullptr, 16), disassembly.substr(start, end - start));
+            start = end + 1;
+        }
+        return lines;
+    }
+
+    string Interpreter::annotate(const Program& program) {
+        auto it = programStates.find(program.id);
+        const ProfileCounter* counters = it != programStates.end() && !it->second.profile.empty() ? it->second.profile.data() : nullptr;
+        char buffer[64];
+        sprintf(buffer, "%12s %16s  ", "count", "cycles");
+        string result = buffer;
+        result.append("\n");
+        for (auto& line : disassembleLines(context, program)) {
+            if (counters && line.first >= program.codeOffset)
+                sprintf(buffer, "%12llu %16llu  ", counters[line.first / sizeof(unsigned int)].count, counters[line.first / sizeof(unsigned int)].cycles);
+            else
+                sprintf(buffer, "%12s %16s  ", "", "");
+            result.append(buffer);
+            result.append(line.second);
+            result.append("\n");
+        }
+        return result;
+    }
+
+    string Interpreter::hotspots(const Program& program, size_t limit) {
+        auto it = programStates.find(program.id);
+        if (it == programStates.end() || it->second.profile.empty())
+            return string();
+        const ProgramState& state = it->second;
+        char buffer[64];
+        string result = "Instructions by cycles:\n";
+        std::vector<std::pair<size_t, string>> lines = disassembleLines(context, program);
+        std::vector<const std::pair<size_t, string>*> instructions;
+        for (auto& line : lines) {
+            if (line.first >= program.codeOffset && state.profile[line.first / sizeof(unsigned int)].count)
+                instructions.push_back(&line);
+        }
+        std::stable_sort(instructions.begin(), instructions.end(), [&state](const std::pair<size_t, string>* a, const std::pair<size_t, string>* b) {
+            return state.profile[a->first / sizeof(unsigned int)].cycles > state.profile[b->first / sizeof(unsigned int)].cycles;
+        });
+        for (size_t i = 0; i < instructions.size() && i < limit; ++i) {
+            const ProfileCounter& counter = state.profile[instructions[i]->first / sizeof(unsigned int)];
+            sprintf(buffer, "%12llu %16llu  ", counter.count, counter.cycles);
+            result.append(buffer);
+            result.append(instructions[i]->second);
+            result.append("\n");
+        }
+        result.append("Node types by cycles:\n");
+        std::vector<std::pair<const NodeType*, ProfileCounter>> calls(state.callProfile.begin(), state.callProfile.end());
+        std::stable_sort(calls.begin(), calls.end(), [](const std::pair<const NodeType*, ProfileCounter>& a, const std::pair<const NodeType*, ProfileCounter>& b) {
+            return a.second.cycles > b.second.cycles;
+        });
+        for (size_t i = 0; i < calls.size() && i < limit; ++i) {
+            sprintf(buffer, "%12llu %16llu  ", calls[i].second.count, calls[i].second.cycles);
+            result.append(buffer);
+            result.append(calls[i].first->symbol.empty() ? "(anonymous)" : calls[i].first->symbol);
+            result.append("\n");
+        }
+        return result;
+    }
+
     char* itoa(int value, char* result) {
         char* ptr = result, *ptr1 = result, tmp_char;
         int tmp_value;
@@ -531,11 +1425,201 @@ namespace Liquid {
         return result;
     }
 
-    bool Interpreter::run(const unsigned char* code, Variable store, void (*callback)(const char* chunk, size_t len, void* data), void* data, const unsigned char* iteration) {
+    static inline unsigned long long profileClock() {
+        #if defined(__x86_64__) || defined(__i386__)
+            return __rdtsc();
+        #else
+            return std::chrono::steady_clock::now().time_since_epoch().count();
+        #endif
+    }
+
+    // The specialized version of an instruction, for the types observed; or the instruction itself if there isn't one.
+    static OPCode getSpecializedOpcode(OPCode opCode, unsigned char feedback) {
+        if (feedback == Interpreter::FEEDBACK_INT) {
+            switch (opCode) {
+                case OP_PLUS: return OP_PLUSINT;
+                case OP_MINUS: return OP_MINUSINT;
+                case OP_EQUAL: return OP_EQUALINT;
+                case OP_NOTEQUAL: return OP_NOTEQUALINT;
+                case OP_LESS: return OP_LESSINT;
+                case OP_LESSEQUAL: return OP_LESSEQUALINT;
+                case OP_GREATER: return OP_GREATERINT;
+                case OP_GREATEREQUAL: return OP_GREATEREQUALINT;
+                default: break;
+            }
+        } else if (feedback == Interpreter::FEEDBACK_STRING) {
+            switch (opCode) {
+                case OP_EQUAL: return OP_EQUALSTR;
+                case OP_NOTEQUAL: return OP_NOTEQUALSTR;
+                default: break;
+            }
+        } else if (feedback == Interpreter::FEEDBACK_BOOL) {
+            switch (opCode) {
+                case OP_JMPFALSE: return OP_JMPFALSEBOOL;
+                case OP_JMPTRUE: return OP_JMPTRUEBOOL;
+                default: break;
+            }
+        }
+        return opCode;
+    }
+
+    static OPCode getGenericOpcode(OPCode opCode) {
+        switch (opCode) {
+            case OP_JMPFALSEBOOL: return OP_JMPFALSE;
+            case OP_JMPTRUEBOOL: return OP_JMPTRUE;
+            case OP_PLUSINT: return OP_PLUS;
+            case OP_MINUSINT: return OP_MINUS;
+            case OP_EQUALINT: case OP_EQUALSTR: return OP_EQUAL;
+            case OP_NOTEQUALINT: case OP_NOTEQUALSTR: return OP_NOTEQUAL;
+            case OP_LESSINT: return OP_LESS;
+            case OP_LESSEQUALINT: return OP_LESSEQUAL;
+            case OP_GREATERINT: return OP_GREATER;
+            case OP_GREATEREQUALINT: return OP_GREATEREQUAL;
+            default: return opCode;
+        }
+    }
+
+    static unsigned char getTypeFeedback(const Interpreter& interpreter, const Interpreter::Register& target, const Interpreter::Register& source) {
+        if (target.type == Interpreter::Register::Type::INT && source.type == Interpreter::Register::Type::INT)
+            return Interpreter::FEEDBACK_INT;
+        if (interpreter.isString(target) && interpreter.isString(source))
+            return Interpreter::FEEDBACK_STRING;
+        return Interpreter::FEEDBACK_OTHER;
+    }
+
+    void Interpreter::specialize(const Program& program, ProgramState& state) {
+        state.specialized = program.code;
+        unsigned int i = program.codeOffset;
+        while (i < state.specialized.size()) {
+            unsigned int& instruction = *(unsigned int*)&state.specialized[i];
+            OPCode opCode = getSpecializedOpcode((OPCode)(instruction & 0xFF), state.feedback[i / sizeof(unsigned int)]);
+            instruction = (instruction & ~0xFF) | opCode;
+            i += sizeof(unsigned int) + operandSize(opCode);
+        }
+        state.feedback.clear();
+        state.feedback.shrink_to_fit();
+    }
+
+    void Interpreter::output(const Register& reg, void (*callback)(const char* chunk, size_t len, void* data), void* data) {
+        // This could potentially be made *way* more efficient.
+        auto append = [this, data, callback](const char* str, size_t len){
+            if (buffers.size())
+                buffers.top().append(str, len);
+            else
+                callback(str, len, data);
+        };
+        switch (reg.type) {
+            case Register::Type::INT: {
+                char buffer[32];
+                itoa(reg.i, buffer);
+                append(buffer, strlen(buffer));
+            } break;
+            case Register::Type::BOOL:
+                if (reg.b)
+                    append("true", 4);
+                else
+                    append("false", 5);
+            break;
+            case Register::Type::SHORT_STRING:
+            case Register::Type::EXTRA_LONG_STRING:
+                append(getStringBuffer(reg), getStringLength(reg));
+            break;
+            case Register::Type::FLOAT: {
+                char buffer[32];
+                size_t len = sprintf(buffer, "%g", reg.f);
+                append(buffer, len);
+            } break;
+            case Register::Type::VARIABLE: {
+                if (reg.pointer) {
+                    long long len = variableResolver.getStringLength(LiquidRenderer { this }, reg.pointer);
+                    if (len > 0) {
+                        if (len < 4096) {
+                            char buffer[4096];
+                            variableResolver.getString(LiquidRenderer { this }, reg.pointer, buffer);
+                            append(buffer, len);
+                        } else {
+                            vector<char> buffer;
+                            buffer.resize(len);
+                            variableResolver.getString(LiquidRenderer { this }, reg.pointer, &buffer[0]);
+                            append(buffer.data(), len);
+                        }
+                    }
+                }
+            } break;
+            case Register::Type::NIL: break;
+            case Register::Type::LONG_STRING:
+                assert(false);
+            break;
+        }
+    }
+
+    void Interpreter::resolve(Register& reg, long long operand, unsigned int slot, Variable store) {
+        // Dereferencing something that didn't resolve to a variable gives nil, rather than looking in the store.
+        if (operand != -1 && (registers[operand].type != Register::Type::VARIABLE || !registers[operand].pointer)) {
+            reg.type = Register::Type::NIL;
+            reg.pointer = nullptr;
+            return;
+        }
+        Variable var = operand == -1 ? (void*)store : registers[operand].pointer;
+        ResolveCache* cache = nullptr;
+        unsigned long long version = 0;
+        if (slot && resolveCache) {
+            cache = &resolveCache[slot - 1];
+            if (cache->container == var.pointer) {
+                if (cache->epoch != resolveEpoch && cache->version && variableResolver.getVersion)
+                    version = variableResolver.getVersion(LiquidRenderer { this }, var);
+                if (cache->epoch == resolveEpoch || (version && version == cache->version)) {
+                    cache->epoch = resolveEpoch;
+                    reg = cache->value;
+                    ++resolveCacheHits;
+                    return;
+                }
+            }
+            ++resolveCacheMisses;
+        }
+        Variable container = var;
+        bool success = false;
+        switch (reg.type) {
+            case Register::Type::INT:
+                success = variableResolver.getArrayVariable(LiquidRenderer { this }, var, reg.i, var);
+            break;
+            case Register::Type::SHORT_STRING:
+            case Register::Type::EXTRA_LONG_STRING:
+                success = variableResolver.getDictionaryVariable(LiquidRenderer { this }, var, getStringBuffer(reg), var);
+            break;
+            case Register::Type::NIL:
+            case Register::Type::BOOL:
+            case Register::Type::FLOAT:
+            case Register::Type::LONG_STRING:
+            case Register::Type::VARIABLE:
+                assert(false);
+            break;
+        }
+        if (success) {
+            pushRegister(reg, var);
+        } else {
+            reg.type = Register::Type::NIL;
+            reg.pointer = nullptr;
+        }
+        if (cache) {
+            cache->container = container.pointer;
+            cache->epoch = resolveEpoch;
+            cache->value = reg;
+            // Long strings are owned by the render, so can't outlive it.
+            if (reg.type != Register::Type::EXTRA_LONG_STRING && variableResolver.getVersion)
+                cache->version = version ? version : variableResolver.getVersion(LiquidRenderer { this }, container);
+            else
+                cache->version = 0;
+        }
+    }
+
+    bool Interpreter::run(const unsigned char* code, Variable store, void (*callback)(const char* chunk, size_t len, void* data), void* data, const unsigned char* iteration, bool step) {
         unsigned int instruction, target;
         long long operand;
         Node node;
         while (true) {
+            const unsigned int* instructionStart = instructionPointer;
+            unsigned long long start = profile ? profileClock() : 0;
             instruction = *instructionPointer++;
             target = instruction >> 8;
             OPCode opCode = (OPCode)(instruction & 0xFF);
@@ -543,11 +1627,7 @@ namespace Liquid {
                 case OP_MOVSTR: {
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
                     unsigned int length = *(unsigned int*)&code[operand];
-                    assert(length < SHORT_STRING_SIZE);
-                    registers[target].type = Register::Type::SHORT_STRING;
-                    registers[target].length = length;
-                    memcpy(registers[target].buffer, &code[operand+sizeof(unsigned int)], length);
-                    registers[target].buffer[length] = 0;
+                    pushRegister(registers[target], (const char*)&code[operand+sizeof(unsigned int)], length);
                 } break;
                 case OP_MOV: {
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
@@ -564,9 +1644,9 @@ namespace Liquid {
                     registers[target].i = operand;
                 } break;
                 case OP_MOVFLOAT: {
-                    operand = *((double*)instructionPointer); instructionPointer += 2;
+                    double value = *((double*)instructionPointer); instructionPointer += 2;
                     registers[target].type = Register::Type::FLOAT;
-                    registers[target].f = operand;
+                    registers[target].f = value;
                 } break;
                 case OP_MOVNIL: {
                     registers[target].type = Register::Type::NIL;
@@ -580,7 +1660,8 @@ namespace Liquid {
                                 isEqual = registers[target].i == registers[0].i;
                             break;
                             case Register::Type::SHORT_STRING:
-                                isEqual = registers[target].length == registers[0].length && strncmp(registers[target].buffer, registers[0].buffer, registers[0].length) == 0;
+                            case Register::Type::EXTRA_LONG_STRING:
+                                isEqual = getStringLength(registers[target]) == getStringLength(registers[0]) && memcmp(getStringBuffer(registers[target]), getStringBuffer(registers[0]), getStringLength(registers[0])) == 0;
                             break;
                             case Register::Type::NIL:
                                 isEqual = true;
@@ -595,7 +1676,6 @@ namespace Liquid {
                                 isEqual = registers[target].pointer == registers[0].pointer;
                             break;
                             case Register::Type::LONG_STRING:
-                            case Register::Type::EXTRA_LONG_STRING:
                                 assert(false);
                             break;
                         }
@@ -623,6 +1703,8 @@ namespace Liquid {
                     popStack(operand);
                 } break;
                 case OP_JMP:
+                    if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                        return false;
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
                     instructionPointer = reinterpret_cast<const unsigned int*>(&code[operand]);
                 break;
@@ -631,64 +1713,16 @@ namespace Liquid {
                     unsigned int argCount = (unsigned int)registers[target].i;
                     pushRegister(registers[0], ((NodeType*)operand)->render(*this, node, store));
                     popStack(argCount);
+                    // Arbitrary node types may write to variables.
+                    ++resolveEpoch;
                 } break;
                 case OP_RESOLVE: {
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
-                    Variable var = operand == -1 || registers[operand].pointer == nullptr ? (void*)store : registers[operand].pointer;
-                    Register& reg = registers[target];
-                    bool success = false;
-                    switch (reg.type) {
-                        case Register::Type::INT:
-                            success = variableResolver.getArrayVariable(LiquidRenderer { this }, var, reg.i, var);
-                        break;
-                        case Register::Type::SHORT_STRING:
-                            success = variableResolver.getDictionaryVariable(LiquidRenderer { this }, var, reg.buffer, var);
-                        break;
-                        case Register::Type::NIL:
-                        case Register::Type::BOOL:
-                        case Register::Type::FLOAT:
-                        case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
-                        case Register::Type::VARIABLE:
-                            assert(false);
-                        break;
-                    }
-                    if (success) {
-                        registers[target].type = Register::Type::VARIABLE;
-                        switch (variableResolver.getType(LiquidRenderer { this }, var)) {
-                            case LIQUID_VARIABLE_TYPE_INT:
-                                reg.type = Register::Type::INT;
-                                variableResolver.getInteger(LiquidRenderer { this }, var, &reg.i);
-                            break;
-                            case LIQUID_VARIABLE_TYPE_BOOL:
-                                reg.type = Register::Type::BOOL;
-                                variableResolver.getBool(LiquidRenderer { this }, var, &reg.b);
-                            break;
-                            case LIQUID_VARIABLE_TYPE_FLOAT:
-                                reg.type = Register::Type::FLOAT;
-                                variableResolver.getFloat(LiquidRenderer { this }, var, &reg.f);
-                            break;
-                            case LIQUID_VARIABLE_TYPE_NIL:
-                                reg.type = Register::Type::NIL;
-                            break;
-                            case LIQUID_VARIABLE_TYPE_STRING: {
-                                reg.type = Register::Type::SHORT_STRING;
-                                long long length = variableResolver.getStringLength(LiquidRenderer { this }, var);
-                                assert(length < SHORT_STRING_SIZE);
-                                reg.length = (unsigned char)length;
-                                variableResolver.getString(LiquidRenderer { this }, var, reg.buffer);
-                                reg.buffer[length] = 0;
-                            } break;
-                            default:
-                                registers[target].pointer = var;
-                        }
-                    } else {
-                        registers[target].type = Register::Type::VARIABLE;
-                        registers[target].pointer = nullptr;
-                    }
+                    resolve(registers[target & 0xFF], operand, target >> 8, store);
                 } break;
                 case OP_ASSIGN: {
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
+                    ++resolveEpoch;
                     Variable hash = registers[target].pointer ? registers[target].pointer : store.pointer;
                     Variable varvalue;
                     Register& value = registers[operand];
@@ -698,7 +1732,8 @@ namespace Liquid {
                             inject(varvalue, value.i);
                         break;
                         case Register::Type::SHORT_STRING:
-                            inject(varvalue, string(value.buffer, value.length));
+                        case Register::Type::EXTRA_LONG_STRING:
+                            inject(varvalue, string(getStringBuffer(value), getStringLength(value)));
                         break;
                         case Register::Type::NIL:
                             inject(varvalue, nullptr);
@@ -713,7 +1748,6 @@ namespace Liquid {
                             varvalue = value.pointer;
                         break;
                         case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
                             assert(false);
                         break;
                     }
@@ -722,13 +1756,13 @@ namespace Liquid {
                             variableResolver.setArrayVariable(*this, hash, key.i, varvalue);
                         break;
                         case Register::Type::SHORT_STRING:
-                            variableResolver.setDictionaryVariable(*this, hash, key.buffer, varvalue);
+                        case Register::Type::EXTRA_LONG_STRING:
+                            variableResolver.setDictionaryVariable(*this, hash, getStringBuffer(key), varvalue);
                         break;
                         case Register::Type::NIL:
                         case Register::Type::BOOL:
                         case Register::Type::FLOAT:
                         case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
                         case Register::Type::VARIABLE:
                             assert(false);
                         break;
@@ -739,20 +1773,32 @@ namespace Liquid {
                         instructionPointer += 2;
                         return true;
                     }
+                    if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                        return false;
                     // TODO: This is a bit of a hack. Probably should allow for an iterator context which will allow us to call this non-recursively.
                     operand = *((long long*)instructionPointer);
                     Register& reg = registers[target];
                     void* pointers[] = { this, const_cast<unsigned char*>(code), store.pointer, (void*)callback, data, const_cast<unsigned int*>(instructionPointer) };
                     instructionPointer += 2;
-                    Variable var = reg.pointer == nullptr ? (void*)store : reg.pointer;
+                    if (reg.type != Register::Type::VARIABLE || !reg.pointer) {
+                        instructionPointer = reinterpret_cast<const unsigned int*>(&code[operand]);
+                        break;
+                    }
+                    if (++currentRenderingDepth > maximumRenderingDepth) {
+                        error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH;
+                        return false;
+                    }
+                    Variable var = reg.pointer;
+                    // Errors stop the iteration, rather than being thrown through the resolver.
                     variableResolver.iterate(LiquidRenderer { this }, var, +[](void* variable, void* data){
                         void** pointers = (void**)data;
                         Interpreter* interpreter = (Interpreter*)pointers[0];
-                        interpreter->registers[0].type = Register::Type::VARIABLE;
-                        interpreter->registers[0].pointer = variable;
-                        interpreter->run((const unsigned char*)pointers[1], Variable { pointers[2] }, (void (*)(const char*, size_t, void*))pointers[3], pointers[4], (const unsigned char*)pointers[5]);
-                        return true;
+                        interpreter->pushRegister(interpreter->registers[0], Variable { variable });
+                        return interpreter->run((const unsigned char*)pointers[1], Variable { pointers[2] }, (void (*)(const char*, size_t, void*))pointers[3], pointers[4], (const unsigned char*)pointers[5]);
                     }, pointers, 0, -1, false);
+                    --currentRenderingDepth;
+                    if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                        return false;
                     instructionPointer = reinterpret_cast<const unsigned int*>(&code[operand]);
                 } break;
                 case OP_OUTPUTMEM: {
@@ -764,115 +1810,29 @@ namespace Liquid {
                         callback((const char*)&code[operand+sizeof(unsigned int)], len, data);
                 } break;
                 case OP_INVERT: {
-                    bool isTrue = false;
-                    switch (registers[target].type) {
-                        case Register::Type::INT:
-                            isTrue = registers[target].i;
-                        break;
-                        case Register::Type::BOOL:
-                            isTrue = registers[target].b;
-                        break;
-                        case Register::Type::SHORT_STRING:
-                            isTrue = registers[target].length > 0;
-                        break;
-                        case Register::Type::NIL:
-                            isTrue = false;
-                        break;
-                        case Register::Type::FLOAT:
-                            isTrue = registers[target].f;
-                        break;
-                        case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
-                        case Register::Type::VARIABLE:
-                        break;
-                    }
+                    bool isTrue = isTruthy(registers[target]);
                     registers[target].type = Register::Type::BOOL;
                     registers[target].b = !isTrue;
                 } break;
-                case OP_OUTPUT: {
-                    // This could potentially be made *way* more efficient.
-                    auto output = [this, data, callback](const char* str, size_t len){
-                        if (buffers.size())
-                            buffers.top().append(str, len);
-                        else
-                            callback(str, len, data);
-                    };
-                    switch (registers[target].type) {
-                        case Register::Type::INT: {
-                            char buffer[32];
-                            itoa(registers[target].i, buffer);
-                            output(buffer, strlen(buffer));
-                        } break;
-                        case Register::Type::BOOL:
-                            if (registers[target].b)
-                                output("true", 4);
-                            else
-                                output("false", 5);
-                        break;
-                        case Register::Type::SHORT_STRING:
-                            output(registers[target].buffer, registers[target].length);
-                        break;
-                        case Register::Type::FLOAT: {
-                            char buffer[32];
-                            size_t len = sprintf(buffer, "%g", registers[target].f);
-                            output(buffer, len);
-                        } break;
-                        case Register::Type::VARIABLE: {
-                            if (registers[target].pointer) {
-                                long long len = variableResolver.getStringLength(LiquidRenderer { this }, registers[target].pointer);
-                                if (len > 0) {
-                                    if (len < 4096) {
-                                        char buffer[4096];
-                                        variableResolver.getString(LiquidRenderer { this }, registers[target].pointer, buffer);
-                                        output(buffer, len);
-                                    } else {
-                                        vector<char> buffer;
-                                        buffer.resize(len);
-                                        variableResolver.getString(LiquidRenderer { this }, registers[target].pointer, &buffer[0]);
-                                        output(buffer.data(), len);
-                                    }
-                                }
-                            }
-                        } break;
-                        case Register::Type::NIL: break;
-                        case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
-                            assert(false);
-                        break;
-                    }
-                } break;
+                case OP_OUTPUT:
+                    output(registers[target], callback, data);
+                break;
                 case OP_JMPTRUE: {
                 case OP_JMPFALSE:
-                    bool isTrue = true;
                     operand = *((long long*)instructionPointer); instructionPointer += 2;
-                    switch (registers[target].type) {
-                        case Register::Type::INT:
-                            isTrue = registers[target].i;
-                        break;
-                        case Register::Type::BOOL:
-                            isTrue = registers[target].b;
-                        break;
-                        case Register::Type::SHORT_STRING:
-                            isTrue = registers[target].length > 0;
-                        break;
-                        case Register::Type::NIL:
-                            isTrue = false;
-                        break;
-                        case Register::Type::FLOAT:
-                            isTrue = registers[target].f;
-                        break;
-                        case Register::Type::VARIABLE:
-                            isTrue = registers[target].pointer;
-                        break;
-                        case Register::Type::LONG_STRING:
-                        case Register::Type::EXTRA_LONG_STRING:
-                        break;
-                    }
+                    if (typeFeedback)
+                        typeFeedback[((const unsigned char*)instructionPointer - code) / sizeof(unsigned int) - 3] |= registers[target].type == Register::Type::BOOL ? FEEDBACK_BOOL : FEEDBACK_OTHER;
+                    bool isTrue = isTruthy(registers[target]);
                     if (opCode == OP_JMPFALSE)
                         isTrue = !isTrue;
                     if (isTrue)
                         instructionPointer = reinterpret_cast<const unsigned int*>(&code[operand]);
                 } break;
+                case OP_SWITCH:
+                    operand = *((long long*)instructionPointer); instructionPointer += 2;
+                    // Each of the jumps that follow is three words.
+                    instructionPointer += 3 * getSwitchIndex(registers[target], &code[operand+sizeof(unsigned int)]);
+                break;
                 case OP_PUSHBUFFER: {
                     buffers.push(string());
                 } break;
@@ -880,21 +1840,229 @@ namespace Liquid {
                     pushRegister(registers[target], move(buffers.top()));
                     buffers.pop();
                 } break;
+                case OP_PLUS:
+                case OP_MINUS:
+                case OP_MULTIPLY:
+                case OP_DIVIDE:
+                case OP_MODULO:
+                case OP_EQUAL:
+                case OP_NOTEQUAL:
+                case OP_LESS:
+                case OP_LESSEQUAL:
+                case OP_GREATER:
+                case OP_GREATEREQUAL:
+                case OP_AND:
+                case OP_OR:
+                case OP_APPEND:
+                case OP_PREPEND:
+                case OP_DEFAULT:
+                case OP_SIZE:
+                case OP_DOWNCASE:
+                case OP_UPCASE:
+                    operand = *((long long*)instructionPointer); instructionPointer += 2;
+                    if (typeFeedback)
+                        typeFeedback[((const unsigned char*)instructionPointer - code) / sizeof(unsigned int) - 3] |= getTypeFeedback(*this, registers[target & 0xFF], registers[target >> 8]);
+                    native(opCode, (const NodeType*)operand, registers[target & 0xFF], registers[target >> 8], store);
+                break;
+                case OP_JMPFALSEBOOL:
+                case OP_JMPTRUEBOOL:
+                    if (registers[target].type != Register::Type::BOOL)
+                        goto deoptimize;
+                    operand = *((long long*)instructionPointer); instructionPointer += 2;
+                    if (registers[target].b == (opCode == OP_JMPTRUEBOOL))
+                        instructionPointer = reinterpret_cast<const unsigned int*>(&code[operand]);
+                break;
+                case OP_PLUSINT:
+                case OP_MINUSINT:
+                case OP_EQUALINT:
+                case OP_NOTEQUALINT:
+                case OP_LESSINT:
+                case OP_LESSEQUALINT:
+                case OP_GREATERINT:
+                case OP_GREATEREQUALINT: {
+                    Register& left = registers[target & 0xFF];
+                    Register& right = registers[target >> 8];
+                    if (left.type != Register::Type::INT || right.type != Register::Type::INT)
+                        goto deoptimize;
+                    instructionPointer += 2;
+                    switch (opCode) {
+                        case OP_PLUSINT: left.i += right.i; break;
+                        case OP_MINUSINT: left.i -= right.i; break;
+                        case OP_EQUALINT: left.b = left.i == right.i; break;
+                        case OP_NOTEQUALINT: left.b = left.i != right.i; break;
+                        case OP_LESSINT: left.b = left.i < right.i; break;
+                        case OP_LESSEQUALINT: left.b = left.i <= right.i; break;
+                        case OP_GREATERINT: left.b = left.i > right.i; break;
+                        default: left.b = left.i >= right.i; break;
+                    }
+                    if (opCode != OP_PLUSINT && opCode != OP_MINUSINT)
+                        left.type = Register::Type::BOOL;
+                } break;
+                case OP_EQUALSTR:
+                case OP_NOTEQUALSTR: {
+                    Register& left = registers[target & 0xFF];
+                    Register& right = registers[target >> 8];
+                    if (!isString(left) || !isString(right))
+                        goto deoptimize;
+                    instructionPointer += 2;
+                    bool isEqual = getStringLength(left) == getStringLength(right) && memcmp(getStringBuffer(left), getStringBuffer(right), getStringLength(left)) == 0;
+                    left.type = Register::Type::BOOL;
+                    left.b = opCode == OP_EQUALSTR ? isEqual : !isEqual;
+                } break;
+                deoptimize:
+                    // The guard failed; permanently rewrite the instruction back to its generic version, and run that instead.
+                    ++deoptimizations;
+                    --instructionPointer;
+                    *const_cast<unsigned int*>(instructionPointer) = (instruction & ~0xFF) | getGenericOpcode(opCode);
+                break;
+                case OP_PARTIAL:
+                case OP_INVOKE: {
+                    operand = *((long long*)instructionPointer); instructionPointer += 2;
+                    const unsigned char* callee = code;
+                    const unsigned int* entry;
+                    ResolveCache* callerResolveCache = resolveCache;
+                    unsigned char* callerTypeFeedback = typeFeedback;
+                    ProfileCounter* callerProfile = profile;
+                    if (opCode == OP_PARTIAL) {
+                        unsigned int length = *(unsigned int*)&code[operand];
+                        auto it = partials.find(string((const char*)&code[operand+sizeof(unsigned int)], length));
+                        if (it == partials.end())
+                            break;
+                        callee = it->second->code.data();
+                        entry = reinterpret_cast<const unsigned int*>(&callee[it->second->codeOffset]);
+                        // The partial's inline cache slots and instruction offsets aren't ours.
+                        resolveCache = nullptr;
+                        typeFeedback = nullptr;
+                        profile = nullptr;
+                    } else
+                        entry = reinterpret_cast<const unsigned int*>(&code[operand]);
+                    if (++currentRenderingDepth > maximumRenderingDepth) {
+                        error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH;
+                        return false;
+                    }
+                    // The callee allocates its registers from the same place we do, so preserve ours.
+                    Register saved[TOTAL_REGISTERS - Compiler::SCRATCH_REGISTERS];
+                    for (unsigned int i = 0; i < target; ++i)
+                        saved[i] = registers[Compiler::SCRATCH_REGISTERS + i];
+                    const unsigned int* returnPointer = instructionPointer;
+                    instructionPointer = entry;
+                    ++callDepth;
+                    run(callee, store, callback, data);
+                    --callDepth;
+                    --currentRenderingDepth;
+                    instructionPointer = returnPointer;
+                    for (unsigned int i = 0; i < target; ++i)
+                        registers[Compiler::SCRATCH_REGISTERS + i] = saved[i];
+                    resolveCache = callerResolveCache;
+                    typeFeedback = callerTypeFeedback;
+                    profile = callerProfile;
+                    if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                        return false;
+                } break;
                 case OP_EXIT:
-                    assert(stackPointer == stackBlock);
+                    assert(callDepth > 0 || stackPointer == stackBlock.data());
                     return false;
                 default:
                     assert(false);
                 break;
             }
+            if (profile) {
+                unsigned long long cycles = profileClock() - start;
+                ProfileCounter& counter = profile[((const unsigned char*)instructionStart - code) / sizeof(unsigned int)];
+                ++counter.count;
+                counter.cycles += cycles;
+                // Native operations, and their specialized versions, keep their node type as the operand, same as OP_CALL; the compiler's own
+                // arithmetic has none.
+                const NodeType* type = opCode == OP_CALL || opCode >= OP_PLUS ? *(const NodeType* const*)&instructionStart[1] : nullptr;
+                if (type) {
+                    ProfileCounter& call = (*callProfile)[type];
+                    ++call.count;
+                    call.cycles += cycles;
+                }
+            }
+            if (step)
+                return true;
         }
     }
 
     void Interpreter::renderTemplate(const Program& prog, Variable store, void (*callback)(const char* chunk, size_t len, void* data), void* data) {
         mode = Renderer::ExecutionMode::INTERPRETER;
-        instructionPointer = reinterpret_cast<const unsigned int*>(&prog.code[prog.codeOffset]);
-        stackPointer = stackBlock;
-        run(prog.code.data(), store, callback, data);
+        error = LIQUID_RENDERER_ERROR_TYPE_NONE;
+        currentRenderingDepth = 0;
+        // If the last render used far less than the stack we have, give some back.
+        size_t highWater = stackHighWater - stackBlock.data();
+        if (stackBlock.size() > INITIAL_STACK_SIZE && highWater < stackBlock.size() / 4) {
+            stackBlock.resize(std::max((size_t)INITIAL_STACK_SIZE, highWater * 2));
+            stackBlock.shrink_to_fit();
+        }
+        stackPointer = stackHighWater = stackBlock.data();
+        longStrings.clear();
+        ++resolveEpoch;
+        resolveCache = nullptr;
+        typeFeedback = nullptr;
+        profile = nullptr;
+        callProfile = nullptr;
+        #ifdef LIQUID_JIT
+            const JitProgram* jitProgram = nullptr;
+        #endif
+        const unsigned char* code = prog.code.data();
+        // Programs that weren't produced by a compiler have no state.
+        if (prog.id) {
+            auto it = programStates.find(prog.id);
+            if (it == programStates.end()) {
+                if (programStates.size() >= programStateLimit) {
+                    for (auto state = programStates.begin(); state != programStates.end();) {
+                        if (state->second.program.expired())
+                            state = programStates.erase(state);
+                        else
+                            ++state;
+                    }
+                    programStateLimit = std::max(programStateLimit, programStates.size() * 2);
+                }
+                it = programStates.emplace(prog.id, ProgramState()).first;
+                it->second.program = prog.lifetime;
+            }
+            ProgramState& state = it->second;
+            if (prog.resolveSites > 0) {
+                if (state.resolveCaches.size() != prog.resolveSites)
+                    state.resolveCaches.assign(prog.resolveSites, ResolveCache { nullptr, 0, 0, Register() });
+                resolveCache = state.resolveCaches.data();
+            }
+            if (state.specialized.empty() && state.renders == SPECIALIZATION_THRESHOLD)
+                specialize(prog, state);
+            if (state.specialized.empty()) {
+                state.feedback.resize(prog.code.size() / sizeof(unsigned int));
+                typeFeedback = state.feedback.data();
+            } else
+                code = state.specialized.data();
+            if (profiling) {
+                if (state.profile.size() != prog.code.size() / sizeof(unsigned int))
+                    state.profile.assign(prog.code.size() / sizeof(unsigned int), ProfileCounter());
+                profile = state.profile.data();
+                callProfile = &state.callProfile;
+            }
+            #ifdef LIQUID_JIT
+                // Only specialized programs are compiled, as the native code doesn't record feedback.
+                if (jit && !state.jit && !state.specialized.empty() && state.renders == JIT_THRESHOLD)
+                    state.jit = JitProgram::compile(*this, prog, code);
+                jitProgram = jit && !profiling ? state.jit.get() : nullptr;
+            #endif
+            ++state.renders;
+        }
+        instructionPointer = reinterpret_cast<const unsigned int*>(&code[prog.codeOffset]);
+        size_t bufferDepth = buffers.size();
+        #ifdef LIQUID_JIT
+            if (jitProgram) {
+                JitProgram::Frame frame = { this, code, store, callback, data, nullptr };
+                jitProgram->run(frame);
+            } else
+        #endif
+        run(code, store, callback, data);
+        if (error != LIQUID_RENDERER_ERROR_TYPE_NONE) {
+            while (buffers.size() > bufferDepth)
+                buffers.pop();
+            throw Renderer::Exception(Renderer::Error(error, Node()));
+        }
     }
 
 
@@ -902,11 +2070,12 @@ namespace Liquid {
         int freeRegister = compiler.freeRegister;
         for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
             compiler.compileBranch(**it);
-            compiler.add(OP_PUSH, freeRegister);
+            compiler.addPush(freeRegister);
             compiler.freeRegister = freeRegister;
         }
         compiler.add(OP_MOVINT, compiler.freeRegister, node.children.size());
         compiler.add(OP_CALL, compiler.freeRegister, (long long)this);
+        compiler.stackSize -= node.children.size();
         compiler.freeRegister = 1;
     }
 
@@ -922,10 +2091,91 @@ namespace Liquid {
         }
     }
 
+    // Hoisted expressions are evaluated in place; a value kept in a register across the loop could point into stack space the body reuses.
+    void Context::HoistingNode::compile(Compiler& compiler, const Node& node) const {
+        compiler.compileBranch(*node.children.back().get());
+    }
+
+    void Context::HoistedNode::compile(Compiler& compiler, const Node& node) const {
+        compiler.compileBranch(*node.children[1].get());
+    }
+
+    // Likewise, shared expressions are evaluated at each occurrence.
+    void Context::SharingNode::compile(Compiler& compiler, const Node& node) const {
+        compiler.compileBranch(*node.children.back().get());
+    }
+
+    void Context::InvalidatingNode::compile(Compiler& compiler, const Node& node) const {
+        compiler.compileBranch(*node.children.back().get());
+    }
+
+    void Context::MemoizingNode::compile(Compiler& compiler, const Node& node) const {
+        compiler.compileBranch(*node.children[1].get());
+    }
+
+    // The switch's jumps go straight to the bodies; a subject that isn't a string goes through the tag's comparisons, in order, which jump
+    // to the same bodies.
+    void DispatchNodeType::compile(Compiler& compiler, const Node& node) const {
+        const Node& tag = *node.children[2].get();
+        const Variant& table = node.children[1]->variant;
+        vector<string> keys;
+        // Each body, in the order the tag compares them, with the jumps to it.
+        vector<pair<int, vector<pair<int, OPCode>>>> bodies;
+        vector<int> keyBodies;
+        for (size_t i = 2; i < table.a.size(); i += 2) {
+            if (table.a[i].type != Variant::Type::NIL) {
+                keys.push_back(table.a[i].s);
+                keyBodies.push_back(table.a[i+1].i);
+                bodies.push_back({ (int)table.a[i+1].i, { } });
+            }
+        }
+        std::sort(bodies.begin(), bodies.end(), [](auto& a, auto& b) { return a.first < b.first; });
+        bodies.erase(std::unique(bodies.begin(), bodies.end(), [](auto& a, auto& b) { return a.first == b.first; }), bodies.end());
+        auto getBody = [&bodies](int index) -> vector<pair<int, OPCode>>& {
+            return std::lower_bound(bodies.begin(), bodies.end(), index, [](auto& body, int index) { return body.first < index; })->second;
+        };
+
+        compiler.freeRegister = 0;
+        compiler.compileBranch(*node.children[0].get());
+        compiler.add(OP_MOV, 0x0, 0x1);
+        compiler.addSwitch(0x1, keys);
+        for (int body : keyBodies)
+            getBody(body).emplace_back(compiler.add(OP_JMP, 0x0, 0x0), OP_JMP);
+        vector<int> defaultJumps = { compiler.add(OP_JMP, 0x0, 0x0) };
+        int fallbackJump = compiler.add(OP_JMP, 0x0, 0x0);
+
+        compiler.modify(fallbackJump, OP_JMP, 0x0, compiler.currentOffset());
+        for (auto& body : bodies) {
+            compiler.freeRegister = 0;
+            compileComparison(compiler, tag, body.first);
+            body.second.emplace_back(compiler.add(OP_JMPTRUE, 0x0, 0x0), OP_JMPTRUE);
+        }
+        defaultJumps.push_back(compiler.add(OP_JMP, 0x0, 0x0));
+
+        vector<int> endJumps;
+        for (auto& body : bodies) {
+            for (auto& jump : body.second)
+                compiler.modify(jump.first, jump.second, 0x0, compiler.currentOffset());
+            compiler.freeRegister = 0;
+            compiler.compileBranch(*tag.children[body.first].get());
+            endJumps.push_back(compiler.add(OP_JMP, 0x0, 0x0));
+        }
+        for (int jump : defaultJumps)
+            compiler.modify(jump, OP_JMP, 0x0, compiler.currentOffset());
+        if (table.a[0].i != -1) {
+            compiler.freeRegister = 0;
+            compiler.compileBranch(*tag.children[table.a[0].i].get());
+        }
+        for (int jump : endJumps)
+            compiler.modify(jump, OP_JMP, 0x0, compiler.currentOffset());
+    }
+
+    // Pushed in reverse, so that the first argument sits directly underneath the operand.
     void Context::ArgumentNode::compile(Compiler& compiler, const Node& node) const {
-        for (auto& child : node.children) {
-            compiler.compileBranch(*child.get());
-            compiler.add(OP_PUSH, compiler.freeRegister - 1);
+        for (auto it = node.children.rbegin(); it != node.children.rend(); ++it) {
+            compiler.freeRegister = 0;
+            compiler.compileBranch(**it);
+            compiler.addPush(compiler.freeRegister - 1);
         }
     }
 
@@ -944,15 +2194,16 @@ namespace Liquid {
 
         if (node.children.size() > 0 && node.children[0]->variant.type == Variant::Type::STRING) {
             auto it = compiler.dropFrames.find(node.children[0]->variant.s);
-            if (it != compiler.dropFrames.end() && it->second.size() > 0) {
-                it->second.back().first(compiler, it->second.back().second, node);
+            if (it != compiler.dropFrames.end() && it->second.size() > 0 && it->second.back().first(compiler, it->second.back().second, node) == 0) {
+                // Drop frames always leave their result in 0x0.
+                compiler.freeRegister = 1;
                 return;
             }
         }
         for (size_t i = 0; i < node.children.size(); ++i) {
             compiler.freeRegister = 0;
             compiler.compileBranch(*node.children[i].get());
-            compiler.add(OP_RESOLVE, 0x0, target);
+            compiler.addResolve(0x0, target, !node.children[i]->type);
             if (i < node.children.size() - 1) {
                 compiler.add(OP_MOV, 0x0, 0x1);
                 target = 0x1;
@@ -960,15 +2211,37 @@ namespace Liquid {
         }
     }
 
+    void DotFilterNodeType::compile(Compiler& compiler, const Node& node) const {
+        const Node& operand = *node.children[0].get();
+        if (operand.type && operand.type->type == NodeType::Type::VARIABLE && operand.children.size() == 1 && !operand.children[0]->type && operand.children[0]->variant.type == Variant::Type::STRING) {
+            auto it = compiler.dropFrames.find(operand.children[0]->variant.s);
+            if (it != compiler.dropFrames.end() && it->second.size() > 0 && it->second.back().first(compiler, it->second.back().second, node) == 0) {
+                // Drop frames always leave their result in 0x0.
+                compiler.freeRegister = 1;
+                return;
+            }
+        }
+        compiler.freeRegister = 0;
+        compiler.compileBranch(operand);
+        compiler.addPush(compiler.freeRegister - 1);
+        compiler.add(OP_MOVINT, compiler.freeRegister, 1);
+        compiler.add(OP_CALL, compiler.freeRegister, (long long)this);
+        compiler.stackSize -= 1;
+        compiler.freeRegister = 1;
+    }
+
     void FilterNodeType::compile(Compiler& compiler, const Node& node) const {
         if (!userCompileFunction) {
+            int stackSize = compiler.stackSize;
             for (int i = node.children.size() - 1; i >= 0; --i) {
+                compiler.freeRegister = 0;
                 compiler.compileBranch(*node.children[i].get());
                 if (i == 0)
-                    compiler.add(OP_PUSH, compiler.freeRegister - 1);
+                    compiler.addPush(compiler.freeRegister - 1);
             }
-            compiler.add(OP_MOVINT, compiler.freeRegister, node.children.size());
+            compiler.add(OP_MOVINT, compiler.freeRegister, compiler.stackSize - stackSize);
             compiler.add(OP_CALL, compiler.freeRegister, (long long)this);
+            compiler.stackSize = stackSize;
             compiler.freeRegister = 1;
         } else
             userCompileFunction(LiquidCompiler{&compiler}, LiquidNode{const_cast<Node*>(&node)}, userData);
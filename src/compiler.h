@@ -5,9 +5,12 @@
 #include <stack>
 #include <unordered_map>
 #include <string>
+#include <deque>
+#include <memory>
 
 #include "common.h"
 #include "renderer.h"
+#include "jit.h"
 
 namespace Liquid {
 
@@ -38,43 +41,122 @@ namespace Liquid {
         OP_JMPTRUE,     // Jumps to the instruction if the priamry register is true.
         OP_CALL,        // Calls the function specified with the amount of arugments on the stack.
         OP_RESOLVE,     // Resovles the named variable in the register and places it into the same register. Operand is either 0x0, for the top-level context, or a register, which contains the context for the next deference.,
+                        // The low byte of the target is the register; the rest is the inline cache slot for the site, or 0 if uncached.
         OP_LENGTH,      // Gets the length of the specified variable held in the target register, and puts it into 0x0.
         OP_ITERATE,     // Iterates through the variable in the specified register, and pops the value into 0x0. If iteration is over, JMPs to the specified instruction.
         OP_INVERT,      // Coerces to a boolean
         OP_PUSHBUFFER,  // Pushes a buffer onto to the buffer stack, with the contents of the target register.
         OP_POPBUFFER,   // Pops a buffer off the buffer stack, flushing the contents of the buffer to the target register.
-        OP_EXIT         // Quits the program.
+        OP_EXIT,        // Quits the program.
+        OP_JMPFALSEBOOL,// Specialized OP_JMPFALSE for a boolean register.
+        OP_JMPTRUEBOOL, // Specialized OP_JMPTRUE for a boolean register.
+        OP_PARTIAL,     // Renders the program registered with the interpreter under the name at the operand. The target is the amount of allocated registers at the call site, which are preserved.
+        OP_INVOKE,      // Calls into the code at the operand, until it hits OP_EXIT. The ProgramLinker turns OP_PARTIALs into these. Target as above.
+        OP_SWITCH,      // Looks up the string in the target register in the table at the operand, and skips as many of the OP_JMPs that follow as the index of the matching
+                        // key; one past the keys if there's no match, and two past if the register isn't a string.
+
+        // Native operations for the hot operators and filters. These work directly on typed registers; the low byte of the target is the destination
+        // and first operand, the next byte is the second operand. The operand is the NodeType that is called if the register types don't have a native path.
+        OP_PLUS,
+        OP_MINUS,
+        OP_MULTIPLY,
+        OP_DIVIDE,
+        OP_MODULO,
+        OP_EQUAL,
+        OP_NOTEQUAL,
+        OP_LESS,
+        OP_LESSEQUAL,
+        OP_GREATER,
+        OP_GREATEREQUAL,
+        OP_AND,
+        OP_OR,
+        OP_APPEND,
+        OP_PREPEND,
+        OP_DEFAULT,
+        OP_SIZE,
+        OP_DOWNCASE,
+        OP_UPCASE,
+
+        // Type-specialized versions of the above, only ever produced by the interpreter from observed types. If the guard on the register types
+        // fails, the instruction is rewritten back to the generic version.
+        OP_PLUSINT,
+        OP_MINUSINT,
+        OP_EQUALINT,
+        OP_NOTEQUALINT,
+        OP_LESSINT,
+        OP_LESSEQUALINT,
+        OP_GREATERINT,
+        OP_GREATEREQUALINT,
+        OP_EQUALSTR,
+        OP_NOTEQUALSTR
     };
 
+    // The hash of the keys in OP_SWITCH tables, and of tables the optimizer builds for them; FNV-1a.
+    inline unsigned int hashSwitchKey(const char* str, size_t length) {
+        unsigned int hash = 2166136261u;
+        for (size_t i = 0; i < length; ++i)
+            hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+        return hash;
+    }
+
     bool hasOperand(OPCode opcode);
+    size_t operandSize(OPCode opcode);
     const char* getSymbolicOpcode(OPCode opcode);
 
     // Entrypoint is always codeOffset.
     // Then comes the data segment, where all strings are located.
     // Then comes the actual code segment.
     struct Program {
+        // Bumped whenever the bytecode changes in a way that makes previously serialized programs invalid.
+        static constexpr unsigned int FORMAT_VERSION = 3;
+
+        // Unique per compilation, or load; used by interpreters to key their inline caches.
+        unsigned long long id = 0;
+        // Shared by copies of the program; interpreters drop what they hold for it once the last is gone.
+        std::shared_ptr<const void> lifetime;
         unsigned int codeOffset;
+        // Amount of OP_RESOLVE sites that have an inline cache slot.
+        unsigned int resolveSites = 0;
         std::vector<unsigned char> code;
+        // Not serialized; only used to label the program's native code for profilers.
+        std::string name;
+
+        // Serializes the program into a relocatable form; node types referred to by the code are written out as a symbol table of names,
+        // with a list of relocations, and are resolved against the context again on load. Throws if a node type isn't part of the context.
+        std::vector<unsigned char> serialize(const Context& context) const;
+        // Throws if the data is malformed, was produced by a different version, or refers to node types the context doesn't have.
+        // Jump targets aren't validated, so only load programs from trusted sources.
+        static Program load(const Context& context, const unsigned char* data, size_t size);
     };
 
     struct Compiler {
+        // Registers below SCRATCH_REGISTERS are used freely for intermediate values. The rest are handed out by allocateRegisters, in a
+        // stack-like fashion, as the lifetimes of values in a template always nest.
+        static constexpr int TOTAL_REGISTERS = 32;
+        static constexpr int SCRATCH_REGISTERS = 4;
+
         std::vector<unsigned char> data;
         std::vector<unsigned char> code;
         int freeRegister;
-        std::unordered_map<long long, int> existingStrings;
+        unsigned int resolveSites;
+        std::unordered_multimap<long long, int> existingStrings;
 
         const Context& context;
         // For forloops, and the forloop vairables, amongst other things. Space should likely be allocated only when actually  needed.
         // Returns the offset from the current stack frame.
+        // Callbacks return 0 if they've compiled the node, or -1 if the node isn't something the frame can handle, in which case it's compiled normally.
+        // If the frame lives in registers rather than on the stack, registerPoint is the first of them, otherwise -1.
         struct DropFrameState {
             int stackPoint;
+            int registerPoint;
         };
         int stackSize;
+        int allocatedRegisters;
         typedef int (*DropFrameCallback)(Compiler& compiler, DropFrameState& state, const Node& node);
         std::unordered_map<std::string, std::vector<std::pair<DropFrameCallback, DropFrameState>>> dropFrames;
 
-        void addDropFrame(const std::string& name, DropFrameCallback callback) {
-            dropFrames[name].emplace_back(callback, DropFrameState { stackSize });
+        void addDropFrame(const std::string& name, DropFrameCallback callback, int registerPoint = -1) {
+            dropFrames[name].emplace_back(callback, DropFrameState { stackSize, registerPoint });
         }
 
         void clearDropFrame(const std::string& name) {
@@ -90,6 +172,21 @@ namespace Liquid {
 
         int addPush(int target);
         int addPop(int amount);
+        // Returns the first of the amount of consecutive registers, or -1 if there aren't enough left, in which case the caller should use the stack.
+        int allocateRegisters(int amount);
+        // Must be called in the reverse order of allocation.
+        void releaseRegisters(int amount);
+        // Adds a resolve; sites with a literal key get an inline cache slot.
+        int addResolve(int target, long long operand, bool cacheable);
+        // For tags like {% include %}; renders the named partial, either through the interpreter's partials, or as linked by a ProgramLinker.
+        int addPartial(const std::string& name);
+        // Adds an OP_SWITCH on the register over the keys, which must be distinct; it has to be followed by an OP_JMP for each key, in order,
+        // then one for no match, and one for a register that isn't a string.
+        int addSwitch(int target, const std::vector<std::string>& keys);
+
+        // Native operations; result ends up in 0x0.
+        int addNative(OPCode code, const NodeType* fallback, const Node& operand);
+        int addNative(OPCode code, const NodeType* fallback, const Node& operand, const Node& argument);
 
         void modify(int offset, OPCode code, int target, long long operand);
         int currentOffset() const;
@@ -101,6 +198,22 @@ namespace Liquid {
         string disassemble(const Program& program);
     };
 
+    // Links compiled programs together into a single image per entry point; static partial names are resolved to direct OP_INVOKEs of the
+    // partial's code, which is appended to the image, or, for small partials, inlined at the call site. Data segments are merged, and registers,
+    // jumps and inline cache slots are relocated.
+    struct ProgramLinker {
+        // Partials whose code is at most this many bytes are inlined, if there are enough registers. 0 disables inlining.
+        size_t inlineThreshold = 256;
+        std::unordered_map<std::string, const Program*> programs;
+
+        // The program must outlive the linker.
+        void add(const std::string& name, const Program& program) { programs[name] = &program; }
+        // Throws if a partial can't be resolved.
+        Program link(const std::string& name) const;
+        // Links every added program; a theme's worth of images.
+        std::unordered_map<std::string, Program> linkAll() const;
+    };
+
     struct Interpreter : Renderer {
         static constexpr int SHORT_STRING_SIZE = 64;
 
@@ -112,7 +225,7 @@ namespace Liquid {
                 NIL,
                 SHORT_STRING,       // Inline, or in a register.
                 LONG_STRING,        // On stack. Up to 65k; short is multiplexed with the type info.
-                EXTRA_LONG_STRING,  // In memory.
+                EXTRA_LONG_STRING,  // In memory; pointer to a string owned by the interpreter for the duration of the render.
                 VARIABLE            // 3rd party variable.
             };
 
@@ -129,18 +242,89 @@ namespace Liquid {
             };
         };
 
-        static constexpr int STACK_SIZE = 100*1024;
-        static constexpr int TOTAL_REGISTERS = 4;
-        static constexpr int MAX_FRAMES = 128;
+        // The stack starts out small, and grows on demand.
+        static constexpr int INITIAL_STACK_SIZE = 4*1024;
+        // The most a single push can take up; a short string, its padding and type.
+        static constexpr int MAX_STACK_ENTRY_SIZE = SHORT_STRING_SIZE + 4 + sizeof(unsigned int);
+        static constexpr int TOTAL_REGISTERS = Compiler::TOTAL_REGISTERS;
 
         stack<string> buffers;
+        // Backing store for strings that don't fit in a register.
+        std::deque<string> longStrings;
 
         Register registers[TOTAL_REGISTERS];
         const unsigned int* instructionPointer;
         char* stackPointer;
+        // If the stack grows past this, in bytes, rendering stops with LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_MEMORY.
+        unsigned int maximumStackSize = 16*1024*1024;
 
-        int frames[MAX_FRAMES];
-        char stackBlock[STACK_SIZE];
+        // Inline cache for an OP_RESOLVE site. A hit requires the same container, and either the same render epoch, or the same non-zero version
+        // from the resolver's getVersion. The epoch is bumped at the start of every render, and whenever something could have written to a variable.
+        struct ResolveCache {
+            void* container;
+            unsigned long long epoch;
+            unsigned long long version;
+            Register value;
+        };
+        // Observed operand types for an instruction, as a mask.
+        enum TypeFeedback {
+            FEEDBACK_INT = 1,
+            FEEDBACK_STRING = 2,
+            FEEDBACK_BOOL = 4,
+            FEEDBACK_OTHER = 8
+        };
+        // Amount of renders of a program for which types are recorded, before the program is specialized.
+        static constexpr unsigned int SPECIALIZATION_THRESHOLD = 8;
+        // Amount of renders of a program, after which it's compiled to native code, where supported.
+        static constexpr unsigned int JIT_THRESHOLD = 32;
+        // Can be turned off per interpreter; programs already compiled are then interpreted again.
+        bool jit = true;
+        // Executions of an instruction, or calls of a node type, and the cycles spent in them.
+        struct ProfileCounter {
+            unsigned long long count = 0;
+            unsigned long long cycles = 0;
+        };
+        // Held per interpreter rather than in the program, so that programs can be shared between threads.
+        struct ProgramState {
+            std::weak_ptr<const void> program;
+            std::vector<ResolveCache> resolveCaches;
+            unsigned int renders = 0;
+            // One entry per 4-byte word of the program.
+            std::vector<unsigned char> feedback;
+            // Copy of the program, with hot instructions rewritten to their type-specialized versions.
+            std::vector<unsigned char> specialized;
+            // While profiling; one entry per 4-byte word of the program, and one per node type called by OP_CALL, or a native operation.
+            std::vector<ProfileCounter> profile;
+            std::unordered_map<const NodeType*, ProfileCounter> callProfile;
+            #ifdef LIQUID_JIT
+                // Native code for the specialized program, once it's been rendered JIT_THRESHOLD times.
+                std::unique_ptr<JitProgram> jit;
+            #endif
+        };
+        // Once there are this many states, those of programs that no longer exist are dropped, and this is raised to twice what's left,
+        // if that's more; so compiling and rendering programs over and over doesn't grow the map.
+        size_t programStateLimit = 64;
+        std::unordered_map<unsigned long long, ProgramState> programStates;
+        ResolveCache* resolveCache = nullptr;
+        unsigned char* typeFeedback = nullptr;
+        unsigned long long resolveEpoch = 0;
+        size_t resolveCacheHits = 0;
+        size_t resolveCacheMisses = 0;
+        size_t deoptimizations = 0;
+        // If set, every instruction run, and every node type called, is counted into the program's state, along with the cycles spent on
+        // it; instructions that run others, like OP_ITERATE and OP_CALL, include their cycles. Programs aren't run as native code while profiling.
+        bool profiling = false;
+        ProfileCounter* profile = nullptr;
+        std::unordered_map<const NodeType*, ProfileCounter>* callProfile = nullptr;
+
+        // Programs for OP_PARTIAL, by name. Partials that went through a ProgramLinker don't need to be here.
+        std::unordered_map<std::string, const Program*> partials;
+        // How many OP_PARTIAL and OP_INVOKE calls deep we are.
+        unsigned int callDepth = 0;
+
+        std::vector<char> stackBlock;
+        // The furthest the stack pointer has gone this render; used to decide whether to shrink the stack between renders.
+        char* stackHighWater;
 
         Interpreter(const Context& context);
         Interpreter(const Context& context, LiquidVariableResolver resolver);
@@ -151,14 +335,39 @@ namespace Liquid {
         void getStack(Register& reg, int i);
         void popStack(int i);
         void pushStack(Register& reg);
+        void growStack();
         void pushRegister(Register& reg, const Node& node);
         void pushRegister(Register& reg, const string& str);
         void pushRegister(Register& reg, string&& str);
+        void pushRegister(Register& reg, const char* str, size_t length);
+        void pushRegister(Register& reg, Variable var);
 
-        bool run(const unsigned char* code, Variable store, void (*callback)(const char* chunk, size_t len, void* data), void* data, const unsigned char* iteration = nullptr);
+        bool isTruthy(const Register& reg) const;
+        // The index of the key the register matches in an OP_SWITCH table; the amount of keys if none, and one past that if it's not a string.
+        unsigned int getSwitchIndex(const Register& reg, const unsigned char* table) const;
+        bool isString(const Register& reg) const { return reg.type == Register::Type::SHORT_STRING || reg.type == Register::Type::EXTRA_LONG_STRING; }
+        const char* getStringBuffer(const Register& reg) const { return reg.type == Register::Type::SHORT_STRING ? reg.buffer : ((string*)reg.pointer)->data(); }
+        size_t getStringLength(const Register& reg) const { return reg.type == Register::Type::SHORT_STRING ? reg.length : ((string*)reg.pointer)->size(); }
+        // Runs a native operation on the specified registers; falling back to the NodeType if there's no fast path for the types involved.
+        void native(OPCode opCode, const NodeType* type, Register& target, Register& source, Variable store);
+        // Rewrites the recorded hot instructions of the program into their type-specialized versions.
+        void specialize(const Program& program, ProgramState& state);
+        // Resolves the key in the register against the container in the operand register, or the store if the operand is -1, into the same
+        // register; slot is the site's inline cache slot, if non-zero.
+        void resolve(Register& reg, long long operand, unsigned int slot, Variable store);
+        // Appends the register to the current buffer, or the output.
+        void output(const Register& reg, void (*callback)(const char* chunk, size_t len, void* data), void* data);
+
+        // If step is set, returns true after a single instruction.
+        bool run(const unsigned char* code, Variable store, void (*callback)(const char* chunk, size_t len, void* data), void* data, const unsigned char* iteration = nullptr, bool step = false);
 
         void renderTemplate(const Program& tmpl, Variable store, void (*)(const char* chunk, size_t len, void* data), void* data);
         string renderTemplate(const Program& tmpl, Variable store);
+
+        // The program's disassembly, with every instruction prefixed by its execution count and cycles, as profiled so far.
+        string annotate(const Program& program);
+        // The instructions, and the node types, that the program has spent the most cycles in.
+        string hotspots(const Program& program, size_t limit = 10);
     };
 }
 
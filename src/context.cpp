@@ -2,6 +2,9 @@
 #include "optimizer.h"
 #include "compiler.h"
 #include "dialect.h"
+#include "closure.h"
+#include "analyzer.h"
+#include "memoizer.h"
 
 namespace Liquid {
 
@@ -18,6 +21,25 @@ namespace Liquid {
         return true;
     }
 
+    string Context::VariableNode::access(AccessAnalyzer& analyzer, const Node& node) const {
+        if (node.children.empty() || !node.children[0] || node.children[0]->type || node.children[0]->variant.type != Variant::Type::STRING)
+            return string();
+        string path = analyzer.getPath(node.children[0]->variant.s);
+        // Past a key computed at render time, anything under the path can be read; keys that come after that are still analyzed.
+        for (size_t i = 1; i < node.children.size(); ++i) {
+            const Node* key = node.children[i].get();
+            while (key->type && (key->type->type == Type::GROUP || key->type->type == Type::GROUP_DEREFERENCE) && key->children.size() == 1)
+                key = key->children[0].get();
+            if (key->type) {
+                analyzer.read(analyzer.analyzeNode(*key));
+                analyzer.dynamic(path);
+                path.clear();
+            } else if (!path.empty())
+                path += key->variant.type == Variant::Type::INT ? "[]" : "." + key->getString();
+        }
+        return path;
+    }
+
     Node NodeType::render(Renderer& renderer, const Node& node, Variable store) const {
         if (!userRenderFunction)
             return Node();
@@ -30,6 +52,8 @@ namespace Liquid {
     Node OperatorNodeType::getOperand(Renderer& renderer, const Node& node, Variable store, int idx) const {
         if (renderer.mode == Renderer::ExecutionMode::INTERPRETER) {
             return static_cast<Interpreter&>(renderer).getStack(-1 - idx);
+        } else if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node) {
+            return renderer.closure->children[idx].evaluate(renderer, store);
         } else {
             return renderer.retrieveRenderedNode(*node.children[idx].get(), store);
         }
@@ -39,6 +63,8 @@ namespace Liquid {
     Node FilterNodeType::getOperand(Renderer& renderer, const Node& node, Variable store) const {
         if (renderer.mode == Renderer::ExecutionMode::INTERPRETER) {
             return static_cast<Interpreter&>(renderer).getStack(-1);
+        } else if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node) {
+            return renderer.closure->children[0].evaluate(renderer, store);
         } else {
             return renderer.retrieveRenderedNode(*node.children[0].get(), store);
         }
@@ -53,6 +79,8 @@ namespace Liquid {
             if (idx >= (int)node.children[offset]->children.size())
                 return Node();
             assert(node.children[offset]->type->type == NodeType::Type::ARGUMENTS);
+            if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node)
+                return renderer.closure->children[offset].children[idx].evaluate(renderer, store);
             return renderer.retrieveRenderedNode(*node.children[offset]->children[idx].get(), store);
         }
     }
@@ -60,6 +88,8 @@ namespace Liquid {
     Node DotFilterNodeType::getOperand(Renderer& renderer, const Node& node, Variable store) const {
         if (renderer.mode == Renderer::ExecutionMode::INTERPRETER)
             return static_cast<Interpreter&>(renderer).getStack(-1);
+        if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node)
+            return renderer.closure->children[0].evaluate(renderer, store);
         return renderer.retrieveRenderedNode(*node.children[0].get(), store);
     }
 
@@ -71,6 +101,8 @@ namespace Liquid {
             if (idx >= (int)node.children[offset]->children.size())
                 return Node();
             assert(node.children[offset]->type->type == NodeType::Type::ARGUMENTS);
+            if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node)
+                return renderer.closure->children[offset].children[idx].evaluate(renderer, store);
             return renderer.retrieveRenderedNode(*node.children[offset]->children[idx].get(), store);
         }
     }
@@ -86,6 +118,8 @@ namespace Liquid {
         } else {
             if (idx >= (int)node.children.size())
                 return Node();
+            if (renderer.mode == Renderer::ExecutionMode::CLOSURE && renderer.closure && renderer.closure->node == &node)
+                return renderer.closure->children[idx].evaluate(renderer, store);
             return renderer.retrieveRenderedNode(*node.children[idx].get(), store);
         }
     }
@@ -118,6 +152,128 @@ namespace Liquid {
         return Node(move(s));
     }
 
+    // Evaluated where the body first reaches each, as an expression under an if that never holds, or in a loop that never runs, may not
+    // be safe to evaluate at all.
+    Node Context::HoistingNode::render(Renderer& renderer, const Node& node, Variable store) const {
+        size_t hoisted = node.children.size() - 1;
+        vector<unique_ptr<Node>> values(hoisted);
+        for (size_t i = 0; i < hoisted; ++i) {
+            renderer.pushInternalDrop(node.children[i]->children[0]->variant.s, { &values[i], +[](Renderer& renderer, const Node& node, Variable store, void* data) {
+                unique_ptr<Node>& value = *static_cast<unique_ptr<Node>*>(data);
+                if (!value)
+                    value = make_unique<Node>(node.type->getChild(renderer, node, store, 1));
+                return *value.get();
+            } });
+        }
+        Node result = getChild(renderer, node, store, hoisted);
+        for (size_t i = 0; i < hoisted; ++i)
+            renderer.popInternalDrop(node.children[i]->children[0]->variant.s);
+        return result;
+    }
+
+    Node Context::HoistedNode::render(Renderer& renderer, const Node& node, Variable store) const {
+        pair<void*, Renderer::DropFunction> drop = renderer.getInternalDrop(node.children[0]->variant.s);
+        if (drop.second)
+            return drop.second(renderer, node, store, drop.first);
+        return getChild(renderer, node, store, 1);
+    }
+
+    Node Context::SharingNode::render(Renderer& renderer, const Node& node, Variable store) const {
+        size_t shared = node.children.size() - 1;
+        vector<unique_ptr<Node>> values(shared);
+        for (size_t i = 0; i < shared; ++i) {
+            renderer.pushInternalDrop(node.children[i]->variant.s, { &values[i], +[](Renderer& renderer, const Node& node, Variable store, void* data) {
+                unique_ptr<Node>& value = *static_cast<unique_ptr<Node>*>(data);
+                if (!value)
+                    value = make_unique<Node>(node.type->getChild(renderer, node, store, 1));
+                return *value.get();
+            } });
+        }
+        Node result = getChild(renderer, node, store, shared);
+        for (size_t i = 0; i < shared; ++i)
+            renderer.popInternalDrop(node.children[i]->variant.s);
+        return result;
+    }
+
+    Node Context::InvalidatingNode::render(Renderer& renderer, const Node& node, Variable store) const {
+        size_t keys = node.children.size() - 1;
+        Node result = getChild(renderer, node, store, keys);
+        for (size_t i = 0; i < keys; ++i) {
+            pair<void*, Renderer::DropFunction> drop = renderer.getInternalDrop(node.children[i]->variant.s);
+            if (drop.second)
+                static_cast<unique_ptr<Node>*>(drop.first)->reset();
+        }
+        return result;
+    }
+
+    Node Context::MemoizingNode::render(Renderer& renderer, const Node& node, Variable store) const {
+        if (renderer.memoizer && renderer.mode == Renderer::ExecutionMode::PARSE_TREE)
+            return renderer.memoizer->render(node, store);
+        return getChild(renderer, node, store, 1);
+    }
+
+    // The table is the default, the mask of the slots, then each slot's string, or nil if it's empty, and the index it renders.
+    int DispatchNodeType::getBranch(const Variant& table, const std::string& key) {
+        size_t mask = table.a[1].i;
+        for (size_t slot = hashSwitchKey(key.data(), key.size()) & mask; table.a[2+slot*2].type != Variant::Type::NIL; slot = (slot + 1) & mask) {
+            if (table.a[2+slot*2].s == key)
+                return table.a[3+slot*2].i;
+        }
+        return table.a[0].i;
+    }
+
+    Node DispatchNodeType::render(Renderer& renderer, const Node& node, Variable store) const {
+        const Node& tag = *node.children[2].get();
+        Node subject = renderer.retrieveRenderedNode(*node.children[0].get(), store);
+        if (subject.type || subject.variant.type != Variant::Type::STRING)
+            return renderer.retrieveRenderedNode(tag, store);
+        int branch = getBranch(node.children[1]->variant, subject.variant.s);
+        return branch != -1 ? renderer.retrieveRenderedNode(*tag.children[branch].get(), store) : Node();
+    }
+
+    static bool isRepeatableExpression(const Node& node) {
+        if (!node.type)
+            return true;
+        if (node.type->type == NodeType::Type::TAG || !node.type->isRepeatable() || node.type->optimization == LIQUID_OPTIMIZATION_SCHEME_SHIELD)
+            return false;
+        for (auto& child : node.children) {
+            if (child && !isRepeatableExpression(*child.get()))
+                return false;
+        }
+        return true;
+    }
+
+    bool DispatchNodeType::wrap(Optimizer& optimizer, Node& tag, const Node& subject, const std::vector<std::pair<std::string, int>>& branches, int fallback) const {
+        if (branches.size() < optimizer.minimumDispatchBranches || !isRepeatableExpression(subject))
+            return false;
+        size_t mask = 1;
+        while (mask + 1 < branches.size() * 2)
+            mask = (mask << 1) | 1;
+        vector<const pair<string, int>*> slots(mask + 1, nullptr);
+        for (auto& branch : branches) {
+            size_t slot = hashSwitchKey(branch.first.data(), branch.first.size()) & mask;
+            while (slots[slot] && slots[slot]->first != branch.first)
+                slot = (slot + 1) & mask;
+            // Later branches for the same string are never reached.
+            if (!slots[slot])
+                slots[slot] = &branch;
+        }
+        Variant table { vector<Variant>() };
+        table.a.reserve(2 + slots.size() * 2);
+        table.a.push_back(Variant((long long)fallback));
+        table.a.push_back(Variant((long long)mask));
+        for (auto slot : slots) {
+            table.a.push_back(slot ? Variant(slot->first) : Variant());
+            table.a.push_back(Variant((long long)(slot ? slot->second : -1)));
+        }
+        Node node(this);
+        node.children.push_back(make_unique<Node>(subject));
+        node.children.push_back(make_unique<Node>(move(table)));
+        node.children.push_back(make_unique<Node>(move(tag)));
+        tag = move(node);
+        return true;
+    }
+
     bool Context::ConcatenationNode::optimize(Optimizer& optimizer, Node& node, Variable store) const {
         if (++optimizer.renderer.currentRenderingDepth > optimizer.renderer.maximumRenderingDepth) {
             --optimizer.renderer.currentRenderingDepth;
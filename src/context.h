@@ -156,6 +156,17 @@ namespace Liquid {
             Node render(Renderer& renderer, const Node& node, Variable store) const override { return Node(); }
         };
 
+        // Mixed into filters that stand for a chain of two, which node types rewrite to, like "sort | first"; they're given the operand and
+        // arguments of the first filter in the chain, named by their symbol, and unparse as the chain.
+        struct Fusion {
+            // The filter chained after the first.
+            string chained;
+            // Arguments past these are the rewrite's own; as are trailing nils, which pad optional arguments.
+            size_t chainArguments;
+
+            Fusion(const string& chained, size_t chainArguments) : chained(chained), chainArguments(chainArguments) { }
+        };
+
         FilterNodeType(string symbol, int minArguments = -1, int maxArguments = -1, bool allowsWildcardQualifiers = false, LiquidOptimizationScheme optimization = LIQUID_OPTIMIZATION_SCHEME_FULL) : NodeType(NodeType::Type::FILTER, symbol, -1, optimization), minArguments(minArguments), maxArguments(maxArguments), allowsWildcardQualifiers(allowsWildcardQualifiers) { }
 
         Node getOperand(Renderer& renderer, const Node& node, Variable store) const;
@@ -169,6 +180,8 @@ namespace Liquid {
         DotFilterNodeType(string symbol, LiquidOptimizationScheme optimization = LIQUID_OPTIMIZATION_SCHEME_FULL) : NodeType(NodeType::Type::DOT_FILTER, symbol, -1, optimization) { }
 
         Node getOperand(Renderer& renderer, const Node& node, Variable store) const;
+
+        void compile(Compiler& compiler, const Node& node) const override;
     };
 
     // Represents something a file, or whatnot. Allows the filling in of
@@ -180,6 +193,34 @@ namespace Liquid {
         }
     };
 
+    // Stands in for a part of the tree, its last child, that it renders as, but with less work; made by the optimizer, and unparsed as
+    // that child.
+    struct WrapperNodeType : NodeType {
+        WrapperNodeType(int maxChildren = -1) : NodeType(Type::OPERATOR, "", maxChildren, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+    };
+
+    // What tags that pick a branch by comparing one expression against strings are rewritten to, once they have enough branches, like case
+    // tags whose whens are all strings; the expression, a table of the strings, then the tag. If the expression renders to a string, the
+    // branch is found by its hash, rather than by comparing it to each string in turn; anything else renders the tag as it is, as its
+    // comparisons may coerce.
+    struct DispatchNodeType : WrapperNodeType {
+        DispatchNodeType() : WrapperNodeType(3) { }
+
+        // Compiles the comparison of the branch whose body is the tag's child at the index, leaving whether it holds in 0x0; the expression
+        // is in 0x1, and has to stay there.
+        virtual void compileComparison(Compiler& compiler, const Node& tag, size_t body) const = 0;
+
+        Node render(Renderer& renderer, const Node& node, Variable store) const override;
+        void compile(Compiler& compiler, const Node& node) const override;
+
+        // Wraps the tag in a node of this type, if it has at least as many branches as the optimizer's minimum, and the expression is
+        // repeatable. Each branch is a string, and the index of the tag's child that renders if the expression is equal to it, in the order
+        // they're compared; the default renders if none is, and is -1 if nothing does. Returns whether it did.
+        bool wrap(Optimizer& optimizer, Node& tag, const Node& subject, const std::vector<std::pair<std::string, int>>& branches, int fallback) const;
+        // The index of the tag's child that renders for the string, from the table; the default if no branch matches.
+        static int getBranch(const Variant& table, const std::string& key);
+    };
+
     struct Context {
         struct ConcatenationNode : NodeType {
             ConcatenationNode() : NodeType(Type::OPERATOR, "", -1, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) { }
@@ -187,6 +228,7 @@ namespace Liquid {
             Node render(Renderer& renderer, const Node& node, Variable store) const override;
             bool optimize(Optimizer& optimizer, Node& node, Variable store) const override;
             void compile(Compiler& compiler, const Node& node) const override;
+            bool transpile(Transpiler& transpiler, const Node& node) const override;
         };
 
         struct OutputNode : ContextualNodeType {
@@ -200,6 +242,7 @@ namespace Liquid {
             }
 
             void compile(Compiler& compiler, const Node& node) const override;
+            bool transpile(Transpiler& transpiler, const Node& node) const override;
         };
 
         struct PassthruNode : NodeType {
@@ -238,6 +281,43 @@ namespace Liquid {
             }
         };
 
+        // Wraps a loop that had invariant expressions moved out of its body by the optimizer. All but the last child are those expressions,
+        // as HoistedNodes, which are evaluated once, the first time the loop's body reaches each, and kept until the loop is done.
+        struct HoistingNode : WrapperNodeType {
+            HoistingNode() : WrapperNodeType() { }
+            Node render(Renderer& renderer, const Node& node, Variable store) const override;
+            void compile(Compiler& compiler, const Node& node) const override;
+        };
+        // An expression moved out of a loop, or shared with its other occurrences; a key, then the expression. Within its HoistingNode, or
+        // SharingNode, it renders to the value evaluated there; elsewhere, and when compiled, the expression is evaluated in place.
+        struct HoistedNode : WrapperNodeType {
+            HoistedNode() : WrapperNodeType(2) { }
+            Node render(Renderer& renderer, const Node& node, Variable store) const override;
+            void compile(Compiler& compiler, const Node& node) const override;
+        };
+        // Wraps a template, or a loop's body, in which the optimizer found expressions that occur more than once. All but the last child
+        // are the keys of those expressions; each is evaluated the first time it's rendered, and kept until the end of the body, or until
+        // an InvalidatingNode clears it.
+        struct SharingNode : WrapperNodeType {
+            SharingNode() : WrapperNodeType() { }
+            Node render(Renderer& renderer, const Node& node, Variable store) const override;
+            void compile(Compiler& compiler, const Node& node) const override;
+        };
+        // Wraps a tag that writes to the store. All but the last child are the keys of shared expressions that may read what it writes;
+        // once the tag has rendered, they're evaluated again the next time they're rendered.
+        struct InvalidatingNode : WrapperNodeType {
+            InvalidatingNode() : WrapperNodeType() { }
+            Node render(Renderer& renderer, const Node& node, Variable store) const override;
+            void compile(Compiler& compiler, const Node& node) const override;
+        };
+        // Wraps a subtree whose output a Memoizer can replay; a key, unique to the subtree, then the subtree. Without a memoizer, and when
+        // compiled, the subtree renders as it is.
+        struct MemoizingNode : WrapperNodeType {
+            MemoizingNode() : WrapperNodeType(2) { }
+            Node render(Renderer& renderer, const Node& node, Variable store) const override;
+            void compile(Compiler& compiler, const Node& node) const override;
+        };
+
         struct UnknownFilterNode : FilterNodeType {
             UnknownFilterNode() : FilterNodeType("", -1, -1, true, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
 
@@ -251,9 +331,11 @@ namespace Liquid {
         EFalsiness falsiness = FALSY_FALSE;
         bool disallowArrayLiterals = false;
         bool disallowGroupingOutsideAssign = false;
+        // Used by {% cache %}, unless the renderer has its own; see CacheDialect.
+        LiquidFragmentCache fragmentCache = {};
 
         struct VariableNode : NodeType {
-            VariableNode() : NodeType(Type::VARIABLE) { }
+            VariableNode() : NodeType(Type::VARIABLE) { effects = LIQUID_EFFECT_READS_STORE; }
 
             Node render(Renderer& renderer, const Node& node, Variable store) const override {
                 pair<void*, Renderer::DropFunction> drop = renderer.getInternalDrop(node, store);
@@ -272,6 +354,7 @@ namespace Liquid {
 
             bool optimize(Optimizer& optimizer, Node& node, Variable store) const override;
             void compile(Compiler& compiler, const Node& node) const override;
+            string access(AccessAnalyzer& analyzer, const Node& node) const override;
         };
 
         unordered_map<string, unique_ptr<NodeType>> tagTypes;
@@ -290,6 +373,11 @@ namespace Liquid {
         UnknownFilterNode unknownFilterNodeType;
         ArrayLiteralNode arrayLiteralNodeType;
         ContextBoundaryNode contextBoundaryNodeType;
+        HoistingNode hoistingNodeType;
+        HoistedNode hoistedNodeType;
+        SharingNode sharingNodeType;
+        InvalidatingNode invalidatingNodeType;
+        MemoizingNode memoizingNodeType;
         FilterNodeType::WildcardQualifierNodeType filterWildcardQualifierNodeType;
 
         const NodeType* getConcatenationNodeType() const { return &concatenationNodeType; }
@@ -301,6 +389,11 @@ namespace Liquid {
         const NodeType* getUnknownFilterNodeType() const { return &unknownFilterNodeType; }
         const NodeType* getArrayLiteralNodeType() const { return &arrayLiteralNodeType; }
         const NodeType* getContextBoundaryNodeType() const { return &contextBoundaryNodeType; }
+        const NodeType* getHoistingNodeType() const { return &hoistingNodeType; }
+        const NodeType* getHoistedNodeType() const { return &hoistedNodeType; }
+        const NodeType* getSharingNodeType() const { return &sharingNodeType; }
+        const NodeType* getInvalidatingNodeType() const { return &invalidatingNodeType; }
+        const NodeType* getMemoizingNodeType() const { return &memoizingNodeType; }
         const NodeType* getFilterWildcardQualifierNodeType() const { return &filterWildcardQualifierNodeType; }
 
         NodeType* registerType(unique_ptr<NodeType> type) {
@@ -3,6 +3,8 @@
 #include "parser.h"
 #include "optimizer.h"
 #include "compiler.h"
+#include "transpiler.h"
+#include "analyzer.h"
 #include <cmath>
 #include <ctime>
 #include <algorithm>
@@ -10,6 +12,42 @@
 
 namespace Liquid {
 
+    // Compiles a filter down to a native opcode if it has the expected number of arguments; otherwise it's left to the generic OP_CALL.
+    static bool compileNativeFilter(Compiler& compiler, const FilterNodeType* type, const Node& node, OPCode opcode) {
+        bool unary = opcode == OP_SIZE || opcode == OP_DOWNCASE || opcode == OP_UPCASE;
+        size_t arguments = node.children.size() > 1 ? node.children[1]->children.size() : 0;
+        if (arguments != (unary ? 0 : 1))
+            return false;
+        if (unary)
+            compiler.addNative(opcode, type, *node.children[0].get());
+        else
+            compiler.addNative(opcode, type, *node.children[0].get(), *node.children[1]->children[0].get());
+        return true;
+    }
+
+    // Whether the node is a range of integers, possibly grouped, like (1..n); if so, evaluates its bounds, so that it can be walked without
+    // being made into an array. The interpreter evaluates operands before calling filters, so there, ranges are always arrays.
+    static bool getRangeBounds(Renderer& renderer, const Node& node, Variable store, long long& start, long long& end) {
+        if (renderer.mode == Renderer::ExecutionMode::INTERPRETER)
+            return false;
+        const Node* range = &node;
+        while (range->type && range->type->type == NodeType::Type::GROUP && range->children.size() == 1)
+            range = range->children[0].get();
+        if (!range->type || range->type->type != NodeType::Type::OPERATOR || range->type->symbol != ".." || range->children.size() != 2)
+            return false;
+        Node op1 = renderer.retrieveRenderedNode(*range->children[0].get(), store);
+        Node op2 = renderer.retrieveRenderedNode(*range->children[1].get(), store);
+        if (op1.type || op2.type || op1.variant.type != Variant::Type::INT || op2.variant.type != Variant::Type::INT)
+            return false;
+        start = op1.variant.i;
+        end = op2.variant.i;
+        return true;
+    }
+
+    static bool getRangeOperand(Renderer& renderer, const Node& node, Variable store, long long& start, long long& end) {
+        return !node.children.empty() && getRangeBounds(renderer, *node.children[0].get(), store, start, end);
+    }
+
     template <bool allowGlobals>
     struct AssignNode : TagNodeType {
 
@@ -17,6 +55,7 @@ namespace Liquid {
 
         AssignNode() : TagNodeType(Composition::FREE, "assign", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) {
             registerType<AssignOperator>();
+            effects = LIQUID_EFFECT_WRITES_STORE;
         }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
@@ -65,11 +104,23 @@ namespace Liquid {
             // The last instruction should be RESOLVE here, on 0x0. We take that instruction, and overwrite it with an ASSIGN, which will assign 0x0 to the targeted register.
             compiler.modify(compiler.currentOffset() - (sizeof(int) + sizeof(long long)), OP_ASSIGN, 0x1, 0x2);
         }
+
+        string access(AccessAnalyzer& analyzer, const Node& node) const override {
+            auto& assignmentNode = node.children.front()->children.front();
+            auto& variableNode = assignmentNode->children.front();
+            // From here on, the variable is whatever was assigned to it; a path in the store, or something local.
+            string path = analyzer.analyzeNode(*assignmentNode->children.back().get());
+            if (variableNode->children.size() == 1 && !variableNode->children[0]->type)
+                analyzer.pushAlias(variableNode->children[0]->getString(), path);
+            else
+                analyzer.read(path);
+            return string();
+        }
     };
 
 
     struct CaptureNode : TagNodeType {
-        CaptureNode() : TagNodeType(Composition::ENCLOSED, "capture", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+        CaptureNode() : TagNodeType(Composition::ENCLOSED, "capture", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { effects = LIQUID_EFFECT_WRITES_STORE; }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto& argumentNode = node.children.front();
@@ -92,10 +143,18 @@ namespace Liquid {
             // The last instruction should be RESOLVE here, on 0x0. We take that instruction, and overwrite it with an ASSIGN, which will assign 0x0 to the targeted register.
             compiler.modify(compiler.currentOffset() - (sizeof(int) + sizeof(long long)), OP_ASSIGN, 0x1, 0x2);
         }
+
+        string access(AccessAnalyzer& analyzer, const Node& node) const override {
+            auto& variableNode = node.children.front()->children.front();
+            analyzer.analyzeNode(*node.children[1].get());
+            if (variableNode->children.size() == 1 && !variableNode->children[0]->type)
+                analyzer.pushAlias(variableNode->children[0]->getString(), "");
+            return string();
+        }
     };
 
     struct IncrementNode : TagNodeType {
-        IncrementNode() : TagNodeType(Composition::FREE, "increment", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+        IncrementNode() : TagNodeType(Composition::FREE, "increment", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { effects = LIQUID_EFFECT_READS_STORE | LIQUID_EFFECT_WRITES_STORE; }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto& argumentNode = node.children.front();
@@ -113,7 +172,7 @@ namespace Liquid {
     };
 
      struct DecrementNode : TagNodeType {
-        DecrementNode() : TagNodeType(Composition::FREE, "decrement", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+        DecrementNode() : TagNodeType(Composition::FREE, "decrement", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { effects = LIQUID_EFFECT_READS_STORE | LIQUID_EFFECT_WRITES_STORE; }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto& argumentNode = node.children.front();
@@ -134,6 +193,7 @@ namespace Liquid {
         CommentNode() : TagNodeType(Composition::LEXING_HALT, "comment", 0, 0, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) { }
         Node render(Renderer& renderer, const Node& node, Variable store) const override { return Node(); }
         void compile(Compiler& compiler, const Node& node) const override { }
+        bool transpile(Transpiler& transpiler, const Node& node) const override { return true; }
     };
 
     struct RawNode : TagNodeType {
@@ -145,8 +205,28 @@ namespace Liquid {
             int offset = compiler.add(node.children[1]->variant.s.data(), node.children[1]->variant.s.size());
             compiler.add(OP_OUTPUTMEM, 0x0, offset);
         }
+        bool transpile(Transpiler& transpiler, const Node& node) const override {
+            if (node.children[1]->type)
+                return false;
+            transpiler.transpileBranch(*node.children[1].get());
+            return true;
+        }
     };
 
+    static bool isSameExpression(const Node& a, const Node& b) {
+        if (a.type != b.type)
+            return false;
+        if (!a.type)
+            return a.variant == b.variant;
+        if (a.children.size() != b.children.size())
+            return false;
+        for (size_t i = 0; i < a.children.size(); ++i) {
+            if (!a.children[i] || !b.children[i] ? a.children[i] != b.children[i] : !isSameExpression(*a.children[i].get(), *b.children[i].get()))
+                return false;
+        }
+        return true;
+    }
+
     template <bool INVERSE>
     struct BranchNode : TagNodeType {
         static Node internalRender(Renderer& renderer, const Node& node, Variable store) {
@@ -155,13 +235,13 @@ namespace Liquid {
             if (INVERSE)
                 truthy = !truthy;
             if (truthy)
-                return renderer.retrieveRenderedNode(*node.children[1].get(), store);
+                return node.type->getChild(renderer, node, store, 1);
             else {
                 // Loop through the elsifs and elses, and anything that's true, run the next concatenation.
                 for (size_t i = 2; i < node.children.size()-1; i += 2) {
-                    auto conditionalResult = renderer.retrieveRenderedNode(*node.children[i].get(), store);
+                    auto conditionalResult = node.type->getChild(renderer, node, store, i);
                     if (!conditionalResult.type && conditionalResult.variant.isTruthy(renderer.context.falsiness)) {
-                        return renderer.retrieveRenderedNode(*node.children[i+1].get(), store);
+                        return node.type->getChild(renderer, node, store, i+1);
                     }
                 }
                 return Node();
@@ -237,12 +317,38 @@ namespace Liquid {
 
         }
 
+        // Same chain as internalRender, as nested C++ branches; an else needs no condition, as it always renders as true.
+        static void internalTranspile(Transpiler& transpiler, const Node& node) {
+            string condition = transpiler.addTemporary();
+            transpiler.line("Node " + condition + " = renderer.retrieveRenderedNode(" + transpiler.addNode(*node.children[0]->children[0].get()) + ", store);");
+            transpiler.line(string("if (") + (INVERSE ? "!" : "") + condition + ".variant.isTruthy(renderer.context.falsiness)) {");
+            ++transpiler.indent;
+            transpiler.transpileBranch(*node.children[1].get());
+            int depth = 0;
+            for (size_t i = 2; i < node.children.size()-1; i += 2) {
+                --transpiler.indent;
+                transpiler.line("} else {");
+                ++transpiler.indent;
+                if (node.children[i]->type->symbol != "else") {
+                    condition = transpiler.addTemporary();
+                    transpiler.line("Node " + condition + " = renderer.retrieveRenderedNode(" + transpiler.addNode(*node.children[i].get()) + ", store);");
+                    transpiler.line("if (" + condition + ".variant.isTruthy(renderer.context.falsiness)) {");
+                    ++transpiler.indent;
+                    ++depth;
+                }
+                transpiler.transpileBranch(*node.children[i+1].get());
+            }
+            for (; depth >= 0; --depth) {
+                --transpiler.indent;
+                transpiler.line("}");
+            }
+        }
+
 
         struct ElsifNode : TagNodeType {
             ElsifNode() : TagNodeType(Composition::FREE, "elsif", 1, 1) { }
             Node render(Renderer& renderer, const Node& node, Variable store) const override {
-                auto& arguments = node.children.front();
-                return renderer.retrieveRenderedNode(*arguments->children.front().get(), store);
+                return getArgument(renderer, node, store, 0);
             }
             void compile(Compiler& compiler, const Node& node) const override { }
             bool optimize(Optimizer& optimizer, Node& node, Variable store) const override {
@@ -261,6 +367,17 @@ namespace Liquid {
             }
         };
 
+        static const Node& getCondition(const Node& node, size_t i) {
+            return i == 0 ? *node.children[0]->children[0].get() : *node.children[i]->children[0]->children[0].get();
+        }
+
+        struct DispatchNode : DispatchNodeType {
+            void compileComparison(Compiler& compiler, const Node& tag, size_t body) const override {
+                compiler.compileBranch(getCondition(tag, body - 1));
+            }
+        };
+        DispatchNode dispatch;
+
         BranchNode(const std::string symbol) : TagNodeType(Composition::ENCLOSED, symbol, 1, 1, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) {
             intermediates["elsif"] = make_unique<ElsifNode>();
             intermediates["else"] = make_unique<ElseNode>();
@@ -291,6 +408,37 @@ namespace Liquid {
         void compile(Compiler& compiler, const Node& node) const override {
             return BranchNode<INVERSE>::internalCompile(compiler, node);
         }
+
+        bool transpile(Transpiler& transpiler, const Node& node) const override {
+            BranchNode<INVERSE>::internalTranspile(transpiler, node);
+            return true;
+        }
+        // An if whose every condition is the same expression compared with "==" to a string dispatches like a case.
+        bool rewrite(Optimizer& optimizer, Node& node) const override {
+            if (INVERSE)
+                return false;
+            const Node* subject = nullptr;
+            vector<pair<string, int>> branches;
+            int fallback = -1;
+            for (size_t i = 0; i + 1 < node.children.size(); i += 2) {
+                if (node.children[i]->type->symbol == "else") {
+                    fallback = i + 1;
+                    break;
+                }
+                const Node& condition = getCondition(node, i);
+                if (!condition.type || condition.type->type != NodeType::Type::OPERATOR || condition.type->symbol != "==" || condition.children.size() != 2)
+                    return false;
+                const Node* expression = condition.children[0].get();
+                const Node* literal = condition.children[1].get();
+                if (!expression->type)
+                    std::swap(expression, literal);
+                if (!expression->type || literal->type || literal->variant.type != Variant::Type::STRING || (subject && !isSameExpression(*subject, *expression)))
+                    return false;
+                subject = expression;
+                branches.emplace_back(literal->variant.s, i + 1);
+            }
+            return subject && dispatch.wrap(optimizer, node, *subject, branches, fallback);
+        }
     };
 
 
@@ -316,6 +464,14 @@ namespace Liquid {
             Node render(Renderer& renderer, const Node& node, Variable store) const override { return Node(); }
         };
 
+        struct DispatchNode : DispatchNodeType {
+            void compileComparison(Compiler& compiler, const Node& tag, size_t body) const override {
+                compiler.compileBranch(*tag.children[body - 1]->children[0]->children[0].get());
+                compiler.add(OP_EQL, 0x1);
+            }
+        };
+        DispatchNode dispatch;
+
         CaseNode() : TagNodeType(Composition::ENCLOSED, "case", 1, 1, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) {
             intermediates["when"] = make_unique<WhenNode>();
             intermediates["else"] = make_unique<ElseNode>();
@@ -367,9 +523,37 @@ namespace Liquid {
             for (int i : outsideJmps)
                 compiler.modify(i, OP_JMP, 0x0, compiler.currentOffset());
         }
+        // Only whens before the first else can be reached.
+        bool rewrite(Optimizer& optimizer, Node& node) const override {
+            auto whenNodeType = intermediates.find("when")->second.get();
+            vector<pair<string, int>> branches;
+            int fallback = -1;
+            for (size_t i = 2; i + 1 < node.children.size(); i += 2) {
+                if (node.children[i]->type != whenNodeType) {
+                    fallback = i + 1;
+                    break;
+                }
+                const Node& value = *node.children[i]->children[0]->children[0].get();
+                if (value.type || value.variant.type != Variant::Type::STRING)
+                    return false;
+                branches.emplace_back(value.variant.s, i + 1);
+            }
+            return dispatch.wrap(optimizer, node, *node.children[0]->children[0].get(), branches, fallback);
+        }
     };
 
     struct ForNode : TagNodeType {
+        // Resolves the rest of a variable path, when the first part has been placed into 0x0.
+        static void compileDereference(Compiler& compiler, const Node& node) {
+            for (size_t i = 1; i < node.children.size(); ++i) {
+                compiler.add(OP_MOV, 0x0, 0x1);
+                compiler.freeRegister = 0;
+                compiler.compileBranch(*node.children[i].get());
+                compiler.addResolve(0x0, 0x1, !node.children[i]->type);
+            }
+            compiler.freeRegister = 1;
+        }
+
         struct InOperatorNode : OperatorNodeType {
             InOperatorNode() :  OperatorNodeType("in", Arity::BINARY, 0, Fixness::INFIX, LIQUID_OPTIMIZATION_SCHEME_SHIELD) { }
             Node render(Renderer& renderer, const Node& node, Variable store) const override { return Node(); }
@@ -460,14 +644,15 @@ namespace Liquid {
                 return Node();
             string variableName = variableNode->children[0]->getString();
 
-            // TODO: Should have an optimization for when the operand from "in" ia s sequence; so that it doesn't render out to a ridiclous thing, it
-            // simply loops through the existing stuff.
-            Node result = renderer.retrieveRenderedNode(*arguments->children[0]->children[1].get(), store);
+            // Ranges are walked without being made into arrays; they're iterated like an array, whose elements are made as they're reached.
+            long long rangeStart, rangeEnd;
+            bool range = getRangeBounds(renderer, *arguments->children[0]->children[1].get(), store, rangeStart, rangeEnd);
+            Node result = range ? Node(Variant(vector<Variant>())) : renderer.retrieveRenderedNode(*arguments->children[0]->children[1].get(), store);
 
             if (result.type != nullptr || (result.variant.type != Variant::Type::VARIABLE && result.variant.type != Variant::Type::ARRAY)) {
                 if (node.children.size() >= 4) {
                     // Run the else statement if there is one.
-                    return renderer.retrieveRenderedNode(*node.children[3].get(), store);
+                    return getChild(renderer, node, store, 3);
                 }
                 return Node();
             }
@@ -499,7 +684,7 @@ namespace Liquid {
 
 
             auto iterator = +[](ForLoopContext& forLoopContext) {
-                forLoopContext.result.append(forLoopContext.renderer.retrieveRenderedNode(*forLoopContext.node.children[1].get(), forLoopContext.store).getString());
+                forLoopContext.result.append(forLoopContext.node.type->getChild(forLoopContext.renderer, forLoopContext.node, forLoopContext.store, 1).getString());
                 ++forLoopContext.idx;
                 if (forLoopContext.renderer.control != Renderer::Control::NONE)  {
                     if (forLoopContext.renderer.control == Renderer::Control::BREAK) {
@@ -515,7 +700,10 @@ namespace Liquid {
             ForLoopContext forLoopContext = { renderer, node, store, nullptr, iterator,  0, "", 0 };
 
 
-            forLoopContext.length = result.variant.type == Variant::Type::ARRAY ? result.variant.a.size() : resolver.getArraySize(renderer, result.variant.p);
+            if (range)
+                forLoopContext.length = std::max(rangeEnd - rangeStart + 1, 0LL);
+            else
+                forLoopContext.length = result.variant.type == Variant::Type::ARRAY ? result.variant.a.size() : resolver.getArraySize(renderer, result.variant.p);
 
             if (!hasLimit)
                 limit = forLoopContext.length;
@@ -556,16 +744,23 @@ namespace Liquid {
                     ForLoopContext& forLoopContext = *static_cast<ForLoopContext*>(data);
                     return Variant(*(Variant*)forLoopContext.variable);
                 } });
+                Variant element((long long)0);
+                auto getElement = [&](int i) -> void* {
+                    if (!range)
+                        return &result.variant.a[i];
+                    element.i = rangeStart + i;
+                    return &element;
+                };
                 int endIndex = std::min(limit+start-1, (int)forLoopContext.length-1);
                 if (reversed) {
                     for (int i = endIndex; i >= start; --i) {
-                        forLoopContext.variable = &result.variant.a[i];
+                        forLoopContext.variable = getElement(i);
                         if (!forLoopContext.iterator(forLoopContext))
                             break;
                     }
                 } else {
                     for (int i = start; i <= endIndex; ++i) {
-                        forLoopContext.variable = &result.variant.a[i];
+                        forLoopContext.variable = getElement(i);
                         if (!forLoopContext.iterator(forLoopContext))
                             break;
                     }
@@ -585,14 +780,66 @@ namespace Liquid {
             renderer.popInternalDrop(variableName);
             if (forLoopContext.idx == 0 && node.children.size() >= 4) {
                 // Run the else statement if there is one.
-                return renderer.retrieveRenderedNode(*node.children[3].get(), store);
+                return getChild(renderer, node, store, 3);
             }
             return Node(forLoopContext.result);
         }
 
 
+        // Loads a value from the loop's frame; offset is negative, from the top of the frame. The frame lives in allocated registers if
+        // there were any left, laid out as they would be on the stack, with the top at registerPoint + 2.
+        static void compileLoopValue(Compiler& compiler, const Compiler::DropFrameState& state, int offset, int target) {
+            if (state.registerPoint != -1)
+                compiler.add(OP_MOV, state.registerPoint + 3 + offset, target);
+            else
+                compiler.add(OP_STACK, target, state.stackPoint - compiler.stackSize + offset);
+        }
+
+        string access(AccessAnalyzer& analyzer, const Node& node) const override {
+            if (node.children.size() < 2 || node.children[0]->children.empty() || !node.children[0]->children[0]->type || node.children[0]->children[0]->children.size() != 2) {
+                analyzer.analyzeChildren(node);
+                return string();
+            }
+            auto& arguments = node.children.front();
+            auto& variableNode = arguments->children[0]->children[0];
+            string path = analyzer.analyzeNode(*arguments->children[0]->children[1].get());
+            analyzer.iterate(path);
+            for (size_t i = 1; i < arguments->children.size(); ++i)
+                analyzer.read(analyzer.analyzeNode(*arguments->children[i].get()));
+            // The loop variable stands for every element of what's iterated over.
+            string name = variableNode->children.size() == 1 && !variableNode->children[0]->type ? variableNode->children[0]->getString() : string();
+            analyzer.pushAlias(name, path.empty() ? path : path + "[]");
+            analyzer.pushAlias("forloop", "");
+            analyzer.analyzeNode(*node.children[1].get());
+            analyzer.popAlias("forloop");
+            analyzer.popAlias(name);
+            if (node.children.size() >= 4)
+                analyzer.analyzeNode(*node.children[3].get());
+            return string();
+        }
+
+        Cost cost(CostAnalyzer& analyzer, const Node& node) const override {
+            if (node.children.size() < 2 || node.children[0]->children.empty() || !node.children[0]->children[0]->type || node.children[0]->children[0]->children.size() != 2)
+                return analyzer.analyzeChildren(node);
+            auto& arguments = node.children.front();
+            int hotspot = analyzer.enter(node);
+            // Runs the body once per element, up to a literal limit.
+            Cost iterations = analyzer.getSize(*arguments->children[0]->children[1].get());
+            for (size_t i = 1; i < arguments->children.size(); ++i) {
+                const Node* child = arguments->children[i].get();
+                if (child->type == limitQualifier && child->children.size() == 1 && !child->children[0]->type && child->children[0]->variant.isNumeric() && child->children[0]->variant.getInt() >= 0) {
+                    double limit = (double)child->children[0]->variant.getInt();
+                    iterations = iterations.isConstant() ? Cost(std::min(iterations.getConstant(), limit)) : Cost(limit);
+                }
+            }
+            Cost cost = Cost(1) + analyzer.analyzeNode(*arguments.get()) + analyzer.analyzeRepeated(*node.children[1].get(), iterations);
+            if (node.children.size() >= 4)
+                cost += analyzer.analyzeNode(*node.children[3].get());
+            return analyzer.leave(hotspot, cost);
+        }
+
         void compile(Compiler& compiler, const Node& node) const override {
-            // Create loop index variable, (and reference to current variable in future), on the stack.
+            // Create loop index variable, (and reference to current variable in future), in registers, or on the stack.
             const Node& group = *node.children[0].get()->children[0]->children[1].get();
             const Node& sequence = group.type && group.type->type == NodeType::Type::GROUP ? *group.children[0].get() : group;
 
@@ -600,22 +847,28 @@ namespace Liquid {
                 // First is the variable to iterate over
                 // Then comes the actual loop variable value.
                 // Then comes the index of the loop.
+                int registerPoint = compiler.allocateRegisters(3);
                 compiler.compileBranch(sequence);
-                compiler.addPush(0x0);
-                compiler.add(OP_MOVNIL, 0x0);
-                compiler.addPush(0x0);
-                compiler.add(OP_MOVINT, 0x0, 0);
-                compiler.addPush(0x0);
+                if (registerPoint != -1) {
+                    compiler.add(OP_MOV, 0x0, registerPoint);
+                    compiler.add(OP_MOVINT, registerPoint + 2, 0);
+                } else {
+                    compiler.addPush(0x0);
+                    compiler.add(OP_MOVNIL, 0x0);
+                    compiler.addPush(0x0);
+                    compiler.add(OP_MOVINT, 0x0, 0);
+                    compiler.addPush(0x0);
+                }
                 compiler.freeRegister = 0;
                 const Node& variable = *node.children[0].get()->children[0]->children[0].get();
                 compiler.addDropFrame(variable.children[0].get()->variant.s, +[](Compiler& compiler, Compiler::DropFrameState& state, const Node& node) {
-                    int negativeOffset = state.stackPoint - compiler.stackSize;
-                    compiler.add(OP_STACK, 0x0, negativeOffset - 2);
+                    if (node.type->type != NodeType::Type::VARIABLE)
+                        return -1;
+                    compileLoopValue(compiler, state, -2, 0x0);
+                    compileDereference(compiler, node);
                     return 0;
-                });
+                }, registerPoint);
                 compiler.addDropFrame("forloop", +[](Compiler& compiler, Compiler::DropFrameState& state, const Node& node) {
-                    int negativeOffset = state.stackPoint - compiler.stackSize;
-
                     string property;
                     if (node.type) {
                         if (node.type->type == NodeType::Type::VARIABLE && node.children.size() == 2 && !node.children[1]->type && node.children[1]->variant.type == Variant::Type::STRING) {
@@ -626,70 +879,120 @@ namespace Liquid {
                     }
                     if (!property.empty()) {
                         if (property == "index0") {
-                            compiler.add(OP_STACK, 0x0, negativeOffset - 1);
+                            compileLoopValue(compiler, state, -1, 0x0);
                             compiler.add(OP_MOVINT, 0x1, 0x1);
                             compiler.add(OP_SUB, 0x1);
                         } else if (property == "index") {
-                            compiler.add(OP_STACK, 0x0, negativeOffset - 1);
-                        } else if (property == "rindex") {
-
-                        } else if (property == "rindex0") {
+                            compileLoopValue(compiler, state, -1, 0x0);
+                        } else if (property == "rindex" || property == "rindex0") {
+                            compileLoopValue(compiler, state, -3, 0x0);
+                            compiler.add(OP_SIZE, 0x0, 0x0);
+                            compileLoopValue(compiler, state, -1, 0x1);
+                            compiler.add(OP_MINUS, 0x0 | (0x1 << 8), 0x0);
+                            if (property == "rindex0") {
+                                compiler.add(OP_MOVINT, 0x1, 0x1);
+                                compiler.add(OP_ADD, 0x1);
+                            }
                         } else if (property == "first") {
-                            compiler.add(OP_STACK, 0x1, negativeOffset - 1);
+                            compileLoopValue(compiler, state, -1, 0x1);
                             compiler.add(OP_MOVINT, 0x0, 0x1);
                             compiler.add(OP_EQL, 0x1);
                         } else if (property == "last") {
-                            compiler.add(OP_STACK, 0x1, negativeOffset - 1);
-                            compiler.add(OP_STACK, 0x0, negativeOffset - 3);
+                            compileLoopValue(compiler, state, -1, 0x1);
+                            compileLoopValue(compiler, state, -3, 0x0);
+                            compiler.add(OP_SIZE, 0x0, 0x0);
                             compiler.add(OP_EQL, 0x1);
                         } else if (property == "length") {
-
-                        }
+                            compileLoopValue(compiler, state, -3, 0x0);
+                            compiler.add(OP_SIZE, 0x0, 0x0);
+                        } else
+                            return -1;
+                        return 0;
                     }
-                    return 0;
-                });
-                // Counter
-                int topLoop = compiler.add(OP_STACK, 0x1, -1);
-                // Variable Context
-                compiler.add(OP_STACK, 0x2, -3);
-                int iterationInstruction = compiler.add(OP_ITERATE, 0x2, 0x0);
-                compiler.add(OP_POP, 0x0, 0x2);
-                compiler.add(OP_PUSH, 0x0);
-                compiler.add(OP_MOVINT, 0x0, 0x1);
-                compiler.add(OP_ADD, 0x1);
-                compiler.add(OP_PUSH, 0x1);
+                    return -1;
+                }, registerPoint);
+                int topLoop, iterationInstruction;
+                if (registerPoint != -1) {
+                    topLoop = iterationInstruction = compiler.add(OP_ITERATE, registerPoint, 0x0);
+                    compiler.add(OP_MOV, 0x0, registerPoint + 1);
+                    compiler.add(OP_MOVINT, 0x1, 0x1);
+                    compiler.add(OP_PLUS, (registerPoint + 2) | (0x1 << 8), 0x0);
+                } else {
+                    // Counter
+                    topLoop = compiler.add(OP_STACK, 0x1, -1);
+                    // Variable Context
+                    compiler.add(OP_STACK, 0x2, -3);
+                    iterationInstruction = compiler.add(OP_ITERATE, 0x2, 0x0);
+                    compiler.add(OP_POP, 0x0, 0x2);
+                    compiler.add(OP_PUSH, 0x0);
+                    compiler.add(OP_MOVINT, 0x0, 0x1);
+                    compiler.add(OP_ADD, 0x1);
+                    compiler.add(OP_PUSH, 0x0);
+                }
                 compiler.compileBranch(*node.children[1].get());
                 compiler.add(OP_JMP, 0x0, topLoop);
-                compiler.modify(iterationInstruction, OP_ITERATE, 0x2, compiler.currentOffset());
-                compiler.addPop(3);
+                compiler.modify(iterationInstruction, OP_ITERATE, registerPoint != -1 ? registerPoint : 0x2, compiler.currentOffset());
+                compiler.clearDropFrame("forloop");
+                compiler.clearDropFrame(variable.children[0].get()->variant.s);
+                if (registerPoint != -1)
+                    compiler.releaseRegisters(3);
+                else
+                    compiler.addPop(3);
             } else {
+                // First comes the end of the range, then the counter.
                 assert(sequence.type && sequence.children.size() == 2);
+                int registerPoint = compiler.allocateRegisters(2);
+                compiler.freeRegister = 0;
                 compiler.compileBranch(*sequence.children[1].get());
                 compiler.add(OP_MOVINT, 0x1, 0x1);
                 compiler.add(OP_ADD, 0x1);
-                compiler.addPush(0x0);
+                if (registerPoint != -1)
+                    compiler.add(OP_MOV, 0x0, registerPoint);
+                else
+                    compiler.addPush(0x0);
+                compiler.freeRegister = 0;
                 compiler.compileBranch(*sequence.children[0].get());
-                compiler.addPush(0x0);
+                if (registerPoint != -1)
+                    compiler.add(OP_MOV, 0x0, registerPoint + 1);
+                else
+                    compiler.addPush(0x0);
+                compiler.freeRegister = 0;
                 const Node& variable = *node.children[0].get()->children[0]->children[0].get();
+                // Two values rather than three, so the frame starts one register early.
                 compiler.addDropFrame(variable.children[0].get()->variant.s, +[](Compiler& compiler, Compiler::DropFrameState& state, const Node& node) {
-                    int negativeOffset = state.stackPoint - compiler.stackSize;
-                    compiler.add(OP_STACK, 0x0, negativeOffset - 1);
+                    if (node.type->type != NodeType::Type::VARIABLE)
+                        return -1;
+                    compileLoopValue(compiler, state, -1, 0x0);
                     return 0;
-                });
-                int entryPointJmp = compiler.add(OP_JMP, 0x0, 0x0);
-                int topLoop = compiler.add(OP_STACK, 0x0, -1);
-                compiler.add(OP_MOVINT, 0x1, 1LL);
-                compiler.add(OP_ADD, 0x1);
-                compiler.add(OP_POP, 0x1, 0x1);
-                compiler.add(OP_PUSH, 0x0);
-                compiler.add(OP_STACK, 0x1, -2);
-                int entryPoint = compiler.add(OP_EQL, 0x1);
-                compiler.modify(entryPointJmp, OP_JMP, 0x0, entryPoint);
-                int endLoopJmp = compiler.add(OP_JMPTRUE, 0x0, 0x0);
+                }, registerPoint != -1 ? registerPoint - 1 : -1);
+                int topLoop;
+                if (registerPoint != -1) {
+                    topLoop = compiler.add(OP_MOV, registerPoint + 1, 0x0);
+                    compiler.add(OP_LESS, 0x0 | (registerPoint << 8), 0x0);
+                } else {
+                    topLoop = compiler.add(OP_STACK, 0x0, -1);
+                    compiler.add(OP_STACK, 0x1, -2);
+                    compiler.add(OP_LESS, 0x0 | (0x1 << 8), 0x0);
+                }
+                int endLoopJmp = compiler.add(OP_JMPFALSE, 0x0, 0x0);
                 compiler.compileBranch(*node.children[1].get());
+                if (registerPoint != -1) {
+                    compiler.add(OP_MOVINT, 0x1, 1LL);
+                    compiler.add(OP_PLUS, (registerPoint + 1) | (0x1 << 8), 0x0);
+                } else {
+                    compiler.add(OP_STACK, 0x0, -1);
+                    compiler.add(OP_MOVINT, 0x1, 1LL);
+                    compiler.add(OP_ADD, 0x1);
+                    compiler.add(OP_POP, 0x0, 0x1);
+                    compiler.add(OP_PUSH, 0x0);
+                }
                 compiler.add(OP_JMP, 0x0, topLoop);
-                compiler.modify(endLoopJmp, OP_JMPTRUE, 0x0, compiler.currentOffset());
-                compiler.addPop(2);
+                compiler.modify(endLoopJmp, OP_JMPFALSE, 0x0, compiler.currentOffset());
+                compiler.clearDropFrame(variable.children[0].get()->variant.s);
+                if (registerPoint != -1)
+                    compiler.releaseRegisters(2);
+                else
+                    compiler.addPop(2);
             }
         }
     };
@@ -697,7 +1000,12 @@ namespace Liquid {
 
     template <class Function>
     struct ArithmeticOperatorNode : OperatorNodeType {
-        ArithmeticOperatorNode(const char* symbol, int priority) : OperatorNodeType(symbol, Arity::BINARY, priority) { }
+        OPCode opcode;
+        ArithmeticOperatorNode(const char* symbol, int priority, OPCode opcode) : OperatorNodeType(symbol, Arity::BINARY, priority), opcode(opcode) { }
+
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(opcode, this, *node.children[0].get(), *node.children[1].get());
+        }
 
         double operate(double v1, long long v2) const { return Function()(v1, v2); }
         double operate(double v1, double v2) const { return Function()(v1, v2); }
@@ -754,13 +1062,17 @@ namespace Liquid {
         }
     };
 
-    struct PlusOperatorNode : ArithmeticOperatorNode<std::plus<>> { PlusOperatorNode() : ArithmeticOperatorNode<std::plus<>>("+", 5) { } };
-    struct MinusOperatorNode : ArithmeticOperatorNode<std::minus<>> { MinusOperatorNode() : ArithmeticOperatorNode<std::minus<>>("-", 5) { } };
-    struct MultiplyOperatorNode : ArithmeticOperatorNode<std::multiplies<>> { MultiplyOperatorNode() : ArithmeticOperatorNode<std::multiplies<>>("*", 10) { } };
-    struct DivideOperatorNode : ArithmeticOperatorNode<std::divides<>> { DivideOperatorNode() : ArithmeticOperatorNode<std::divides<>>("/", 10) { } };
+    struct PlusOperatorNode : ArithmeticOperatorNode<std::plus<>> { PlusOperatorNode() : ArithmeticOperatorNode<std::plus<>>("+", 5, OP_PLUS) { } };
+    struct MinusOperatorNode : ArithmeticOperatorNode<std::minus<>> { MinusOperatorNode() : ArithmeticOperatorNode<std::minus<>>("-", 5, OP_MINUS) { } };
+    struct MultiplyOperatorNode : ArithmeticOperatorNode<std::multiplies<>> { MultiplyOperatorNode() : ArithmeticOperatorNode<std::multiplies<>>("*", 10, OP_MULTIPLY) { } };
+    struct DivideOperatorNode : ArithmeticOperatorNode<std::divides<>> { DivideOperatorNode() : ArithmeticOperatorNode<std::divides<>>("/", 10, OP_DIVIDE) { } };
     struct ModuloOperatorNode : OperatorNodeType {
         ModuloOperatorNode() : OperatorNodeType("%", Arity::BINARY, 10) { }
 
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(OP_MODULO, this, *node.children[0].get(), *node.children[1].get());
+        }
+
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             Node op1 = getOperand(renderer, node, store, 0);
             Node op2 = getOperand(renderer, node, store, 1);
@@ -794,9 +1106,18 @@ namespace Liquid {
     };
 
 
+    static bool rewriteSizeComparison(Optimizer& optimizer, Node& node);
+
     template <class Function>
     struct NumericalComparaisonOperatorNode : OperatorNodeType {
-        NumericalComparaisonOperatorNode(const std::string& symbol, int priority) : OperatorNodeType(symbol, Arity::BINARY, priority) { }
+        OPCode opcode;
+        NumericalComparaisonOperatorNode(const std::string& symbol, int priority, OPCode opcode) : OperatorNodeType(symbol, Arity::BINARY, priority), opcode(opcode) { }
+
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(opcode, this, *node.children[0].get(), *node.children[1].get());
+        }
+
+        bool rewrite(Optimizer& optimizer, Node& node) const override { return rewriteSizeComparison(optimizer, node); }
 
         template <class A, class B>
         bool operate(A a, B b) const { return Function()(a, b); }
@@ -838,7 +1159,14 @@ namespace Liquid {
 
     template <class Function>
     struct QualitativeComparaisonOperatorNode : OperatorNodeType {
-        QualitativeComparaisonOperatorNode(const std::string& symbol, int priority) : OperatorNodeType(symbol, Arity::BINARY, priority) { }
+        OPCode opcode;
+        QualitativeComparaisonOperatorNode(const std::string& symbol, int priority, OPCode opcode) : OperatorNodeType(symbol, Arity::BINARY, priority), opcode(opcode) { }
+
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(opcode, this, *node.children[0].get(), *node.children[1].get());
+        }
+
+        bool rewrite(Optimizer& optimizer, Node& node) const override { return rewriteSizeComparison(optimizer, node); }
 
         template <class A, class B>
         bool operate(A a, B b) const { return Function()(a, b); }
@@ -899,16 +1227,20 @@ namespace Liquid {
         }
     };
 
-    struct LessThanOperatorNode : NumericalComparaisonOperatorNode<std::less<>> { LessThanOperatorNode() : NumericalComparaisonOperatorNode<std::less<>>("<", 2) {  } };
-    struct LessThanEqualOperatorNode : NumericalComparaisonOperatorNode<std::less_equal<>> { LessThanEqualOperatorNode() : NumericalComparaisonOperatorNode<std::less_equal<>>("<=", 2) {  } };
-    struct GreaterThanOperatorNode : NumericalComparaisonOperatorNode<std::greater<>> { GreaterThanOperatorNode() : NumericalComparaisonOperatorNode<std::greater<>>(">", 2) {  } };
-    struct GreaterThanEqualOperatorNode : NumericalComparaisonOperatorNode<std::greater_equal<>> { GreaterThanEqualOperatorNode() : NumericalComparaisonOperatorNode<std::greater_equal<>>(">=", 2) {  } };
-    struct EqualOperatorNode : QualitativeComparaisonOperatorNode<std::equal_to<>> { EqualOperatorNode() : QualitativeComparaisonOperatorNode<std::equal_to<>>("==", 2) {  } };
-    struct NotEqualOperatorNode : QualitativeComparaisonOperatorNode<std::not_equal_to<>> { NotEqualOperatorNode() : QualitativeComparaisonOperatorNode<std::not_equal_to<>>("!=", 2) {  } };
+    struct LessThanOperatorNode : NumericalComparaisonOperatorNode<std::less<>> { LessThanOperatorNode() : NumericalComparaisonOperatorNode<std::less<>>("<", 2, OP_LESS) {  } };
+    struct LessThanEqualOperatorNode : NumericalComparaisonOperatorNode<std::less_equal<>> { LessThanEqualOperatorNode() : NumericalComparaisonOperatorNode<std::less_equal<>>("<=", 2, OP_LESSEQUAL) {  } };
+    struct GreaterThanOperatorNode : NumericalComparaisonOperatorNode<std::greater<>> { GreaterThanOperatorNode() : NumericalComparaisonOperatorNode<std::greater<>>(">", 2, OP_GREATER) {  } };
+    struct GreaterThanEqualOperatorNode : NumericalComparaisonOperatorNode<std::greater_equal<>> { GreaterThanEqualOperatorNode() : NumericalComparaisonOperatorNode<std::greater_equal<>>(">=", 2, OP_GREATEREQUAL) {  } };
+    struct EqualOperatorNode : QualitativeComparaisonOperatorNode<std::equal_to<>> { EqualOperatorNode() : QualitativeComparaisonOperatorNode<std::equal_to<>>("==", 2, OP_EQUAL) {  } };
+    struct NotEqualOperatorNode : QualitativeComparaisonOperatorNode<std::not_equal_to<>> { NotEqualOperatorNode() : QualitativeComparaisonOperatorNode<std::not_equal_to<>>("!=", 2, OP_NOTEQUAL) {  } };
 
     struct AndOperatorNode : OperatorNodeType {
         AndOperatorNode() : OperatorNodeType("and", Arity::BINARY, 1, Fixness::INFIX, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) { }
 
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(OP_AND, this, *node.children[0].get(), *node.children[1].get());
+        }
+
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             Node op1 = getOperand(renderer, node, store, 0);
             if (!op1.variant.isTruthy(renderer.context.falsiness))
@@ -938,6 +1270,10 @@ namespace Liquid {
     struct OrOperatorNode : OperatorNodeType {
         OrOperatorNode() : OperatorNodeType("or", Arity::BINARY, 1, Fixness::INFIX, LIQUID_OPTIMIZATION_SCHEME_PARTIAL) { }
 
+        void compile(Compiler& compiler, const Node& node) const override {
+            compiler.addNative(OP_OR, this, *node.children[0].get(), *node.children[1].get());
+        }
+
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             Node op1 = getOperand(renderer, node, store, 0);
             if (op1.variant.isTruthy(renderer.context.falsiness))
@@ -970,9 +1306,41 @@ namespace Liquid {
         ContainsOperatorNode() : OperatorNodeType("contains", Arity::BINARY, 2) { }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end)) {
+                Node op2 = getOperand(renderer, node, store, 1);
+                if (op2.type || !op2.variant.isNumeric())
+                    return Node();
+                double value = op2.variant.getFloat();
+                return Variant(value >= start && value <= end && value == std::floor(value));
+            }
             Node op1 = getOperand(renderer, node, store, 0);
             Node op2 = getOperand(renderer, node, store, 1);
 
+            // Numbers are looked for among the numbers of an array, as they are in a range; so a range contains the same numbers whether
+            // it's been folded to an array, or assigned, or not.
+            if (!op2.type && op2.variant.isNumeric()) {
+                double value = op2.variant.getFloat();
+                if (op1.variant.type == Variant::Type::ARRAY) {
+                    for (size_t i = 0; i < op1.variant.a.size(); ++i) {
+                        if (op1.variant.a[i].isNumeric() && op1.variant.a[i].getFloat() == value)
+                            return Variant(true);
+                    }
+                    return Variant(false);
+                }
+                if (op1.variant.type == Variant::Type::VARIABLE && renderer.variableResolver.getType(renderer, op1.variant.v) == LIQUID_VARIABLE_TYPE_ARRAY) {
+                    long long size = renderer.variableResolver.getArraySize(renderer, op1.variant.v);
+                    for (long long i = 0; i < size; ++i) {
+                        void* element;
+                        if (renderer.variableResolver.getArrayVariable(renderer, op1.variant.v, i, &element)) {
+                            Variant variant = renderer.parseVariant(element);
+                            if (variant.isNumeric() && variant.getFloat() == value)
+                                return Variant(true);
+                        }
+                    }
+                    return Variant(false);
+                }
+            }
             if (op2.variant.type != Variant::Type::STRING)
                 return Node();
             switch (op1.variant.type) {
@@ -1000,10 +1368,16 @@ namespace Liquid {
             if (op1.variant.type != Variant::Type::INT || op2.variant.type != Variant::Type::INT)
                 return Node();
             auto result = Node(Variant(vector<Variant>()));
-            // TODO: This can allocate a lot of memory. Short-circuit that; but should be plugge dinto the allocator.
-            long long size = op2.variant.i - op1.variant.i + 1;
-            if (size > 10000)
+            // Descending ranges are empty.
+            long long size = std::max(op2.variant.i - op1.variant.i + 1, 0LL);
+            if (size > renderer.maximumRangeSize)
+                return Node();
+            unsigned long long bytes = size * sizeof(Variant);
+            if (renderer.maximumMemoryUsage && renderer.currentMemoryUsage + bytes > renderer.maximumMemoryUsage) {
+                renderer.error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_MEMORY;
                 return Node();
+            }
+            renderer.currentMemoryUsage += bytes;
             result.variant.a.reserve(size);
             for (long long i = op1.variant.i; i <= op2.variant.i; ++i)
                 result.variant.a.push_back(Variant(i));
@@ -1013,7 +1387,13 @@ namespace Liquid {
 
     template <class Function>
     struct ArithmeticFilterNode : FilterNodeType {
-        ArithmeticFilterNode(const string& symbol) : FilterNodeType(symbol, 1, 1) { }
+        OPCode opcode;
+        ArithmeticFilterNode(const string& symbol, OPCode opcode) : FilterNodeType(symbol, 1, 1), opcode(opcode) { }
+
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, opcode))
+                FilterNodeType::compile(compiler, node);
+        }
 
         double operate(double v1, long long v2) const { return Function()(v1, v2); }
         double operate(double v1, double v2) const { return Function()(v1, v2); }
@@ -1072,10 +1452,10 @@ namespace Liquid {
         }
     };
 
-    struct PlusFilterNode : ArithmeticFilterNode<std::plus<>> { PlusFilterNode() : ArithmeticFilterNode<std::plus<>>("plus") { } };
-    struct MinusFilterNode : ArithmeticFilterNode<std::minus<>> { MinusFilterNode() : ArithmeticFilterNode<std::minus<>>("minus") { } };
-    struct MultiplyFilterNode : ArithmeticFilterNode<std::multiplies<>> { MultiplyFilterNode() : ArithmeticFilterNode<std::multiplies<>>("times") { } };
-    struct DivideFilterNode : ArithmeticFilterNode<std::divides<>> { DivideFilterNode() : ArithmeticFilterNode<std::divides<>>("divided_by") { } };
+    struct PlusFilterNode : ArithmeticFilterNode<std::plus<>> { PlusFilterNode() : ArithmeticFilterNode<std::plus<>>("plus", OP_PLUS) { } };
+    struct MinusFilterNode : ArithmeticFilterNode<std::minus<>> { MinusFilterNode() : ArithmeticFilterNode<std::minus<>>("minus", OP_MINUS) { } };
+    struct MultiplyFilterNode : ArithmeticFilterNode<std::multiplies<>> { MultiplyFilterNode() : ArithmeticFilterNode<std::multiplies<>>("times", OP_MULTIPLY) { } };
+    struct DivideFilterNode : ArithmeticFilterNode<std::divides<>> { DivideFilterNode() : ArithmeticFilterNode<std::divides<>>("divided_by", OP_DIVIDE) { } };
     struct ModuloFilterNode : FilterNodeType {
         ModuloFilterNode() : FilterNodeType("modulo", 1, 1) { }
 
@@ -1215,6 +1595,10 @@ namespace Liquid {
 
     struct AppendFilterNode : FilterNodeType {
         AppendFilterNode() : FilterNodeType("append", 1, 1) { }
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_APPEND))
+                FilterNodeType::compile(compiler, node);
+        }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             auto argument = getArgument(renderer, node, store, 0);
@@ -1241,6 +1625,10 @@ namespace Liquid {
     };
     struct DowncaseFilterNode : FilterNodeType {
         DowncaseFilterNode() : FilterNodeType("downcase", 0, 0) { }
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_DOWNCASE))
+                FilterNodeType::compile(compiler, node);
+        }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             string str = operand.getString();
@@ -1285,6 +1673,10 @@ namespace Liquid {
 
     struct PrependFilterNode : FilterNodeType {
         PrependFilterNode() : FilterNodeType("prepend", 1, 1) { }
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_PREPEND))
+                FilterNodeType::compile(compiler, node);
+        }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             auto argument = getArgument(renderer, node, store, 0);
@@ -1494,6 +1886,10 @@ namespace Liquid {
     };
     struct UpcaseFilterNode : FilterNodeType {
         UpcaseFilterNode() : FilterNodeType("upcase", 0, 0) { }
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_UPCASE))
+                FilterNodeType::compile(compiler, node);
+        }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             auto argument = getArgument(renderer, node, store, 0);
@@ -1505,6 +1901,53 @@ namespace Liquid {
 
     struct ArrayFilterNodeType : FilterNodeType {
         ArrayFilterNodeType(const std::string& symbol, int minArguments = -1, int maxArguments = -1) : FilterNodeType(symbol, minArguments, maxArguments) { }
+
+        // Most array filters visit each element once.
+        virtual Cost getOperationCost(const Cost& size) const { return size; }
+
+        Cost cost(CostAnalyzer& analyzer, const Node& node) const override {
+            if (node.children.empty())
+                return analyzer.analyzeChildren(node);
+            int hotspot = analyzer.enter(node);
+            return analyzer.leave(hotspot, analyzer.analyzeChildren(node) + getOperationCost(analyzer.getSize(*node.children[0].get())));
+        }
+
+        // The first argument, if it's a literal string, naming the property of each element the filter looks at.
+        static string getPropertyArgument(const Node& node) {
+            if (node.children.size() < 2 || !node.children[1] || node.children[1]->children.empty() || node.children[1]->children[0]->type || node.children[1]->children[0]->variant.type != Variant::Type::STRING)
+                return string();
+            return node.children[1]->children[0]->variant.s;
+        }
+
+        // By default, the filter uses every element of its operand as a whole, and returns something new.
+        virtual string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const {
+            analyzer.read(operand + "[]");
+            return string();
+        }
+
+        // Makes the node, a filter whose operand is another filter, into a filter of the fused type, which takes the operand and arguments of
+        // the inner one; pads them with nils to arguments, so that each is pushed in the interpreter.
+        static void fuse(Node& node, const FilterNodeType* type, size_t arguments) {
+            unique_ptr<Node> inner = move(node.children[0]);
+            node.type = type;
+            node.children = move(inner->children);
+            while (node.children[1]->children.size() < arguments)
+                node.children[1]->children.push_back(make_unique<Node>(Variant()));
+        }
+
+        string access(AccessAnalyzer& analyzer, const Node& node) const override {
+            if (node.children.empty())
+                return string();
+            string operand = analyzer.analyzeNode(*node.children[0].get());
+            for (size_t i = 1; i < node.children.size(); ++i) {
+                if (node.children[i])
+                    analyzer.analyzeChildren(*node.children[i].get());
+            }
+            if (operand.empty())
+                return string();
+            analyzer.iterate(operand);
+            return accessResult(analyzer, node, operand);
+        }
     };
 
     struct JoinFilterNode : ArrayFilterNodeType {
@@ -1549,10 +1992,24 @@ namespace Liquid {
                     accumulator.append(joiner);
                 accumulator.append(operand.a[i].getString());
             }
-            return operand.a[operand.a.size()-1];
+            return Node(move(accumulator));
         }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end)) {
+                if (end < start)
+                    return Node();
+                auto argument = getArgument(renderer, node, store, 0);
+                string joiner = argument.type ? string() : argument.getString();
+                string accumulator;
+                for (long long i = start; i <= end; ++i) {
+                    if (i > start)
+                        accumulator.append(joiner);
+                    accumulator.append(std::to_string(i));
+                }
+                return Node(move(accumulator));
+            }
             auto operand = getOperand(renderer, node, store);
             if (operand.variant.type == Variant::Type::ARRAY)
                 return variantOperate(renderer, node, store, operand.variant);
@@ -1610,6 +2067,12 @@ namespace Liquid {
     struct MapFilterNode : ArrayFilterNodeType {
         MapFilterNode() : ArrayFilterNodeType("map", 1, 1) { }
 
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+            string property = getPropertyArgument(node);
+            analyzer.read(operand + (property.empty() ? "[]" : "[]." + property));
+            return string();
+        }
+
         struct MapStruct {
             Renderer& renderer;
             string property;
@@ -1621,7 +2084,7 @@ namespace Liquid {
                 MapStruct& mapStruct = *static_cast<MapStruct*>(data);
                 Variable target;
                 if (mapStruct.renderer.variableResolver.getDictionaryVariable(mapStruct.renderer, variable, mapStruct.property.data(), target))
-                    mapStruct.accumulator.a.push_back(target);
+                    mapStruct.accumulator.a.push_back(mapStruct.renderer.parseVariant(target));
                 else
                     mapStruct.accumulator.a.push_back(Variant());
                 return true;
@@ -1633,7 +2096,7 @@ namespace Liquid {
                 if (it->type == Variant::Type::VARIABLE) {
                     Variable target;
                     if (mapStruct.renderer.variableResolver.getDictionaryVariable(mapStruct.renderer, const_cast<Variable&>(it->v), mapStruct.property.data(), target))
-                        mapStruct.accumulator.a.push_back(target);
+                        mapStruct.accumulator.a.push_back(mapStruct.renderer.parseVariant(target));
                     else
                         mapStruct.accumulator.a.push_back(Variant());
                 } else {
@@ -1645,13 +2108,13 @@ namespace Liquid {
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             auto argument = getArgument(renderer, node, store, 0);
-            MapStruct mapStruct = { renderer, argument.getString(), nullptr };
+            MapStruct mapStruct = { renderer, argument.getString(), Variant(vector<Variant>()) };
             switch (operand.variant.type) {
                 case Variant::Type::VARIABLE:
                     accumulate(renderer, mapStruct, operand.variant.v);
                 break;
                 case Variant::Type::ARRAY:
-                    accumulate(renderer, mapStruct, operand.variant.a);
+                    accumulate(renderer, mapStruct, operand.variant);
                 break;
                 default:
                     return Node();
@@ -1663,17 +2126,33 @@ namespace Liquid {
     struct ReverseFilterNode : ArrayFilterNodeType {
         ReverseFilterNode() : ArrayFilterNodeType("reverse", 0, 0) { }
 
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override { return operand; }
+
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
-            Variant accumulator;
+            Variant accumulator { vector<Variant>() };
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end)) {
+                if (end - start + 1 > renderer.maximumRangeSize)
+                    return Node();
+                for (long long i = end; i >= start; --i)
+                    accumulator.a.push_back(Variant(i));
+                return accumulator;
+            }
             auto operand = getOperand(renderer, node, store);
             auto& v = operand.variant;
             switch (operand.variant.type) {
-                case Variant::Type::VARIABLE:
+                case Variant::Type::VARIABLE: {
+                    struct ReverseStruct {
+                        Renderer& renderer;
+                        Variant& accumulator;
+                    };
+                    ReverseStruct reverseStruct = { renderer, accumulator };
                     renderer.variableResolver.iterate(renderer, v.v, +[](void* variable, void* data) {
-                        static_cast<Variant*>(data)->a.push_back(Variable({variable}));
+                        ReverseStruct& reverseStruct = *static_cast<ReverseStruct*>(data);
+                        reverseStruct.accumulator.a.push_back(reverseStruct.renderer.parseVariant(Variable({variable})));
                         return true;
-                    }, &accumulator, 0, -1, true);
-                break;
+                    }, &reverseStruct, 0, -1, true);
+                } break;
                 case Variant::Type::ARRAY:
                     for (auto it = v.a.rbegin(); it != v.a.rend(); ++it)
                         accumulator.a.push_back(*it);
@@ -1681,129 +2160,245 @@ namespace Liquid {
                 default:
                     return Node();
             }
-            std::reverse(accumulator.a.begin(), accumulator.a.end());
             return accumulator;
         }
     };
 
     struct SortFilterNode : ArrayFilterNodeType {
+        // "sort | first", and "sort | last"; finds the element the sort would put first, or last, in one pass.
+        struct SelectionFilterNode : ArrayFilterNodeType, FilterNodeType::Fusion {
+            bool last;
+
+            SelectionFilterNode(bool last) : ArrayFilterNodeType("sort", 1, 1), FilterNodeType::Fusion(last ? "last" : "first", 1), last(last) { }
+
+            string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+                readProperty(analyzer, node, operand);
+                return operand + "[]";
+            }
+
+            Node render(Renderer& renderer, const Node& node, Variable store) const override {
+                Variant elements = getElements(renderer, getOperand(renderer, node, store));
+                if (elements.type != Variant::Type::ARRAY || elements.a.size() == 0)
+                    return Node();
+                string property = getProperty(getArgument(renderer, node, store, 0));
+                // As sorts are stable, the first of the least elements is first, and the last of the greatest is last.
+                size_t selected = 0;
+                for (size_t i = 1; i < elements.a.size(); ++i) {
+                    if (last ? !less(renderer, property, elements.a[i], elements.a[selected]) : less(renderer, property, elements.a[i], elements.a[selected]))
+                        selected = i;
+                }
+                return elements.a[selected];
+            }
+        };
+
+        SelectionFilterNode selectFirst = SelectionFilterNode(false);
+        SelectionFilterNode selectLast = SelectionFilterNode(true);
+
         SortFilterNode() : ArrayFilterNodeType("sort", 0, 1) { }
 
-        Node render(Renderer& renderer, const Node& node, Variable store) const override {
-            Variant accumulator;
-            string property;
-            auto operand = getOperand(renderer, node, store);
-            auto argument = getArgument(renderer, node, store, 0);
+        static void readProperty(AccessAnalyzer& analyzer, const Node& node, const string& operand) {
+            string property = getPropertyArgument(node);
+            analyzer.read(operand + (property.empty() ? "[]" : "[]." + property));
+        }
+
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+            readProperty(analyzer, node, operand);
+            return operand;
+        }
+
+        Cost getOperationCost(const Cost& size) const override { return size * size.logarithm(); }
+
+        // The elements of the operand, as an array, or nil if it isn't one.
+        static Variant getElements(Renderer& renderer, const Node& operand) {
             switch (operand.variant.type) {
                 case Variant::Type::VARIABLE: {
-                    renderer.variableResolver.iterate(renderer, operand.variant.v, +[](void* variable, void* data) {
+                    Variant accumulator = Variant(vector<Variant>());
+                    if (!renderer.variableResolver.iterate(renderer, operand.variant.v.pointer, +[](void* variable, void* data) {
                         static_cast<Variant*>(data)->a.push_back(Variable({variable}));
                         return true;
-                    }, &accumulator, 0, -1, false);
-                } break;
-                case Variant::Type::ARRAY: {
-                    auto& v = operand.variant;
-                    for (auto it = v.a.begin(); it != v.a.end(); ++it)
-                        accumulator.a.push_back(*it);
-                } break;
+                    }, &accumulator, 0, -1, false))
+                        return Variant();
+                    return accumulator;
+                }
+                case Variant::Type::ARRAY:
+                    return operand.variant;
                 default:
-                    return Node();
+                    return Variant();
             }
+        }
 
-            if (!argument.type && argument.variant.type == Variant::Type::STRING) {
-                property = argument.getString();
-                std::sort(accumulator.a.begin(), accumulator.a.end(), [&property, &renderer](Variant& a, Variant& b) -> bool {
-                    if (a.type != Variant::Type::VARIABLE || b.type != Variant::Type::VARIABLE)
-                        return false;
-                    Variable targetA, targetB;
-                    if (!renderer.variableResolver.getDictionaryVariable(renderer, a.v, property.data(), targetA))
-                        return false;
-                    if (!renderer.variableResolver.getDictionaryVariable(renderer, b.v, property.data(), targetB))
-                        return false;
-                    return renderer.variableResolver.compare(targetA, targetB) < 0;
-                });
-            } else {
-                std::sort(accumulator.a.begin(), accumulator.a.end(), [](Variant& a, Variant& b) -> bool { return a < b; });
-            }
+        // Elements are sorted by this property, if it's given, or else by their value.
+        static string getProperty(const Node& argument) {
+            return !argument.type && argument.variant.type == Variant::Type::STRING ? argument.getString() : string();
+        }
+
+        // The element's property, if it has one that isn't nil.
+        static bool getKey(Renderer& renderer, const string& property, const Variant& element, Variable& key) {
+            if (element.type != Variant::Type::VARIABLE || !renderer.variableResolver.getDictionaryVariable(renderer, element.v.pointer, property.data(), key))
+                return false;
+            return renderer.variableResolver.getType(renderer, key) != LIQUID_VARIABLE_TYPE_NIL;
+        }
+
+        // Elements without the property go after all those with it, so that the sort, and the selections, agree on an order.
+        static bool less(Renderer& renderer, const string& property, const Variant& a, const Variant& b) {
+            if (property.empty())
+                return a < b;
+            Variable targetA, targetB;
+            if (!getKey(renderer, property, a, targetA))
+                return false;
+            if (!getKey(renderer, property, b, targetB))
+                return true;
+            return renderer.variableResolver.compare(targetA, targetB) < 0;
+        }
+
+        Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            Variant accumulator = getElements(renderer, getOperand(renderer, node, store));
+            if (accumulator.type != Variant::Type::ARRAY)
+                return Node();
+            string property = getProperty(getArgument(renderer, node, store, 0));
+            std::stable_sort(accumulator.a.begin(), accumulator.a.end(), [&property, &renderer](const Variant& a, const Variant& b) { return less(renderer, property, a, b); });
             return accumulator;
         }
     };
 
 
     struct WhereFilterNode : ArrayFilterNodeType {
-        WhereFilterNode() : ArrayFilterNodeType("where", 1, 2) { }
+        // "where | first"; stops at the first match.
+        struct FindFilterNode : ArrayFilterNodeType, FilterNodeType::Fusion {
+            FindFilterNode() : ArrayFilterNodeType("where", 2, 2), FilterNodeType::Fusion("first", 2) { }
 
-        struct WhereStruct {
-            Renderer& renderer;
-            string property;
-            Variant value;
-            Variant accumulator;
+            string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+                readProperty(analyzer, node, operand);
+                return operand + "[]";
+            }
+
+            Node render(Renderer& renderer, const Node& node, Variable store) const override {
+                // Variant's assignment doesn't carry the type over; hold the match in a vector instead.
+                vector<Variant> result;
+                select(renderer, getOperand(renderer, node, store), getArgument(renderer, node, store, 0).getString(), getArgument(renderer, node, store, 1).variant, [&result](const Variant& element) {
+                    result.push_back(element);
+                    return false;
+                });
+                return result.empty() ? Node() : Node(result[0]);
+            }
         };
 
-        void accumulate(WhereStruct& whereStruct, Variable v) const {
-            whereStruct.renderer.variableResolver.iterate(whereStruct.renderer, v, +[](void* variable, void* data) {
-                WhereStruct& whereStruct = *static_cast<WhereStruct*>(data);
-                Variable target;
-                if (whereStruct.renderer.variableResolver.getDictionaryVariable(whereStruct.renderer, variable, whereStruct.property.data(), target)) {
-                    if (whereStruct.property.empty()) {
-                        if (whereStruct.renderer.variableResolver.getTruthy(whereStruct.renderer, target))
-                            whereStruct.accumulator.a.push_back(variable);
-                    } else {
-                        // std::string str;
-                        //if (whereStruct.resolver.getString(str)) {
-                            // TODO.
-                            // if (str == whereStruct.value)
-                            //    whereStruct.accumulator.a.push_back(variable);
-                        //}
-                    }
-                }
-                return true;
-            }, &whereStruct, 0, -1, false);
-        }
+        // "where | size", compared to an integer; counts matches only up to its last argument, which is one more than that integer, as the
+        // comparison comes out the same for any count past it.
+        struct CountFilterNode : ArrayFilterNodeType, FilterNodeType::Fusion {
+            CountFilterNode() : ArrayFilterNodeType("where", 3, 3), FilterNodeType::Fusion("size", 2) { }
 
-        void accumulate(WhereStruct& whereStruct, const Variant& v) const {
-            for (auto it = v.a.begin(); it != v.a.end(); ++it) {
-                if (it->type == Variant::Type::VARIABLE) {
-                    Variable target;
-                    if (whereStruct.renderer.variableResolver.getDictionaryVariable(whereStruct.renderer, const_cast<Variable&>(it->v), whereStruct.property.data(), target)) {
-                        if (whereStruct.property.empty()) {
-                            if (whereStruct.renderer.variableResolver.getTruthy(whereStruct.renderer, target))
-                                whereStruct.accumulator.a.push_back(*it);
-                        } else {
-                            //std::string str;
-                            //if (target->getString(str)) {
-                                // TODO
-                                //if (str == whereStruct.value)
-                                //    whereStruct.accumulator.a.push_back(*it);
-                            //}
-                        }
-                    }
-                }
+            string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+                readProperty(analyzer, node, operand);
+                return string();
+            }
+
+            Node render(Renderer& renderer, const Node& node, Variable store) const override {
+                long long limit = getArgument(renderer, node, store, 2).variant.getInt();
+                long long count = 0;
+                if (!select(renderer, getOperand(renderer, node, store), getArgument(renderer, node, store, 0).getString(), getArgument(renderer, node, store, 1).variant, [&count, limit](const Variant& element) {
+                    return ++count < limit;
+                }))
+                    return Node();
+                return Variant(count);
             }
+        };
+
+        FindFilterNode find;
+        CountFilterNode count;
+
+        WhereFilterNode() : ArrayFilterNodeType("where", 1, 2) { }
+
+        static void readProperty(AccessAnalyzer& analyzer, const Node& node, const string& operand) {
+            string property = getPropertyArgument(node);
+            analyzer.read(operand + (property.empty() ? "[]" : "[]." + property));
         }
 
-        Node render(Renderer& renderer, const Node& node, Variable store) const override {
-            auto operand = getOperand(renderer, node, store);
-            auto arg1 = getArgument(renderer, node, store, 0);
-            auto arg2 = getArgument(renderer, node, store, 1);
-            WhereStruct whereStruct = { renderer, arg1.getString(), arg2.variant, nullptr };
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+            readProperty(analyzer, node, operand);
+            return operand;
+        }
+
+        // Whether the element's property is truthy, or, if value isn't nil, equal to it.
+        static bool matches(Renderer& renderer, Variable element, const string& property, const Variant& value) {
+            Variable target;
+            if (!renderer.variableResolver.getDictionaryVariable(renderer, element, property.data(), target))
+                return false;
+            if (value.type == Variant::Type::NIL)
+                return renderer.variableResolver.getTruthy(renderer, target);
+            return renderer.parseVariant(target) == value;
+        }
+
+        // Calls match with each element of the operand that matches, in order, until it returns false. Returns false if the operand isn't
+        // an array.
+        template <class Function>
+        static bool select(Renderer& renderer, const Node& operand, const string& property, const Variant& value, Function match) {
             switch (operand.variant.type) {
-                case Variant::Type::VARIABLE:
-                    accumulate(whereStruct, operand.variant.v);
-                break;
+                case Variant::Type::VARIABLE: {
+                    struct SelectStruct {
+                        Renderer& renderer;
+                        const string& property;
+                        const Variant& value;
+                        Function& match;
+                    };
+                    SelectStruct selectStruct = { renderer, property, value, match };
+                    renderer.variableResolver.iterate(renderer, operand.variant.v.pointer, +[](void* variable, void* data) {
+                        SelectStruct& selectStruct = *static_cast<SelectStruct*>(data);
+                        if (!matches(selectStruct.renderer, variable, selectStruct.property, selectStruct.value))
+                            return true;
+                        return selectStruct.match(Variant(Variable({ variable })));
+                    }, &selectStruct, 0, -1, false);
+                } return true;
                 case Variant::Type::ARRAY:
-                    accumulate(whereStruct, operand.variant.a);
-                break;
+                    for (auto& element : operand.variant.a) {
+                        if (element.type == Variant::Type::VARIABLE && matches(renderer, element.v, property, value) && !match(element))
+                            break;
+                    }
+                return true;
                 default:
-                    return Node();
+                return false;
             }
-            return whereStruct.accumulator;
+        }
+
+        // Always pushes a value, even if it wasn't given, so render doesn't read past the arguments in the interpreter.
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (node.children.size() != 2 || node.children[1]->children.size() != 1)
+                return FilterNodeType::compile(compiler, node);
+            int stackSize = compiler.stackSize;
+            compiler.freeRegister = 0;
+            compiler.compileBranch(Node(Variant()));
+            compiler.addPush(compiler.freeRegister - 1);
+            compiler.freeRegister = 0;
+            compiler.compileBranch(*node.children[1]->children[0].get());
+            compiler.addPush(compiler.freeRegister - 1);
+            compiler.freeRegister = 0;
+            compiler.compileBranch(*node.children[0].get());
+            compiler.addPush(compiler.freeRegister - 1);
+            compiler.add(OP_MOVINT, compiler.freeRegister, compiler.stackSize - stackSize);
+            compiler.add(OP_CALL, compiler.freeRegister, (long long)this);
+            compiler.stackSize = stackSize;
+            compiler.freeRegister = 1;
+        }
+
+        Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            Variant accumulator = Variant(vector<Variant>());
+            if (!select(renderer, getOperand(renderer, node, store), getArgument(renderer, node, store, 0).getString(), getArgument(renderer, node, store, 1).variant, [&accumulator](const Variant& element) {
+                accumulator.a.push_back(element);
+                return true;
+            }))
+                return Node();
+            return accumulator;
         }
     };
 
     struct UniqFilterNode : ArrayFilterNodeType {
         UniqFilterNode() : ArrayFilterNodeType("uniq", 0, 0) { }
 
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override {
+            analyzer.read(operand + "[]");
+            return operand;
+        }
+
         struct UniqStruct {
             Renderer& renderer;
             std::unordered_set<size_t> hashes;
@@ -1851,6 +2446,22 @@ namespace Liquid {
     struct FirstFilterNode : ArrayFilterNodeType {
         FirstFilterNode() : ArrayFilterNodeType("first", 0, 0) { }
 
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override { return operand + "[]"; }
+
+        bool rewrite(Optimizer& optimizer, Node& node) const override {
+            if (node.children.empty() || !node.children[0]->type)
+                return false;
+            if (const SortFilterNode* sort = dynamic_cast<const SortFilterNode*>(node.children[0]->type)) {
+                fuse(node, &sort->selectFirst, 1);
+                return true;
+            }
+            if (const WhereFilterNode* where = dynamic_cast<const WhereFilterNode*>(node.children[0]->type)) {
+                fuse(node, &where->find, 2);
+                return true;
+            }
+            return false;
+        }
+
         Node variableOperate(Renderer& renderer, const Node& node, Variable store, Variable operand) const {
             Variable v;
             if (!renderer.variableResolver.getArrayVariable(renderer, operand, 0, v))
@@ -1863,6 +2474,17 @@ namespace Liquid {
                 return Node();
             return operand.a[0];
         }
+        Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end))
+                return end >= start ? Node(Variant(start)) : Node();
+            auto operand = getOperand(renderer, node, store);
+            if (operand.variant.type == Variant::Type::ARRAY)
+                return variantOperate(renderer, node, store, operand.variant);
+            else if (operand.variant.type == Variant::Type::VARIABLE)
+                return variableOperate(renderer, node, store, operand.variant.v);
+            return Node();
+        }
     };
 
     struct FirstDotFilterNode : DotFilterNodeType {
@@ -1885,18 +2507,6 @@ namespace Liquid {
             }
         }
 
-        void compile(Compiler& compiler, const Node& node) const override {
-            if (node.type && node.children.size() == 1 && node.children[0]->type && node.children[0]->type->type == NodeType::Type::VARIABLE && node.children[0]->children.size() == 1 && !node.children[0]->children[0]->type) {
-                string str = node.children[0]->children[0]->variant.s;
-                auto it = compiler.dropFrames.find(str);
-                if (it != compiler.dropFrames.end() && it->second.size() > 0) {
-                    it->second.back().first(compiler, it->second.back().second, node);
-                    return;
-                }
-            }
-            DotFilterNodeType::compile(compiler, node);
-        }
-
         Node variableOperate(Renderer& renderer, const Node& node, Variable store, Variable operand) const {
             Variable v;
             LiquidVariableType type = renderer.variableResolver.getType(renderer, operand);
@@ -1921,6 +2531,18 @@ namespace Liquid {
     struct LastFilterNode : ArrayFilterNodeType {
         LastFilterNode() : ArrayFilterNodeType("last", 0, 0) { }
 
+        string accessResult(AccessAnalyzer& analyzer, const Node& node, const string& operand) const override { return operand + "[]"; }
+
+        bool rewrite(Optimizer& optimizer, Node& node) const override {
+            if (node.children.empty() || !node.children[0]->type)
+                return false;
+            if (const SortFilterNode* sort = dynamic_cast<const SortFilterNode*>(node.children[0]->type)) {
+                fuse(node, &sort->selectLast, 1);
+                return true;
+            }
+            return false;
+        }
+
         Node variableOperate(Renderer& renderer, const Node& node, Variable store, Variable operand) const {
             Variable v;
             long long size = renderer.variableResolver.getArraySize(renderer, operand);
@@ -1934,6 +2556,17 @@ namespace Liquid {
                 return Node();
             return operand.a[operand.a.size()-1];
         }
+        Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end))
+                return end >= start ? Node(Variant(end)) : Node();
+            auto operand = getOperand(renderer, node, store);
+            if (operand.variant.type == Variant::Type::ARRAY)
+                return variantOperate(renderer, node, store, operand.variant);
+            else if (operand.variant.type == Variant::Type::VARIABLE)
+                return variableOperate(renderer, node, store, operand.variant.v);
+            return Node();
+        }
     };
 
 
@@ -1941,10 +2574,10 @@ namespace Liquid {
         LastDotFilterNode() : DotFilterNodeType("last") { }
 
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
-            if (node.type && node.type->type == NodeType::Type::VARIABLE && node.children.size() == 1) {
+            if (node.type && node.children.size() == 1 && node.children[0]->type && node.children[0]->type->type == NodeType::Type::VARIABLE && node.children[0]->children.size() == 1) {
                 pair<void*, Renderer::DropFunction> drop = renderer.getInternalDrop(*node.children[0].get(), store);
                 if (drop.second)
-                    return drop.second(renderer, Variant("first"), store, drop.first);
+                    return drop.second(renderer, Variant("last"), store, drop.first);
             }
             auto operand = getOperand(renderer, node, store);
             switch (operand.variant.type) {
@@ -2003,7 +2636,15 @@ namespace Liquid {
     struct SizeFilterNode : FilterNodeType {
         SizeFilterNode() : FilterNodeType("size", 0, 0) { }
 
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_SIZE))
+                FilterNodeType::compile(compiler, node);
+        }
+
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
+            long long start, end;
+            if (getRangeOperand(renderer, node, store, start, end))
+                return Variant(std::max(end - start + 1, 0LL));
             auto operand = getOperand(renderer, node, store);
             switch (operand.variant.type) {
                 case Variant::Type::ARRAY:
@@ -2030,6 +2671,25 @@ namespace Liquid {
     };
 
 
+    // Counts only as many matches of "where" as a comparison of its size to an integer needs.
+    static bool rewriteSizeComparison(Optimizer& optimizer, Node& node) {
+        if (node.children.size() != 2 || node.children[1]->type || node.children[1]->variant.type != Variant::Type::INT || node.children[1]->variant.i < 0)
+            return false;
+        Node* operand = node.children[0].get();
+        while (operand->type && operand->type->type == NodeType::Type::GROUP && operand->children.size() == 1)
+            operand = operand->children[0].get();
+        if (!operand->type || !dynamic_cast<const SizeFilterNode*>(operand->type))
+            return false;
+        Node& size = *operand;
+        const WhereFilterNode* where = size.children.empty() || !size.children[0]->type ? nullptr : dynamic_cast<const WhereFilterNode*>(size.children[0]->type);
+        if (!where)
+            return false;
+        ArrayFilterNodeType::fuse(size, &where->count, 2);
+        size.children[1]->children.push_back(make_unique<Node>(Variant(node.children[1]->variant.i + 1)));
+        return true;
+    }
+
+
     struct SizeDotFilterNode : DotFilterNodeType {
         SizeDotFilterNode() : DotFilterNodeType("size") { }
 
@@ -2083,6 +2743,10 @@ namespace Liquid {
 
     struct DefaultFilterNode : FilterNodeType {
         DefaultFilterNode() : FilterNodeType("default", 1, 1) { }
+        void compile(Compiler& compiler, const Node& node) const override {
+            if (!compileNativeFilter(compiler, this, node, OP_DEFAULT))
+                FilterNodeType::compile(compiler, node);
+        }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             auto argument = getArgument(renderer, node, store, 0);
@@ -2093,7 +2757,8 @@ namespace Liquid {
     };
 
     struct DateFilterNode : FilterNodeType {
-        DateFilterNode() : FilterNodeType("date", 1, 1) { }
+        // Formats in the local timezone, which may not be the same when optimizing as when rendering.
+        DateFilterNode() : FilterNodeType("date", 1, 1) { effects = LIQUID_EFFECT_READS_TIME; }
         Node render(Renderer& renderer, const Node& node, Variable store) const override {
             auto operand = getOperand(renderer, node, store);
             time_t timeT = 0;
@@ -66,6 +66,7 @@ namespace Liquid {
 #ifdef LIQUID_INCLUDE_WEB_DIALECT
     #include "web.h"
 #endif
+#include "cache.h"
 
 
 #endif
@@ -3,6 +3,7 @@
 #include "context.h"
 #include "optimizer.h"
 #include "compiler.h"
+#include "memoizer.h"
 #include <memory>
 
 using namespace Liquid;
@@ -26,6 +27,21 @@ void liquidImplementPermissiveStandardDialect(LiquidContext context) {
         WebDialect::implement(*static_cast<Context*>(context.context));
     }
 #endif
+void liquidImplementCacheDialect(LiquidContext context) {
+    CacheDialect::implement(*static_cast<Context*>(context.context));
+}
+
+LiquidFragmentCache liquidCreateLRUFragmentCache(size_t maximumSize, size_t shards) {
+    return (new LRUFragmentCache(maximumSize, shards))->getInterface();
+}
+
+void liquidFreeLRUFragmentCache(LiquidFragmentCache cache) {
+    delete static_cast<LRUFragmentCache*>(static_cast<FragmentCache*>(cache.data));
+}
+
+void liquidContextSetFragmentCache(LiquidContext context, LiquidFragmentCache cache) {
+    static_cast<Context*>(context.context)->fragmentCache = cache;
+}
 
 LiquidRenderer liquidCreateRenderer(LiquidContext context) {
     Interpreter* interpreter = new Interpreter(*static_cast<Context*>(context.context), {
@@ -52,7 +68,8 @@ LiquidRenderer liquidCreateRenderer(LiquidContext context) {
         .createNil = +[](LiquidRenderer renderer) { return (void*)NULL; },
         .createClone = +[](LiquidRenderer renderer, void* value) { return (void*)NULL; },
         .freeVariable = +[](LiquidRenderer renderer, void* value) { },
-        .compare = +[](void* a, void* b) { return 0; }
+        .compare = +[](void* a, void* b) { return 0; },
+        .getVersion = nullptr
     });
     // So that we pre-allocate things.
     interpreter->buffers.push(string());
@@ -78,10 +95,39 @@ void liquidOptimizeTemplate(LiquidOptimizer optimizer, LiquidTemplate tmpl, void
     static_cast<Optimizer*>(optimizer.optimizer)->optimize(*static_cast<Node*>(tmpl.ast), Variable({ variableStore }));
 }
 
+int liquidOptimizerHoistInvariants(LiquidOptimizer optimizer, LiquidTemplate tmpl) {
+    return static_cast<Optimizer*>(optimizer.optimizer)->hoist(*static_cast<Node*>(tmpl.ast));
+}
+
+int liquidOptimizerRewrite(LiquidOptimizer optimizer, LiquidTemplate tmpl) {
+    return static_cast<Optimizer*>(optimizer.optimizer)->rewrite(*static_cast<Node*>(tmpl.ast));
+}
+
+int liquidOptimizerEliminateCommonSubexpressions(LiquidOptimizer optimizer, LiquidTemplate tmpl) {
+    return static_cast<Optimizer*>(optimizer.optimizer)->eliminateCommonSubexpressions(*static_cast<Node*>(tmpl.ast));
+}
+
+int liquidOptimizerUnrollLoops(LiquidOptimizer optimizer, LiquidTemplate tmpl, size_t maximumIterations) {
+    static_cast<Optimizer*>(optimizer.optimizer)->maximumUnrolledIterations = maximumIterations;
+    return static_cast<Optimizer*>(optimizer.optimizer)->unroll(*static_cast<Node*>(tmpl.ast));
+}
+
+int liquidOptimizerMemoize(LiquidOptimizer optimizer, LiquidTemplate tmpl) {
+    return static_cast<Optimizer*>(optimizer.optimizer)->memoize(*static_cast<Node*>(tmpl.ast));
+}
+
 void liquidFreeOptimizer(LiquidOptimizer optimizer) {
     delete (Optimizer*)optimizer.optimizer;
 }
 
+LiquidMemoizer liquidCreateMemoizer(LiquidRenderer renderer, size_t maximumSize) {
+    return LiquidMemoizer({ new Memoizer(*static_cast<Renderer*>(renderer.renderer), maximumSize) });
+}
+
+void liquidFreeMemoizer(LiquidMemoizer memoizer) {
+    delete (Memoizer*)memoizer.memoizer;
+}
+
 LiquidCompiler liquidCreateCompiler(LiquidContext context) {
     return LiquidCompiler({ new Compiler(*static_cast<Context*>(context.context)) } );
 }
@@ -102,6 +148,24 @@ int liquidCompilerDisassembleProgram(LiquidCompiler compiler, LiquidProgram prog
     return copied;
 }
 
+long long liquidSerializeProgram(LiquidContext context, LiquidProgram program, char* buffer, size_t maxSize) {
+    try {
+        std::vector<unsigned char> serialized = static_cast<Program*>(program.program)->serialize(*static_cast<Context*>(context.context));
+        memcpy(buffer, serialized.data(), std::min(maxSize, serialized.size()));
+        return serialized.size();
+    } catch (Liquid::Exception& exp) {
+        return -1;
+    }
+}
+
+LiquidProgram liquidLoadProgram(LiquidContext context, const char* buffer, size_t size) {
+    try {
+        return LiquidProgram({ new Program(Program::load(*static_cast<Context*>(context.context), (const unsigned char*)buffer, size)) });
+    } catch (Liquid::Exception& exp) {
+        return LiquidProgram({ NULL });
+    }
+}
+
 int liquidParserUnparseTemplate(LiquidParser parser, LiquidTemplate tmpl, char* buffer, size_t maxSize) {
     string unparse = static_cast<Parser*>(parser.parser)->unparse(*static_cast<Node*>(tmpl.ast));
     size_t copied = std::min(maxSize, unparse.size());
@@ -110,6 +174,27 @@ int liquidParserUnparseTemplate(LiquidParser parser, LiquidTemplate tmpl, char*
     return copied;
 }
 
+static int copyReport(const string& report, char* buffer, size_t maxSize) {
+    if (maxSize == 0)
+        return 0;
+    size_t copied = std::min(maxSize - 1, report.size());
+    memcpy(buffer, report.data(), copied);
+    buffer[copied] = 0;
+    return copied;
+}
+
+void liquidRendererSetProfiling(LiquidRenderer renderer, bool profiling) {
+    static_cast<Interpreter*>(renderer.renderer)->profiling = profiling;
+}
+
+int liquidRendererAnnotateProgram(LiquidRenderer renderer, LiquidProgram program, char* buffer, size_t maxSize) {
+    return copyReport(static_cast<Interpreter*>(renderer.renderer)->annotate(*static_cast<Program*>(program.program)), buffer, maxSize);
+}
+
+int liquidRendererGetProgramHotspots(LiquidRenderer renderer, LiquidProgram program, size_t limit, char* buffer, size_t maxSize) {
+    return copyReport(static_cast<Interpreter*>(renderer.renderer)->hotspots(*static_cast<Program*>(program.program), limit), buffer, maxSize);
+}
+
 void liquidFreeProgram(LiquidProgram program) {
     delete static_cast<Program*>(program.program);
 }
@@ -209,6 +294,20 @@ LiquidTemplateRender liquidRendererRenderTemplate(LiquidRenderer renderer, void*
     return LiquidTemplateRender({ str });
 }
 
+LiquidTemplateRender liquidRendererRerenderTemplate(LiquidRenderer renderer, void* variableStore, LiquidTemplate tmpl, const char** changedPaths, size_t changedPathCount, LiquidRendererError* error) {
+    if (error)
+        error->type = LIQUID_RENDERER_ERROR_TYPE_NONE;
+    std::string* str;
+    try {
+        str = new std::string(std::move(static_cast<Renderer*>(renderer.renderer)->rerender(*static_cast<Node*>(tmpl.ast), Variable({ variableStore }), std::vector<std::string>(changedPaths, changedPaths + changedPathCount))));
+    } catch (Renderer::Exception& exp) {
+        if (error)
+            *error = exp.rendererError;
+        return LiquidTemplateRender({ NULL });
+    }
+    return LiquidTemplateRender({ str });
+}
+
 
 void* liquidRendererRenderArgument(LiquidRenderer renderer, void* variableStore, LiquidTemplate tmpl, LiquidRendererError* error) {
     if (error)
@@ -275,6 +374,14 @@ void* liquidNodeTypeGetUserData(void* nodeType) {
     return static_cast<NodeType*>(nodeType)->userData;
 }
 
+void liquidNodeTypeSetEffects(void* nodeType, int effects) {
+    static_cast<NodeType*>(nodeType)->effects = effects;
+}
+
+int liquidNodeTypeGetEffects(void* nodeType) {
+    return static_cast<NodeType*>(nodeType)->effects;
+}
+
 
 void liquidFilterGetOperand(void** targetVariable, LiquidRenderer lRenderer, LiquidNode filter, void* variableStore) {
     Renderer& renderer = *static_cast<Renderer*>(lRenderer.renderer);
@@ -363,6 +470,14 @@ void liquidRendererSetReturnValueVariable(LiquidRenderer renderer, void* variabl
     static_cast<Renderer*>(renderer.renderer)->returnValue = Variant(Variable{variable});
 }
 
+void liquidRendererSetFragmentCache(LiquidRenderer renderer, LiquidFragmentCache cache) {
+    static_cast<Renderer*>(renderer.renderer)->fragmentCache = cache;
+}
+
+LiquidFragmentCacheMetrics liquidRendererGetFragmentCacheMetrics(LiquidRenderer renderer) {
+    return static_cast<Renderer*>(renderer.renderer)->fragmentCacheMetrics;
+}
+
 void liquidRegisterVariableResolver(LiquidRenderer renderer, LiquidVariableResolver resolver) {
     Renderer* rdr = static_cast<Renderer*>(renderer.renderer);
     rdr->variableResolver = resolver;
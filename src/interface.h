@@ -74,6 +74,19 @@ extern "C" {
         LIQUID_OPTIMIZATION_SCHEME_FULL
     } LiquidOptimizationScheme;
 
+    // What rendering a node depends on, or changes, beyond its children; a combination of flags. Types registered with an optimization
+    // scheme of NONE or SHIELD start out as LIQUID_EFFECT_UNKNOWN, all others as LIQUID_EFFECT_PURE.
+    typedef enum ELiquidEffect {
+        LIQUID_EFFECT_PURE              = 0,
+        // The time, or the timezone.
+        LIQUID_EFFECT_READS_TIME        = 1,
+        // Variables in the store, other than those passed in as children.
+        LIQUID_EFFECT_READS_STORE       = 2,
+        LIQUID_EFFECT_WRITES_STORE      = 4,
+        LIQUID_EFFECT_NONDETERMINISTIC  = 8,
+        LIQUID_EFFECT_UNKNOWN           = 15
+    } LiquidEffect;
+
     typedef enum ELiquidTagType {
         LIQUID_TAG_TYPE_FREE,
         LIQUID_TAG_TYPE_ENCLOSING
@@ -97,6 +110,7 @@ extern "C" {
     typedef struct SLiquidParser { void* parser; } LiquidParser;
     typedef struct SLiquidTemplate { void* ast; } LiquidTemplate;
     typedef struct SLiquidOptimizer { void* optimizer; } LiquidOptimizer;
+    typedef struct SLiquidMemoizer { void* memoizer; } LiquidMemoizer;
     typedef struct SLiquidCompiler { void* compiler; } LiquidCompiler;
     typedef struct SLiquidInterpreter { void* interpreter; } LiquidInterpreter;
     typedef struct SLiquidProgram { void* program; } LiquidProgram;
@@ -147,8 +161,27 @@ extern "C" {
         void* (*createClone)(LiquidRenderer renderer, void* value);
         void (*freeVariable)(LiquidRenderer renderer, void* value);
         int (*compare)(void* a, void* b);
+        // Optional. Returns a version for the variable, which must change whenever the variable or any of its direct members change, and which
+        // must not be reused by a different variable at the same address. 0 means unknown. When supplied, the VM's inline caches for variable lookups
+        // stay valid across renders. Null if the resolver is unversioned; every variable is then unknown.
+        unsigned long long (*getVersion)(LiquidRenderer renderer, void* variable);
     } LiquidVariableResolver;
 
+    // Stores the output of {% cache %} blocks. Both functions may be called from several renderers at once. On a hit, get calls found with
+    // the output, and the time in nanoseconds it took to render, before returning true. A ttl of 0 never expires.
+    typedef struct SLiquidFragmentCache {
+        bool (*get)(void* data, const char* key, size_t keyLength, void (*found)(const char* output, size_t outputLength, unsigned long long renderTime, void* target), void* target);
+        void (*set)(void* data, const char* key, size_t keyLength, const char* output, size_t outputLength, unsigned long long renderTime, unsigned int ttl);
+        void* data;
+    } LiquidFragmentCache;
+
+    // Accumulated for as long as the renderer lives; savedTime is the render time, in nanoseconds, of the output served from the cache.
+    typedef struct SLiquidFragmentCacheMetrics {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long savedTime;
+    } LiquidFragmentCacheMetrics;
+
     LiquidContext liquidCreateContext();
     const char* liquidGetContextError(LiquidContext context);
     void liquidFreeContext(LiquidContext context);
@@ -157,6 +190,11 @@ extern "C" {
     #ifdef LIQUID_INCLUDE_WEB_DIALECT
         void liquidImplementWebDialect(LiquidContext context);
     #endif
+    void liquidImplementCacheDialect(LiquidContext context);
+    // An in-process cache of at most maximumSize bytes, split into shards; must be freed with liquidFreeLRUFragmentCache.
+    LiquidFragmentCache liquidCreateLRUFragmentCache(size_t maximumSize, size_t shards);
+    void liquidFreeLRUFragmentCache(LiquidFragmentCache cache);
+    void liquidContextSetFragmentCache(LiquidContext context, LiquidFragmentCache cache);
     #ifdef LIQUID_INCLUDE_RAPIDJSON_VARIABLE
         void liquidImplementJSONStringVariable();
     #endif
@@ -166,6 +204,8 @@ extern "C" {
     void liquidRendererSetStrictFilters(LiquidRenderer renderer, bool strict);
     void liquidRendererSetCustomData(LiquidRenderer renderer, void* data);
     void* liquidRendererGetCustomData(LiquidRenderer renderer);
+    void liquidRendererSetFragmentCache(LiquidRenderer renderer, LiquidFragmentCache cache);
+    LiquidFragmentCacheMetrics liquidRendererGetFragmentCacheMetrics(LiquidRenderer renderer);
     void liquidRendererSetReturnValueNil(LiquidRenderer renderer);
     void liquidRendererSetReturnValueBool(LiquidRenderer renderer, bool b);
     void liquidRendererSetReturnValueString(LiquidRenderer renderer, const char* s, int length);
@@ -189,17 +229,44 @@ extern "C" {
 
     LiquidOptimizer liquidCreateOptimizer(LiquidRenderer renderer);
     void liquidOptimizeTemplate(LiquidOptimizer optimizer, LiquidTemplate tmpl, void* variableStore);
+    // Moves loop-invariant expressions out of loops; returns how many were moved.
+    int liquidOptimizerHoistInvariants(LiquidOptimizer optimizer, LiquidTemplate tmpl);
+    // Rewrites filter chains that do more work than they need to, like "sort | first"; returns how many were rewritten.
+    int liquidOptimizerRewrite(LiquidOptimizer optimizer, LiquidTemplate tmpl);
+    // Evaluates repeated expressions once per render, until something they read is assigned; returns how many occurrences share a value.
+    int liquidOptimizerEliminateCommonSubexpressions(LiquidOptimizer optimizer, LiquidTemplate tmpl);
+    // Unrolls for loops over constant sequences of at most maximumIterations elements; returns how many were unrolled.
+    int liquidOptimizerUnrollLoops(LiquidOptimizer optimizer, LiquidTemplate tmpl, size_t maximumIterations);
+    // Wraps pure subtrees expensive enough to be worth replaying, for a memoizer; returns how many were wrapped.
+    int liquidOptimizerMemoize(LiquidOptimizer optimizer, LiquidTemplate tmpl);
     void liquidFreeOptimizer(LiquidOptimizer optimizer);
+    // Replays the output of memoized subtrees rendered through the renderer, keeping at most maximumSize bytes, until freed.
+    LiquidMemoizer liquidCreateMemoizer(LiquidRenderer renderer, size_t maximumSize);
+    void liquidFreeMemoizer(LiquidMemoizer memoizer);
 
     LiquidCompiler liquidCreateCompiler(LiquidContext context);
     void liquidFreeCompiler(LiquidCompiler compiler);
     LiquidProgram liquidCompilerCompileTemplate(LiquidCompiler compiler, LiquidTemplate tmpl);
     void liquidFreeProgram(LiquidProgram program);
     int liquidCompilerDisassembleProgram(LiquidCompiler compiler, LiquidProgram program, char* buffer, size_t maxSize);
+    // Returns the size of the serialized program, copying at most maxSize bytes of it into buffer; or -1 if it can't be serialized.
+    long long liquidSerializeProgram(LiquidContext context, LiquidProgram program, char* buffer, size_t maxSize);
+    // Returns a program with a null pointer if the data can't be loaded against this context.
+    LiquidProgram liquidLoadProgram(LiquidContext context, const char* buffer, size_t size);
     int liquidParserUnparseTemplate(LiquidParser parser, LiquidTemplate tmpl, char* buffer, size_t maxSize);
 
     LiquidProgramRender liquidRendererRunProgram(LiquidRenderer renderer, void* variableStore, LiquidProgram program, LiquidRendererError* error);
+    // While set, programs run through the renderer count executions and cycles per instruction, and per node type called; counts
+    // accumulate for as long as the renderer lives.
+    void liquidRendererSetProfiling(LiquidRenderer renderer, bool profiling);
+    // As liquidCompilerDisassembleProgram, with every instruction prefixed by its execution count and cycles.
+    int liquidRendererAnnotateProgram(LiquidRenderer renderer, LiquidProgram program, char* buffer, size_t maxSize);
+    // The limit instructions, and node types, the program has spent the most cycles in.
+    int liquidRendererGetProgramHotspots(LiquidRenderer renderer, LiquidProgram program, size_t limit, char* buffer, size_t maxSize);
     LiquidTemplateRender liquidRendererRenderTemplate(LiquidRenderer renderer, void* variableStore, LiquidTemplate tmpl, LiquidRendererError* error);
+    // As liquidRendererRenderTemplate; renders of the same template and store that follow only render again what read under any of the
+    // changed paths, like "settings.color" or "products[0]". See Renderer::rerender.
+    LiquidTemplateRender liquidRendererRerenderTemplate(LiquidRenderer renderer, void* variableStore, LiquidTemplate tmpl, const char** changedPaths, size_t changedPathCount, LiquidRendererError* error);
     void* liquidRendererRenderArgument(LiquidRenderer renderer, void* variableStore, LiquidTemplate argument, LiquidRendererError* error);
     typedef void (*LiquidWalkTemplateFunction)(LiquidTemplate tmpl, const LiquidNode node, void* data);
     void liquidWalkTemplate(LiquidTemplate tmpl, LiquidWalkTemplateFunction callback, void* data);
@@ -228,6 +295,9 @@ extern "C" {
     void* liquidRegisterOperator(LiquidContext context, const char* symbol, enum ELiquidOperatorArity arity, enum ELiquidOperatorFixness fixness, int priority, LiquidOptimizationScheme optimization, LiquidRenderFunction renderFunction, void* data);
 
     void* liquidNodeTypeGetUserData(void* nodeType);
+    // For node types returned by the liquidRegister functions; effects is a combination of LiquidEffect flags.
+    void liquidNodeTypeSetEffects(void* nodeType, int effects);
+    int liquidNodeTypeGetEffects(void* nodeType);
 #ifdef __cplusplus
 }
 #endif
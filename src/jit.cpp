@@ -0,0 +1,445 @@
+#include "jit.h"
+
+#ifdef LIQUID_JIT
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <initializer_list>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "compiler.h"
+
+namespace Liquid {
+
+    bool JitProgram::perfMap = false;
+
+    // Called from native code. Those that can fail return whether the render is now in error.
+    static bool jitStep(JitProgram::Frame* frame, const unsigned int* instruction) {
+        Interpreter& interpreter = *frame->interpreter;
+        interpreter.instructionPointer = instruction;
+        // A specialized instruction whose guard fails is rewritten to its generic version, and left to be run again.
+        do {
+            interpreter.run(frame->code, frame->store, frame->callback, frame->data, nullptr, true);
+        } while (interpreter.instructionPointer == instruction);
+        return interpreter.error != LIQUID_RENDERER_ERROR_TYPE_NONE;
+    }
+
+    static void jitOutput(JitProgram::Frame* frame, const char* str, size_t len) {
+        Interpreter& interpreter = *frame->interpreter;
+        if (interpreter.buffers.size())
+            interpreter.buffers.top().append(str, len);
+        else
+            frame->callback(str, len, frame->data);
+    }
+
+    static void jitOutputRegister(JitProgram::Frame* frame, const Interpreter::Register* reg) {
+        frame->interpreter->output(*reg, frame->callback, frame->data);
+    }
+
+    static void jitMoveString(Interpreter* interpreter, Interpreter::Register* reg, const char* str, size_t len) {
+        interpreter->pushRegister(*reg, str, len);
+    }
+
+    static bool jitCompareStrings(JitProgram::Frame* frame, const unsigned int* instruction) {
+        Interpreter& interpreter = *frame->interpreter;
+        Interpreter::Register& left = interpreter.registers[(*instruction >> 8) & 0xFF];
+        Interpreter::Register& right = interpreter.registers[*instruction >> 16];
+        if (!interpreter.isString(left) || !interpreter.isString(right))
+            return jitStep(frame, instruction);
+        bool isEqual = interpreter.getStringLength(left) == interpreter.getStringLength(right) && memcmp(interpreter.getStringBuffer(left), interpreter.getStringBuffer(right), interpreter.getStringLength(left)) == 0;
+        left.type = Interpreter::Register::Type::BOOL;
+        left.b = (OPCode)(*instruction & 0xFF) == OP_EQUALSTR ? isEqual : !isEqual;
+        return false;
+    }
+
+    static bool jitResolve(JitProgram::Frame* frame, Interpreter::Register* reg, long long operand, unsigned int slot) {
+        frame->interpreter->resolve(*reg, operand, slot, frame->store);
+        return frame->interpreter->error != LIQUID_RENDERER_ERROR_TYPE_NONE;
+    }
+
+    static bool jitNative(JitProgram::Frame* frame, long long opCode, const NodeType* type, Interpreter::Register* target, Interpreter::Register* source) {
+        frame->interpreter->native((OPCode)opCode, type, *target, *source, frame->store);
+        return frame->interpreter->error != LIQUID_RENDERER_ERROR_TYPE_NONE;
+    }
+
+    static bool jitTruthy(const Interpreter* interpreter, const Interpreter::Register* reg) {
+        return interpreter->isTruthy(*reg);
+    }
+
+    static unsigned int jitSwitch(const Interpreter* interpreter, const Interpreter::Register* reg, const unsigned char* table) {
+        return interpreter->getSwitchIndex(*reg, table);
+    }
+
+    // As OP_ITERATE in Interpreter::run; returns 0 to carry on after the loop, 1 if this is the end of the body being run, and 2 on error.
+    static int jitIterate(JitProgram::Frame* frame, const unsigned int* instruction, const JitProgram* program, const void* body) {
+        Interpreter& interpreter = *frame->interpreter;
+        if (frame->iteration == instruction)
+            return 1;
+        if (interpreter.error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+            return 2;
+        Interpreter::Register& reg = interpreter.registers[*instruction >> 8];
+        if (reg.type != Interpreter::Register::Type::VARIABLE || !reg.pointer)
+            return 0;
+        if (++interpreter.currentRenderingDepth > interpreter.maximumRenderingDepth) {
+            interpreter.error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH;
+            return 2;
+        }
+        JitProgram::Frame inner = *frame;
+        inner.iteration = instruction;
+        const void* pointers[] = { &inner, program, body };
+        interpreter.variableResolver.iterate(LiquidRenderer { &interpreter }, reg.pointer, +[](void* variable, void* data){
+            const void** pointers = (const void**)data;
+            JitProgram::Frame* frame = (JitProgram::Frame*)pointers[0];
+            frame->interpreter->pushRegister(frame->interpreter->registers[0], Variable { variable });
+            return ((const JitProgram*)pointers[1])->function(frame, pointers[2]);
+        }, pointers, 0, -1, false);
+        --interpreter.currentRenderingDepth;
+        return interpreter.error != LIQUID_RENDERER_ERROR_TYPE_NONE ? 2 : 0;
+    }
+
+    namespace {
+        enum Reg { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7, R8 = 8 };
+        enum Condition { JE = 0x84, JNE = 0x85 };
+        // Labels are byte offsets into the bytecode; these two are the ways out of the native code.
+        enum Exit { EXIT_FALSE = -1, EXIT_TRUE = -2 };
+
+        struct Emitter {
+            struct Fixup {
+                size_t position;
+                long long label;
+                // Absolute fixups are 8-byte addresses; the rest are 4-byte displacements from the end of the fixup.
+                bool absolute;
+            };
+            std::vector<unsigned char> bytes;
+            std::vector<Fixup> fixups;
+
+            void emit(std::initializer_list<unsigned char> list) { bytes.insert(bytes.end(), list); }
+            void emit(const void* value, size_t size) { bytes.insert(bytes.end(), (const unsigned char*)value, (const unsigned char*)value + size); }
+
+            void mov(Reg reg, unsigned long long value) {
+                emit({ (unsigned char)(reg >= R8 ? 0x49 : 0x48), (unsigned char)(0xB8 + (reg & 7)) });
+                emit(&value, sizeof(value));
+            }
+            void mov(Reg reg, const void* value) { mov(reg, (unsigned long long)value); }
+            // Every helper takes the frame, held in rbx, first.
+            void movFrame() { emit({ 0x48, 0x89, 0xDF }); }
+            void call(const void* function) {
+                mov(RAX, function);
+                emit({ 0xFF, 0xD0 });
+            }
+            // Leaves the native code, returning false, if the helper that was just called returned true.
+            void exitIfSet() {
+                emit({ 0x84, 0xC0 });
+                jump(JNE, EXIT_FALSE);
+            }
+            void fixup(long long label, bool absolute) {
+                fixups.push_back({ bytes.size(), label, absolute });
+                bytes.resize(bytes.size() + (absolute ? 8 : 4));
+            }
+            void jump(long long label) {
+                emit({ 0xE9 });
+                fixup(label, false);
+            }
+            void jump(Condition condition, long long label) {
+                emit({ 0x0F, (unsigned char)condition });
+                fixup(label, false);
+            }
+            void movLabel(Reg reg, long long label) {
+                emit({ (unsigned char)(reg >= R8 ? 0x49 : 0x48), (unsigned char)(0xB8 + (reg & 7)) });
+                fixup(label, true);
+            }
+            // A rel8 jump to be pointed somewhere later in the fragment with land.
+            size_t shortJump(unsigned char opCode) {
+                emit({ opCode, 0x00 });
+                return bytes.size();
+            }
+            void land(size_t jump) { bytes[jump - 1] = (unsigned char)(bytes.size() - jump); }
+        };
+    }
+
+    JitProgram::~JitProgram() {
+        if (memory)
+            munmap(memory, size);
+    }
+
+    std::unique_ptr<JitProgram> JitProgram::compile(Interpreter& interpreter, const Program& program, const unsigned char* code) {
+        typedef Interpreter::Register Register;
+        static_assert(offsetof(Register, type) == 0 && offsetof(Register, i) < 0x80 && offsetof(Register, b) < 0x80, "register layout");
+        static_assert(offsetof(Frame, iteration) < 0x80, "frame layout");
+        static_assert(sizeof(Register::Type) == 4 && sizeof(interpreter.error) == 4 && sizeof(Register) % 8 == 0, "register layout");
+
+        std::unique_ptr<JitProgram> result = std::make_unique<JitProgram>();
+        Emitter emitter;
+        // Native offset of each bytecode word that starts an instruction.
+        std::vector<long long> labels(program.code.size() / sizeof(unsigned int) + 1, -1);
+
+        // push rbx; mov rbx, rdi; jmp rsi. The one push leaves the stack 16-byte aligned for calls.
+        emitter.emit({ 0x53, 0x48, 0x89, 0xFB, 0xFF, 0xE6 });
+        size_t offset = program.codeOffset;
+        while (offset < program.code.size()) {
+            labels[offset / sizeof(unsigned int)] = emitter.bytes.size();
+            const unsigned int* instruction = (const unsigned int*)&code[offset];
+            OPCode opCode = (OPCode)(*instruction & 0xFF);
+            unsigned int target = *instruction >> 8;
+            long long operand = operandSize(opCode) ? *(const long long*)&instruction[1] : 0;
+            offset += sizeof(unsigned int) + operandSize(opCode);
+            switch (opCode) {
+                case OP_OUTPUTMEM:
+                    emitter.movFrame();
+                    emitter.mov(RSI, &code[operand+sizeof(unsigned int)]);
+                    emitter.mov(RDX, *(const unsigned int*)&code[operand]);
+                    emitter.call((const void*)&jitOutput);
+                break;
+                case OP_MOV:
+                    // mov rcx, size / 8; rep movsq
+                    emitter.mov(RSI, &interpreter.registers[target]);
+                    emitter.mov(RDI, &interpreter.registers[operand]);
+                    emitter.mov(RCX, sizeof(Register) / 8);
+                    emitter.emit({ 0xF3, 0x48, 0xA5 });
+                break;
+                case OP_MOVSTR:
+                    emitter.mov(RDI, &interpreter);
+                    emitter.mov(RSI, &interpreter.registers[target]);
+                    emitter.mov(RDX, &code[operand+sizeof(unsigned int)]);
+                    emitter.mov(RCX, *(const unsigned int*)&code[operand]);
+                    emitter.call((const void*)&jitMoveString);
+                break;
+                case OP_OUTPUT:
+                    emitter.movFrame();
+                    emitter.mov(RSI, &interpreter.registers[target]);
+                    emitter.call((const void*)&jitOutputRegister);
+                break;
+                case OP_PLUSINT:
+                case OP_MINUSINT:
+                case OP_EQUALINT:
+                case OP_NOTEQUALINT:
+                case OP_LESSINT:
+                case OP_LESSEQUALINT:
+                case OP_GREATERINT:
+                case OP_GREATEREQUALINT: {
+                    const unsigned char i = offsetof(Register, i);
+                    emitter.mov(RAX, &interpreter.registers[target & 0xFF]);
+                    emitter.mov(RDX, &interpreter.registers[target >> 8]);
+                    // cmp dword [rax], INT; jne generic; cmp dword [rdx], INT; jne generic; mov rcx, [rax+i]
+                    emitter.emit({ 0x83, 0x38, (unsigned char)Register::Type::INT });
+                    size_t leftGeneric = emitter.shortJump(0x75);
+                    emitter.emit({ 0x83, 0x3A, (unsigned char)Register::Type::INT });
+                    size_t rightGeneric = emitter.shortJump(0x75);
+                    emitter.emit({ 0x48, 0x8B, 0x48, i });
+                    if (opCode == OP_PLUSINT || opCode == OP_MINUSINT) {
+                        // add/sub rcx, [rdx+i]; mov [rax+i], rcx
+                        emitter.emit({ 0x48, (unsigned char)(opCode == OP_PLUSINT ? 0x03 : 0x2B), 0x4A, i });
+                        emitter.emit({ 0x48, 0x89, 0x48, i });
+                    } else {
+                        unsigned char condition;
+                        switch (opCode) {
+                            case OP_EQUALINT: condition = 0x94; break;
+                            case OP_NOTEQUALINT: condition = 0x95; break;
+                            case OP_LESSINT: condition = 0x9C; break;
+                            case OP_LESSEQUALINT: condition = 0x9E; break;
+                            case OP_GREATERINT: condition = 0x9F; break;
+                            default: condition = 0x9D; break;
+                        }
+                        unsigned int typeValue = (unsigned int)Register::Type::BOOL;
+                        // cmp rcx, [rdx+i]; setcc cl; mov [rax+b], cl; mov dword [rax], BOOL
+                        emitter.emit({ 0x48, 0x3B, 0x4A, i, 0x0F, condition, 0xC1, 0x88, 0x48, (unsigned char)offsetof(Register, b), 0xC7, 0x00 });
+                        emitter.emit(&typeValue, sizeof(typeValue));
+                    }
+                    size_t done = emitter.shortJump(0xEB);
+                    // The guard failed; the interpreter deoptimizes the instruction, and runs it.
+                    emitter.land(leftGeneric);
+                    emitter.land(rightGeneric);
+                    emitter.movFrame();
+                    emitter.mov(RSI, instruction);
+                    emitter.call((const void*)&jitStep);
+                    emitter.exitIfSet();
+                    emitter.land(done);
+                } break;
+                case OP_EQUALSTR:
+                case OP_NOTEQUALSTR:
+                    emitter.movFrame();
+                    emitter.mov(RSI, instruction);
+                    emitter.call((const void*)&jitCompareStrings);
+                    emitter.exitIfSet();
+                break;
+                case OP_MOVINT:
+                case OP_MOVBOOL:
+                case OP_MOVFLOAT:
+                case OP_MOVNIL: {
+                    // The operand's 8 bytes are the value, whatever its type; nil is a null pointer.
+                    Register::Type type = opCode == OP_MOVINT ? Register::Type::INT : (opCode == OP_MOVBOOL ? Register::Type::BOOL : (opCode == OP_MOVFLOAT ? Register::Type::FLOAT : Register::Type::NIL));
+                    unsigned long long value = opCode == OP_MOVBOOL ? (operand ? 1 : 0) : operand;
+                    unsigned int typeValue = (unsigned int)type;
+                    emitter.mov(RAX, &interpreter.registers[target]);
+                    // mov dword [rax], type; mov rcx, value; mov [rax+i], rcx
+                    emitter.emit({ 0xC7, 0x00 });
+                    emitter.emit(&typeValue, sizeof(typeValue));
+                    emitter.mov(RCX, value);
+                    emitter.emit({ 0x48, 0x89, 0x48, (unsigned char)offsetof(Register, i) });
+                } break;
+                case OP_RESOLVE:
+                    emitter.movFrame();
+                    emitter.mov(RSI, &interpreter.registers[target & 0xFF]);
+                    emitter.mov(RDX, operand);
+                    emitter.mov(RCX, target >> 8);
+                    emitter.call((const void*)&jitResolve);
+                    emitter.exitIfSet();
+                break;
+                case OP_PLUS:
+                case OP_MINUS:
+                case OP_MULTIPLY:
+                case OP_DIVIDE:
+                case OP_MODULO:
+                case OP_EQUAL:
+                case OP_NOTEQUAL:
+                case OP_LESS:
+                case OP_LESSEQUAL:
+                case OP_GREATER:
+                case OP_GREATEREQUAL:
+                case OP_AND:
+                case OP_OR:
+                case OP_APPEND:
+                case OP_PREPEND:
+                case OP_DEFAULT:
+                case OP_SIZE:
+                case OP_DOWNCASE:
+                case OP_UPCASE:
+                    emitter.movFrame();
+                    emitter.mov(RSI, opCode);
+                    emitter.mov(RDX, operand);
+                    emitter.mov(RCX, &interpreter.registers[target & 0xFF]);
+                    emitter.mov(R8, &interpreter.registers[target >> 8]);
+                    emitter.call((const void*)&jitNative);
+                    emitter.exitIfSet();
+                break;
+                case OP_JMP:
+                    // cmp dword [rax], 0
+                    emitter.mov(RAX, &interpreter.error);
+                    emitter.emit({ 0x83, 0x38, 0x00 });
+                    emitter.jump(JNE, EXIT_FALSE);
+                    emitter.jump(operand);
+                break;
+                case OP_JMPTRUE:
+                case OP_JMPFALSE:
+                case OP_JMPTRUEBOOL:
+                case OP_JMPFALSEBOOL: {
+                    bool onTrue = opCode == OP_JMPTRUE || opCode == OP_JMPTRUEBOOL;
+                    size_t generic = 0, done = 0;
+                    emitter.mov(RAX, &interpreter.registers[target]);
+                    // Rather than deoptimizing, booleans are checked inline, and anything else is left to isTruthy.
+                    if (opCode == OP_JMPTRUEBOOL || opCode == OP_JMPFALSEBOOL) {
+                        // cmp dword [rax], BOOL; jne generic; cmp byte [rax+b], 0
+                        emitter.emit({ 0x83, 0x38, (unsigned char)Register::Type::BOOL });
+                        generic = emitter.shortJump(0x75);
+                        emitter.emit({ 0x80, 0x78, (unsigned char)offsetof(Register, b), 0x00 });
+                        emitter.jump(onTrue ? JNE : JE, operand);
+                        done = emitter.shortJump(0xEB);
+                        emitter.land(generic);
+                    }
+                    // mov rsi, rax
+                    emitter.emit({ 0x48, 0x89, 0xC6 });
+                    emitter.mov(RDI, &interpreter);
+                    emitter.call((const void*)&jitTruthy);
+                    emitter.emit({ 0x84, 0xC0 });
+                    emitter.jump(onTrue ? JNE : JE, operand);
+                    if (done)
+                        emitter.land(done);
+                } break;
+                case OP_ITERATE:
+                    // The end of the body being run: mov rax, instruction; cmp [rbx+iteration], rax; je true
+                    emitter.mov(RAX, instruction);
+                    emitter.emit({ 0x48, 0x39, 0x43, (unsigned char)offsetof(Frame, iteration) });
+                    emitter.jump(JE, EXIT_TRUE);
+                    emitter.movFrame();
+                    emitter.mov(RSI, instruction);
+                    emitter.mov(RDX, result.get());
+                    emitter.movLabel(RCX, offset);
+                    emitter.call((const void*)&jitIterate);
+                    // cmp eax, 1; cmp eax, 2
+                    emitter.emit({ 0x83, 0xF8, 0x01 });
+                    emitter.jump(JE, EXIT_TRUE);
+                    emitter.emit({ 0x83, 0xF8, 0x02 });
+                    emitter.jump(JE, EXIT_FALSE);
+                    emitter.jump(operand);
+                break;
+                case OP_SWITCH:
+                    emitter.mov(RDI, &interpreter);
+                    emitter.mov(RSI, &interpreter.registers[target]);
+                    emitter.mov(RDX, &code[operand+sizeof(unsigned int)]);
+                    emitter.call((const void*)&jitSwitch);
+                    // mov eax, eax; lea rcx, [rip+3]; jmp [rcx+rax*8]; then the address of each of the jumps that follow.
+                    emitter.emit({ 0x89, 0xC0, 0x48, 0x8D, 0x0D, 0x03, 0x00, 0x00, 0x00, 0xFF, 0x24, 0xC1 });
+                    for (unsigned int i = 0; i < *(const unsigned int*)&code[operand+sizeof(unsigned int)] + 2; ++i)
+                        emitter.fixup(offset + i * (sizeof(unsigned int) + sizeof(long long)), true);
+                break;
+                case OP_EXIT:
+                    emitter.jump(EXIT_FALSE);
+                break;
+                default:
+                    emitter.movFrame();
+                    emitter.mov(RSI, instruction);
+                    emitter.call((const void*)&jitStep);
+                    emitter.exitIfSet();
+                break;
+            }
+        }
+        labels[offset / sizeof(unsigned int)] = emitter.bytes.size();
+        emitter.jump(EXIT_FALSE);
+        // xor eax, eax; pop rbx; ret
+        long long exitFalse = emitter.bytes.size();
+        emitter.emit({ 0x31, 0xC0, 0x5B, 0xC3 });
+        // mov eax, 1; pop rbx; ret
+        long long exitTrue = emitter.bytes.size();
+        emitter.emit({ 0xB8, 0x01, 0x00, 0x00, 0x00, 0x5B, 0xC3 });
+
+        result->size = emitter.bytes.size();
+        result->memory = mmap(nullptr, result->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (result->memory == MAP_FAILED) {
+            result->memory = nullptr;
+            return nullptr;
+        }
+        unsigned char* base = (unsigned char*)result->memory;
+        for (auto& fixup : emitter.fixups) {
+            long long target;
+            if (fixup.label == EXIT_FALSE)
+                target = exitFalse;
+            else if (fixup.label == EXIT_TRUE)
+                target = exitTrue;
+            else if (fixup.label >= 0 && fixup.label % sizeof(unsigned int) == 0 && fixup.label / sizeof(unsigned int) < labels.size() && labels[fixup.label / sizeof(unsigned int)] != -1)
+                target = labels[fixup.label / sizeof(unsigned int)];
+            else
+                return nullptr;
+            if (fixup.absolute) {
+                unsigned long long address = (unsigned long long)(base + target);
+                memcpy(&emitter.bytes[fixup.position], &address, sizeof(address));
+            } else {
+                int displacement = (int)(target - (long long)(fixup.position + 4));
+                memcpy(&emitter.bytes[fixup.position], &displacement, sizeof(displacement));
+            }
+        }
+        memcpy(base, emitter.bytes.data(), result->size);
+        if (mprotect(result->memory, result->size, PROT_READ | PROT_EXEC) != 0)
+            return nullptr;
+        result->function = (Function)result->memory;
+        result->entry = base + labels[program.codeOffset / sizeof(unsigned int)];
+
+        if (perfMap) {
+            static std::mutex mutex;
+            std::lock_guard<std::mutex> lock(mutex);
+            std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+            if (FILE* file = fopen(path.c_str(), "a")) {
+                if (program.name.empty())
+                    fprintf(file, "%llx %zx liquid:program-%llu\n", (unsigned long long)base, result->size, program.id);
+                else
+                    fprintf(file, "%llx %zx liquid:%s\n", (unsigned long long)base, result->size, program.name.c_str());
+                fclose(file);
+            }
+        }
+        return result;
+    }
+}
+
+#endif
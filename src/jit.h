@@ -0,0 +1,59 @@
+#ifndef LIQUIDJIT_H
+#define LIQUIDJIT_H
+
+// Native code is only generated on x86-64 Linux; define LIQUID_DISABLE_JIT to leave it out entirely.
+#if defined(__x86_64__) && defined(__linux__) && !defined(LIQUID_DISABLE_JIT)
+    #define LIQUID_JIT
+#endif
+
+#ifdef LIQUID_JIT
+
+#include <memory>
+
+#include "common.h"
+
+namespace Liquid {
+    struct Interpreter;
+    struct Program;
+
+    // A specialized program translated into x86-64, one fragment per instruction. Literal output, jumps, branches, switches, iteration, moves of
+    // constants, resolves and native operations are emitted as native code, or direct calls; every other instruction calls back into the
+    // interpreter to run just that instruction. The code has the addresses of the interpreter's registers and of the program's bytecode
+    // baked in, so is only valid for the interpreter and bytecode it was compiled against.
+    struct JitProgram {
+        // Everything that can change between calls into the native code.
+        struct Frame {
+            Interpreter* interpreter;
+            const unsigned char* code;
+            Variable store;
+            void (*callback)(const char* chunk, size_t len, void* data);
+            void* data;
+            // The OP_ITERATE whose body is being run, if any.
+            const unsigned int* iteration;
+        };
+        // Starts running at entry. As Interpreter::run, returns true when reaching the end of the frame's iteration body, and false on
+        // OP_EXIT, or an error.
+        typedef bool (*Function)(Frame* frame, const void* entry);
+
+        // If set, every compiled program is added to /tmp/perf-<pid>.map, so that perf can attribute samples to templates.
+        static bool perfMap;
+
+        void* memory = nullptr;
+        size_t size = 0;
+        Function function = nullptr;
+        const void* entry = nullptr;
+
+        JitProgram() { }
+        JitProgram(const JitProgram&) = delete;
+        ~JitProgram();
+
+        bool run(Frame& frame) const { return function(&frame, entry); }
+
+        // Returns null if the code can't be mapped executable.
+        static std::unique_ptr<JitProgram> compile(Interpreter& interpreter, const Program& program, const unsigned char* code);
+    };
+}
+
+#endif
+
+#endif
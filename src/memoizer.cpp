@@ -0,0 +1,225 @@
+#include "memoizer.h"
+#include "renderer.h"
+#include "context.h"
+#include <algorithm>
+
+namespace Liquid {
+
+    // FNV-1a.
+    static void hashBytes(unsigned long long& hash, const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<const unsigned char*>(data)[i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    template <class T>
+    static void hashValue(unsigned long long& hash, const T& value) {
+        hashBytes(hash, &value, sizeof(value));
+    }
+
+    static const unsigned long long initialHash = 0xcbf29ce484222325ULL;
+
+    Memoizer::Memoizer(Renderer& renderer, size_t maximumSize) : renderer(renderer), maximumSize(maximumSize) {
+        renderer.memoizer = this;
+    }
+
+    Memoizer::~Memoizer() {
+        if (renderer.memoizer == this)
+            renderer.memoizer = nullptr;
+    }
+
+    bool Memoizer::hash(unsigned long long& hash, Variable variable, bool found) {
+        hashValue(hash, found);
+        if (!found)
+            return true;
+        const LiquidVariableResolver& resolver = renderer.variableResolver;
+        LiquidVariableType type = resolver.getType(renderer, variable);
+        hashValue(hash, type);
+        switch (type) {
+            case LIQUID_VARIABLE_TYPE_STRING: {
+                std::string str;
+                renderer.resolveVariableString(str, variable);
+                hashValue(hash, str.size());
+                hashBytes(hash, str.data(), str.size());
+            } break;
+            case LIQUID_VARIABLE_TYPE_INT: {
+                long long i = 0;
+                resolver.getInteger(renderer, variable, &i);
+                hashValue(hash, i);
+            } break;
+            case LIQUID_VARIABLE_TYPE_FLOAT: {
+                double f = 0;
+                resolver.getFloat(renderer, variable, &f);
+                hashValue(hash, f);
+            } break;
+            case LIQUID_VARIABLE_TYPE_BOOL: {
+                bool b = false;
+                resolver.getBool(renderer, variable, &b);
+                hashValue(hash, b);
+            } break;
+            case LIQUID_VARIABLE_TYPE_ARRAY: {
+                long long size = resolver.getArraySize(renderer, variable);
+                hashValue(hash, size);
+                for (long long i = 0; i < size; ++i) {
+                    Variable element;
+                    bool found = resolver.getArrayVariable(renderer, variable, i, element);
+                    if (!this->hash(hash, element, found))
+                        return false;
+                }
+            } break;
+            case LIQUID_VARIABLE_TYPE_NIL:
+            break;
+            default: {
+                // Dictionaries can't be walked; without a version, there's no telling whether they've changed.
+                unsigned long long version = resolver.getVersion ? resolver.getVersion(renderer, variable) : 0;
+                if (!version)
+                    return false;
+                hashValue(hash, variable.pointer);
+                hashValue(hash, version);
+            } break;
+        }
+        return true;
+    }
+
+    bool Memoizer::resolve(Variable& variable, const std::vector<Variant>& keys) {
+        for (auto& key : keys) {
+            bool found = key.type == Variant::Type::INT ?
+                renderer.variableResolver.getArrayVariable(renderer, variable, key.i, variable) :
+                renderer.variableResolver.getDictionaryVariable(renderer, variable, key.s.data(), variable);
+            if (!found)
+                return false;
+        }
+        return true;
+    }
+
+    bool Memoizer::matches(const Entry& entry, Variable store) {
+        for (auto& read : entry.reads) {
+            Variable value = store;
+            bool found = resolve(value, read.keys);
+            unsigned long long hash = initialHash;
+            if (!this->hash(hash, value, found) || hash != read.hash)
+                return false;
+        }
+        return true;
+    }
+
+    void Memoizer::record(const Read& read, Variable store) {
+        for (auto& recording : recordings) {
+            if (recording.store.pointer == store.pointer && recording.paths.insert(read.path).second)
+                recording.reads.push_back(read);
+        }
+    }
+
+    void Memoizer::read(const Node& variable, Variable store) {
+        Read read;
+        // Keys computed as the template renders can't be looked up again; what they index into is read as a whole.
+        for (auto& child : variable.children) {
+            if (child->type || (child->variant.type != Variant::Type::STRING && child->variant.type != Variant::Type::INT))
+                break;
+            read.keys.push_back(child->variant);
+            read.path.append(child->variant.type == Variant::Type::INT ? "[" + std::to_string(child->variant.i) + "]" : "." + child->variant.s);
+        }
+        bool known = true;
+        for (auto& recording : recordings) {
+            if (recording.store.pointer == store.pointer && !recording.paths.count(read.path))
+                known = false;
+        }
+        if (known)
+            return;
+        Variable value = store;
+        bool found = resolve(value, read.keys);
+        read.hash = initialHash;
+        if (read.keys.empty() || !hash(read.hash, value, found)) {
+            for (auto& recording : recordings) {
+                if (recording.store.pointer == store.pointer)
+                    recording.tainted = true;
+            }
+            return;
+        }
+        record(read, store);
+    }
+
+    void Memoizer::drop(const std::string& key, size_t depth) {
+        for (auto& recording : recordings) {
+            auto it = recording.drops.find(key);
+            if (depth <= (it != recording.drops.end() ? it->second : 0))
+                recording.tainted = true;
+        }
+    }
+
+    void Memoizer::erase(std::list<Entry>::iterator it) {
+        auto& variants = sites[it->site].variants;
+        variants.erase(std::find(variants.begin(), variants.end(), it));
+        currentSize -= it->size;
+        entries.erase(it);
+    }
+
+    void Memoizer::clear() {
+        entries.clear();
+        sites.clear();
+        currentSize = 0;
+    }
+
+    Node Memoizer::render(const Node& node, Variable store) {
+        long long id = node.children[0]->variant.i;
+        const Node& subtree = *node.children[1].get();
+        Site& site = sites[id];
+        if (site.abandoned)
+            return renderer.retrieveRenderedNode(subtree, store);
+        for (size_t i = 0; i < site.variants.size(); ++i) {
+            auto it = site.variants[i];
+            if (matches(*it, store)) {
+                ++hits;
+                ++site.hits;
+                entries.splice(entries.begin(), entries, it);
+                std::rotate(site.variants.begin(), site.variants.begin() + i, site.variants.begin() + i + 1);
+                // Whatever's being recorded around the subtree depends on what it read.
+                for (auto& read : it->reads) {
+                    record(read, store);
+                    renderer.recordRead(read.keys, store);
+                }
+                return Variant(it->output);
+            }
+        }
+        ++misses;
+        ++site.misses;
+        if (site.misses >= site.hits + maximumMisses) {
+            site.abandoned = true;
+            while (!site.variants.empty())
+                erase(site.variants.back());
+            return renderer.retrieveRenderedNode(subtree, store);
+        }
+
+        recordings.emplace_back();
+        recordings.back().store = store;
+        for (auto& drop : renderer.internalDrops)
+            recordings.back().drops.emplace(drop.first, drop.second.size());
+        Node result = renderer.retrieveRenderedNode(subtree, store);
+        Recording recording = std::move(recordings.back());
+        recordings.pop_back();
+
+        // What makes a subtree unsuitable, like reading a loop's variable, doesn't change from one render to the next.
+        if (recording.tainted) {
+            site.abandoned = true;
+            while (!site.variants.empty())
+                erase(site.variants.back());
+            return result;
+        }
+        if (renderer.error != LIQUID_RENDERER_ERROR_TYPE_NONE || result.type || result.variant.type != Variant::Type::STRING)
+            return result;
+        size_t size = sizeof(Entry) + result.variant.s.size();
+        for (auto& read : recording.reads)
+            size += sizeof(Read) + read.path.size() + read.keys.size() * sizeof(Variant);
+        if (size > maximumSize)
+            return result;
+        if (site.variants.size() >= maximumVariants)
+            erase(site.variants.back());
+        entries.push_front({ id, std::move(recording.reads), result.variant.s, size });
+        site.variants.insert(site.variants.begin(), entries.begin());
+        currentSize += size;
+        while (currentSize > maximumSize)
+            erase(std::prev(entries.end()));
+        return result;
+    }
+}
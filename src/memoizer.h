@@ -0,0 +1,83 @@
+#ifndef LIQUIDMEMOIZER_H
+#define LIQUIDMEMOIZER_H
+
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "common.h"
+
+namespace Liquid {
+
+    struct Renderer;
+
+    // Replays the output of subtrees wrapped by Optimizer::memoize when everything they read from the store is as it was when they were
+    // recorded. A render that misses records the path of each variable the subtree reads, and a hash of its value; arrays are hashed
+    // element by element, dictionaries by address and version, so values that contain dictionaries can only be kept if the resolver has
+    // getVersion. Subtrees that read anything else, like the variable of a loop outside of them, aren't kept. Only applies to renders of
+    // the tree; compiled programs render wrapped subtrees as they are.
+    struct Memoizer {
+        Renderer& renderer;
+        // In bytes, of kept output and paths; the least recently used are dropped beyond it.
+        size_t maximumSize;
+        // How many different sets of inputs are kept for each subtree.
+        size_t maximumVariants = 4;
+        // Subtrees that miss this many more times than they hit aren't recorded anymore; their inputs vary too much to be worth it.
+        unsigned int maximumMisses = 16;
+        unsigned int hits = 0;
+        unsigned int misses = 0;
+
+        // Renders through the renderer are memoized for as long as this lives.
+        Memoizer(Renderer& renderer, size_t maximumSize = 16*1024*1024);
+        ~Memoizer();
+
+        Node render(const Node& node, Variable store);
+        // Called by the renderer while recording; for every variable it looks up from the root of a store, and every internal drop it finds.
+        void read(const Node& variable, Variable store);
+        void drop(const std::string& key, size_t depth);
+        bool isRecording() const { return !recordings.empty(); }
+        size_t size() const { return currentSize; }
+        void clear();
+
+    protected:
+        struct Read {
+            // The keys, as one string.
+            std::string path;
+            std::vector<Variant> keys;
+            unsigned long long hash;
+        };
+        struct Entry {
+            long long site;
+            std::vector<Read> reads;
+            std::string output;
+            size_t size;
+        };
+        struct Site {
+            std::vector<std::list<Entry>::iterator> variants;
+            unsigned int hits = 0;
+            unsigned int misses = 0;
+            bool abandoned = false;
+        };
+        struct Recording {
+            Variable store;
+            std::vector<Read> reads;
+            std::unordered_set<std::string> paths;
+            // How deep each internal drop was when recording started; those found no deeper were pushed outside the subtree.
+            std::unordered_map<std::string, size_t> drops;
+            bool tainted = false;
+        };
+
+        std::list<Entry> entries;
+        std::unordered_map<long long, Site> sites;
+        std::vector<Recording> recordings;
+        size_t currentSize = 0;
+
+        bool hash(unsigned long long& hash, Variable variable, bool found);
+        bool resolve(Variable& variable, const std::vector<Variant>& keys);
+        bool matches(const Entry& entry, Variable store);
+        void record(const Read& read, Variable store);
+        void erase(std::list<Entry>::iterator it);
+    };
+}
+
+#endif
@@ -1,5 +1,11 @@
 #include "optimizer.h"
 #include "renderer.h"
+#include "context.h"
+#include "analyzer.h"
+#include <atomic>
+#include <unordered_set>
+#include <unordered_map>
+#include <algorithm>
 
 namespace Liquid {
 
@@ -26,11 +32,676 @@ namespace Liquid {
             }
         }
 
+        // Types that depend on the time, or have effects, would fold to what they were when optimized, not when rendered.
+        if (!ast.type->isRepeatable())
+            return;
         if (hasAnyNonRendered) {
             if (ast.type->optimization == LIQUID_OPTIMIZATION_SCHEME_PARTIAL)
                 ast.type->optimize(*this, ast, store);
-        } else if (ast.type->optimization != LIQUID_OPTIMIZATION_SCHEME_NONE) {
+        } else {
             ast.type->optimize(*this, ast, store);
         }
     }
+
+    struct HoistState {
+        struct Loop {
+            std::string variable;
+            std::vector<std::unique_ptr<Node>> hoisted;
+            // Whether its body has a tag that may write anything, as it hasn't said what it does; nothing's moved out of it.
+            bool opaque;
+        };
+        const Context& context;
+        std::unordered_set<std::string> assigned;
+        std::vector<Loop> loops;
+        unsigned int& counter;
+        int moved = 0;
+    };
+
+    // Loops are tags whose first argument is "variable in sequence", and whose body is their second child.
+    static bool isLoop(const Node& node) {
+        if (!node.type || node.type->type != NodeType::Type::TAG || node.children.size() < 2 || !node.children[0]->type || node.children[0]->type->type != NodeType::Type::ARGUMENTS || node.children[0]->children.empty())
+            return false;
+        const Node& in = *node.children[0]->children[0].get();
+        return in.type && in.type->type == NodeType::Type::OPERATOR && in.type->symbol == "in" && in.children.size() == 2 && in.children[0]->type && in.children[0]->type->type == NodeType::Type::VARIABLE &&
+            !in.children[0]->children.empty() && !in.children[0]->children[0]->type;
+    }
+
+    // Whether the tag hasn't said what it does, so may write to any variable, named in its arguments or not. Intermediates, like for's
+    // else, are rendered by their tag, and break and continue only stop an iteration.
+    static bool writesUnknown(const Context& context, const Node& node) {
+        if (!node.type || node.type->type != NodeType::Type::TAG || node.type->effects != LIQUID_EFFECT_UNKNOWN || context.getTagType(node.type->symbol) != node.type)
+            return false;
+        return node.type != context.getTagType("break") && node.type != context.getTagType("continue");
+    }
+
+    static bool hasUnknownWrites(const Context& context, const Node& node) {
+        bool unknown = false;
+        node.walk([&context, &unknown](const Node& child) {
+            if (writesUnknown(context, child))
+                unknown = true;
+        });
+        return unknown;
+    }
+
+    // The number of enclosing loops, counting from the outermost, whose variables the expression refers to; 0 if it's invariant in all of
+    // them, or -1 if it can't be moved at all.
+    static int getLoopDependency(const HoistState& state, const Node& node) {
+        if (!node.type)
+            return 0;
+        int depth = 0;
+        switch (node.type->type) {
+            case NodeType::Type::VARIABLE: {
+                if (node.children.empty() || node.children[0]->type || node.children[0]->variant.type != Variant::Type::STRING)
+                    return -1;
+                const std::string& name = node.children[0]->variant.s;
+                if (state.assigned.count(name))
+                    return -1;
+                if (name == "forloop")
+                    depth = state.loops.size();
+                for (size_t i = state.loops.size(); i > 0 && depth == 0; --i) {
+                    if (state.loops[i - 1].variable == name)
+                        depth = i;
+                }
+            } break;
+            case NodeType::Type::GROUP:
+            case NodeType::Type::GROUP_DEREFERENCE:
+            case NodeType::Type::ARRAY_LITERAL:
+            case NodeType::Type::ARGUMENTS:
+            break;
+            case NodeType::Type::FILTER:
+            case NodeType::Type::DOT_FILTER:
+            case NodeType::Type::OPERATOR:
+                if (!node.type->isRepeatable() || node.type->optimization == LIQUID_OPTIMIZATION_SCHEME_SHIELD ||
+                    node.type == state.context.getConcatenationNodeType() || node.type == state.context.getHoistedNodeType())
+                    return -1;
+            break;
+            default:
+                return -1;
+        }
+        for (auto& child : node.children) {
+            int childDepth = getLoopDependency(state, *child.get());
+            if (childDepth == -1)
+                return -1;
+            depth = std::max(depth, childDepth);
+        }
+        return depth;
+    }
+
+    static void hoistNode(HoistState& state, Node& node) {
+        if (!node.type)
+            return;
+        if (isLoop(node)) {
+            // The loop's own arguments, and else branch, are evaluated once per entry; only the body is repeated.
+            state.loops.push_back({ node.children[0]->children[0]->children[0]->children[0]->variant.s, { }, hasUnknownWrites(state.context, *node.children[1].get()) });
+            hoistNode(state, *node.children[1].get());
+            HoistState::Loop loop = std::move(state.loops.back());
+            state.loops.pop_back();
+            for (size_t i = 2; i < node.children.size(); ++i)
+                hoistNode(state, *node.children[i].get());
+            if (!loop.hoisted.empty()) {
+                Node wrapper(state.context.getHoistingNodeType());
+                wrapper.line = node.line;
+                wrapper.column = node.column;
+                wrapper.children = std::move(loop.hoisted);
+                wrapper.children.push_back(std::make_unique<Node>(std::move(node)));
+                node = std::move(wrapper);
+            }
+            return;
+        }
+        NodeType::Type type = node.type->type;
+        if (!state.loops.empty() && (type == NodeType::Type::FILTER || type == NodeType::Type::DOT_FILTER || type == NodeType::Type::OPERATOR)) {
+            int depth = getLoopDependency(state, node);
+            // A loop around one that's opaque is too; so it's moved out of as many as aren't, if any.
+            while (depth != -1 && depth < (int)state.loops.size() && state.loops[depth].opaque)
+                ++depth;
+            if (depth != -1 && depth < (int)state.loops.size()) {
+                Node hoisted(state.context.getHoistedNodeType());
+                hoisted.line = node.line;
+                hoisted.column = node.column;
+                hoisted.children.push_back(std::make_unique<Node>(Variant("#" + std::to_string(++state.counter))));
+                hoisted.children.push_back(std::make_unique<Node>(std::move(node)));
+                state.loops[depth].hoisted.push_back(std::make_unique<Node>(hoisted));
+                node = std::move(hoisted);
+                ++state.moved;
+                return;
+            }
+        }
+        for (auto& child : node.children) {
+            if (child)
+                hoistNode(state, *child.get());
+        }
+    }
+
+    int Optimizer::hoist(Node& ast) {
+        HoistState state = { renderer.context, { }, { }, hoisted };
+        // Anything named in the arguments of a tag that writes to the store, like assign, capture or increment, may change as the template renders.
+        ast.walk([&state](const Node& node) {
+            if (node.type && node.type->type == NodeType::Type::TAG && (node.type->effects & LIQUID_EFFECT_WRITES_STORE) && !node.children.empty() && node.children[0]->type) {
+                node.children[0]->walk([&state](const Node& argument) {
+                    if (argument.type && argument.type->type == NodeType::Type::VARIABLE && !argument.children.empty() && !argument.children[0]->type)
+                        state.assigned.insert(argument.children[0]->getString());
+                });
+            }
+        });
+        hoistNode(state, ast);
+        return state.moved;
+    }
+
+    struct SharingState {
+        struct Loop {
+            std::string variable;
+            const Node* node;
+        };
+        struct Shared {
+            std::unordered_set<std::string> reads;
+            const Node* region;
+            int uses;
+        };
+        const Context& context;
+        std::vector<Loop> loops;
+        // By region, then signature; occurrences, when counting, then keys, when replacing.
+        std::unordered_map<std::string, int> occurrences;
+        std::unordered_map<std::string, std::string> keys;
+        std::unordered_map<std::string, Shared> shared;
+        unsigned int& counter;
+        bool replacing;
+    };
+
+    // Appends a description of the expression that's the same for all expressions that evaluate alike; false if it isn't one that can be
+    // shared. Collects the names of the variables it reads, and whether it calls a filter at all; operators alone are cheaper to evaluate
+    // than to look up.
+    static bool getSignature(const SharingState& state, const Node& node, std::string& signature, std::unordered_set<std::string>& reads, bool& filtered) {
+        if (!node.type) {
+            std::string value;
+            switch (node.variant.type) {
+                case Variant::Type::NIL: break;
+                case Variant::Type::BOOL:
+                case Variant::Type::INT:
+                case Variant::Type::FLOAT:
+                case Variant::Type::STRING:
+                    value = node.variant.getString();
+                break;
+                default:
+                    return false;
+            }
+            signature.append("l" + std::to_string((int)node.variant.type) + ":" + std::to_string(value.size()) + ":");
+            signature.append(value);
+            return true;
+        }
+        switch (node.type->type) {
+            case NodeType::Type::VARIABLE:
+                if (node.children.empty() || node.children[0]->type || node.children[0]->variant.type != Variant::Type::STRING)
+                    return false;
+                reads.insert(node.children[0]->variant.s);
+            break;
+            case NodeType::Type::GROUP:
+            case NodeType::Type::GROUP_DEREFERENCE:
+            case NodeType::Type::ARRAY_LITERAL:
+            case NodeType::Type::ARGUMENTS:
+            break;
+            case NodeType::Type::FILTER:
+            case NodeType::Type::DOT_FILTER:
+            case NodeType::Type::OPERATOR:
+                if (node.type->type != NodeType::Type::OPERATOR)
+                    filtered = true;
+                if (!node.type->isRepeatable() || node.type->optimization == LIQUID_OPTIMIZATION_SCHEME_SHIELD || node.type == state.context.getConcatenationNodeType())
+                    return false;
+            break;
+            default:
+                return false;
+        }
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "t%p:%d(", (const void*)node.type, (int)node.children.size());
+        signature.append(buffer);
+        for (auto& child : node.children) {
+            if (!child || !getSignature(state, *child.get(), signature, reads, filtered))
+                return false;
+        }
+        signature.append(")");
+        return true;
+    }
+
+    static bool isSharingCandidate(const Node& node) {
+        return node.type && (node.type->type == NodeType::Type::FILTER || node.type->type == NodeType::Type::DOT_FILTER || node.type->type == NodeType::Type::OPERATOR);
+    }
+
+    static void shareNode(SharingState& state, Node& node);
+
+    static void shareChildren(SharingState& state, Node& node, size_t start = 0) {
+        for (size_t i = start; i < node.children.size(); ++i) {
+            if (node.children[i])
+                shareNode(state, *node.children[i].get());
+        }
+    }
+
+    static void shareNode(SharingState& state, Node& node) {
+        if (!node.type)
+            return;
+        if (isLoop(node)) {
+            // The sequence is evaluated outside of the loop; its qualifiers are left alone.
+            shareNode(state, *node.children[0]->children[0]->children[1].get());
+            state.loops.push_back({ node.children[0]->children[0]->children[0]->children[0]->variant.s, &node });
+            shareNode(state, *node.children[1].get());
+            state.loops.pop_back();
+            shareChildren(state, node, 2);
+            return;
+        }
+        if (node.type->type == NodeType::Type::TAG) {
+            if (!node.children.empty() && node.children[0]->type && node.children[0]->type->type == NodeType::Type::ARGUMENTS) {
+                // Only the value that's assigned, of what's written to.
+                const Node& arguments = *node.children[0].get();
+                if ((node.type->effects & LIQUID_EFFECT_WRITES_STORE) && arguments.children.size() == 1 && arguments.children[0]->type &&
+                    arguments.children[0]->type->type == NodeType::Type::OPERATOR && (arguments.children[0]->type->effects & LIQUID_EFFECT_WRITES_STORE) &&
+                    arguments.children[0]->children.size() == 2)
+                    shareNode(state, *arguments.children[0]->children[1].get());
+                else if (node.type->isRepeatable())
+                    shareNode(state, *node.children[0].get());
+                shareChildren(state, node, 1);
+            } else
+                shareChildren(state, node);
+            return;
+        }
+        if (isSharingCandidate(node)) {
+            std::string signature;
+            std::unordered_set<std::string> reads;
+            bool filtered = false;
+            if (getSignature(state, node, signature, reads, filtered) && filtered) {
+                // The innermost loop whose variable it refers to; if none, the whole template.
+                const Node* region = nullptr;
+                for (size_t i = state.loops.size(); i > 0 && !region; --i) {
+                    if (reads.count(state.loops[i - 1].variable) || reads.count("forloop"))
+                        region = state.loops[i - 1].node;
+                }
+                char buffer[32];
+                snprintf(buffer, sizeof(buffer), "%p:", (const void*)region);
+                signature.insert(0, buffer);
+                if (!state.replacing)
+                    ++state.occurrences[signature];
+                else if (state.occurrences[signature] > 1) {
+                    auto it = state.keys.find(signature);
+                    if (it == state.keys.end()) {
+                        it = state.keys.emplace(signature, "#" + std::to_string(++state.counter)).first;
+                        state.shared[it->second] = { std::move(reads), region, 0 };
+                    }
+                    ++state.shared[it->second].uses;
+                    Node hoisted(state.context.getHoistedNodeType());
+                    hoisted.line = node.line;
+                    hoisted.column = node.column;
+                    hoisted.children.push_back(std::make_unique<Node>(Variant(it->second)));
+                    hoisted.children.push_back(std::make_unique<Node>(std::move(node)));
+                    node = std::move(hoisted);
+                    return;
+                }
+            }
+        }
+        shareChildren(state, node);
+    }
+
+    static void wrap(Node& node, const NodeType* type, const std::vector<std::string>& keys) {
+        Node wrapper(type);
+        wrapper.line = node.line;
+        wrapper.column = node.column;
+        for (auto& key : keys)
+            wrapper.children.push_back(std::make_unique<Node>(Variant(key)));
+        wrapper.children.push_back(std::make_unique<Node>(std::move(node)));
+        node = std::move(wrapper);
+    }
+
+    // Unshares expressions left with a single occurrence, because another occurrence was part of a larger shared expression. Then places
+    // the shared values in their regions, and clears them after each tag that may change them.
+    static void placeShared(SharingState& state, Node& node) {
+        if (!node.type)
+            return;
+        if (node.type == state.context.getHoistedNodeType()) {
+            auto it = state.shared.find(node.children[0]->variant.s);
+            if (it != state.shared.end() && it->second.uses == 1) {
+                std::unique_ptr<Node> expression = std::move(node.children[1]);
+                node = std::move(*expression.get());
+                it->second.uses = 0;
+            }
+            return;
+        }
+        for (auto& child : node.children) {
+            if (child)
+                placeShared(state, *child.get());
+        }
+        if (isLoop(node)) {
+            std::vector<std::string> keys;
+            for (auto& shared : state.shared) {
+                if (shared.second.region == &node && shared.second.uses > 1)
+                    keys.push_back(shared.first);
+            }
+            if (!keys.empty()) {
+                std::sort(keys.begin(), keys.end());
+                wrap(*node.children[1].get(), state.context.getSharingNodeType(), keys);
+            }
+            return;
+        }
+        bool unknown = writesUnknown(state.context, node);
+        if (!unknown && (node.type->type != NodeType::Type::TAG || !(node.type->effects & LIQUID_EFFECT_WRITES_STORE)))
+            return;
+        // Otherwise, tags with no arguments and no body write nothing.
+        if (!unknown && node.children.size() <= 1 && (node.children.empty() || node.children[0]->children.empty()))
+            return;
+        std::unordered_set<std::string> written;
+        if (!unknown && node.children[0]->type) {
+            node.children[0]->walk([&written](const Node& argument) {
+                if (argument.type && argument.type->type == NodeType::Type::VARIABLE && !argument.children.empty() && !argument.children[0]->type)
+                    written.insert(argument.children[0]->getString());
+            });
+        }
+        std::vector<std::string> keys;
+        for (auto& shared : state.shared) {
+            if (shared.second.uses < 2)
+                continue;
+            bool reads = unknown;
+            for (auto it = written.begin(); it != written.end() && !reads; ++it)
+                reads = shared.second.reads.count(*it) > 0;
+            if (reads)
+                keys.push_back(shared.first);
+        }
+        if (!keys.empty()) {
+            std::sort(keys.begin(), keys.end());
+            wrap(node, state.context.getInvalidatingNodeType(), keys);
+        }
+    }
+
+    int Optimizer::eliminateCommonSubexpressions(Node& ast) {
+        SharingState state = { renderer.context, { }, { }, { }, { }, hoisted, false };
+        shareNode(state, ast);
+        state.replacing = true;
+        shareNode(state, ast);
+        placeShared(state, ast);
+        int shared = 0;
+        std::vector<std::string> rootKeys;
+        for (auto& entry : state.shared) {
+            if (entry.second.uses > 1) {
+                shared += entry.second.uses;
+                if (!entry.second.region)
+                    rootKeys.push_back(entry.first);
+            }
+        }
+        if (!rootKeys.empty()) {
+            std::sort(rootKeys.begin(), rootKeys.end());
+            wrap(ast, renderer.context.getSharingNodeType(), rootKeys);
+        }
+        return shared;
+    }
+
+    struct Iteration {
+        const std::string& variable;
+        const Variant& element;
+        long long idx;
+        long long length;
+    };
+
+    static bool isLoopReference(const Node& node, const std::string& name) {
+        return node.type && node.type->type == NodeType::Type::VARIABLE && !node.children.empty() && !node.children[0]->type &&
+            node.children[0]->variant.type == Variant::Type::STRING && node.children[0]->variant.s == name;
+    }
+
+    static bool isForloopProperty(const std::string& property) {
+        return property == "index" || property == "index0" || property == "rindex" || property == "rindex0" || property == "first" || property == "last" || property == "length";
+    }
+
+    static bool isDropDotFilter(const Node& node) {
+        return node.type->type == NodeType::Type::DOT_FILTER && (node.type->symbol == "first" || node.type->symbol == "last") && node.children.size() == 1 &&
+            node.children[0]->type && node.children[0]->type->type == NodeType::Type::VARIABLE && node.children[0]->children.size() == 1;
+    }
+
+    // Whether every reference to the loop, within its body, can be replaced with a constant; forloop only refers to this loop outside of
+    // nested ones.
+    static bool isUnrollable(const Node& node, const std::string& variable, bool outer) {
+        if (!node.type)
+            return true;
+        switch (node.type->type) {
+            case NodeType::Type::TAG:
+                if (node.type->effects == LIQUID_EFFECT_UNKNOWN)
+                    return false;
+                if ((node.type->effects & LIQUID_EFFECT_WRITES_STORE) && !node.children.empty()) {
+                    bool writesVariable = false;
+                    node.children[0]->walk([&variable, &writesVariable](const Node& argument) {
+                        if (isLoopReference(argument, variable))
+                            writesVariable = true;
+                    });
+                    if (writesVariable)
+                        return false;
+                }
+                if (isLoop(node)) {
+                    if (node.children[0]->children[0]->children[0]->children[0]->variant.s == variable)
+                        return false;
+                    for (size_t i = 0; i < node.children.size(); ++i) {
+                        if (!isUnrollable(*node.children[i].get(), variable, outer && i != 1))
+                            return false;
+                    }
+                    return true;
+                }
+            break;
+            case NodeType::Type::DOT_FILTER:
+                // The first and last dot filters ask internal drops directly; forloop answers, the loop variable ignores them.
+                if (isDropDotFilter(node)) {
+                    if (isLoopReference(*node.children[0].get(), variable))
+                        return false;
+                    if (outer && isLoopReference(*node.children[0].get(), "forloop"))
+                        return true;
+                }
+            break;
+            case NodeType::Type::VARIABLE:
+                if (isLoopReference(node, variable))
+                    return node.children.size() == 1;
+                if (isLoopReference(node, "forloop") && outer)
+                    return node.children.size() == 2 && !node.children[1]->type && isForloopProperty(node.children[1]->getString());
+            break;
+            default:
+            break;
+        }
+        for (auto& child : node.children) {
+            if (child && !isUnrollable(*child.get(), variable, outer))
+                return false;
+        }
+        return true;
+    }
+
+    static void substituteIteration(const Iteration& iteration, Node& node, bool outer) {
+        if (!node.type)
+            return;
+        if (isLoopReference(node, iteration.variable)) {
+            node = Node(Variant(iteration.element));
+            return;
+        }
+        if (outer && (isLoopReference(node, "forloop") || (isDropDotFilter(node) && isLoopReference(*node.children[0].get(), "forloop")))) {
+            // As ForNode renders them.
+            const std::string property = node.type->type == NodeType::Type::DOT_FILTER ? node.type->symbol : node.children[1]->getString();
+            if (property == "index0")
+                node = Node(Variant(iteration.idx));
+            else if (property == "index")
+                node = Node(Variant(iteration.idx + 1));
+            else if (property == "rindex")
+                node = Node(Variant(iteration.length - (iteration.idx + 1)));
+            else if (property == "rindex0")
+                node = Node(Variant(iteration.length - iteration.idx));
+            else if (property == "first")
+                node = Node(Variant(iteration.idx == 0));
+            else if (property == "last")
+                node = Node(Variant(iteration.idx == iteration.length - 1));
+            else
+                node = Node(Variant(iteration.length));
+            return;
+        }
+        bool loop = isLoop(node);
+        for (size_t i = 0; i < node.children.size(); ++i) {
+            if (node.children[i])
+                substituteIteration(iteration, *node.children[i].get(), outer && !(loop && i == 1));
+        }
+    }
+
+    // Evaluates a sequence made up only of literals, operators and filters; false if it refers to anything else.
+    static bool getConstantSequence(Renderer& renderer, const Node& node, Node& sequence) {
+        bool constant = true;
+        node.walk([&constant](const Node& child) {
+            if (child.type && (child.type->type == NodeType::Type::VARIABLE || child.type->type == NodeType::Type::TAG || !child.type->isRepeatable()))
+                constant = false;
+        });
+        if (!constant)
+            return false;
+        sequence = renderer.retrieveRenderedNode(node, Variable());
+        if (sequence.type || sequence.variant.type != Variant::Type::ARRAY)
+            return false;
+        for (auto& element : sequence.variant.a) {
+            if (element.type == Variant::Type::ARRAY || element.type == Variant::Type::STRING_VIEW || element.type == Variant::Type::VARIABLE || element.type == Variant::Type::POINTER)
+                return false;
+        }
+        return true;
+    }
+
+    static bool unrollLoop(Optimizer& optimizer, Node& node) {
+        if (!isLoop(node) || node.type->symbol != "for")
+            return false;
+        const Node& arguments = *node.children[0].get();
+        const std::string& variable = arguments.children[0]->children[0]->children[0]->variant.s;
+        if (arguments.children[0]->children[0]->children.size() != 1)
+            return false;
+        bool reversed = false;
+        long long start = 0, limit = -1;
+        bool hasLimit = false;
+        for (size_t i = 1; i < arguments.children.size(); ++i) {
+            const Node& qualifier = *arguments.children[i].get();
+            if (!qualifier.type || qualifier.type->type != NodeType::Type::QUALIFIER)
+                return false;
+            if (qualifier.type->symbol == "reversed") {
+                reversed = true;
+                continue;
+            }
+            if (qualifier.children.size() != 1 || qualifier.children[0]->type || !qualifier.children[0]->variant.isNumeric())
+                return false;
+            if (qualifier.type->symbol == "limit") {
+                limit = qualifier.children[0]->variant.getInt();
+                hasLimit = true;
+            } else if (qualifier.type->symbol == "offset")
+                start = std::max(qualifier.children[0]->variant.getInt(), 0LL);
+            else
+                return false;
+        }
+        Node sequence;
+        if (!getConstantSequence(optimizer.renderer, *arguments.children[0]->children[1].get(), sequence))
+            return false;
+        long long length = sequence.variant.a.size();
+        if (!hasLimit)
+            limit = length;
+        else if (limit < 0)
+            limit = std::max(limit + length, 0LL);
+        long long end = std::min(limit + start - 1, length - 1);
+        long long iterations = std::max(end - start + 1, 0LL);
+        if (iterations > (long long)optimizer.maximumUnrolledIterations || !isUnrollable(*node.children[1].get(), variable, true))
+            return false;
+
+        Node unrolled(optimizer.renderer.context.getConcatenationNodeType());
+        unrolled.line = node.line;
+        unrolled.column = node.column;
+        for (long long i = 0; i < iterations; ++i) {
+            Iteration iteration = { variable, sequence.variant.a[reversed ? end - i : start + i], start + i, length };
+            auto body = std::make_unique<Node>(*node.children[1].get());
+            substituteIteration(iteration, *body.get(), true);
+            unrolled.children.push_back(std::move(body));
+        }
+        // ForNode only renders its else branch if it started at the beginning.
+        if (iterations == 0 && start == 0 && node.children.size() >= 4)
+            unrolled.children.push_back(std::move(node.children[3]));
+        node = std::move(unrolled);
+        return true;
+    }
+
+    int Optimizer::unroll(Node& ast) {
+        if (!ast.type)
+            return 0;
+        int unrolled = 0;
+        for (auto& child : ast.children) {
+            if (child)
+                unrolled += unroll(*child.get());
+        }
+        if (unrollLoop(*this, ast))
+            ++unrolled;
+        return unrolled;
+    }
+
+    // Whether the subtree renders the same for the same store, reading it only through variables, and changes nothing; the wrappers the
+    // optimizer places are as pure as what they wrap.
+    static bool isMemoizable(const Node& node, bool argument = false) {
+        if (!node.type)
+            return true;
+        switch (node.type->type) {
+            // Structure, and what's read from the store, which the memoizer tracks itself.
+            case NodeType::Type::VARIABLE:
+            case NodeType::Type::GROUP:
+            case NodeType::Type::GROUP_DEREFERENCE:
+            case NodeType::Type::ARRAY_LITERAL:
+            case NodeType::Type::ARGUMENTS:
+            case NodeType::Type::QUALIFIER:
+            break;
+            default: {
+                // Shielded operators in a tag's arguments, like for's in, are rendered by the tag.
+                bool rendered = dynamic_cast<const WrapperNodeType*>(node.type) || (argument && node.type->type == NodeType::Type::OPERATOR &&
+                    node.type->optimization == LIQUID_OPTIMIZATION_SCHEME_SHIELD);
+                if (!rendered && node.type->effects != LIQUID_EFFECT_PURE)
+                    return false;
+            } break;
+        }
+        for (auto& child : node.children) {
+            if (child && !isMemoizable(*child.get(), node.type->type == NodeType::Type::ARGUMENTS))
+                return false;
+        }
+        return true;
+    }
+
+    static long long getNextMemoizedId() {
+        static std::atomic<long long> memoized(0);
+        return ++memoized;
+    }
+
+    static int memoizeNode(Optimizer& optimizer, Node& node) {
+        const Context& context = optimizer.renderer.context;
+        if (!node.type || node.type == context.getMemoizingNodeType())
+            return 0;
+        int memoized = 0;
+        // Only the elements of a body can be replaced by their output; arguments, and the intermediates of a tag, like else, can't.
+        bool body = node.type == context.getConcatenationNodeType();
+        for (auto& child : node.children) {
+            if (!child)
+                continue;
+            if (body && child->type && (child->type->type == NodeType::Type::TAG || child->type->type == NodeType::Type::OUTPUT) && isMemoizable(*child.get())) {
+                CostAnalyzer analyzer;
+                if (analyzer.analyze(*child.get()).total >= optimizer.minimumMemoizedCost) {
+                    Node wrapper(context.getMemoizingNodeType());
+                    wrapper.line = child->line;
+                    wrapper.column = child->column;
+                    wrapper.children.push_back(std::make_unique<Node>(Variant(getNextMemoizedId())));
+                    wrapper.children.push_back(std::make_unique<Node>(std::move(*child.get())));
+                    *child.get() = std::move(wrapper);
+                    ++memoized;
+                    continue;
+                }
+            }
+            memoized += memoizeNode(optimizer, *child.get());
+        }
+        return memoized;
+    }
+
+    int Optimizer::memoize(Node& ast) {
+        return memoizeNode(*this, ast);
+    }
+
+    int Optimizer::rewrite(Node& ast) {
+        if (!ast.type)
+            return 0;
+        int rewritten = 0;
+        // A dispatch's tag has already been rewritten into it.
+        size_t children = dynamic_cast<const DispatchNodeType*>(ast.type) ? 1 : ast.children.size();
+        for (size_t i = 0; i < children; ++i) {
+            if (ast.children[i])
+                rewritten += rewrite(*ast.children[i].get());
+        }
+        if (ast.type->rewrite(*this, ast))
+            ++rewritten;
+        return rewritten;
+    }
 }
@@ -12,6 +12,41 @@ namespace Liquid {
 
         Optimizer(Renderer& renderer);
         void optimize(Node& ast, Variable store);
+        // Moves expressions that don't change from one iteration of a loop to the next out of the loop's body, so they're evaluated once,
+        // the first time the body reaches them, rather than once per element. Only expressions made up entirely of repeatable filters and operators are
+        // moved, and only if they don't refer to a loop variable, forloop, or anything the template assigns; each is moved out past as
+        // many loops as it's invariant in, so those invariant everywhere are evaluated once per render. Nothing is moved out of a loop
+        // whose body has a tag with unknown effects, as it may write anything. Returns the number moved.
+        int hoist(Node& ast);
+        // Replaces idioms in the tree with equivalents that do less work, as each node type's rewrite sees fit; like "sort | first", which
+        // needn't sort, or a case tag with many string whens, which needn't compare against each. Unlike optimize, needs no store. Returns
+        // the number of rewrites.
+        int rewrite(Node& ast);
+        // Evaluates expressions that occur more than once in a render only once. Occurrences of the same filter chain, made up entirely of
+        // repeatable filters and operators, share a value for the whole template, or for one iteration of the innermost loop whose variable
+        // they refer to. Tags that write to the store, like assign or capture, clear the values of those that read what they write, and
+        // tags with unknown effects clear them all. Returns the number of occurrences that share a value.
+        int eliminateCommonSubexpressions(Node& ast);
+        // Replaces for loops over constant sequences, like (1..4) or ['a', 'b'], that have no more than maximumUnrolledIterations
+        // iterations, with a copy of the body for each, in which the loop variable and forloop's properties are constants. Loops whose
+        // bodies contain tags with unknown effects, like break, cycle or include, or that assign to the loop variable, are left alone.
+        // Optimizing again afterwards folds what depended on them. Returns the number of loops unrolled.
+        int unroll(Node& ast);
+        // Wraps the tags and outputs of bodies that are pure, and that CostAnalyzer estimates at no less than minimumMemoizedCost, so that a
+        // Memoizer attached to the renderer can replay their output while what they read from the store stays the same; those whose inputs
+        // turn out to vary too much are left to render as they are. Should be the last pass applied. Returns the number wrapped.
+        int memoize(Node& ast);
+
+        size_t maximumUnrolledIterations = 16;
+        // Case tags, and if tags that compare one expression against a string in every branch, with at least this many branches, are
+        // rewritten to pick their branch by the string's hash.
+        size_t minimumDispatchBranches = 4;
+        // With every size at CostAnalyzer's default, this is about a loop over a hundred elements that outputs a few variables each.
+        double minimumMemoizedCost = 500;
+
+    protected:
+        // Gives each hoisted or shared expression a distinct key, even across templates.
+        unsigned int hoisted = 0;
     };
 }
 
@@ -33,13 +33,31 @@ namespace Liquid {
             parser.nodes.back() = move(qualifierNode);
         }
         if (parser.nodes.back()->type && parser.nodes.back()->type->type == NodeType::Type::QUALIFIER) {
-            if (static_cast<const TagNodeType::QualifierNodeType*>(parser.nodes.back()->type)->arity == TagNodeType::QualifierNodeType::Arity::NONARY) {
+            // Filter wildcard qualifiers always take an operand, and have no arity to check.
+            if (parser.nodes.back()->type != context.getFilterWildcardQualifierNodeType() && static_cast<const TagNodeType::QualifierNodeType*>(parser.nodes.back()->type)->arity == TagNodeType::QualifierNodeType::Arity::NONARY) {
                 parser.pushError(Parser::Error(*this, Parser::Error::Type::LIQUID_PARSER_ERROR_TYPE_UNEXPECTED_OPERAND, parser.nodes.back()->type->symbol));
                 return false;
             }
             parser.nodes.back()->children.push_back(nullptr);
             return true;
         }
+        // After a comma, a tag's unary qualifier reads as a variable until its colon; like {% cache key, ttl: 60 %}.
+        if (parser.nodes.size() >= 3 && parser.nodes.back()->type == context.getVariableNodeType() && parser.nodes.back()->children.size() == 1 && !parser.nodes.back()->children.front()->type) {
+            const Node& arguments = *parser.nodes[parser.nodes.size()-2].get();
+            const Node& tag = *parser.nodes[parser.nodes.size()-3].get();
+            if (arguments.type == context.getArgumentsNodeType() && tag.type && tag.type->type == NodeType::Type::TAG) {
+                auto& qualifiers = static_cast<const TagNodeType*>(tag.type)->qualifiers;
+                auto it = qualifiers.find(parser.nodes.back()->children.front()->variant.s);
+                if (it != qualifiers.end() && static_cast<const TagNodeType::QualifierNodeType*>(it->second.get())->arity == TagNodeType::QualifierNodeType::Arity::UNARY) {
+                    auto qualifierNode = make_unique<Node>(it->second.get());
+                    qualifierNode->line = parser.nodes.back()->line;
+                    qualifierNode->column = parser.nodes.back()->column;
+                    qualifierNode->children.push_back(nullptr);
+                    parser.nodes.back() = move(qualifierNode);
+                    return true;
+                }
+            }
+        }
         if (parser.nodes.back()->type != context.getVariableNodeType() || parser.nodes.back()->children.size() != 1) {
             parser.pushError(Parser::Error(*this, Parser::Error::Type::LIQUID_PARSER_ERROR_TYPE_INVALID_SYMBOL, ":"));
             return false;
@@ -348,6 +366,8 @@ namespace Liquid {
                                 op = static_cast<const FilterNodeType*>(context.getUnknownFilterNodeType());
                             }
                             auto operatorNode = make_unique<Node>(op);
+                            operatorNode->line = line;
+                            operatorNode->column = column;
                             if (unknown)
                                 operatorNode->children.push_back(make_unique<Node>(Variant(opName)));
                             auto& parentNode = parser.nodes[parser.nodes.size()-2];
@@ -653,6 +673,8 @@ namespace Liquid {
     }
 
     void Parser::unparse(const Node& node, string& target, Parser::State state) {
+        if (dynamic_cast<const WrapperNodeType*>(node.type))
+            return unparse(*node.children.back().get(), target, state);
         if (node.type) {
             switch (node.type->type) {
                 case Liquid::NodeType::Type::TAG: {
@@ -663,7 +685,7 @@ namespace Liquid {
                         bool latch = false;
                         for (auto& child : node.children[0]->children) {
                             target.push_back(' ');
-                            if (latch)
+                            if (latch && !(child->type && child->type->type == NodeType::Type::QUALIFIER))
                                 target.push_back(',');
                             unparse(*child.get(), target, Parser::State::ARGUMENT);
                             latch = true;
@@ -676,7 +698,7 @@ namespace Liquid {
                         bool latch = false;
                         for (auto& child : node.children[0]->children) {
                             target.push_back(' ');
-                            if (latch)
+                            if (latch && !(child->type && child->type->type == NodeType::Type::QUALIFIER))
                                 target.push_back(',');
                             unparse(*child.get(), target, Parser::State::ARGUMENT);
                             latch = true;
@@ -767,18 +789,36 @@ namespace Liquid {
                         target.append(" | ");
                         target.append(filterNodeType->symbol);
                     }
-                    if (node.children[offset+1]->children.size() > 0) {
+                    size_t arguments = node.children[offset+1]->children.size();
+                    const FilterNodeType::Fusion* fusion = dynamic_cast<const FilterNodeType::Fusion*>(filterNodeType);
+                    if (fusion) {
+                        arguments = std::min(arguments, fusion->chainArguments);
+                        while (arguments > 0 && !node.children[1]->children[arguments-1]->type && node.children[1]->children[arguments-1]->variant.type == Variant::Type::NIL)
+                            --arguments;
+                    }
+                    if (arguments > 0) {
                         target.append(": ");
-                        for (size_t i = 0; i < node.children[1]->children.size(); ++i) {
+                        for (size_t i = 0; i < arguments; ++i) {
                             if (i > 0)
                                 target.append(", ");
                             unparse(*node.children[1]->children[i].get(), target, Parser::State::ARGUMENT);
                         }
                     }
+                    if (fusion) {
+                        target.append(" | ");
+                        target.append(fusion->chained);
+                    }
                 } break;
                 case Liquid::NodeType::Type::CONTEXTUAL:
                     unparse(*node.children[1].get(), target, state);
                 break;
+                case Liquid::NodeType::Type::QUALIFIER:
+                    target.append(node.type->symbol);
+                    if (node.children.size() > 0 && node.children[0]) {
+                        target.append(": ");
+                        unparse(*node.children[0].get(), target, Parser::State::ARGUMENT);
+                    }
+                break;
                 default:
                     assert(false);
                 break;
@@ -1,6 +1,10 @@
 #include "renderer.h"
 #include "context.h"
 #include "cppvariable.h"
+#include "transpiler.h"
+#include "closure.h"
+#include "memoizer.h"
+#include <set>
 
 namespace Liquid {
     struct Context;
@@ -67,6 +71,89 @@ namespace Liquid {
         return accumulator;
     }
 
+    LiquidRendererErrorType Renderer::render(const std::string& name, const Node& ast, Variable store, void (*callback)(const char* chunk, size_t size, void* data), void* data) {
+        const TranspiledTemplate* transpiled = TranspiledTemplate::find(name);
+        if (!transpiled)
+            return render(ast, store, callback, data);
+        auto it = transpiledTrees.find(transpiled->id);
+        if (it == transpiledTrees.end()) {
+            it = transpiledTrees.emplace(transpiled->id, std::pair<std::unique_ptr<Node>, std::vector<const Node*>>()).first;
+            transpiled->getNodes(context, it->second.first, it->second.second);
+        }
+        if (!it->second.first)
+            return render(ast, store, callback, data);
+        const std::vector<const Node*>* nodes = &it->second.second;
+        string s;
+        if (internalRender) {
+            transpiled->function(*this, nodes->data(), store, s);
+        } else {
+            mode = Renderer::ExecutionMode::PARSE_TREE;
+            nodeContext = nullptr;
+            errors.clear();
+            unknownErrors.clear();
+            renderStartTime = std::chrono::system_clock::now();
+            currentMemoryUsage = 0;
+            currentRenderingDepth = 0;
+            error = Error::Type::LIQUID_RENDERER_ERROR_TYPE_NONE;
+            internalRender = true;
+            transpiled->function(*this, nodes->data(), store, s);
+            internalRender = false;
+        }
+        // The tree discards everything once an error's been hit.
+        if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+            s.clear();
+        callback(s.data(), s.size(), data);
+        return error;
+    }
+
+    string Renderer::render(const std::string& name, const Node& ast, Variable store) {
+        string accumulator;
+        LiquidRendererErrorType error = render(name, ast, store, +[](const char* chunk, size_t size, void* data){
+            string* accumulator = (string*)data;
+            accumulator->append(chunk, size);
+        }, &accumulator);
+        if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+            throw Error(error, Node());
+        return accumulator;
+    }
+
+    LiquidRendererErrorType Renderer::render(const Closure& closure, Variable store, void (*callback)(const char* chunk, size_t size, void* data), void* data) {
+        ExecutionMode previousMode = mode;
+        const Closure* previousClosure = this->closure;
+        if (!internalRender) {
+            nodeContext = nullptr;
+            errors.clear();
+            unknownErrors.clear();
+            renderStartTime = std::chrono::system_clock::now();
+            currentMemoryUsage = 0;
+            currentRenderingDepth = 0;
+            error = Error::Type::LIQUID_RENDERER_ERROR_TYPE_NONE;
+        }
+        bool wasInternalRender = internalRender;
+        internalRender = true;
+        mode = Renderer::ExecutionMode::CLOSURE;
+        this->closure = nullptr;
+        Node node = closure.evaluate(*this, store);
+        this->closure = previousClosure;
+        mode = previousMode;
+        internalRender = wasInternalRender;
+        assert(node.type == nullptr);
+        auto s = node.getString();
+        callback(s.data(), s.size(), data);
+        return error;
+    }
+
+    string Renderer::render(const Closure& closure, Variable store) {
+        string accumulator;
+        LiquidRendererErrorType error = render(closure, store, +[](const char* chunk, size_t size, void* data){
+            string* accumulator = (string*)data;
+            accumulator->append(chunk, size);
+        }, &accumulator);
+        if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+            throw Error(error, Node());
+        return accumulator;
+    }
+
     string Renderer::renderTrimmed(const Node& ast, Variable store) {
         string result = render(ast, store);
         int start,end;
@@ -77,10 +164,206 @@ namespace Liquid {
         return result.substr(start, end - start + 1);
     }
 
+    // Adds the keys at the root of the store that the subtree writes to, taken as the first variable in the arguments of each tag that
+    // writes, as with assign, capture and increment; false if it does anything else to the store, or beyond it.
+    static bool getWrites(const Context& context, const Node& node, std::unordered_set<std::string>& writes, bool argument = false) {
+        if (!node.type)
+            return true;
+        switch (node.type->type) {
+            case NodeType::Type::VARIABLE:
+            case NodeType::Type::GROUP:
+            case NodeType::Type::GROUP_DEREFERENCE:
+            case NodeType::Type::ARRAY_LITERAL:
+            case NodeType::Type::ARGUMENTS:
+            case NodeType::Type::QUALIFIER:
+            break;
+            default: {
+                // Shielded operators in a tag's arguments, like for's in, are rendered by the tag.
+                if (dynamic_cast<const WrapperNodeType*>(node.type) || (argument && node.type->type == NodeType::Type::OPERATOR &&
+                    node.type->optimization == LIQUID_OPTIMIZATION_SCHEME_SHIELD))
+                    break;
+                // The time is as of whenever the element was last rendered.
+                if (node.type->effects & ~(LIQUID_EFFECT_READS_TIME | LIQUID_EFFECT_READS_STORE | LIQUID_EFFECT_WRITES_STORE))
+                    return false;
+                if (node.type->effects & LIQUID_EFFECT_WRITES_STORE) {
+                    const Node* target = nullptr;
+                    if (node.type->type == NodeType::Type::TAG && !node.children.empty() && node.children[0]) {
+                        node.children[0]->walk([&context, &target](const Node& argument) {
+                            if (!target && argument.type == context.getVariableNodeType())
+                                target = &argument;
+                        });
+                    }
+                    if (!target || target->children.empty() || target->children[0]->type)
+                        return false;
+                    writes.insert(target->children[0]->getString());
+                }
+            } break;
+        }
+        for (auto& child : node.children) {
+            if (child && !getWrites(context, *child.get(), writes, node.type->type == NodeType::Type::ARGUMENTS))
+                return false;
+        }
+        return true;
+    }
+
+    // Whether a change under one path can be seen from the other.
+    static bool overlaps(const string& a, const string& b) {
+        size_t length = std::min(a.size(), b.size());
+        return a.compare(0, length, b, 0, length) == 0 && (a.size() == b.size() || (a.size() > length ? a[length] : b[length]) == '.');
+    }
+
+    void Renderer::recordRead(const std::vector<Variant>& keys, Variable store) {
+        if (!recordedSegment || store.pointer != dependencies.store.pointer)
+            return;
+        if (keys.empty()) {
+            recordedSegment->opaque = true;
+            return;
+        }
+        string path;
+        for (auto& key : keys) {
+            if (!path.empty())
+                path.push_back('.');
+            path.append(key.type == Variant::Type::INT ? std::to_string(key.i) : key.s);
+        }
+        recordedSegment->reads.insert(move(path));
+    }
+
+    string Renderer::rerender(const Node& ast, Variable store, const std::vector<std::string>& changedPaths) {
+        mode = Renderer::ExecutionMode::PARSE_TREE;
+        nodeContext = nullptr;
+        errors.clear();
+        unknownErrors.clear();
+        renderStartTime = std::chrono::system_clock::now();
+        currentMemoryUsage = 0;
+        currentRenderingDepth = 0;
+        error = Error::Type::LIQUID_RENDERER_ERROR_TYPE_NONE;
+        internalRender = true;
+
+        // Renders a segment, recording what it reads; false if its output can't be used as a part of the body's.
+        auto renderSegment = [this](size_t index, string& output) {
+            Dependencies::Segment& segment = dependencies.segments[index];
+            segment.reads.clear();
+            segment.opaque = false;
+            recordedSegment = &segment;
+            output = retrieveRenderedNode(*segment.node, dependencies.store).getString();
+            recordedSegment = nullptr;
+            for (auto& read : segment.reads)
+                dependencies.readers[read.substr(0, read.find('.'))].insert(index);
+            return error == LIQUID_RENDERER_ERROR_TYPE_NONE && control == Control::NONE;
+        };
+
+        bool body = ast.type == context.getConcatenationNodeType();
+        size_t segments = body ? ast.children.size() : 1;
+        if (body)
+            ++currentRenderingDepth;
+        bool rendered = dependencies.incremental && dependencies.ast == &ast && dependencies.store.pointer == store.pointer && dependencies.segments.size() == segments;
+        for (size_t i = 0; rendered && i < segments; ++i)
+            rendered = dependencies.segments[i].node == (body ? ast.children[i].get() : &ast);
+        if (rendered) {
+            std::set<size_t> affected;
+            for (size_t i = 0; i < dependencies.segments.size(); ++i) {
+                if (dependencies.segments[i].opaque)
+                    affected.insert(i);
+            }
+            for (auto& changedPath : changedPaths) {
+                string path;
+                for (char c : changedPath) {
+                    if (c == '[')
+                        c = '.';
+                    if (c != ']' && (c != '.' || !path.empty()))
+                        path.push_back(c);
+                }
+                string root = path.substr(0, path.find('.'));
+                if (dependencies.writes.count(root)) {
+                    rendered = false;
+                    break;
+                }
+                auto it = dependencies.readers.find(root);
+                if (it == dependencies.readers.end())
+                    continue;
+                for (size_t index : it->second) {
+                    for (auto& read : dependencies.segments[index].reads) {
+                        if (overlaps(read, path)) {
+                            affected.insert(index);
+                            break;
+                        }
+                    }
+                }
+            }
+            for (auto it = affected.begin(); rendered && it != affected.end(); ++it) {
+                const Dependencies::Segment& segment = dependencies.segments[*it];
+                rendered = !segment.unknown && segment.writes.empty();
+                for (auto read = segment.reads.begin(); rendered && read != segment.reads.end(); ++read)
+                    rendered = !dependencies.writes.count(read->substr(0, read->find('.')));
+            }
+            std::vector<string> outputs;
+            for (auto it = affected.begin(); rendered && it != affected.end(); ++it) {
+                outputs.emplace_back();
+                rendered = renderSegment(*it, outputs.back());
+            }
+            if (rendered && !affected.empty()) {
+                string output;
+                auto next = affected.begin();
+                size_t rerendered = 0;
+                for (size_t i = 0; i < dependencies.segments.size(); ++i) {
+                    Dependencies::Segment& segment = dependencies.segments[i];
+                    size_t offset = output.size();
+                    if (next != affected.end() && *next == i) {
+                        output.append(outputs[rerendered++]);
+                        ++next;
+                    } else
+                        output.append(dependencies.output, segment.offset, segment.length);
+                    segment.offset = offset;
+                    segment.length = output.size() - offset;
+                }
+                dependencies.output = move(output);
+            }
+        }
+
+        if (!rendered) {
+            dependencies = Dependencies();
+            dependencies.ast = &ast;
+            dependencies.store = store;
+            dependencies.incremental = true;
+            errors.clear();
+            unknownErrors.clear();
+            error = Error::Type::LIQUID_RENDERER_ERROR_TYPE_NONE;
+            control = Control::NONE;
+            dependencies.segments.resize(segments);
+            for (size_t i = 0; i < dependencies.segments.size(); ++i) {
+                Dependencies::Segment& segment = dependencies.segments[i];
+                segment.node = body ? ast.children[i].get() : &ast;
+                segment.unknown = !getWrites(context, *segment.node, segment.writes);
+                dependencies.writes.insert(segment.writes.begin(), segment.writes.end());
+            }
+            for (size_t i = 0; i < dependencies.segments.size(); ++i) {
+                string output;
+                bool complete = renderSegment(i, output);
+                dependencies.segments[i].offset = dependencies.output.size();
+                dependencies.segments[i].length = output.size();
+                dependencies.output.append(output);
+                if (!complete) {
+                    // Whatever follows a break isn't rendered, so can't be rendered again on its own.
+                    dependencies.segments.resize(i + 1);
+                    dependencies.incremental = false;
+                    break;
+                }
+            }
+        }
+        internalRender = false;
+        if (error != LIQUID_RENDERER_ERROR_TYPE_NONE) {
+            dependencies = Dependencies();
+            throw Error(error, Node());
+        }
+        return dependencies.output;
+    }
+
     pair<void*, Renderer::DropFunction> Renderer::getInternalDrop(const string& key) {
         auto it = internalDrops.find(key);
         if (it == internalDrops.end())
             return { nullptr, nullptr };
+        if (memoizer && memoizer->isRecording())
+            memoizer->drop(key, it->second.size());
         return it->second.back();
     }
 
@@ -250,6 +533,17 @@ namespace Liquid {
         }
         if (logUnknownVariables && !valid)
             pushUnknownVariableWarning(node, offset, store);
+        if (memoizer && offset == 0 && memoizer->isRecording())
+            memoizer->read(node, store);
+        if (recordedSegment && offset == 0) {
+            std::vector<Variant> keys;
+            for (auto& child : node.children) {
+                if (child->type || (child->variant.type != Variant::Type::STRING && child->variant.type != Variant::Type::INT))
+                    break;
+                keys.push_back(child->variant);
+            }
+            recordRead(keys, store);
+        }
         return { valid, storePointer };
     }
 
@@ -6,6 +6,8 @@
 namespace Liquid {
     struct Context;
     struct ContextBoundaryNode;
+    struct Closure;
+    struct Memoizer;
 
     // One renderer per thread; though many renderers can be instantiated.
     struct Renderer {
@@ -13,7 +15,8 @@ namespace Liquid {
 
         enum class ExecutionMode {
             PARSE_TREE,
-            INTERPRETER
+            INTERPRETER,
+            CLOSURE
         };
 
         enum class Control {
@@ -101,6 +104,9 @@ namespace Liquid {
         // How many concatenation nodes are allowed at any given time. This roughly corresponds to the amount of nested tags. In non-malicious code
         // this will probably rarely exceed 100.
         unsigned int maximumRenderingDepth = 100;
+        // Loops over ranges, and filters like size or join, walk them without making them into arrays. Those that still have to be, like
+        // when assigned, can't have more elements than this, and count against maximumMemoryUsage; beyond either, they're nil.
+        unsigned int maximumRangeSize = 10000;
 
         unsigned int currentMemoryUsage;
         std::chrono::system_clock::time_point renderStartTime;
@@ -112,6 +118,40 @@ namespace Liquid {
         bool internalRender = false;
 
         const ContextBoundaryNode* nodeContext = nullptr;
+        // In closure mode, the closure whose node is being rendered by its NodeType.
+        const Closure* closure = nullptr;
+        // Set by a Memoizer for as long as it lives; see Optimizer::memoize.
+        Memoizer* memoizer = nullptr;
+
+        // What the last render through rerender depended on; each element of the template's body, where its output went, what it read
+        // from the store, and what it wrote there.
+        struct Dependencies {
+            struct Segment {
+                const Node* node;
+                size_t offset = 0;
+                size_t length = 0;
+                // From the root of the store, keys separated by '.'.
+                std::unordered_set<std::string> reads;
+                // Read under a key computed as it rendered; rendered again on any change.
+                bool opaque = false;
+                // Keys at the root of the store.
+                std::unordered_set<std::string> writes;
+                // Does something other than read and write the store, like break or cycle, that can't be repeated on its own.
+                bool unknown = false;
+            };
+            const Node* ast = nullptr;
+            Variable store;
+            std::string output;
+            std::vector<Segment> segments;
+            // The segments that read under each key at the root of the store, and those written by any.
+            std::unordered_map<std::string, std::unordered_set<size_t>> readers;
+            std::unordered_set<std::string> writes;
+            // Whether the body rendered to the end.
+            bool incremental = false;
+        };
+        Dependencies dependencies;
+        Dependencies::Segment* recordedSegment = nullptr;
+        void recordRead(const std::vector<Variant>& keys, Variable store);
 
         // Done so we don't repeat unknown errors if they're inloops.
         unordered_set<const Node*> unknownErrors;
@@ -123,6 +163,12 @@ namespace Liquid {
         Node returnValue;
         void* customData;
         LiquidVariableResolver variableResolver;
+        // Takes precedence over the context's.
+        LiquidFragmentCache fragmentCache = {};
+        LiquidFragmentCacheMetrics fragmentCacheMetrics = {};
+        // Trees for the templates liquid-aot linked in, by TranspiledTemplate::id, and their node tables; parsed under the context the first
+        // time this renderer runs each, and left empty if the source no longer matches.
+        std::unordered_map<unsigned long long, std::pair<std::unique_ptr<Node>, std::vector<const Node*>>> transpiledTrees;
 
         Renderer(const Context& context);
         Renderer(const Context& context, LiquidVariableResolver variableResolver);
@@ -131,7 +177,19 @@ namespace Liquid {
         Variant renderArgument(const Node& ast, Variable store);
         LiquidRendererErrorType render(const Node& ast, Variable store, void (*)(const char* chunk, size_t size, void* data), void* data);
         string render(const Node& ast, Variable store);
+        // Renders the template that liquid-aot linked in under this name, if there is one; otherwise renders the tree.
+        LiquidRendererErrorType render(const std::string& name, const Node& ast, Variable store, void (*)(const char* chunk, size_t size, void* data), void* data);
+        string render(const std::string& name, const Node& ast, Variable store);
+        // Renders a closure tree bound from an AST with Closure::bind.
+        LiquidRendererErrorType render(const Closure& closure, Variable store, void (*)(const char* chunk, size_t size, void* data), void* data);
+        string render(const Closure& closure, Variable store);
         string renderTrimmed(const Node& ast, Variable store);
+        // Renders as render does, recording the dependencies of each element of the template's body. Called again with the same template,
+        // unchanged, and the same store, only renders again the elements that read under any of the changedPaths, like "settings.color" or
+        // "products[0]", and splices their output into the last. Renders everything if one of those elements writes to the store, or
+        // reads what the template writes, or does anything else that can't be repeated on its own, or if the template writes to any of
+        // the changed paths.
+        string rerender(const Node& ast, Variable store, const std::vector<std::string>& changedPaths);
         // Retrieves a rendered node, if possible. If the node in question has a nodetype that is PARTIAL optimized, Has the potential to return node with
         // a type still attached; otherwise, will always be a variant node.
         Node retrieveRenderedNode(const Node& node, Variable store) {
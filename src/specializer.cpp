@@ -0,0 +1,140 @@
+#include "specializer.h"
+#include "renderer.h"
+#include "optimizer.h"
+
+namespace Liquid {
+
+    // FNV-1a.
+    static void hashBytes(unsigned long long& hash, const void* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<const unsigned char*>(data)[i];
+            hash *= 0x100000001b3ULL;
+        }
+    }
+
+    template <class T>
+    static void hashValue(unsigned long long& hash, const T& value) {
+        hashBytes(hash, &value, sizeof(value));
+    }
+
+    static void hashVariable(Renderer& renderer, unsigned long long& hash, Variable variable, bool whole) {
+        const LiquidVariableResolver& resolver = renderer.variableResolver;
+        LiquidVariableType type = resolver.getType(renderer, variable);
+        hashValue(hash, type);
+        switch (type) {
+            case LIQUID_VARIABLE_TYPE_STRING: {
+                std::string str;
+                renderer.resolveVariableString(str, variable);
+                hashValue(hash, str.size());
+                hashBytes(hash, str.data(), str.size());
+            } break;
+            case LIQUID_VARIABLE_TYPE_INT: {
+                long long i = 0;
+                resolver.getInteger(renderer, variable, &i);
+                hashValue(hash, i);
+            } break;
+            case LIQUID_VARIABLE_TYPE_FLOAT: {
+                double f = 0;
+                resolver.getFloat(renderer, variable, &f);
+                hashValue(hash, f);
+            } break;
+            case LIQUID_VARIABLE_TYPE_BOOL: {
+                bool b = false;
+                resolver.getBool(renderer, variable, &b);
+                hashValue(hash, b);
+            } break;
+            case LIQUID_VARIABLE_TYPE_ARRAY: {
+                long long size = resolver.getArraySize(renderer, variable);
+                hashValue(hash, size);
+                // Only iterated arrays need just their size; what's read from their elements is hashed through their own paths.
+                if (whole) {
+                    for (long long i = 0; i < size; ++i) {
+                        Variable element;
+                        if (resolver.getArrayVariable(renderer, variable, i, element))
+                            hashVariable(renderer, hash, element, true);
+                    }
+                }
+            } break;
+            case LIQUID_VARIABLE_TYPE_NIL:
+            break;
+            default: {
+                hashValue(hash, variable.pointer);
+                unsigned long long version = resolver.getVersion ? resolver.getVersion(renderer, variable) : 0;
+                hashValue(hash, version);
+            } break;
+        }
+    }
+
+    static void hashPath(Renderer& renderer, unsigned long long& hash, Variable variable, const std::vector<std::string>& keys, size_t idx, const AccessAnalyzer::Access& access) {
+        if (idx == keys.size()) {
+            hashVariable(renderer, hash, variable, access.read);
+            return;
+        }
+        if (keys[idx] == "[]") {
+            long long size = renderer.variableResolver.getArraySize(renderer, variable);
+            hashValue(hash, size);
+            for (long long i = 0; i < size; ++i) {
+                Variable element;
+                if (renderer.variableResolver.getArrayVariable(renderer, variable, i, element))
+                    hashPath(renderer, hash, element, keys, idx + 1, access);
+            }
+            return;
+        }
+        Variable member;
+        bool found = renderer.variableResolver.getDictionaryVariable(renderer, variable, keys[idx].data(), member);
+        hashValue(hash, found);
+        if (found)
+            hashPath(renderer, hash, member, keys, idx + 1, access);
+    }
+
+    Specializer::Specializer(Renderer& renderer) : renderer(renderer), compiler(renderer.context) { }
+
+    unsigned long long Specializer::getDigest(const std::map<std::string, AccessAnalyzer::Access>& paths, Variable staticStore) {
+        unsigned long long hash = 0xcbf29ce484222325ULL;
+        for (auto& path : paths) {
+            // "a.b[].c" is "a", "b", "[]", "c".
+            std::vector<std::string> keys;
+            size_t offset = 0;
+            while (offset < path.first.size()) {
+                size_t end = std::min(path.first.find_first_of(".[", offset), path.first.size());
+                if (end > offset)
+                    keys.push_back(path.first.substr(offset, end - offset));
+                if (end < path.first.size() && path.first[end] == '[') {
+                    keys.push_back("[]");
+                    end += 2;
+                }
+                offset = end + 1;
+            }
+            hashBytes(hash, path.first.data(), path.first.size());
+            hashPath(renderer, hash, staticStore, keys, 0, path.second);
+        }
+        return hash;
+    }
+
+    const Specializer::Specialization& Specializer::specialize(const Node& tmpl, Variable staticStore) {
+        auto it = entries.find(&tmpl);
+        if (it == entries.end()) {
+            it = entries.emplace(&tmpl, Entry()).first;
+            AccessAnalyzer analyzer;
+            it->second.paths = analyzer.analyze(tmpl);
+        }
+        Entry& entry = it->second;
+        unsigned long long digest = getDigest(entry.paths, staticStore);
+        if (entry.specialization && entry.specialization->digest == digest) {
+            ++hits;
+            return *entry.specialization.get();
+        }
+        ++misses;
+        auto specialization = std::make_unique<Specialization>();
+        specialization->digest = digest;
+        specialization->ast = Node(tmpl);
+        Optimizer optimizer(renderer);
+        optimizer.optimize(specialization->ast, staticStore);
+        if (hoist)
+            optimizer.hoist(specialization->ast);
+        if (compile)
+            specialization->program = compiler.compile(specialization->ast);
+        entry.specialization = std::move(specialization);
+        return *entry.specialization.get();
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef LIQUIDSPECIALIZER_H
+#define LIQUIDSPECIALIZER_H
+
+#include <memory>
+#include <unordered_map>
+
+#include "common.h"
+#include "compiler.h"
+#include "analyzer.h"
+
+namespace Liquid {
+
+    struct Renderer;
+
+    // Partially evaluates templates against a static store, like theme settings, and caches the residual tree, and its program, so that
+    // renders only evaluate what depends on the rest of the store. Each template keeps one specialization, keyed by a digest of the values
+    // in the static store the template can read; when any of those change, it's specialized again.
+    struct Specializer {
+        struct Specialization {
+            unsigned long long digest;
+            Node ast;
+            Program program;
+        };
+
+        Renderer& renderer;
+        Compiler compiler;
+        // If unset, specializations only have a tree.
+        bool compile = true;
+        // Also moves loop-invariant expressions out of loops in the residual tree.
+        bool hoist = true;
+        unsigned int hits = 0;
+        unsigned int misses = 0;
+
+        Specializer(Renderer& renderer);
+
+        // The template must outlive its specialization; the returned reference is valid until the template is specialized again, or
+        // invalidated.
+        const Specialization& specialize(const Node& tmpl, Variable staticStore);
+        // Hashes the values in the store at each path, as AccessAnalyzer lists them. Dictionaries that are read as a whole, and those
+        // indexed by keys computed at render time, can't be walked through the resolver; they're hashed by address, and by version, if the
+        // resolver has getVersion.
+        unsigned long long getDigest(const std::map<std::string, AccessAnalyzer::Access>& paths, Variable staticStore);
+        void invalidate(const Node& tmpl) { entries.erase(&tmpl); }
+        void clear() { entries.clear(); }
+
+    protected:
+        struct Entry {
+            std::map<std::string, AccessAnalyzer::Access> paths;
+            std::unique_ptr<Specialization> specialization;
+        };
+        std::unordered_map<const Node*, Entry> entries;
+    };
+}
+
+#endif
@@ -0,0 +1,354 @@
+#ifndef LIQUIDSTATICTEMPLATE_H
+#define LIQUIDSTATICTEMPLATE_H
+
+#include <string_view>
+#include <vector>
+
+#include "context.h"
+#include "renderer.h"
+
+// Templates that are lexed at compile time, for the small ones that live in C++ string literals. Only output blocks are allowed; literals,
+// variable paths (a.b[0]["c"]) and filters with literal or variable arguments. Anything else fails to compile.
+//
+//  static constexpr auto subject = LIQUID_STATIC_TEMPLATE("Hello {{ name | upcase }}!");
+//  std::string s = subject.render(renderer, store);
+//
+// Rendering does no parsing, and literal parts go straight from the string literal to the output.
+#define LIQUID_STATIC_TEMPLATE(str) ([]() { \
+    constexpr std::string_view liquidStaticSource = str; \
+    constexpr Liquid::StaticTemplate<Liquid::StaticOpCounter::count(liquidStaticSource)> liquidStaticTemplate(liquidStaticSource); \
+    return liquidStaticTemplate; \
+}())
+
+namespace Liquid {
+
+    struct StaticOp {
+        // Ops are postfix; an OUTPUT follows its operand, and a FILTER follows its operand and arguments. A VARIABLE is followed by its
+        // path, as i KEY and INDEX ops.
+        enum class Type {
+            LITERAL,
+            STRING,
+            INTEGER,
+            FLOAT,
+            BOOL,
+            NIL,
+            VARIABLE,
+            KEY,
+            INDEX,
+            FILTER,
+            OUTPUT
+        };
+
+        Type type = Type::LITERAL;
+        std::string_view text;
+        long long i = 0;
+        double f = 0;
+    };
+
+    // The same shape as Lexer<T>; the derived class gets a callback for each op. Unlike Lexer, this is constexpr, so it keeps to the
+    // subset of syntax that can be rendered without a parse tree.
+    template <class T>
+    struct StaticLexer {
+        // Keys are copied to the stack to null-terminate them for the resolver.
+        static constexpr size_t MAX_KEY_LENGTH = 128;
+
+        std::string_view source;
+        size_t offset = 0;
+
+        constexpr bool isSpace(char c) const { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }
+        constexpr bool isDigit(char c) const { return c >= '0' && c <= '9'; }
+        constexpr bool isIdentifier(char c, bool first) const { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (!first && (isDigit(c) || c == '-' || c == '?')); }
+
+        constexpr void skipSpace() {
+            while (offset < source.size() && isSpace(source[offset]))
+                ++offset;
+        }
+
+        constexpr bool consume(char c) {
+            skipSpace();
+            if (offset < source.size() && source[offset] == c) {
+                ++offset;
+                return true;
+            }
+            return false;
+        }
+
+        constexpr std::string_view identifier() {
+            skipSpace();
+            size_t start = offset;
+            if (offset >= source.size() || !isIdentifier(source[offset], true))
+                throw Exception("Expected an identifier in static template.");
+            // A trailing '-' belongs to the whitespace control of the closing '-}}'.
+            while (offset < source.size() && isIdentifier(source[offset], false) && !(source[offset] == '-' && offset + 1 < source.size() && source[offset+1] == '}'))
+                ++offset;
+            return source.substr(start, offset - start);
+        }
+
+        constexpr std::string_view quoted() {
+            char quote = source[offset++];
+            size_t start = offset;
+            while (offset < source.size() && source[offset] != quote)
+                ++offset;
+            if (offset >= source.size())
+                throw Exception("Unterminated string in static template.");
+            return source.substr(start, offset++ - start);
+        }
+
+        constexpr void number() {
+            bool negative = source[offset] == '-';
+            if (negative)
+                ++offset;
+            long long i = 0;
+            while (offset < source.size() && isDigit(source[offset]))
+                i = i * 10 + (source[offset++] - '0');
+            if (offset < source.size() && source[offset] == '.') {
+                double f = i, scale = 0.1;
+                for (++offset; offset < source.size() && isDigit(source[offset]); ++offset, scale /= 10)
+                    f += (source[offset] - '0') * scale;
+                static_cast<T*>(this)->op(StaticOp { StaticOp::Type::FLOAT, {}, 0, negative ? -f : f });
+            } else
+                static_cast<T*>(this)->op(StaticOp { StaticOp::Type::INTEGER, {}, negative ? -i : i, 0 });
+        }
+
+        constexpr void variable() {
+            T& derived = *static_cast<T*>(this);
+            std::string_view name = identifier();
+            if (name == "true" || name == "false") {
+                derived.op(StaticOp { StaticOp::Type::BOOL, {}, name == "true", 0 });
+                return;
+            }
+            if (name == "nil") {
+                derived.op(StaticOp { StaticOp::Type::NIL, {}, 0, 0 });
+                return;
+            }
+            size_t variable = derived.op(StaticOp { StaticOp::Type::VARIABLE, {}, 0, 0 });
+            key(name);
+            long long length = 1;
+            for (;; ++length) {
+                if (offset < source.size() && source[offset] == '.') {
+                    ++offset;
+                    key(identifier());
+                } else if (offset < source.size() && source[offset] == '[') {
+                    ++offset;
+                    skipSpace();
+                    if (offset < source.size() && (source[offset] == '"' || source[offset] == '\'')) {
+                        key(quoted());
+                    } else if (offset < source.size() && isDigit(source[offset])) {
+                        long long idx = 0;
+                        while (offset < source.size() && isDigit(source[offset]))
+                            idx = idx * 10 + (source[offset++] - '0');
+                        derived.op(StaticOp { StaticOp::Type::INDEX, {}, idx });
+                    } else
+                        throw Exception("Only literal indices are allowed in static templates.");
+                    if (!consume(']'))
+                        throw Exception("Expected ']' in static template.");
+                } else
+                    break;
+            }
+            derived.setLength(variable, length);
+        }
+
+        constexpr void key(std::string_view key) {
+            if (key.size() >= MAX_KEY_LENGTH)
+                throw Exception("Key too long in static template.");
+            static_cast<T*>(this)->op(StaticOp { StaticOp::Type::KEY, key });
+        }
+
+        constexpr void operand() {
+            skipSpace();
+            if (offset >= source.size())
+                throw Exception("Unexpected end of static template.");
+            char c = source[offset];
+            if (c == '"' || c == '\'')
+                static_cast<T*>(this)->op(StaticOp { StaticOp::Type::STRING, quoted() });
+            else if (isDigit(c) || (c == '-' && offset + 1 < source.size() && isDigit(source[offset+1])))
+                number();
+            else
+                variable();
+        }
+
+        constexpr void output() {
+            T& derived = *static_cast<T*>(this);
+            operand();
+            while (consume('|')) {
+                std::string_view name = identifier();
+                long long arguments = 0;
+                if (consume(':')) {
+                    do {
+                        operand();
+                        ++arguments;
+                    } while (consume(','));
+                }
+                derived.op(StaticOp { StaticOp::Type::FILTER, name, arguments });
+            }
+            derived.op(StaticOp { StaticOp::Type::OUTPUT, {}, 0, 0 });
+        }
+
+        constexpr void literal(size_t start, size_t end, bool trimStart, bool trimEnd) {
+            if (trimStart) {
+                while (start < end && isSpace(source[start]))
+                    ++start;
+            }
+            if (trimEnd) {
+                while (end > start && isSpace(source[end-1]))
+                    --end;
+            }
+            if (end > start)
+                static_cast<T*>(this)->op(StaticOp { StaticOp::Type::LITERAL, source.substr(start, end - start) });
+        }
+
+        constexpr void lex(std::string_view str) {
+            source = str;
+            offset = 0;
+            bool trimStart = false;
+            while (true) {
+                size_t open = source.find('{', offset);
+                while (open != std::string_view::npos && open + 1 < source.size() && source[open+1] != '{' && source[open+1] != '%')
+                    open = source.find('{', open + 1);
+                if (open == std::string_view::npos || open + 1 >= source.size()) {
+                    literal(offset, source.size(), trimStart, false);
+                    return;
+                }
+                if (source[open+1] == '%')
+                    throw Exception("Tags are not supported in static templates.");
+                bool suppress = open + 2 < source.size() && source[open+2] == '-';
+                literal(offset, open, trimStart, suppress);
+                offset = open + (suppress ? 3 : 2);
+                output();
+                skipSpace();
+                trimStart = offset < source.size() && source[offset] == '-';
+                if (trimStart)
+                    ++offset;
+                if (offset + 1 >= source.size() || source[offset] != '}' || source[offset+1] != '}')
+                    throw Exception("Expected '}}' in static template.");
+                offset += 2;
+            }
+        }
+    };
+
+    struct StaticOpCounter : StaticLexer<StaticOpCounter> {
+        size_t size = 0;
+
+        constexpr size_t op(const StaticOp&) { return size++; }
+        constexpr void setLength(size_t, long long) { }
+
+        static constexpr size_t count(std::string_view source) {
+            StaticOpCounter counter;
+            counter.lex(source);
+            return counter.size;
+        }
+    };
+
+    template <size_t N>
+    struct StaticOpWriter : StaticLexer<StaticOpWriter<N>> {
+        StaticOp* ops;
+        size_t size = 0;
+
+        constexpr StaticOpWriter(StaticOp* ops) : ops(ops) { }
+
+        constexpr size_t op(const StaticOp& op) {
+            ops[size] = op;
+            return size++;
+        }
+        constexpr void setLength(size_t idx, long long length) { ops[idx].i = length; }
+    };
+
+    template <size_t N>
+    struct StaticTemplate {
+        StaticOp ops[N > 0 ? N : 1];
+        size_t size = 0;
+
+        constexpr StaticTemplate(std::string_view source) : ops() {
+            StaticOpWriter<N> writer(ops);
+            writer.lex(source);
+            size = writer.size;
+        }
+
+        LiquidRendererErrorType render(Renderer& renderer, Variable store, void (*callback)(const char* chunk, size_t size, void* data), void* data) const {
+            renderer.mode = Renderer::ExecutionMode::PARSE_TREE;
+            renderer.error = LIQUID_RENDERER_ERROR_TYPE_NONE;
+            // Only touched by outputs; a template that's all literals never allocates.
+            std::vector<Variant> stack;
+            for (size_t i = 0; i < size; ++i) {
+                const StaticOp& op = ops[i];
+                switch (op.type) {
+                    case StaticOp::Type::LITERAL:
+                        callback(op.text.data(), op.text.size(), data);
+                    break;
+                    case StaticOp::Type::STRING:
+                        stack.push_back(Variant(std::string(op.text)));
+                    break;
+                    case StaticOp::Type::INTEGER:
+                        stack.push_back(Variant(op.i));
+                    break;
+                    case StaticOp::Type::FLOAT:
+                        stack.push_back(Variant(op.f));
+                    break;
+                    case StaticOp::Type::BOOL:
+                        stack.push_back(Variant(op.i != 0));
+                    break;
+                    case StaticOp::Type::NIL:
+                        stack.push_back(Variant());
+                    break;
+                    case StaticOp::Type::VARIABLE: {
+                        Variable storePointer = store;
+                        bool valid = true;
+                        char key[StaticLexer<StaticOpCounter>::MAX_KEY_LENGTH];
+                        for (long long j = 0; j < op.i; ++j) {
+                            const StaticOp& link = ops[++i];
+                            if (!valid)
+                                continue;
+                            if (link.type == StaticOp::Type::INDEX) {
+                                valid = renderer.variableResolver.getArrayVariable(renderer, storePointer, link.i, storePointer);
+                            } else {
+                                memcpy(key, link.text.data(), link.text.size());
+                                key[link.text.size()] = 0;
+                                valid = renderer.variableResolver.getDictionaryVariable(renderer, storePointer, key, storePointer);
+                            }
+                        }
+                        stack.push_back(valid ? renderer.parseVariant(storePointer) : Variant());
+                    } break;
+                    case StaticOp::Type::FILTER: {
+                        const FilterNodeType* filterType = renderer.context.getFilterType(std::string(op.text));
+                        // Variant assignment doesn't change the type, so results are always pushed fresh.
+                        if (!filterType) {
+                            stack.resize(stack.size() - op.i - 1);
+                            stack.push_back(Variant());
+                            break;
+                        }
+                        Node filter(filterType);
+                        filter.children.push_back(std::make_unique<Node>(std::move(stack[stack.size() - op.i - 1])));
+                        auto arguments = std::make_unique<Node>(renderer.context.getArgumentsNodeType());
+                        for (size_t j = stack.size() - op.i; j < stack.size(); ++j)
+                            arguments->children.push_back(std::make_unique<Node>(std::move(stack[j])));
+                        filter.children.push_back(std::move(arguments));
+                        stack.resize(stack.size() - op.i - 1);
+                        stack.push_back(std::move(renderer.retrieveRenderedNode(filter, store).variant));
+                    } break;
+                    case StaticOp::Type::OUTPUT: {
+                        std::string s = renderer.getString(Node(std::move(stack.back())));
+                        stack.pop_back();
+                        callback(s.data(), s.size(), data);
+                    } break;
+                    case StaticOp::Type::KEY:
+                    case StaticOp::Type::INDEX:
+                        assert(false);
+                    break;
+                }
+            }
+            return renderer.error;
+        }
+
+        std::string render(Renderer& renderer, Variable store) const {
+            std::string accumulator;
+            LiquidRendererErrorType error = render(renderer, store, +[](const char* chunk, size_t size, void* data){
+                static_cast<std::string*>(data)->append(chunk, size);
+            }, &accumulator);
+            if (error != LIQUID_RENDERER_ERROR_TYPE_NONE)
+                throw Renderer::Exception(Renderer::Error(error, Node()));
+            return accumulator;
+        }
+    };
+}
+
+#endif
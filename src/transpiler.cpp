@@ -0,0 +1,212 @@
+#include "transpiler.h"
+#include "context.h"
+#include "parser.h"
+#include "renderer.h"
+
+#include <atomic>
+
+namespace Liquid {
+
+    bool NodeType::transpile(Transpiler& transpiler, const Node& node) const {
+        return false;
+    }
+
+    bool Context::ConcatenationNode::transpile(Transpiler& transpiler, const Node& node) const {
+        // Mirrors render(); the only difference is that stopping early leaves the whole function, as every enclosing concatenation would stop too.
+        transpiler.line("if (++renderer.currentRenderingDepth > renderer.maximumRenderingDepth) {");
+        transpiler.line("    --renderer.currentRenderingDepth;");
+        transpiler.line("    renderer.error = LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH;");
+        transpiler.line("    return;");
+        transpiler.line("}");
+        for (auto& child : node.children) {
+            transpiler.transpileBranch(*child.get());
+            if (child->type)
+                transpiler.transpileInterrupt();
+        }
+        transpiler.line("--renderer.currentRenderingDepth;");
+        return true;
+    }
+
+    bool Context::OutputNode::transpile(Transpiler& transpiler, const Node& node) const {
+        const Node& argument = *node.children.front()->children[0].get();
+        if (!argument.type) {
+            std::string text = argument.variant.getString();
+            if (!text.empty())
+                transpiler.line("out.append(" + transpiler.addString(text) + ");");
+        } else
+            transpiler.line("out.append(renderer.getString(renderer.retrieveRenderedNode(" + transpiler.addNode(argument) + ", store)));");
+        return true;
+    }
+
+    void Transpiler::line(const std::string& text) {
+        code.append(indent * 4, ' ');
+        code.append(text);
+        code.append("\n");
+    }
+
+    std::string Transpiler::addNode(const Node& node) {
+        auto it = nodeIndices.find(&node);
+        int idx;
+        if (it == nodeIndices.end()) {
+            idx = nodes.size();
+            nodeIndices[&node] = idx;
+            nodes.push_back(&node);
+        } else
+            idx = it->second;
+        return "(*nodes[" + std::to_string(idx) + "])";
+    }
+
+    std::string Transpiler::addString(const std::string& text) {
+        auto it = stringIndices.find(text);
+        int idx;
+        if (it == stringIndices.end()) {
+            idx = strings.size();
+            stringIndices[text] = idx;
+            strings.push_back(text);
+        } else
+            idx = it->second;
+        return "s" + std::to_string(idx);
+    }
+
+    std::string Transpiler::addTemporary() {
+        return "t" + std::to_string(temporaries++);
+    }
+
+    void Transpiler::transpileBranch(const Node& node) {
+        if (!node.type) {
+            std::string text = node.getString();
+            if (!text.empty())
+                line("out.append(" + addString(text) + ");");
+        } else if (!node.type->transpile(*this, node))
+            line("out.append(renderer.retrieveRenderedNode(" + addNode(node) + ", store).getString());");
+    }
+
+    void Transpiler::transpileInterrupt() {
+        line("if (renderer.error != LIQUID_RENDERER_ERROR_TYPE_NONE || renderer.control != Renderer::Control::NONE)");
+        line("    return;");
+    }
+
+    std::string Transpiler::escape(const std::string& text) {
+        std::string result = "\"";
+        char buffer[8];
+        for (unsigned char c : text) {
+            switch (c) {
+                case '"': result.append("\\\""); break;
+                case '\\': result.append("\\\\"); break;
+                case '\n': result.append("\\n"); break;
+                case '\t': result.append("\\t"); break;
+                case '?': result.append("\\?"); break;
+                default:
+                    if (c < 0x20 || c >= 0x7F) {
+                        // Always three digits, so a following digit can't be taken as part of the escape.
+                        sprintf(buffer, "\\%03o", c);
+                        result.append(buffer);
+                    } else
+                        result.push_back(c);
+                break;
+            }
+        }
+        result.append("\"");
+        return result;
+    }
+
+    static void buildPaths(std::unordered_map<const Node*, std::vector<int>>& paths, const Node& node, std::vector<int>& path) {
+        paths[&node] = path;
+        if (!node.type)
+            return;
+        for (size_t i = 0; i < node.children.size(); ++i) {
+            path.push_back(i);
+            buildPaths(paths, *node.children[i].get(), path);
+            path.pop_back();
+        }
+    }
+
+    std::string Transpiler::transpile(const Node& ast, const std::string& name, const std::string& source) {
+        code.clear();
+        paths.clear();
+        nodes.clear();
+        nodeIndices.clear();
+        strings.clear();
+        stringIndices.clear();
+        temporaries = 0;
+        indent = 2;
+
+        std::vector<int> path;
+        buildPaths(paths, ast, path);
+        transpileBranch(ast);
+
+        std::string result = "// Generated by liquid-aot from " + name + "; do not edit.\n";
+        result.append("#include <string_view>\n\n#include <liquid/context.h>\n#include <liquid/transpiler.h>\n\nnamespace {\n    using namespace Liquid;\n\n");
+        result.append("    constexpr char source[] = " + escape(source) + ";\n");
+        for (size_t i = 0; i < strings.size(); ++i)
+            result.append("    constexpr std::string_view s" + std::to_string(i) + "(" + escape(strings[i]) + ", " + std::to_string(strings[i].size()) + ");\n");
+        result.append("    constexpr int paths[] = {");
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            auto& nodePath = paths[nodes[i]];
+            result.append(i > 0 ? ", " : " ");
+            result.append(std::to_string(nodePath.size()));
+            for (int idx : nodePath)
+                result.append(", " + std::to_string(idx));
+        }
+        result.append(nodes.size() > 0 ? " };\n\n" : " 0 };\n\n");
+        result.append("    void render(Renderer& renderer, const Node* const* nodes, Variable store, std::string& out) {\n");
+        result.append(code);
+        result.append("    }\n\n");
+        result.append("    TranspiledTemplate transpiledTemplate(" + escape(name) + ", source, sizeof(source) - 1, paths, " + std::to_string(nodes.size()) + ", render);\n");
+        result.append("}\n");
+        return result;
+    }
+
+
+    TranspiledTemplate::TranspiledTemplate(const char* name, const char* source, size_t sourceSize, const int* paths, size_t nodeCount, RenderFunction function) :
+        name(name), source(source), sourceSize(sourceSize), paths(paths), nodeCount(nodeCount), function(function) {
+        static std::atomic<unsigned long long> templates(0);
+        id = ++templates;
+        getRegistry()[name] = this;
+    }
+
+    TranspiledTemplate::~TranspiledTemplate() {
+        auto it = getRegistry().find(name);
+        if (it != getRegistry().end() && it->second == this)
+            getRegistry().erase(it);
+    }
+
+    std::unordered_map<std::string, const TranspiledTemplate*>& TranspiledTemplate::getRegistry() {
+        static std::unordered_map<std::string, const TranspiledTemplate*> registry;
+        return registry;
+    }
+
+    const TranspiledTemplate* TranspiledTemplate::find(const std::string& name) {
+        auto& registry = getRegistry();
+        auto it = registry.find(name);
+        if (it == registry.end())
+            return nullptr;
+        return it->second;
+    }
+
+    bool TranspiledTemplate::getNodes(const Context& context, std::unique_ptr<Node>& tree, std::vector<const Node*>& nodes) const {
+        std::unique_ptr<Node> ast;
+        try {
+            Parser parser(context);
+            ast = std::make_unique<Node>(parser.parse(source, sourceSize));
+        } catch (Parser::Exception& exception) {
+            return false;
+        }
+        nodes.clear();
+        const int* path = paths;
+        for (size_t i = 0; i < nodeCount; ++i) {
+            const Node* node = ast.get();
+            int length = *path++;
+            for (int j = 0; j < length; ++j, ++path) {
+                if (!node->type || *path >= (int)node->children.size()) {
+                    nodes.clear();
+                    return false;
+                }
+                node = node->children[*path].get();
+            }
+            nodes.push_back(node);
+        }
+        tree = std::move(ast);
+        return true;
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef LIQUIDTRANSPILER_H
+#define LIQUIDTRANSPILER_H
+
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <memory>
+
+#include "common.h"
+
+namespace Liquid {
+
+    struct Context;
+    struct Renderer;
+
+    // Turns a parse tree into a C++ translation unit, which renders the same output as the tree renderer, when linked against libliquid.
+    // Static text becomes constexpr string_views, and node types that implement transpile() become straight-line C++; so far, those are
+    // concatenations, output tags, if, unless, raw and comment. Anything else, such as for, case, assign and capture, and every expression,
+    // filters included, is handed to the node's own render() through a table of nodes that's rebuilt at runtime from the embedded source.
+    // The tree must be unoptimized; the node table is found by re-parsing the source, so the shapes have to match.
+    struct Transpiler {
+        const Context& context;
+
+        Transpiler(const Context& context) : context(context) { }
+
+        // The body of the render function, as it's being built.
+        std::string code;
+        int indent = 1;
+        int temporaries = 0;
+
+        // Path from the root, by child index, for every node in the tree.
+        std::unordered_map<const Node*, std::vector<int>> paths;
+        std::vector<const Node*> nodes;
+        std::unordered_map<const Node*, int> nodeIndices;
+        std::vector<std::string> strings;
+        std::unordered_map<std::string, int> stringIndices;
+
+        // Emits a line into the render function at the current indentation.
+        void line(const std::string& text);
+        // Returns an expression that refers to the runtime copy of this node.
+        std::string addNode(const Node& node);
+        // Returns the name of a constexpr string_view holding this text.
+        std::string addString(const std::string& text);
+        // Returns a fresh local name.
+        std::string addTemporary();
+        // Emits code which appends the rendered node to the output, and leaves the function if rendering should stop.
+        void transpileBranch(const Node& node);
+        // Emits the checks that follow anything which could error, or break out of a loop.
+        void transpileInterrupt();
+
+        std::string transpile(const Node& ast, const std::string& name, const std::string& source);
+
+        static std::string escape(const std::string& text);
+    };
+
+    // A template that liquid-aot compiled ahead of time. The generated translation unit holds one of these statically, which registers
+    // it under its name; Renderer::render(name, ...) uses it in place of the tree from then on.
+    struct TranspiledTemplate {
+        typedef void (*RenderFunction)(Renderer& renderer, const Node* const* nodes, Variable store, std::string& out);
+
+        // Never reused, unlike the address; renderers keep the node table under it.
+        unsigned long long id;
+        const char* name;
+        const char* source;
+        size_t sourceSize;
+        // Each node's path, as its length followed by the child indices.
+        const int* paths;
+        size_t nodeCount;
+        RenderFunction function;
+
+        TranspiledTemplate(const char* name, const char* source, size_t sourceSize, const int* paths, size_t nodeCount, RenderFunction function);
+        ~TranspiledTemplate();
+
+        // Parses the embedded source under the context into the tree, and fills in the node table for the render function from it. Returns
+        // false, leaving the tree empty, if the source no longer parses into the same shape.
+        bool getNodes(const Context& context, std::unique_ptr<Node>& tree, std::vector<const Node*>& nodes) const;
+
+        static const TranspiledTemplate* find(const std::string& name);
+        static std::unordered_map<std::string, const TranspiledTemplate*>& getRegistry();
+    };
+}
+
+#endif
@@ -3,7 +3,13 @@
 #include "../src/parser.h"
 #include "../src/renderer.h"
 #include "../src/compiler.h"
+#include "../src/transpiler.h"
+#include "../src/statictemplate.h"
+#include "../src/closure.h"
+#include "../src/analyzer.h"
 #include "../src/optimizer.h"
+#include "../src/specializer.h"
+#include "../src/memoizer.h"
 #include "../src/dialect.h"
 #include "../src/cppvariable.h"
 
@@ -21,6 +27,7 @@ Context& getContext() {
         #ifdef LIQUID_INCLUDE_WEB_DIALECT
             WebDialect::implement(context);
         #endif
+        CacheDialect::implement(context);
         setup = true;
     }
     return context;
@@ -860,81 +867,461 @@ TEST(sanity, clang) {
 }
 
 TEST(sanity, vm) {
-    /*CPPVariable hash = { };
+    CPPVariable hash = { };
     Node ast;
     Program program;
-    std::string str;
     std::string result;
 
-    hash[0] = 1;
-    hash[1] = 3;
-    hash[2] = 5;
-    hash[3] = 7;
+    hash["a"] = 1;
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+    hash["s"] = "str";
 
+    ast = getParser().parse("{% if a %}asdfghj {{ a }}{% else %}asdfjlsjkhgsjlkhglsdfjkgdfhs{% for i in (1..10) %}{{ i }}fasdfsdf{% endfor %}{% endif %}");
+    program = getCompiler().compile(ast);
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "asdfghj 1");
 
-        ast = getParser().parse("{% if a %}asdfghj {{ a }}{% else %}asdfjlsjkhgsjlkhglsdfjkgdfhs{% for i in b %}{{ i }}fasdfsdf{% endfor %}{% endif %}");
-        getOptimizer().optimize(ast, hash);
+    hash["a"] = false;
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "asdfjlsjkhgsjlkhglsdfjkgdfhs1fasdfsdf2fasdfsdf3fasdfsdf4fasdfsdf5fasdfsdf6fasdfsdf7fasdfsdf8fasdfsdf9fasdfsdf10fasdfsdf");
+    hash["a"] = 1;
+
+    ast = getParser().parse("{% for i in b %}{{ forloop.index0 }}{{ forloop.first }}{{ forloop.last }}{{ i }};{% endfor %}");
+    program = getCompiler().compile(ast);
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "0truefalse1;1falsefalse3;2falsefalse5;3falsetrue7;");
+
+    ast = getParser().parse("{% for i in (1..2) %}{% for j in b %}{{ i | times: j }},{% endfor %}{% endfor %}");
+    program = getCompiler().compile(ast);
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "1,3,5,7,2,6,10,14,");
+
+    ast = getParser().parse("kjhafsdjkhfjkdhsf {{ a + 1 + 2 }} jhafsdkhgsdfjkg");
+    program = getCompiler().compile(ast);
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "kjhafsdjkhfjkdhsf 4 jhafsdkhgsdfjkg");
+
+    ast = getParser().parse("asdjkfsdhsjkg {{ a | plus: 3 | minus: 5 | times: 6 }}");
+    program = getCompiler().compile(ast);
+    result = getInterpreter().renderTemplate(program, hash);
+    ASSERT_EQ(result, "asdjkfsdhsjkg -6");
+
+    // Native opcodes should agree with the tree renderer, including where they have to fall back to the node type.
+    const char* templates[] = {
+        "{{ a + 1.5 }} {{ a * 3 - 1 }} {{ 7 % 3 }} {{ a / 2.0 }} {{ 'a' + 'b' }} {{ '1' | plus: 2 }}",
+        "{{ a < 2 and a > 0 }} {{ a == 1 }} {{ s == 'str' }} {{ s != 'str' or a >= 1 }} {{ a == '1' }} {{ missing == nil }}",
+        "{{ s | upcase }} {{ s | size }} {{ s | append: 'abc' }} {{ 'x' | prepend: s }} {{ missing | default: 'd' }} {{ b | size }}",
+        "{{ s | append: '0123456789012345678901234567890123456789012345678901234567890123456789' | upcase }}"
+    };
+    for (auto tmpl : templates) {
+        ast = getParser().parse(tmpl);
         program = getCompiler().compile(ast);
-        result =  getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "asdfjlsjkhgsjlkhglsdfjkgdfhs1fasdfsdf3fasdfsdf5fasdfsdf7fasdfsdf");
+        ASSERT_EQ(getInterpreter().renderTemplate(program, hash), getRenderer().render(ast, hash));
+    }
+    ASSERT_EQ(getCompiler().disassemble(getCompiler().compile(getParser().parse("{{ a + 1 }}"))).find("OP_CALL"), string::npos);
+}
 
-        hash.clear();
+TEST(sanity, vmRegisters) {
+    CPPVariable hash = { };
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+    Node ast;
+    Program program;
 
+    ast = getParser().parse("{% for i in (1..3) %}{% for j in b %}{{ i * j + forloop.index }},{% endfor %}{% endfor %}");
+    program = getCompiler().compile(ast);
+    ASSERT_EQ(getInterpreter().renderTemplate(program, hash), getRenderer().render(ast, hash));
+    std::string disassembly = getCompiler().disassemble(program);
+    ASSERT_EQ(disassembly.find("OP_PUSH"), std::string::npos);
+    ASSERT_EQ(disassembly.find("OP_STACK"), std::string::npos);
+
+    // Once we run out of registers, loops go on the stack.
+    std::string tmpl, expected;
+    for (int i = 0; i < 16; ++i)
+        tmpl += "{% for i" + std::to_string(i) + " in (1..1) %}";
+    tmpl += "{{ i0 | plus: i15 }}";
+    for (int i = 0; i < 16; ++i)
+        tmpl += "{% endfor %}";
+    ast = getParser().parse(tmpl);
+    program = getCompiler().compile(ast);
+    ASSERT_NE(getCompiler().disassemble(program).find("OP_STACK"), std::string::npos);
+    ASSERT_EQ(getInterpreter().renderTemplate(program, hash), getRenderer().render(ast, hash));
+}
 
-        ast = getParser().parse("{% if a %}asdfghj {{ a }}{% else %}asdfjlsjkhgsjlkhglsdfjkgdfhs{% for i in (1..10) %}{{ i }}fasdfsdf{% endfor %}{% endif %}");
-        getOptimizer().optimize(ast, hash);
-        program = getCompiler().compile(ast);
-        hash["a"] = false;
-        result =  getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "asdfjlsjkhgsjlkhglsdfjkgdfhs1fasdfsdf2fasdfsdf3fasdfsdf4fasdfsdf5fasdfsdf6fasdfsdf7fasdfsdf8fasdfsdf9fasdfsdf10fasdfsdf");
+TEST(sanity, vmResolveCache) {
+    static unsigned long long version = 1;
+    CPPVariableResolver resolver;
+    resolver.getVersion = +[](LiquidRenderer renderer, void* variable) -> unsigned long long { return version; };
+    Interpreter interpreter(getContext(), resolver);
+    CPPVariable hash = { };
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+    hash["s"] = "a";
+
+    Program program = getCompiler().compile(getParser().parse("{% for i in b %}{{ s }}{% endfor %}"));
+    ASSERT_EQ(program.resolveSites, 2);
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "aaaa");
+    ASSERT_EQ(interpreter.resolveCacheMisses, 2);
+    ASSERT_EQ(interpreter.resolveCacheHits, 3);
+
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "aaaa");
+    ASSERT_EQ(interpreter.resolveCacheMisses, 2);
+    ASSERT_EQ(interpreter.resolveCacheHits, 8);
+
+    hash["s"] = "b";
+    ++version;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "bbbb");
+    ASSERT_EQ(interpreter.resolveCacheMisses, 4);
+
+    // Without versions, caches only last for a render.
+    hash["s"] = "c";
+    ASSERT_EQ(getInterpreter().renderTemplate(program, hash), "cccc");
+    hash["s"] = "d";
+    ASSERT_EQ(getInterpreter().renderTemplate(program, hash), "dddd");
+    ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(getParser().parse("{% assign s = 'e' %}{{ s }}{% for i in b %}{% assign s = i %}{{ s }}{% endfor %}")), hash), "e1357");
+}
 
-        hash["a"] = 1;
 
-        ast = getParser().parse("{% for i in (1..3) %}{{ i }}fasdfsdf{% endfor %}");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "1fasdfsdf2fasdfsdf3fasdfsdf");
+TEST(sanity, vmSpecialization) {
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["a"] = 1;
+    hash["s"] = "b";
+
+    Node ast = getParser().parse("{% for i in (1..4) %}{% if i == a %}x{% endif %}{% if s == 'b' %}y{% endif %}{{ i + a }}{% endfor %}");
+    Program program = getCompiler().compile(ast);
+    for (unsigned int i = 0; i <= Interpreter::SPECIALIZATION_THRESHOLD; ++i)
+        ASSERT_EQ(interpreter.renderTemplate(program, hash), "xy2y3y4y5");
+    const Interpreter::ProgramState& state = interpreter.programStates[program.id];
+    ASSERT_FALSE(state.specialized.empty());
+    Program specialized = program;
+    specialized.code = state.specialized;
+    std::string disassembly = getCompiler().disassemble(specialized);
+    ASSERT_NE(disassembly.find("OP_PLUSINT"), std::string::npos);
+    ASSERT_NE(disassembly.find("OP_EQUALINT"), std::string::npos);
+    ASSERT_NE(disassembly.find("OP_EQUALSTR"), std::string::npos);
+    ASSERT_NE(disassembly.find("OP_JMPFALSEBOOL"), std::string::npos);
+    ASSERT_EQ(interpreter.deoptimizations, 0);
+
+    // Differently shaped data falls back to the generic instructions.
+    hash["a"] = 1.5;
+    hash["s"] = 2;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), getRenderer().render(ast, hash));
+    ASSERT_EQ(interpreter.deoptimizations, 3);
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), getRenderer().render(ast, hash));
+    ASSERT_EQ(interpreter.deoptimizations, 3);
+}
 
+#ifdef LIQUID_JIT
+TEST(sanity, vmJit) {
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["a"] = 1;
+    hash["s"] = "b";
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+
+    Node ast = getParser().parse("{% for i in b %}{% if i == a %}x{% else %}{{ i | plus: a }}{% endif %}{% if s == 'b' %}{{ i }}{% endif %}-{% endfor %}{% for i in c %}{{ i }}{% endfor %}{% assign t = 'c' %}{{ t }}{{ a - 2 }}");
+    Program program = getCompiler().compile(ast);
+    std::string expected = getRenderer().render(ast, hash);
+    for (unsigned int i = 0; i <= Interpreter::JIT_THRESHOLD; ++i)
+        ASSERT_EQ(interpreter.renderTemplate(program, hash), expected);
+    ASSERT_TRUE(interpreter.programStates[program.id].jit);
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), expected);
+
+    // Guards that fail in native code deoptimize the same way.
+    hash["a"] = 1.5;
+    hash["s"] = 2;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), getRenderer().render(ast, hash));
+    ASSERT_GT(interpreter.deoptimizations, 0);
+    interpreter.jit = false;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), getRenderer().render(ast, hash));
+}
+#endif
 
+TEST(sanity, vmProgramStates) {
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["a"] = 1;
 
-        ast = getParser().parse("jaslkdjfasdkf {{ a }} kjhdfjkhgsdfg");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "jaslkdjfasdkf 1 kjhdfjkhgsdfg");
+    Node ast = getParser().parse("{% for i in (1..3) %}{{ i + a }}{% endfor %}");
+    Program kept = getCompiler().compile(ast);
+    ASSERT_EQ(interpreter.renderTemplate(kept, hash), "234");
+    // Each past the point it's compiled natively, where supported; their states go with them.
+    for (unsigned int i = 0; i < interpreter.programStateLimit * 4; ++i) {
+        Program program = getCompiler().compile(ast);
+        for (unsigned int j = 0; j <= Interpreter::JIT_THRESHOLD; ++j)
+            ASSERT_EQ(interpreter.renderTemplate(program, hash), "234");
+        ASSERT_LE(interpreter.programStates.size(), 64U);
+    }
+    ASSERT_EQ(interpreter.programStateLimit, 64U);
+    ASSERT_EQ(interpreter.programStates.count(kept.id), 1U);
+    ASSERT_EQ(interpreter.programStates[kept.id].renders, 1U);
+}
 
+TEST(sanity, vmProfile) {
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+
+    Program program = getCompiler().compile(getParser().parse("{% for i in b %}{{ i | plus: 1 }}{% endfor %}"));
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468");
+    ASSERT_EQ(interpreter.hotspots(program), "");
+    interpreter.profiling = true;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468");
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468");
+
+    std::string annotation = interpreter.annotate(program);
+    size_t output = annotation.find("OP_OUTPUT ");
+    ASSERT_NE(output, std::string::npos);
+    ASSERT_EQ(strtoull(&annotation[annotation.rfind('\n', output) + 1], nullptr, 10), 8);
+    std::string hotspots = interpreter.hotspots(program);
+    size_t plus = hotspots.find("plus\n", hotspots.find("Node types by cycles:"));
+    ASSERT_NE(plus, std::string::npos);
+    ASSERT_EQ(strtoull(&hotspots[hotspots.rfind('\n', plus) + 1], nullptr, 10), 8);
+
+    char buffer[4096];
+    LiquidRenderer renderer = { &interpreter };
+    LiquidProgram handle = { &program };
+    ASSERT_EQ(liquidRendererAnnotateProgram(renderer, handle, buffer, sizeof(buffer)), (int)annotation.size());
+    ASSERT_EQ(std::string(buffer), annotation);
+    ASSERT_EQ(liquidRendererGetProgramHotspots(renderer, handle, 2, buffer, 16), 15);
+}
 
+TEST(sanity, vmSerialization) {
+    CPPVariable hash = { };
+    hash["a"] = 2;
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+    hash["s"] = "Str";
+
+    Node ast = getParser().parse("{% for i in b %}{{ i | plus: a | times: 2 }}{{ s | upcase | replace: 'S', 'x' }}{% if forloop.last %}{{ b | size }}{% endif %}{% endfor %}");
+    Program program = getCompiler().compile(ast);
+    std::vector<unsigned char> serialized = program.serialize(getContext());
+    Program loaded = Program::load(getContext(), serialized.data(), serialized.size());
+    ASSERT_NE(loaded.id, program.id);
+    ASSERT_EQ(loaded.code, program.code);
+    ASSERT_EQ(getInterpreter().renderTemplate(loaded, hash), getRenderer().render(ast, hash));
+
+    // Contexts that lack a node type the program uses are rejected.
+    Context context;
+    StandardDialect::implementPermissive(context);
+    context.filterTypes.erase("replace");
+    ASSERT_THROW(Program::load(context, serialized.data(), serialized.size()), Liquid::Exception);
 
-        ast = getParser().parse("asdlsjaflkdhsfjlkdshf");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "asdlsjaflkdhsfjlkdshf");
+    serialized[4] = 0xFF;
+    ASSERT_THROW(Program::load(getContext(), serialized.data(), serialized.size()), Liquid::Exception);
+    ASSERT_THROW(Program::load(getContext(), serialized.data(), 10), Liquid::Exception);
+}
 
+TEST(sanity, vmStack) {
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["b"] = CPPVariable({ 1, 3, 5, 7 });
+    ASSERT_EQ(interpreter.stackBlock.size(), Interpreter::INITIAL_STACK_SIZE);
+
+    Interpreter::Register reg;
+    interpreter.pushRegister(reg, std::string(60, 'a'));
+    for (int i = 0; i < 1000; ++i)
+        interpreter.pushStack(reg);
+    ASSERT_GT(interpreter.stackBlock.size(), Interpreter::INITIAL_STACK_SIZE);
+    Interpreter::Register top;
+    interpreter.getStack(top, -1);
+    ASSERT_EQ(std::string(interpreter.getStringBuffer(top), interpreter.getStringLength(top)), std::string(60, 'a'));
+    interpreter.popStack(1000);
+
+    // Shrinks back down once renders no longer need the space.
+    Program program = getCompiler().compile(getParser().parse("{% for i in b %}{% for j in b %}{{ i | plus: j }}{% endfor %}{% endfor %}"));
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468468106810128101214");
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468468106810128101214");
+    ASSERT_EQ(interpreter.stackBlock.size(), Interpreter::INITIAL_STACK_SIZE);
+
+    interpreter.maximumRenderingDepth = 1;
+    ASSERT_THROW(interpreter.renderTemplate(program, hash), Renderer::Exception);
+    ASSERT_EQ(interpreter.error, LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_DEPTH);
+    interpreter.maximumRenderingDepth = 100;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2468468106810128101214");
+}
 
-        ast = getParser().parse("kjhafsdjkhfjkdhsf {{ a + 1 }} jhafsdkhgsdfjkg");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "kjhafsdjkhfjkdhsf 2 jhafsdkhgsdfjkg");
+struct IncludeNode : TagNodeType {
+    static std::unordered_map<std::string, Node>& getPartials() {
+        static std::unordered_map<std::string, Node> partials;
+        return partials;
+    }
 
-        ast = getParser().parse("kjhafsdjkhfjkdhsf {{ a + 1 + 2 }} jhafsdkhgsdfjkg");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "kjhafsdjkhfjkdhsf 4 jhafsdkhgsdfjkg");
+    IncludeNode() : TagNodeType(Composition::FREE, "include", 1, 1, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
 
-        ast = getParser().parse("fahsdjkhgflghljh {% if a %}A{% else %}B{% endif %} kjdjkghdf");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "fahsdjkhgflghljh A kjdjkghdf");
+    Node render(Renderer& renderer, const Node& node, Variable store) const override {
+        return renderer.retrieveRenderedNode(getPartials()[node.children[0]->children[0]->variant.s], store);
+    }
 
+    void compile(Compiler& compiler, const Node& node) const override {
+        compiler.addPartial(node.children[0]->children[0]->variant.s);
+    }
+};
 
-        ast = getParser().parse("asdjkfsdhsjkg {{ a | plus: 3 | minus: 5 | times: 6 }}");
-        program = getCompiler().compile(ast);
-        result = getInterpreter().renderTemplate(program, hash);
-        ASSERT_EQ(result, "asdjkfsdhsjkg -6");*/
+TEST(sanity, vmLinking) {
+    Context context;
+    StandardDialect::implementPermissive(context);
+    context.registerType<IncludeNode>();
+    Parser parser(context);
+    Compiler compiler(context);
+    Renderer renderer(context, CPPVariableResolver());
+    Interpreter interpreter(context, CPPVariableResolver());
+    CPPVariable hash = { };
+    hash["b"] = CPPVariable({ 1, 2 });
+    hash["s"] = "s";
+
+    IncludeNode::getPartials()["item"] = parser.parse("[{{ s }}{% for j in b %}{{ j | plus: 10 }}{% endfor %}]");
+    IncludeNode::getPartials()["outer"] = parser.parse("{{ s }}{% for i in b %}{{ i }}{% include 'item' %}{{ i }}{% endfor %}");
+    Node page = parser.parse("{% for k in b %}{% include 'outer' %}{{ k }}{% endfor %}");
+    std::string expected = renderer.render(page, hash);
+    ASSERT_EQ(expected, "s1[s1112]12[s1112]21s1[s1112]12[s1112]22");
+
+    Program item = compiler.compile(IncludeNode::getPartials()["item"]);
+    Program outer = compiler.compile(IncludeNode::getPartials()["outer"]);
+    Program program = compiler.compile(page);
+
+    // Unlinked, partials are looked up by name.
+    interpreter.partials["item"] = &item;
+    interpreter.partials["outer"] = &outer;
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), expected);
+    interpreter.partials.clear();
+
+    ProgramLinker linker;
+    linker.add("item", item);
+    linker.add("outer", outer);
+    linker.add("page", program);
+    Program linked = linker.link("page");
+    std::string disassembly = compiler.disassemble(linked);
+    ASSERT_EQ(disassembly.find("OP_PARTIAL"), std::string::npos);
+    ASSERT_EQ(disassembly.find("OP_INVOKE"), std::string::npos);
+    ASSERT_EQ(interpreter.renderTemplate(linked, hash), expected);
+
+    linker.inlineThreshold = 0;
+    auto images = linker.linkAll();
+    ASSERT_NE(compiler.disassemble(images["page"]).find("OP_INVOKE"), std::string::npos);
+    ASSERT_EQ(interpreter.renderTemplate(images["page"], hash), expected);
+    ASSERT_EQ(interpreter.renderTemplate(images["outer"], hash), renderer.render(IncludeNode::getPartials()["outer"], hash));
+
+    ProgramLinker incomplete;
+    incomplete.add("page", program);
+    ASSERT_THROW(incomplete.link("page"), Liquid::Exception);
+}
 
+TEST(sanity, transpiler) {
+    CPPVariable hash = { };
+    hash["a"] = 2;
+    std::string source = "A{% if a > 1 %}{{ a }}{% else %}B{% endif %}{% for i in (1..2) %}{{ i }}{% endfor %}";
+    Node ast = getParser().parse(source);
+
+    Transpiler transpiler(getContext());
+    std::string code = transpiler.transpile(ast, "page", source);
+    ASSERT_NE(code.find("constexpr std::string_view s0(\"A\", 1);"), std::string::npos);
+    ASSERT_NE(code.find(".variant.isTruthy(renderer.context.falsiness)) {"), std::string::npos);
+    ASSERT_NE(code.find("} else {"), std::string::npos);
+    ASSERT_NE(code.find("TranspiledTemplate transpiledTemplate(\"page\", source"), std::string::npos);
+    // Condition, output, and the for loop, which is left to its render().
+    ASSERT_EQ(transpiler.nodes.size(), 3U);
+    ASSERT_EQ(Transpiler::escape("\"\\\n\001??"), "\"\\\"\\\\\\n\\001\\?\\?\"");
+
+    // Nothing registered; renders the tree.
+    ASSERT_EQ(getRenderer().render("page", ast, hash), "A212");
+
+    static const int paths[] = { 3, 1, 0, 0, 3, 1, 1, 0 };
+    {
+        TranspiledTemplate transpiled("page", source.data(), source.size(), paths, 2, +[](Renderer& renderer, const Node* const* nodes, Variable store, std::string& out) {
+            out.append("condition:");
+            out.append(renderer.retrieveRenderedNode(*nodes[0], store).getString());
+            out.append(",output:");
+            out.append(renderer.retrieveRenderedNode(*nodes[1], store).getString());
+        });
+        ASSERT_EQ(TranspiledTemplate::find("page"), &transpiled);
+        ASSERT_EQ(getRenderer().render("page", ast, hash), "condition:true,output:2");
+        ASSERT_EQ(getRenderer().transpiledTrees.count(transpiled.id), 1U);
+    }
+    ASSERT_EQ(TranspiledTemplate::find("page"), nullptr);
 
+    // Likely at the same address as the last, but its table is its own; a path that isn't in the tree renders the tree instead.
+    static const int missing[] = { 2, 9, 0 };
+    TranspiledTemplate moved("page", source.data(), source.size(), missing, 1, +[](Renderer& renderer, const Node* const* nodes, Variable store, std::string& out) {
+        out.append("stale");
+    });
+    ASSERT_EQ(getRenderer().render("page", ast, hash), "A212");
+    ASSERT_EQ(getRenderer().transpiledTrees.count(moved.id), 1U);
+}
 
+TEST(sanity, transpiledTemplates) {
+    // The templates under t/aot, as transpiled by liquid-aot, and linked in by the test build.
+    CPPVariable user = { };
+    user["name"] = "Ann";
+    CPPVariable full = { };
+    full["user"] = std::move(user);
+    full["items"] = CPPVariable({ 1, 2, 3, 4, 5 });
+    CPPVariable admin = { };
+    admin["admin"] = true;
+    CPPVariable sparse = { };
+    sparse["user"] = std::move(admin);
+    sparse["items"] = CPPVariable({ 2 });
+    CPPVariable empty = { };
+
+    Renderer renderer(getContext(), CPPVariableResolver());
+    for (const char* name : { "branches", "loops" }) {
+        const TranspiledTemplate* transpiled = TranspiledTemplate::find(name);
+        ASSERT_NE(transpiled, nullptr);
+        Node ast = getParser().parse(transpiled->source, transpiled->sourceSize);
+        for (CPPVariable* store : { &full, &sparse, &empty }) {
+            ASSERT_EQ(renderer.render(name, ast, *store), renderer.render(ast, *store));
+            // It ran the generated code, rather than falling back to the tree.
+            ASSERT_TRUE(renderer.transpiledTrees[transpiled->id].first);
+        }
+    }
 }
 
+TEST(sanity, staticTemplate) {
+    CPPVariable hash = { };
+    hash["name"] = "world";
+    hash["list"] = CPPVariable({ 1, 2 });
+    CPPVariable user = { };
+    user["first"] = "Ann";
+    hash["user"] = std::move(user);
+
+    static constexpr auto literal = LIQUID_STATIC_TEMPLATE("No variables here.");
+    static_assert(literal.size == 1, "one literal op");
+    ASSERT_EQ(literal.render(getRenderer(), hash), "No variables here.");
+
+    static constexpr auto greeting = LIQUID_STATIC_TEMPLATE("Hello {{ name | upcase }}, {{ user.first }} {{- user[\"first\"] | append: '!', 'x' }} {{ list[1] | plus: 2.5 }} {{ missing }}-{{ 3 }}{{ true }}");
+    static_assert(greeting.ops[0].type == StaticOp::Type::LITERAL && greeting.ops[0].text == "Hello ", "leading literal");
+    std::string source = "Hello {{ name | upcase }}, {{ user.first }} {{- user[\"first\"] | append: '!' }} {{ list[1] | plus: 2.5 }} {{ missing }}-{{ 3 }}{{ true }}";
+    ASSERT_EQ(greeting.render(getRenderer(), hash), "Hello WORLD, AnnAnn! 4.5 -3true");
+    ASSERT_EQ(renderTemplate(getParser().parse(source), hash), "Hello WORLD, AnnAnn! 4.5 -3true");
+}
+
+TEST(sanity, closure) {
+    CPPVariable hash = { };
+    hash["a"] = 3;
+    hash["s"] = "str";
+    hash["list"] = CPPVariable({ 1, 2, 3, 4 });
+    CPPVariable user = { };
+    user["name"] = "Ann";
+    hash["user"] = std::move(user);
+
+    const char* templates[] = {
+        "a{{ a }}b{{ a + 1 * 2 }}{{ s | upcase | append: user.name }}",
+        "{% if a > 2 and s == 'str' %}yes{% elsif a %}maybe{% else %}no{% endif %}{% unless a == 3 %}!{% endunless %}",
+        "{% for i in list %}{{ forloop.index }}:{{ i | plus: a }}{% if i == 3 %}{% break %}{% endif %}{% cycle 'x', 'y' %},{% endfor %}",
+        "{% for i in (1..3) reversed %}{% for j in list limit: 2 %}{{ i }}{{ j }}{% endfor %}{% else %}none{% endfor %}{% for k in missing %}a{% else %}empty{% endfor %}",
+        "{% assign b = a | times: 2 %}{% capture c %}{{ b }}-{{ user[\"name\"] }}{% endcapture %}{{ c }}{% case b %}{% when 6 %}six{% else %}other{% endcase %}",
+        "{{ missing.path }}{{ user.name.size }}{{ (a + 2) * 3 }}{{ list[1] }}{{ list | join: '-' }}"
+    };
+    for (const char* source : templates) {
+        Node ast = getParser().parse(source);
+        Closure closure = Closure::bind(getContext(), ast);
+        ASSERT_EQ(getRenderer().render(closure, hash), getRenderer().render(ast, hash)) << source;
+    }
+
+    Node ast = getParser().parse("{{ user.name }}{{ a | plus: 1 }}");
+    Closure closure = Closure::bind(getContext(), ast);
+    ASSERT_EQ(closure.children[0].children[0].children[0].function, &Closure::renderVariable);
+    ASSERT_EQ(closure.children[1].children[0].children[0].function, &Closure::renderNode);
+    ASSERT_EQ(getRenderer().render(closure, hash), "Ann4");
+}
 
 TEST(sanity, error) {
     CPPVariable hash = { };
@@ -1126,6 +1513,610 @@ TEST(sanity, unparser) {
     ASSERT_EQ(target, "asdflkjsdlkhjgkea  sdjlkfasjlkdhgkjhgjlk {{ a[\"a\"] }} {% if a > 15 %} {% endif %}");
 }
 
+TEST(sanity, costAnalysis) {
+    CPPVariable hash = { };
+    hash["products"] = CPPVariable({ 1, 2, 3, 4, 5, 6, 7, 8 });
+    hash["orders"] = CPPVariable({ 1, 2, 3, 4 });
+
+    Node ast = getParser().parse("{% for p in products limit: 5 %}{{ p }}{% endfor %}\n{% for o in orders %}{% for i in (1..3) %}{{ i }}{% endfor %}{% endfor %}\n{% for y in products %}{{ orders | sort }}{% endfor %}");
+    CostAnalyzer analyzer;
+    CostAnalyzer::Estimate estimate = analyzer.analyze(ast, getRenderer(), hash);
+    ASSERT_EQ(estimate.cost.describe(), "42 + 23*orders + 7*products + orders*products*log(orders)");
+    ASSERT_EQ(estimate.total, 42 + 23*4 + 7*8 + 4*8*2);
+    ASSERT_NE(estimate.worst, nullptr);
+    ASSERT_EQ(estimate.worst->type->symbol, "sort");
+    ASSERT_EQ(estimate.worst->line, 3);
+    ASSERT_EQ(estimate.worst->column, 12);
+
+    // Without a store, every size is the default.
+    analyzer.defaultSize = 2;
+    ASSERT_EQ(analyzer.analyze(ast).total, 42 + 23*2 + 7*2 + 2*2*1);
+}
+
+TEST(sanity, accessAnalysis) {
+    Node ast = getParser().parse("{% for p in collection.products limit: max %}{{ p.title }}{% if forloop.first %}{{ p.variants[0].price }}{% endif %}{% endfor %}"
+        "{% assign c = customer %}{{ c.name | upcase }}{% assign n = 3 %}{{ n }}{{ settings[key] }}{{ products | map: 'handle' | join: ',' }}");
+    AccessAnalyzer analyzer;
+    std::string paths;
+    for (auto& access : analyzer.analyze(ast))
+        paths += access.first + (access.second.read ? " read" : "") + (access.second.iterated ? " iterated" : "") + (access.second.dynamic ? " dynamic" : "") + "\n";
+    ASSERT_EQ(paths,
+        "collection.products iterated\n"
+        "collection.products[].title read\n"
+        "collection.products[].variants[].price read\n"
+        "customer.name read\n"
+        "key read\n"
+        "max read\n"
+        "products iterated\n"
+        "products[].handle read\n"
+        "settings dynamic\n"
+    );
+}
+
+struct CountedFilterNode : FilterNodeType {
+    static int calls;
+    CountedFilterNode() : FilterNodeType("counted", 0, 0) { }
+    Node render(Renderer& renderer, const Node& node, Variable store) const override {
+        ++calls;
+        return getOperand(renderer, node, store);
+    }
+};
+int CountedFilterNode::calls = 0;
+
+// Sets y to how many times it's rendered, without saying what it writes.
+struct BumpNode : TagNodeType {
+    static int bumps;
+    BumpNode() : TagNodeType(Composition::FREE, "bump", 0, 0, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+    Node render(Renderer& renderer, const Node& node, Variable store) const override {
+        (*static_cast<CPPVariable*>(store.pointer))["y"] = ++bumps;
+        return Node();
+    }
+};
+int BumpNode::bumps = 0;
+
+TEST(sanity, loopInvariants) {
+    getContext().registerType<CountedFilterNode>();
+    CPPVariable hash = { };
+    hash["products"] = CPPVariable({ 1, 2, 3 });
+    hash["sizes"] = CPPVariable({ 10, 20 });
+    hash["shop"] = "x";
+
+    std::string source = "{% assign t = 1 %}{% for p in products %}{% for s in sizes %}{{ shop | counted | upcase }}{{ p | plus: 1 | counted }}{% if shop == 'x' %}!{% endif %}{{ s | counted }}{{ t | plus: 1 }}{% endfor %}{% endfor %}";
+    Node ast = getParser().parse(source);
+    CountedFilterNode::calls = 0;
+    std::string expected = getRenderer().render(ast, hash);
+    ASSERT_EQ(expected, "X2!102X2!202X3!102X3!202X4!102X4!202");
+    ASSERT_EQ(CountedFilterNode::calls, 18);
+
+    // The upcased shop, and the comparison, move out of both loops; p | plus: 1 only out of the inner one.
+    ASSERT_EQ(getOptimizer().hoist(ast), 3);
+    CountedFilterNode::calls = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), expected);
+    ASSERT_EQ(CountedFilterNode::calls, 1 + 3 + 6);
+    std::string unparsed;
+    getParser().unparse(ast, unparsed);
+    ASSERT_EQ(getRenderer().render(getParser().parse(unparsed), hash), expected);
+
+    ast = getParser().parse("{% for p in products %}{{ shop | counted | upcase }}{% if shop == 'x' %}{{ p }}{% endif %}{% endfor %}");
+    ASSERT_EQ(getOptimizer().hoist(ast), 2);
+    ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(ast), hash), "X1X2X3");
+
+    // Nothing the tree wouldn't have evaluated is; here, a division by zero, under an if that never holds, and in a loop that never runs.
+    hash["n"] = 6;
+    hash["z"] = 0;
+    hash["none"] = CPPVariable({ });
+    ast = getParser().parse("{% for i in products %}{% if z != 0 %}{{ n | divided_by: z }}{% endif %}{% endfor %}{% for i in none %}{{ n | divided_by: z }}{% endfor %}.");
+    ASSERT_EQ(getOptimizer().hoist(ast), 3);
+    ASSERT_EQ(getRenderer().render(ast, hash), ".");
+    hash["z"] = 2;
+    ASSERT_EQ(getRenderer().render(ast, hash), "333.");
+
+    // A tag that doesn't say what it writes may write what's read; nothing's moved out of its loop, or shared across it.
+    getContext().registerType<BumpNode>();
+    ast = getParser().parse("{% for i in (1..3) %}{% bump %}{{ y | plus: 0 }}{% for j in (1..2) %}{{ y | plus: 0 }}{% endfor %}{% endfor %}");
+    BumpNode::bumps = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), "111222333");
+    ASSERT_EQ(getOptimizer().hoist(ast), 1);
+    BumpNode::bumps = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), "111222333");
+    ast = getParser().parse("{% for i in (1..3) %}{% bump %}{{ y | plus: 0 }}{{ y | plus: 0 }}{% endfor %}");
+    ASSERT_GT(getOptimizer().eliminateCommonSubexpressions(ast), 0);
+    BumpNode::bumps = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), "112233");
+}
+
+struct ShoutFilterNode : FilterNodeType {
+    ShoutFilterNode() : FilterNodeType("shout", 0, 0, false, LIQUID_OPTIMIZATION_SCHEME_NONE) { }
+    Node render(Renderer& renderer, const Node& node, Variable store) const override {
+        return Variant(getOperand(renderer, node, store).getString() + "!");
+    }
+};
+
+TEST(sanity, effects) {
+    void* shout = getContext().registerType<ShoutFilterNode>();
+    ASSERT_EQ(liquidNodeTypeGetEffects(shout), LIQUID_EFFECT_UNKNOWN);
+    auto countFilters = [](const Node& ast) {
+        int filters = 0;
+        ast.walk([&filters](const Node& node) {
+            if (node.type && node.type->type == NodeType::Type::FILTER)
+                ++filters;
+        });
+        return filters;
+    };
+
+    // Dates depend on the timezone they're rendered in, and shout hasn't said what it depends on; neither is folded.
+    Node ast = getParser().parse("{{ 0 | date: '%Y' }}{{ 'a' | upcase }}{{ 'a' | shout }}");
+    getOptimizer().optimize(ast, CPPVariable());
+    ASSERT_EQ(countFilters(ast), 2);
+
+    liquidNodeTypeSetEffects(shout, LIQUID_EFFECT_PURE);
+    ast = getParser().parse("{{ 'a' | shout }}");
+    getOptimizer().optimize(ast, CPPVariable());
+    ASSERT_EQ(countFilters(ast), 0);
+    ASSERT_EQ(getRenderer().render(ast, CPPVariable()), "a!");
+}
+
+TEST(sanity, specializer) {
+    CPPVariable settings = { }, shop = { }, staticStore = { }, dynamicStore = { }, store = { };
+    settings["currency"] = "CAD";
+    shop["name"] = "Maple";
+    staticStore["settings"] = move(settings);
+    staticStore["shop"] = move(shop);
+    dynamicStore["prices"] = CPPVariable({ 1, 2, 3 });
+
+    Node tmpl = getParser().parse("{{ shop.name | upcase }}:{% for p in prices %}{{ p }} {{ settings.currency }}{% if settings.currency == 'CAD' %}!{% endif %},{% endfor %}");
+    Specializer specializer(getRenderer());
+    const Specializer::Specialization* specialization = &specializer.specialize(tmpl, staticStore);
+    ASSERT_EQ(specializer.misses, 1);
+    ASSERT_EQ(getRenderer().render(specialization->ast, dynamicStore), "MAPLE:1 CAD!,2 CAD!,3 CAD!,");
+    ASSERT_EQ(getInterpreter().renderTemplate(specialization->program, dynamicStore), "MAPLE:1 CAD!,2 CAD!,3 CAD!,");
+
+    store["settings"] = staticStore["settings"];
+    store["shop"] = staticStore["shop"];
+    store["prices"] = dynamicStore["prices"];
+    ASSERT_EQ(getRenderer().render(tmpl, store), "MAPLE:1 CAD!,2 CAD!,3 CAD!,");
+
+    specializer.specialize(tmpl, staticStore);
+    ASSERT_EQ(specializer.hits, 1);
+    ASSERT_EQ(specializer.misses, 1);
+
+    staticStore["settings"]["currency"] = "USD";
+    specialization = &specializer.specialize(tmpl, staticStore);
+    ASSERT_EQ(specializer.misses, 2);
+    ASSERT_EQ(getRenderer().render(specialization->ast, dynamicStore), "MAPLE:1 USD,2 USD,3 USD,");
+
+    specializer.invalidate(tmpl);
+    specializer.specialize(tmpl, staticStore);
+    ASSERT_EQ(specializer.misses, 3);
+}
+
+TEST(sanity, filterRewrites) {
+    CPPVariable hash = { }, p1 = { }, p2 = { }, p3 = { };
+    p1["title"] = "A"; p1["price"] = 30; p1["available"] = false;
+    p2["title"] = "B"; p2["price"] = 10; p2["available"] = true;
+    p3["title"] = "C"; p3["price"] = 10; p3["available"] = true;
+    hash["products"] = CPPVariable({ p1, p2, p3 });
+
+    // The first of equally cheap products is first, and the last of the most expensive, last.
+    std::vector<std::pair<std::string, std::string>> cases = {
+        { "{% for p in products %}{% if p == (products | sort: \"price\" | first) %}{{ p.title }}{% endif %}{% endfor %}", "B" },
+        { "{% for p in products %}{% if p == (products | sort: \"price\" | last) %}{{ p.title }}{% endif %}{% endfor %}", "A" },
+        { "{% for p in products %}{% if p == (products | where: \"available\" | first) %}{{ p.title }}{% endif %}{% endfor %}", "B" },
+        { "{% for p in products %}{% if p == (products | where: \"title\", \"C\" | first) %}{{ p.title }}{% endif %}{% endfor %}", "C" },
+        { "{% if (products | where: \"available\" | size) > 0 %}yes{% else %}no{% endif %}", "yes" },
+        { "{% if (products | where: \"available\" | size) == 2 %}yes{% else %}no{% endif %}", "yes" },
+        { "{% if (products | where: \"available\" | size) > 2 %}yes{% else %}no{% endif %}", "no" },
+        { "{% if (products | where: \"title\", \"Z\" | size) != 0 %}yes{% else %}no{% endif %}", "no" }
+    };
+    for (auto& test : cases) {
+        Node ast = getParser().parse(test.first);
+        ASSERT_EQ(getRenderer().render(ast, hash), test.second);
+        ASSERT_EQ(getOptimizer().rewrite(ast), 1);
+        ASSERT_EQ(getRenderer().render(ast, hash), test.second);
+        ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(ast), hash), test.second);
+        std::string unparsed;
+        getParser().unparse(ast, unparsed);
+        ASSERT_EQ(unparsed, test.first);
+    }
+
+    // A rewritten chain no longer sorts.
+    Node ast = getParser().parse("{{ products | sort: 'price' | first }}");
+    ASSERT_EQ(CostAnalyzer().analyze(ast).cost.describe(), "8 + products + products*log(products)");
+    getOptimizer().rewrite(ast);
+    ASSERT_EQ(CostAnalyzer().analyze(ast).cost.describe(), "6 + products");
+    ast = getParser().parse("{{ products | first }}{{ products | sort | size }}");
+    ASSERT_EQ(getOptimizer().rewrite(ast), 0);
+
+    // Elements without the property, or with it nil, go last, in their order; the selections agree with the sort.
+    CPPVariable i1 = { }, i2 = { }, i3 = { }, i4 = { };
+    i1["p"] = 3; i1["n"] = "A";
+    i2["n"] = "B";
+    i3["p"] = 1; i3["n"] = "C";
+    i4["p"] = nullptr; i4["n"] = "D";
+    hash["items"] = CPPVariable({ i1, i4, i2, i3 });
+    ASSERT_EQ(getRenderer().render(getParser().parse("{{ items | sort: 'p' | map: 'n' | join: '' }}"), hash), "CADB");
+    for (auto& test : std::vector<std::pair<std::string, std::string>>({
+        { "{% for i in items %}{% if i == (items | sort: 'p' | first) %}{{ i.n }}{% endif %}{% endfor %}", "C" },
+        { "{% for i in items %}{% if i == (items | sort: 'p' | last) %}{{ i.n }}{% endif %}{% endfor %}", "B" }
+    })) {
+        Node ast = getParser().parse(test.first);
+        ASSERT_EQ(getRenderer().render(ast, hash), test.second);
+        ASSERT_EQ(getOptimizer().rewrite(ast), 1);
+        ASSERT_EQ(getRenderer().render(ast, hash), test.second);
+        ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(ast), hash), test.second);
+    }
+}
+
+TEST(sanity, commonSubexpressions) {
+    CPPVariable hash = { };
+    hash["products"] = CPPVariable({ 1, 2, 3 });
+    hash["shop"] = "x";
+    hash["t"] = 1;
+
+    // The whole upcased chain is shared; the downcased one only has a part in common, which isn't shared on its own.
+    Node ast = getParser().parse("{{ shop | counted | upcase }}{{ shop | counted | upcase }}{{ shop | counted | downcase }}");
+    ASSERT_EQ(getOptimizer().eliminateCommonSubexpressions(ast), 2);
+    CountedFilterNode::calls = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), "XXx");
+    ASSERT_EQ(CountedFilterNode::calls, 2);
+
+    // Assigning, or capturing, what's read evaluates it again.
+    std::string source = "{{ t | counted }}{% assign t = 2 %}{{ t | counted }}{{ t | counted }}{% capture t %}3{% endcapture %}{{ t | counted }}";
+    ast = getParser().parse(source);
+    ASSERT_EQ(getOptimizer().eliminateCommonSubexpressions(ast), 4);
+    CountedFilterNode::calls = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), "1223");
+    ASSERT_EQ(CountedFilterNode::calls, 3);
+    std::string unparsed;
+    getParser().unparse(ast, unparsed);
+    ASSERT_EQ(unparsed, source);
+
+    // Those that refer to the loop variable are shared within an iteration; the rest across the whole template.
+    source = "{% for p in products %}{{ p | plus: 1 | counted }}{{ p | plus: 1 | counted }}{{ shop | counted }}{% endfor %}{{ shop | counted }}";
+    ast = getParser().parse(source);
+    CountedFilterNode::calls = 0;
+    std::string expected = getRenderer().render(ast, hash);
+    ASSERT_EQ(expected, "22x33x44xx");
+    ASSERT_EQ(CountedFilterNode::calls, 10);
+    ASSERT_EQ(getOptimizer().eliminateCommonSubexpressions(ast), 4);
+    CountedFilterNode::calls = 0;
+    ASSERT_EQ(getRenderer().render(ast, hash), expected);
+    ASSERT_EQ(CountedFilterNode::calls, 3 + 1);
+    ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(ast), hash), expected);
+    unparsed.clear();
+    getParser().unparse(ast, unparsed);
+    ASSERT_EQ(unparsed, source);
+}
+
+TEST(sanity, loopUnrolling) {
+    CPPVariable hash = { };
+    hash["products"] = CPPVariable({ 1, 2, 3 });
+    hash["shop"] = "x";
+
+    auto countLoops = [](const Node& ast) {
+        int loops = 0;
+        ast.walk([&loops](const Node& node) {
+            if (node.type && node.type->type == NodeType::Type::TAG && node.type->symbol == "for")
+                ++loops;
+        });
+        return loops;
+    };
+    std::vector<std::string> sources = {
+        "{% for i in (1..4) %}{{ i }}:{{ forloop.index }}{% if forloop.last %}.{% else %},{% endif %}{% endfor %}",
+        "{% for x in ['a', 'b', 'c'] reversed %}{{ x | upcase }}{{ forloop.rindex }}{{ shop }}{% endfor %}",
+        "{% for i in (1..10) limit: 3 offset: 2 %}{{ i }}{{ forloop.index0 }}{{ forloop.first }}{% endfor %}",
+        "{% for i in (1..3) %}{% for p in products %}{{ i | times: p }}{{ forloop.index }}{% endfor %};{% endfor %}",
+        "{% for i in (3..1) %}{{ i }}{% else %}none{% endfor %}"
+    };
+    for (auto& source : sources) {
+        Node ast = getParser().parse(source);
+        std::string expected = getRenderer().render(ast, hash);
+        ASSERT_EQ(getOptimizer().unroll(ast), 1);
+        ASSERT_EQ(getRenderer().render(ast, hash), expected);
+        ASSERT_EQ(getInterpreter().renderTemplate(getCompiler().compile(ast), hash), expected);
+        getOptimizer().optimize(ast, hash);
+        ASSERT_EQ(getRenderer().render(ast, hash), expected);
+    }
+    Node ast = getParser().parse(sources[0]);
+    getOptimizer().unroll(ast);
+    getOptimizer().optimize(ast, hash);
+    ASSERT_EQ(countLoops(ast), 0);
+    ASSERT_TRUE(!ast.type && ast.variant.s == "1:1,2:2,3:3,4:4.");
+
+    // Too long, not constant, or with a break.
+    Optimizer optimizer(getRenderer());
+    optimizer.maximumUnrolledIterations = 3;
+    ast = getParser().parse("{% for i in (1..4) %}{{ i }}{% endfor %}{% for p in products %}{{ p }}{% endfor %}{% for i in (1..2) %}{% if i == 2 %}{% break %}{% endif %}{{ i }}{% endfor %}");
+    ASSERT_EQ(optimizer.unroll(ast), 0);
+    ASSERT_EQ(countLoops(ast), 3);
+}
+
+TEST(sanity, lazyRanges) {
+    CPPVariable hash = { };
+    hash["m"] = 1;
+    hash["n"] = 5;
+    Renderer renderer(getContext(), CPPVariableResolver());
+    // No larger than the loop would be without it.
+    renderer.maximumRangeSize = 10;
+    renderer.maximumMemoryUsage = 200;
+
+    ASSERT_EQ(renderer.render(getParser().parse("{% for i in (1..20000) %}{% if forloop.last %}{{ i }}{% endif %}{% endfor %}"), hash), "20000");
+    ASSERT_EQ(renderer.render(getParser().parse("{% for i in (2..9) limit: 3 offset: 2 reversed %}{{ i }}{{ forloop.index }}{% endfor %}"), hash), "635445");
+    ASSERT_EQ(renderer.render(getParser().parse("{% for i in (3..1) %}{{ i }}{% else %}none{% endfor %}"), hash), "none");
+    ASSERT_EQ(renderer.render(getParser().parse("{{ (m .. n) | join: ',' }} {{ (1..20000) | size }} {{ (4..20000) | first }} {{ (4..20000) | last }} {{ (m .. n) | reverse | join: ',' }}"), hash), "1,2,3,4,5 20000 4 20000 5,4,3,2,1");
+    ASSERT_EQ(renderer.render(getParser().parse("{% if (1..20000) contains 3 %}a{% endif %}{% if (m .. n) contains 6 %}b{% endif %}"), hash), "a");
+
+    // Those that have to be arrays are limited.
+    ASSERT_EQ(renderer.render(getParser().parse("{% assign a = (1..11) %}{{ a | size }}{% assign a = (1..3) %}{{ a | size }}"), hash), "3");
+    ASSERT_THROW(renderer.render(getParser().parse("{% assign a = (1..10) %}{{ a | size }}"), hash), Renderer::Error);
+    ASSERT_EQ(renderer.error, LIQUID_RENDERER_ERROR_TYPE_EXCEEDED_MEMORY);
+
+    // Whether or not the optimizer folds the range into an array, it contains the same numbers. Each render has a store of its own, as
+    // the tree assigns to it.
+    auto getStore = []() {
+        CPPVariable store = { };
+        store["nums"] = CPPVariable({ 1, 2, 3 });
+        return store;
+    };
+    for (auto source : {
+        "{% if (1..5) contains 3 %}a{% endif %}{% if (1..5) contains 6 %}b{% endif %}{% if (1..5) contains 2.5 %}c{% endif %}{% if (1..5) contains 4.0 %}d{% endif %}{% if (1..5) contains '3' %}e{% endif %}",
+        "{% assign r = (1..5) %}{% if r contains 3 %}a{% endif %}{% if r contains 6 %}b{% endif %}",
+        "{% if nums contains 2 %}a{% endif %}{% if nums contains 4 %}b{% endif %}"
+    }) {
+        Node ast = getParser().parse(source);
+        std::string expected = getRenderer().render(ast, getStore());
+        ASSERT_EQ(expected.find('a'), 0U);
+        ASSERT_EQ(expected.find('b'), std::string::npos);
+        getOptimizer().optimize(ast, getStore());
+        ASSERT_EQ(getRenderer().render(ast, getStore()), expected);
+    }
+}
+
+TEST(sanity, caseDispatch) {
+    CPPVariable hash = { };
+    std::vector<std::string> templates = {
+        "{% case t %}{% when \"a\" %}A{% when \"b\" %}B{% when \"c\" %}C{% when \"b\" %}D{% when \"e\" %}E{% else %}F{% endcase %}",
+        "{% case t %}{% when \"a\" %}A{% when \"b\" %}B{% when \"c\" %}C{% when \"d\" %}D{% endcase %}",
+        "{% if t == \"a\" %}A{% elsif \"b\" == t %}B{% elsif t == \"c\" %}C{% elsif t == \"1\" %}D{% else %}E{% endif %}"
+    };
+    // Subjects that aren't strings are compared as the tag would, coercing or not.
+    std::vector<CPPVariable> subjects = { "a", "b", "c", "d", "e", "1", "z", "", 1, 2.0, CPPVariable() };
+    for (auto& source : templates) {
+        Node ast = getParser().parse(source);
+        std::vector<std::string> expected;
+        for (auto& subject : subjects) {
+            hash["t"] = subject;
+            expected.push_back(getRenderer().render(ast, hash));
+        }
+        ASSERT_EQ(getOptimizer().rewrite(ast), 1);
+        ASSERT_EQ(getOptimizer().rewrite(ast), 0);
+        std::string unparsed;
+        getParser().unparse(ast, unparsed);
+        ASSERT_EQ(unparsed, source);
+        Program program = getCompiler().compile(ast);
+        ASSERT_NE(getCompiler().disassemble(program).find("OP_SWITCH"), std::string::npos);
+        Interpreter interpreter(getContext(), CPPVariableResolver());
+        // Enough renders for the program to be run natively, where supported.
+        for (unsigned int i = 0; i <= Interpreter::JIT_THRESHOLD / subjects.size() + 1; ++i) {
+            for (size_t j = 0; j < subjects.size(); ++j) {
+                hash["t"] = subjects[j];
+                ASSERT_EQ(getRenderer().render(ast, hash), expected[j]);
+                ASSERT_EQ(interpreter.renderTemplate(program, hash), expected[j]);
+            }
+        }
+        #ifdef LIQUID_JIT
+            ASSERT_TRUE(interpreter.programStates[program.id].jit);
+        #endif
+    }
+
+    // Dispatches on as many keys, in one program, each switch on their own table.
+    for (auto source : {
+        "{% case x %}{% when 'k0' %}0{% when 'k1' %}1{% when 'k2' %}2{% when 'x' %}X{% endcase %}{% case s %}{% when 'k0' %}0{% when 'k1' %}1{% when 'k2' %}2{% when 'hello' %}IN{% endcase %}",
+        "{% if x == 'a' %}A{% elsif x == 'b' %}B{% elsif x == 'c' %}C{% elsif x == 'x' %}X{% endif %}{% if s == 'a' %}A{% elsif s == 'b' %}B{% elsif s == 'c' %}C{% elsif s == 'hello' %}IN{% endif %}",
+        "{% case x %}{% when 'k0' %}0{% when 'k1' %}1{% when 'k2' %}2{% when 'x' %}{% case s %}{% when 'k0' %}0{% when 'k1' %}1{% when 'k2' %}2{% when 'hello' %}IN{% endcase %}{% endcase %}"
+    }) {
+        Node ast = getParser().parse(source);
+        hash["x"] = "x";
+        hash["s"] = "hello";
+        std::string expected = getRenderer().render(ast, hash);
+        ASSERT_NE(expected.find("IN"), std::string::npos);
+        ASSERT_EQ(getOptimizer().rewrite(ast), 2);
+        Program program = getCompiler().compile(ast);
+        Interpreter interpreter(getContext(), CPPVariableResolver());
+        for (unsigned int i = 0; i <= Interpreter::JIT_THRESHOLD + 1; ++i)
+            ASSERT_EQ(interpreter.renderTemplate(program, hash), expected);
+    }
+
+    // Too few branches, a condition that isn't an equality with a string, and a different expression, are left alone.
+    for (auto source : {
+        "{% case t %}{% when 'a' %}A{% when 'b' %}B{% endcase %}",
+        "{% case t %}{% when 'a' %}A{% when 'b' %}B{% when 1 %}C{% when 'd' %}D{% endcase %}",
+        "{% if t == 'a' %}A{% elsif t == 'b' %}B{% elsif t != 'c' %}C{% elsif t == 'd' %}D{% endif %}",
+        "{% if t == 'a' %}A{% elsif t == 'b' %}B{% elsif u == 'c' %}C{% elsif t == 'd' %}D{% endif %}",
+        "{% unless t == 'a' %}A{% elsif t == 'b' %}B{% elsif t == 'c' %}C{% elsif t == 'd' %}D{% endunless %}"
+    }) {
+        Node ast = getParser().parse(source);
+        ASSERT_EQ(getOptimizer().rewrite(ast), 0);
+    }
+}
+
+// Serves everything it's given back, as having taken a microsecond.
+struct RecordingFragmentCache : FragmentCache {
+    std::map<std::string, std::string> entries;
+    std::vector<unsigned int> ttls;
+
+    bool get(const std::string& key, std::string& output, unsigned long long& renderTime) override {
+        auto it = entries.find(key);
+        if (it == entries.end())
+            return false;
+        output = it->second;
+        renderTime = 1000;
+        return true;
+    }
+    void set(const std::string& key, const std::string& output, unsigned long long renderTime, unsigned int ttl) override {
+        entries[key] = output;
+        ttls.push_back(ttl);
+    }
+};
+
+TEST(sanity, fragmentCache) {
+    CPPVariable hash = { };
+    hash["k"] = "a";
+    hash["v"] = 1;
+    Node ast = getParser().parse("{% cache k, ttl: 60 %}{{ v }}{% endcache %}|{{ v }}");
+    std::string unparsed;
+    getParser().unparse(ast, unparsed);
+    ASSERT_EQ(unparsed, "{% cache k ttl: 60 %}{{ v }}{% endcache %}|{{ v }}");
+
+    Renderer renderer(getContext(), CPPVariableResolver());
+    RecordingFragmentCache cache;
+    renderer.fragmentCache = cache.getInterface();
+    ASSERT_EQ(renderer.render(ast, hash), "1|1");
+    hash["v"] = 2;
+    ASSERT_EQ(renderer.render(ast, hash), "1|2");
+    hash["k"] = "b";
+    ASSERT_EQ(renderer.render(ast, hash), "2|2");
+    ASSERT_EQ(renderer.fragmentCacheMetrics.hits, 1ULL);
+    ASSERT_EQ(renderer.fragmentCacheMetrics.misses, 2ULL);
+    ASSERT_EQ(renderer.fragmentCacheMetrics.savedTime, 1000ULL);
+    ASSERT_EQ(cache.ttls, std::vector<unsigned int>({ 60, 60 }));
+    // A different body doesn't share entries, even under the same key.
+    Node other = getParser().parse("{% cache k %}{{ v }}!{% endcache %}");
+    ASSERT_EQ(renderer.render(other, hash), "2!");
+    ASSERT_EQ(cache.ttls.back(), 0U);
+
+    // Programs use the same keys as the tree.
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    interpreter.fragmentCache = cache.getInterface();
+    Program program = getCompiler().compile(ast);
+    hash["v"] = 3;
+    for (unsigned int i = 0; i <= Interpreter::JIT_THRESHOLD; ++i)
+        ASSERT_EQ(interpreter.renderTemplate(program, hash), "2|3");
+    hash["k"] = "c";
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "3|3");
+    ASSERT_EQ(interpreter.fragmentCacheMetrics.hits, (unsigned long long)Interpreter::JIT_THRESHOLD + 1);
+    ASSERT_EQ(interpreter.fragmentCacheMetrics.misses, 1ULL);
+
+    // Without one on the renderer, the context's is used.
+    RecordingFragmentCache contextCache;
+    getContext().fragmentCache = contextCache.getInterface();
+    hash["k"] = "d";
+    ASSERT_EQ(getRenderer().render(ast, hash), "3|3");
+    getContext().fragmentCache = { };
+    ASSERT_EQ(contextCache.entries.size(), 1U);
+
+    LRUFragmentCache lru(64, 1);
+    std::string output;
+    unsigned long long renderTime;
+    lru.set("a", std::string(30, 'a'), 1, 0);
+    lru.set("b", std::string(30, 'b'), 1, 0);
+    ASSERT_TRUE(lru.get("a", output, renderTime));
+    // Evicts b, as a was used since.
+    lru.set("c", std::string(30, 'c'), 1, 0);
+    ASSERT_FALSE(lru.get("b", output, renderTime));
+    ASSERT_TRUE(lru.get("c", output, renderTime));
+    ASSERT_EQ(output, std::string(30, 'c'));
+    // Larger than the shard; never stored.
+    lru.set("d", std::string(100, 'd'), 1, 0);
+    ASSERT_FALSE(lru.get("d", output, renderTime));
+    ASSERT_EQ(lru.size(), 62U);
+}
+
+TEST(sanity, memoization) {
+    CPPVariable hash = { };
+    hash["a"] = CPPVariable({ 1, 2, 3 });
+    hash["v"] = 1;
+    Node ast = getParser().parse("{% for i in a %}{{ i | plus: v }},{% endfor %}|{{ v }}|{% for i in a %}{{ i | times: 2 }}{% endfor %}");
+    Renderer renderer(getContext(), CPPVariableResolver());
+    Optimizer optimizer(renderer);
+    optimizer.minimumMemoizedCost = 1;
+    ASSERT_EQ(optimizer.memoize(ast), 3);
+    std::string unparsed;
+    getParser().unparse(ast, unparsed);
+    ASSERT_EQ(unparsed, "{% for i in a %}{{ i | plus: v }},{% endfor %}|{{ v }}|{% for i in a %}{{ i | times: 2 }}{% endfor %}");
+
+    Memoizer memoizer(renderer);
+    ASSERT_EQ(renderer.render(ast, hash), "2,3,4,|1|246");
+    ASSERT_EQ(renderer.render(ast, hash), "2,3,4,|1|246");
+    ASSERT_EQ(memoizer.hits, 3U);
+    ASSERT_EQ(memoizer.misses, 3U);
+    // Only what reads v renders again; the first set of inputs is still kept.
+    hash["v"] = 2;
+    ASSERT_EQ(renderer.render(ast, hash), "3,4,5,|2|246");
+    ASSERT_EQ(memoizer.hits, 4U);
+    hash["a"] = CPPVariable({ 1, 2 });
+    ASSERT_EQ(renderer.render(ast, hash), "3,4,|2|24");
+    ASSERT_EQ(memoizer.hits, 5U);
+    hash["v"] = 1;
+    hash["a"] = CPPVariable({ 1, 2, 3 });
+    ASSERT_EQ(renderer.render(ast, hash), "2,3,4,|1|246");
+    ASSERT_EQ(memoizer.hits, 8U);
+    // Compiled, the wrappers render what they wrap.
+    Program program = getCompiler().compile(ast);
+    Interpreter interpreter(getContext(), CPPVariableResolver());
+    ASSERT_EQ(interpreter.renderTemplate(program, hash), "2,3,4,|1|246");
+
+    // Reads the loop's variable, so it's never kept; the loop itself changes the store, so it isn't memoized.
+    Node loop = getParser().parse("{% for i in a %}{% increment c %}{{ i | times: v }}{% endfor %}");
+    ASSERT_EQ(optimizer.memoize(loop), 1);
+    memoizer.clear();
+    ASSERT_EQ(renderer.render(loop, hash), "123");
+    ASSERT_EQ(renderer.render(loop, hash), "123");
+    ASSERT_EQ(memoizer.size(), 0U);
+
+    // Nothing larger than the memoizer is kept.
+    Memoizer small(renderer, 16);
+    ASSERT_EQ(renderer.render(ast, hash), "2,3,4,|1|246");
+    ASSERT_EQ(renderer.render(ast, hash), "2,3,4,|1|246");
+    ASSERT_EQ(small.hits, 0U);
+    ASSERT_EQ(small.size(), 0U);
+}
+
+TEST(sanity, rerender) {
+    CPPVariable hash = { }, settings = { }, first = { }, second = { };
+    settings["color"] = "red";
+    settings["show"] = true;
+    first["title"] = "a";
+    second["title"] = "b";
+    hash["settings"] = settings;
+    hash["products"] = CPPVariable({ first, second });
+    hash["title"] = "T";
+    Node ast = getParser().parse("{{ settings.color }}|{% for p in products %}{{ p.title }}{% endfor %}|{% if settings.show %}shown{% endif %}|{{ title }}");
+    Renderer renderer(getContext(), CPPVariableResolver());
+    ASSERT_EQ(renderer.rerender(ast, hash, { }), "red|ab|shown|T");
+
+    // Title changes without saying so; what's rendered again shows it, everything else is as it was.
+    hash["title"] = "U";
+    hash["settings"]["color"] = "blue";
+    ASSERT_EQ(renderer.rerender(ast, hash, { "settings.color" }), "blue|ab|shown|T");
+    hash["products"][1]["title"] = "c";
+    ASSERT_EQ(renderer.rerender(ast, hash, { "products[1].title" }), "blue|ac|shown|T");
+    hash["settings"]["show"] = false;
+    ASSERT_EQ(renderer.rerender(ast, hash, { "settings" }), "blue|ac||T");
+    ASSERT_EQ(renderer.rerender(ast, hash, { "other", "title" }), "blue|ac||U");
+    ASSERT_EQ(renderer.rerender(ast, hash, { }), "blue|ac||U");
+    // Another store renders everything.
+    CPPVariable other = hash;
+    other["title"] = "V";
+    ASSERT_EQ(renderer.rerender(ast, other, { }), "blue|ac||V");
+
+    // What the template writes isn't re-rendered on its own.
+    Node assigned = getParser().parse("{% assign c = settings.color %}{{ c }}|{{ title }}");
+    ASSERT_EQ(renderer.rerender(assigned, hash, { }), "blue|U");
+    hash["settings"]["color"] = "green";
+    hash["title"] = "W";
+    ASSERT_EQ(renderer.rerender(assigned, hash, { "settings.color" }), "green|W");
+    hash["title"] = "X";
+    ASSERT_EQ(renderer.rerender(assigned, hash, { "title" }), "green|X");
+    hash["c"] = "white";
+    ASSERT_EQ(renderer.rerender(assigned, hash, { "c" }), "green|X");
+    // Stops at the break, so whatever follows can't be spliced into.
+    Node broken = getParser().parse("{{ title }}{% break %}{{ title }}");
+    ASSERT_EQ(renderer.rerender(broken, hash, { }), "X");
+    hash["title"] = "Y";
+    ASSERT_EQ(renderer.rerender(broken, hash, { "title" }), "Y");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
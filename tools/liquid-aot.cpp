@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+#include "../src/liquid.h"
+#include "../src/transpiler.h"
+#include "../src/web.h"
+
+// Transpiles a template into a C++ translation unit that registers itself under the template's name. Link the output against libliquid,
+// and Renderer::render(name, ast, store) will run it in place of the tree.
+//
+//  liquid-aot [--dialect strict|web] [--name NAME] [-o OUTPUT] TEMPLATE
+
+static int usage() {
+    fprintf(stderr, "usage: liquid-aot [--dialect strict|web] [--name NAME] [-o OUTPUT] TEMPLATE\n");
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    std::string dialect = "strict", name, output, input;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--dialect") == 0 && i + 1 < argc)
+            dialect = argv[++i];
+        else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+            name = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (argv[i][0] == '-' || !input.empty())
+            return usage();
+        else
+            input = argv[i];
+    }
+    if (input.empty())
+        return usage();
+    if (name.empty())
+        name = input;
+
+    int dialects;
+    if (dialect == "strict")
+        dialects = Liquid::Context::STRICT_STANDARD_DIALECT;
+    #ifdef LIQUID_INCLUDE_WEB_DIALECT
+        else if (dialect == "web")
+            dialects = Liquid::Context::STRICT_STANDARD_DIALECT | Liquid::Context::WEB_DIALECT;
+    #endif
+    else
+        return usage();
+
+    std::ifstream file(input, std::ios::binary);
+    if (!file) {
+        fprintf(stderr, "liquid-aot: can't read %s\n", input.c_str());
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string source = buffer.str();
+
+    Liquid::Context context(dialects);
+    #ifdef LIQUID_INCLUDE_WEB_DIALECT
+        if (dialects & Liquid::Context::WEB_DIALECT)
+            Liquid::WebDialect::implement(context);
+    #endif
+    std::string code;
+    try {
+        Liquid::Parser parser(context);
+        Liquid::Node ast = parser.parse(source);
+        Liquid::Transpiler transpiler(context);
+        code = transpiler.transpile(ast, name, source);
+    } catch (Liquid::Parser::Exception& exception) {
+        fprintf(stderr, "liquid-aot: %s: %s\n", input.c_str(), exception.what());
+        return 1;
+    }
+
+    if (output.empty()) {
+        fwrite(code.data(), 1, code.size(), stdout);
+    } else {
+        std::ofstream target(output, std::ios::binary);
+        target << code;
+        if (!target) {
+            fprintf(stderr, "liquid-aot: can't write %s\n", output.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
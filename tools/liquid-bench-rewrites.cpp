@@ -0,0 +1,86 @@
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "../src/liquid.h"
+#include "../src/optimizer.h"
+
+// Times the filter chains Optimizer::rewrite fuses, as written and as rewritten, over an array of products, on the tree renderer. Exits
+// non-zero if the two ever render differently.
+//
+//  liquid-bench-rewrites [PRODUCTS] [ITERATIONS]
+
+struct Chain {
+    const char* name;
+    const char* source;
+};
+
+static double time(Liquid::Renderer& renderer, const Liquid::Node& ast, Liquid::CPPVariable& store, int iterations, std::string& output) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        output = renderer.render(ast, store);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / iterations;
+}
+
+int main(int argc, char* argv[]) {
+    int size = argc > 1 ? atoi(argv[1]) : 100000;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    if (size <= 0 || iterations <= 0) {
+        fprintf(stderr, "usage: liquid-bench-rewrites [PRODUCTS] [ITERATIONS]\n");
+        return 1;
+    }
+
+    // Prices in no particular order; only a product a tenth of the way in is available, so a search that stops early reads a tenth.
+    Liquid::CPPVariable store = { };
+    Liquid::CPPVariable products = { };
+    products.assign(std::vector<std::unique_ptr<Liquid::CPPVariable>>());
+    unsigned int seed = 1;
+    for (int i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        Liquid::CPPVariable product = { };
+        product["title"] = "p" + std::to_string(i);
+        product["price"] = (long long)(seed >> 8) % 100000;
+        product["available"] = i == size / 10;
+        products.a.push_back(std::make_unique<Liquid::CPPVariable>(std::move(product)));
+    }
+    store["products"] = std::move(products);
+
+    Liquid::Context context;
+    Liquid::StandardDialect::implementPermissive(context);
+    Liquid::Parser parser(context);
+    Liquid::Renderer renderer(context, Liquid::CPPVariableResolver());
+    Liquid::Optimizer optimizer(renderer);
+
+    const std::vector<Chain> chains = {
+        { "sort | first", "{% assign p = products | sort: 'price' | first %}{{ p.title }}" },
+        { "sort | last", "{% assign p = products | sort: 'price' | last %}{{ p.title }}" },
+        { "where | first", "{% assign p = products | where: 'available' | first %}{{ p.title }}" },
+        { "where | size > 0", "{% if (products | where: 'available' | size) > 0 %}yes{% else %}no{% endif %}" },
+        // Nothing matches, so the count can't stop early; the worst case.
+        { "where | size == 0", "{% if (products | where: 'title', 'none' | size) == 0 %}none{% endif %}" }
+    };
+
+    printf("%d products, %d iterations\n\n", size, iterations);
+    printf("%-20s %14s %14s %10s\n", "chain", "written (ms)", "rewritten (ms)", "speedup");
+    int status = 0;
+    for (auto& chain : chains) {
+        Liquid::Node written = parser.parse(chain.source);
+        Liquid::Node rewritten = parser.parse(chain.source);
+        if (optimizer.rewrite(rewritten) == 0) {
+            fprintf(stderr, "liquid-bench-rewrites: %s: not rewritten\n", chain.name);
+            status = 1;
+            continue;
+        }
+        std::string expected, output;
+        double before = time(renderer, written, store, iterations, expected);
+        double after = time(renderer, rewritten, store, iterations, output);
+        if (output != expected) {
+            fprintf(stderr, "liquid-bench-rewrites: %s: rendered '%s', rather than '%s'\n", chain.name, output.c_str(), expected.c_str());
+            status = 1;
+        }
+        printf("%-20s %14.3f %14.3f %9.1fx\n", chain.name, before, after, before / after);
+    }
+    return status;
+}